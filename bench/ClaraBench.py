@@ -0,0 +1,275 @@
+"""Drives the native code completer without Sublime Text.
+
+Loads a compile_commands.json, opens the files of a corpus, requests
+completions at chosen positions and reports how long everything took. The
+sublime module is replaced by the stub next to this file.
+
+    python3 ClaraBench.py --module-dir build/lib --builtin-headers \\
+        /path/to/clang/lib/Headers /path/to/build [file.cpp:line:col ...]
+
+Without positions, completions are requested after every member access in
+the first files of the database. The positions are 1-based, like the
+positions in compiler messages.
+"""
+
+import argparse
+import collections
+import getpass
+import importlib
+import json
+import os
+import re
+import resource
+import shutil
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+import types
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+
+import sublime
+
+MEMBER_ACCESS = re.compile(r"(\.|->|::)(?=[A-Za-z_])")
+
+class DiagnosticsStub(types.ModuleType):
+    """Takes the place of Clara.eventlisteners.diagnostics."""
+
+    def __init__(self):
+        types.ModuleType.__init__(self, "Clara.eventlisteners.diagnostics")
+        self.counts = {}
+
+    def show_diagnostics(self, view, diagnostics):
+        self.counts[view.file_name()] = diagnostics.counts()
+
+def import_clara(module_dir):
+    # The real package would import sublime_plugin, so the native module is
+    # imported into an empty package instead.
+    package = types.ModuleType("Clara")
+    package.__path__ = [module_dir]
+    sys.modules["Clara"] = package
+    listeners = types.ModuleType("Clara.eventlisteners")
+    listeners.__path__ = []
+    sys.modules["Clara.eventlisteners"] = listeners
+    diagnostics = DiagnosticsStub()
+    sys.modules[diagnostics.__name__] = diagnostics
+    listeners.diagnostics = diagnostics
+    return importlib.import_module("Clara.Clara"), diagnostics
+
+def query_system_headers(compiler):
+    """Does what the Clara: Write System Headers command does."""
+    process = subprocess.Popen([compiler, "-E", "-x", "c++", "-", "-v"],
+                               stdin=subprocess.DEVNULL,
+                               stdout=subprocess.DEVNULL,
+                               stderr=subprocess.PIPE)
+    _, output = process.communicate()
+    headers, frameworks = [], []
+    inside = False
+    for line in output.decode("utf-8", "replace").splitlines():
+        if line.startswith("#include <...> search starts here"):
+            inside = True
+        elif line.startswith("End of search list."):
+            inside = False
+        elif inside:
+            line = line.strip()
+            if line.endswith(" (framework directory)"):
+                frameworks.append(os.path.abspath(line[:-22]))
+            elif not re.search(r"[/\\]clang[/\\][^/\\]+[/\\]include$", line):
+                # The builtin headers of the compiler are left out; Clara
+                # brings its own.
+                headers.append(os.path.abspath(line))
+    return headers, frameworks
+
+def find_positions(view, limit):
+    """Returns up to limit points right after member accesses, spread over
+    the file, skipping comments and preprocessor lines."""
+    points = []
+    for row, start in enumerate(view._line_starts):
+        end = view._line_starts[row + 1] if row + 1 < len(view._line_starts) \
+            else view.size()
+        line = view.substr(sublime.Region(start, end))
+        stripped = line.lstrip()
+        if stripped.startswith(("#", "//", "/*", "*")):
+            continue
+        for match in MEMBER_ACCESS.finditer(line):
+            points.append(start + match.end())
+    if len(points) > limit:
+        step = len(points) / limit
+        points = [points[int(i * step)] for i in range(limit)]
+    return points
+
+def percentile(values, fraction):
+    if not values:
+        return 0.0
+    values = sorted(values)
+    return values[min(len(values) - 1, int(fraction * len(values)))]
+
+def peak_rss_megabytes():
+    peak = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+    # Linux reports kilobytes, macOS reports bytes.
+    return peak / (1024.0 * 1024.0 if sys.platform == "darwin" else 1024.0)
+
+def wait(event, timeout):
+    # Event.wait releases the GIL, which the workers need to report back.
+    return event.wait(timeout)
+
+def parse_arguments():
+    parser = argparse.ArgumentParser(
+        description=__doc__.split("\n\n")[0],
+        formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("database", help="directory of compile_commands.json")
+    parser.add_argument("positions", nargs="*",
+                        help="file:line:column to complete at")
+    parser.add_argument("--module-dir", required=True,
+                        help="directory of the built Clara module")
+    parser.add_argument("--builtin-headers", required=True,
+                        help="clang's builtin headers (lib/Headers)")
+    parser.add_argument("--compiler", default="clang++",
+                        help="compiler to ask for the system headers")
+    parser.add_argument("--max-files", type=int, default=10,
+                        help="files to open when no positions are given")
+    parser.add_argument("--requests-per-file", type=int, default=20)
+    parser.add_argument("--repeat", type=int, default=3,
+                        help="how often each position is completed")
+    parser.add_argument("--worker-threads", type=int, default=0)
+    parser.add_argument("--preamble-cache-directory", default="")
+    parser.add_argument("--timeout", type=float, default=300.0,
+                        help="seconds to wait for a single parse")
+    parser.add_argument("--json", help="also write the report to this file")
+    return parser.parse_args()
+
+def select_files(arguments):
+    """Returns a dict from file names to 1-based (line, column) pairs. An
+    empty list means that the positions are found automatically."""
+    files = {}
+    for position in arguments.positions:
+        name, line, column = position.rsplit(":", 2)
+        files.setdefault(os.path.abspath(name), []).append(
+            (int(line), int(column)))
+    if files:
+        return files
+    path = os.path.join(arguments.database, "compile_commands.json")
+    with open(path) as f:
+        entries = json.load(f)
+    for entry in entries:
+        name = os.path.join(entry["directory"], entry["file"])
+        files.setdefault(os.path.normpath(name), [])
+        if len(files) == arguments.max_files:
+            break
+    return files
+
+def main():
+    arguments = parse_arguments()
+    packages = tempfile.mkdtemp(prefix="clara-bench-")
+    try:
+        os.mkdir(os.path.join(packages, "Clara"))
+        os.symlink(os.path.abspath(arguments.builtin_headers),
+                   os.path.join(packages, "Clara", "include"))
+        return run(arguments, packages)
+    finally:
+        shutil.rmtree(packages, ignore_errors=True)
+
+def run(arguments, packages):
+    Clara, diagnostics = import_clara(os.path.abspath(arguments.module_dir))
+    headers, frameworks = query_system_headers(arguments.compiler)
+    sublime._packages_path = packages
+    settings = sublime.load_settings("Clara.sublime-settings")
+    settings.set("{}@{}".format(getpass.getuser(), socket.gethostname()),
+                 {"system_headers": headers, "system_frameworks": frameworks})
+    settings.set("worker_threads", arguments.worker_threads)
+    settings.set("preamble_cache_directory",
+                 arguments.preamble_cache_directory)
+
+    files = select_files(arguments)
+    window = sublime.Window({"folder": os.path.abspath(arguments.database)})
+    view_settings = {"compile_commands": "${folder}",
+                     "syntax": "Packages/C++/C++.sublime-syntax"}
+    watcher = Clara.CompilationDatabaseWatcher()
+
+    report = {"files": [], "loads": [], "latencies": [], "results": 0}
+    database_time = None
+    for name, positions in sorted(files.items()):
+        view = window.open_file(name, view_settings)
+        start = time.perf_counter()
+        watcher.on_new(view)
+        while not view.settings().get("_clara_code_completer", False):
+            if time.perf_counter() - start > arguments.timeout:
+                break
+            time.sleep(0.01)
+        if database_time is None:
+            database_time = time.perf_counter() - start
+        if not view.settings().get("_clara_code_completer", False):
+            print("skipping {}: no compile command".format(name))
+            continue
+
+        start = time.perf_counter()
+        completer = Clara.CodeCompleter(view)
+        if not wait(view.loaded, arguments.timeout):
+            print("skipping {}: it did not load".format(name))
+            del completer
+            continue
+        load_time = time.perf_counter() - start
+        report["loads"].append(load_time)
+
+        if positions:
+            points = [view.text_point(line - 1, column - 1)
+                      for line, column in positions]
+        else:
+            points = find_positions(view, arguments.requests_per_file)
+        latencies = []
+        results = 0
+        for _ in range(arguments.repeat):
+            for point in points:
+                view.touch()
+                view.completed.clear()
+                start = time.perf_counter()
+                completer.on_query_completions("", [point])
+                if not wait(view.completed, arguments.timeout):
+                    print("no completions at {}:{}:{}".format(
+                        name, *[n + 1 for n in view.rowcol(point)]))
+                    continue
+                latencies.append(time.perf_counter() - start)
+                # The results are in; this returns them from the cache.
+                results += len(completer.on_query_completions("", [point]))
+        del completer
+        report["latencies"].extend(latencies)
+        report["results"] += results
+        counts = diagnostics.counts.get(name, (0, 0, 0, 0))
+        report["files"].append({"file": name, "load": load_time,
+                                "requests": len(latencies),
+                                "results": results, "errors": counts[0]})
+        print("{}: loaded in {:.0f} ms, {} requests, {} results{}".format(
+            name, load_time * 1000, len(latencies), results,
+            ", {} errors".format(counts[0]) if counts[0] else ""))
+    window.close()
+
+    stats = Clara.stats()["global"]
+    latencies = report["latencies"]
+    preamble = stats.get("preamble", {})
+    summary = collections.OrderedDict([
+        ("database_ms", (database_time or 0) * 1000),
+        ("cold_start_p50_ms", percentile(report["loads"], 0.5) * 1000),
+        ("cold_start_max_ms", max(report["loads"] or [0]) * 1000),
+        ("preamble_builds", preamble.get("count", 0)),
+        ("preamble_p50_ms", preamble.get("p50", 0.0)),
+        ("completion_p50_ms", percentile(latencies, 0.5) * 1000),
+        ("completion_p99_ms", percentile(latencies, 0.99) * 1000),
+        ("requests", len(latencies)),
+        ("results_per_second",
+         report["results"] / sum(latencies) if latencies else 0.0),
+        ("peak_rss_mb", peak_rss_megabytes())])
+    print()
+    width = max(len(key) for key in summary)
+    for key, value in summary.items():
+        print("{:<{}}  {}".format(key, width, value if isinstance(value, int)
+                                  else "{:.1f}".format(value)))
+    if arguments.json:
+        with open(arguments.json, "w") as f:
+            json.dump({"summary": summary, "phases": stats,
+                       "files": report["files"]}, f, indent=2)
+    return 0 if latencies else 1
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,224 @@
+// Compares building the completion strings of one code completion run the
+// way Clara used to, with a handful of std::strings per result, against
+// building them into a CompletionStore. Clang is left out of the picture:
+// the results are synthetic chunk lists that look like those of a typical
+// global completion.
+
+#include "CompletionStore.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <utility>
+#include <vector>
+
+static std::atomic<std::size_t> gAllocations{0};
+
+void *operator new(std::size_t size)
+{
+    ++gAllocations;
+    if (void *result = std::malloc(size == 0 ? 1 : size)) return result;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *pointer) noexcept { std::free(pointer); }
+void operator delete(void *pointer, std::size_t) noexcept
+{
+    std::free(pointer);
+}
+
+namespace
+{
+
+enum class ChunkKind
+{
+    TypedText,
+    Text,
+    Placeholder,
+    ResultType
+};
+
+struct Chunk
+{
+    ChunkKind kind;
+    std::string text;
+};
+
+struct Result
+{
+    std::string name;
+    std::vector<Chunk> chunks;
+    unsigned priority;
+};
+
+std::vector<Result> makeResults(unsigned count)
+{
+    std::vector<Result> results(count);
+    for (unsigned i = 0; i < count; ++i)
+    {
+        auto &result = results[i];
+        result.name = "someFunctionName" + std::to_string(i);
+        result.priority = i % 80;
+        result.chunks.push_back({ChunkKind::ResultType, "unsigned long"});
+        result.chunks.push_back({ChunkKind::TypedText, result.name});
+        result.chunks.push_back({ChunkKind::Text, "("});
+        for (unsigned j = 0; j < i % 4; ++j)
+        {
+            if (j != 0) result.chunks.push_back({ChunkKind::Text, ", "});
+            result.chunks.push_back(
+                {ChunkKind::Placeholder, "const std::string &argument"});
+        }
+        result.chunks.push_back({ChunkKind::Text, ")"});
+    }
+    return results;
+}
+
+// The old way: three strings per result, std::to_string per placeholder,
+// and a record of four strings that is moved into a vector.
+struct Completion
+{
+    std::string display;
+    std::string insertion;
+    std::string name;
+    unsigned priority;
+};
+
+void buildStrings(const Result &result, std::vector<Completion> &completions)
+{
+    std::string first, second, informative, resultType;
+    unsigned argCount = 0;
+    for (const auto &chunk : result.chunks)
+    {
+        switch (chunk.kind)
+        {
+        case ChunkKind::TypedText:
+            first += chunk.text;
+            second += chunk.text;
+            break;
+        case ChunkKind::Text:
+            informative += chunk.text;
+            second += chunk.text;
+            break;
+        case ChunkKind::Placeholder:
+            ++argCount;
+            second += "${";
+            second += std::to_string(argCount);
+            second += ":";
+            informative += chunk.text;
+            second += chunk.text;
+            second += "}";
+            break;
+        case ChunkKind::ResultType:
+            resultType = chunk.text;
+            break;
+        }
+    }
+    informative += " -> ";
+    informative += resultType;
+    if (argCount > 0) second += "$0";
+    first += "\t";
+    first += informative;
+    completions.push_back(Completion{std::move(first), std::move(second),
+                                     result.name, result.priority});
+}
+
+// The new way: scratch strings that are reused for every result, a
+// snippet template, and a store that keeps its memory between runs.
+void buildStrings(const Result &result, std::string &first,
+                  std::string &second, std::string &informative,
+                  Clara::CompletionStore &store)
+{
+    first.clear();
+    second.clear();
+    informative.clear();
+    llvm::StringRef resultType;
+    for (const auto &chunk : result.chunks)
+    {
+        switch (chunk.kind)
+        {
+        case ChunkKind::TypedText:
+            first += chunk.text;
+            second += chunk.text;
+            break;
+        case ChunkKind::Text:
+            informative += chunk.text;
+            second += chunk.text;
+            break;
+        case ChunkKind::Placeholder:
+            second += Clara::CompletionStore::placeholderBegin;
+            informative += chunk.text;
+            second += chunk.text;
+            second += Clara::CompletionStore::placeholderEnd;
+            break;
+        case ChunkKind::ResultType:
+            resultType = chunk.text;
+            break;
+        }
+    }
+    informative += " -> ";
+    informative.append(resultType.data(), resultType.size());
+    first += "\t";
+    first += informative;
+    store.add(result.name, first, second, result.priority);
+}
+
+template <class Function> void measure(const char *name, Function function)
+{
+    const unsigned runs = 20;
+    // Warm up, so that reused memory is already there.
+    function();
+    const auto allocations = gAllocations.load();
+    const auto start = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < runs; ++i) function();
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    std::printf(
+        "%-40s %10zu allocations/run %8.3f ms/run\n", name,
+        (gAllocations.load() - allocations) / runs,
+        std::chrono::duration<double, std::milli>(elapsed).count() / runs);
+}
+
+} // anonymous namespace
+
+int main()
+{
+    const unsigned shown = 300;
+    for (const unsigned count : {1000u, 10000u, 50000u})
+    {
+        const auto results = makeResults(count);
+        std::printf("%u results, %u shown\n", count, shown);
+
+        std::vector<Completion> completions;
+        measure("std::string per result", [&]() {
+            completions.clear();
+            for (const auto &result : results)
+            {
+                buildStrings(result, completions);
+            }
+            std::vector<std::pair<std::string, std::string>> output;
+            for (unsigned i = 0; i < shown; ++i)
+            {
+                output.emplace_back(completions[i].display,
+                                    completions[i].insertion);
+            }
+        });
+
+        Clara::CompletionStore store;
+        std::string first, second, informative;
+        measure("CompletionStore, lazy snippets", [&]() {
+            store.clear();
+            for (const auto &result : results)
+            {
+                buildStrings(result, first, second, informative, store);
+            }
+            std::vector<std::pair<std::string, std::string>> output;
+            for (unsigned i = 0; i < shown; ++i)
+            {
+                output.emplace_back(store.getDisplay(i).str(), std::string());
+                Clara::CompletionStore::renderSnippet(store.getSnippet(i),
+                                                      output.back().second);
+            }
+        });
+    }
+}
@@ -0,0 +1,129 @@
+// Measures how many translation units per second the SymbolIndex indexes,
+// in total and per core, with one thread and then with more and more of
+// them. The units are those of a compilation database; run it with a build
+// directory, for example
+//
+// $ ./lib/SymbolIndexBench /path/to/build --builtin-headers /path/to/headers
+//
+// Nothing is written to disk: the shards are only counted.
+
+#include "SymbolIndex.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <clang/Tooling/CompilationDatabase.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace
+{
+
+struct Totals
+{
+    std::atomic<std::size_t> failed{0};
+    std::atomic<std::size_t> symbols{0};
+    std::atomic<std::size_t> occurrences{0};
+};
+
+void index(const std::vector<Clara::SymbolIndex::Unit> &units,
+           const Clara::CompletionBackend::Options &options,
+           unsigned threadCount, Totals &totals)
+{
+    std::atomic<std::size_t> next{0};
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < threadCount; ++i)
+    {
+        threads.emplace_back([&]() {
+            for (auto unit = next++; unit < units.size(); unit = next++)
+            {
+                Clara::SymbolIndex::Shard shard;
+                if (!Clara::SymbolIndex::indexUnit(units[unit], options,
+                                                   shard))
+                {
+                    ++totals.failed;
+                    continue;
+                }
+                totals.symbols += shard.symbols.size();
+                totals.occurrences += shard.occurrences.size();
+            }
+        });
+    }
+    for (auto &thread : threads) thread.join();
+}
+
+} // anonymous namespace
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        std::fprintf(stderr, "usage: %s <build directory> [--builtin-headers "
+                             "<directory>] [--units <count>]\n",
+                     argv[0]);
+        return 1;
+    }
+    Clara::CompletionBackend::Options options;
+    std::size_t maxUnits = 64;
+    for (int i = 2; i + 1 < argc; i += 2)
+    {
+        if (std::strcmp(argv[i], "--builtin-headers") == 0)
+        {
+            options.builtinHeaders = argv[i + 1];
+        }
+        else if (std::strcmp(argv[i], "--units") == 0)
+        {
+            maxUnits = std::strtoul(argv[i + 1], nullptr, 10);
+        }
+    }
+    std::string error;
+    const auto database =
+        clang::tooling::CompilationDatabase::autoDetectFromDirectory(argv[1],
+                                                                     error);
+    if (!database)
+    {
+        std::fprintf(stderr, "%s\n", error.c_str());
+        return 1;
+    }
+    std::vector<Clara::SymbolIndex::Unit> units;
+    for (auto &command : database->getAllCompileCommands())
+    {
+        if (units.size() == maxUnits) break;
+        units.push_back({std::move(command.Filename),
+                         std::move(command.CommandLine),
+                         std::move(command.Directory)});
+    }
+    if (units.empty())
+    {
+        std::fprintf(stderr, "no units in %s\n", argv[1]);
+        return 1;
+    }
+
+    const auto maxThreads =
+        std::max(1u, std::thread::hardware_concurrency());
+    // Once, so that the headers are in the file system cache.
+    {
+        Totals totals;
+        index(units, options, maxThreads, totals);
+        std::printf("%zu units, %zu failed, %zu symbols, %zu occurrences\n",
+                    units.size(), totals.failed.load(),
+                    totals.symbols.load(), totals.occurrences.load());
+    }
+    for (unsigned threads = 1;; threads = std::min(2 * threads, maxThreads))
+    {
+        Totals totals;
+        const auto start = std::chrono::steady_clock::now();
+        index(units, options, threads, totals);
+        const auto seconds = std::chrono::duration<double>(
+                                 std::chrono::steady_clock::now() - start)
+                                 .count();
+        const auto perSecond = units.size() / seconds;
+        std::printf("%3u threads %8.2f s %8.2f units/s %8.2f units/s/core\n",
+                    threads, seconds, perSecond, perSecond / threads);
+        if (threads == maxThreads) break;
+    }
+    return 0;
+}
@@ -0,0 +1,173 @@
+"""A stand-in for Sublime Text's sublime module, with just enough of the API
+for the native code completer. Used by ClaraBench.py."""
+
+import os
+import re
+import sys
+import threading
+
+_settings = {}
+_windows = []
+_packages_path = ""
+_next_id = 1
+
+def version():
+    return "3000"
+
+def platform():
+    return {"darwin": "osx", "win32": "windows"}.get(sys.platform, "linux")
+
+def packages_path():
+    return _packages_path
+
+def error_message(message):
+    raise RuntimeError(message)
+
+def load_settings(name):
+    return _settings.setdefault(name, Settings())
+
+def windows():
+    return list(_windows)
+
+def expand_variables(value, variables):
+    return re.sub(r"\$\{(\w+)\}|\$(\w+)",
+                  lambda m: variables.get(m.group(1) or m.group(2), ""),
+                  value)
+
+def _new_id():
+    global _next_id
+    result = _next_id
+    _next_id += 1
+    return result
+
+class Region(object):
+
+    def __init__(self, a, b=None):
+        self.a = a
+        self.b = a if b is None else b
+
+    def begin(self):
+        return min(self.a, self.b)
+
+    def end(self):
+        return max(self.a, self.b)
+
+    def empty(self):
+        return self.a == self.b
+
+class Settings(object):
+
+    def __init__(self, values=None):
+        self._values = dict(values or {})
+
+    def get(self, key, default=None):
+        return self._values.get(key, default)
+
+    def set(self, key, value):
+        self._values[key] = value
+
+class Window(object):
+
+    def __init__(self, variables=None):
+        self._id = _new_id()
+        self._views = []
+        self._variables = dict(variables or {})
+        _windows.append(self)
+
+    def id(self):
+        return self._id
+
+    def views(self):
+        return list(self._views)
+
+    def active_view(self):
+        return self._views[-1] if self._views else None
+
+    def extract_variables(self):
+        return dict(self._variables)
+
+    def open_file(self, file_name, settings):
+        view = View(self, file_name, settings)
+        self._views.append(view)
+        return view
+
+    def close(self):
+        _windows.remove(self)
+
+class View(object):
+    """A view of a file on disk. Every request for completions is answered
+    through run_command("auto_complete"), which signals the completed
+    event."""
+
+    def __init__(self, window, file_name, settings):
+        self._id = _new_id()
+        self._window = window
+        self._file_name = file_name
+        self._settings = Settings(settings)
+        with open(file_name, encoding="utf-8", errors="replace") as f:
+            self._text = f.read()
+        self._line_starts = [0]
+        for match in re.finditer("\n", self._text):
+            self._line_starts.append(match.end())
+        self._change_count = 0
+        self._selection = [Region(0)]
+        self.loaded = threading.Event()
+        self.completed = threading.Event()
+        self.status = {}
+
+    def id(self):
+        return self._id
+
+    def file_name(self):
+        return self._file_name
+
+    def window(self):
+        return self._window
+
+    def settings(self):
+        return self._settings
+
+    def size(self):
+        return len(self._text)
+
+    def substr(self, region):
+        return self._text[region.begin():region.end()]
+
+    def change_count(self):
+        return self._change_count
+
+    def is_dirty(self):
+        return False
+
+    def touch(self):
+        """Pretends that the buffer was edited, so that the next request
+        can't be served from the results of the previous one."""
+        self._change_count += 1
+
+    def text_point(self, row, col):
+        return self._line_starts[row] + col
+
+    def rowcol(self, point):
+        low, high = 0, len(self._line_starts) - 1
+        while low < high:
+            middle = (low + high + 1) // 2
+            if self._line_starts[middle] <= point:
+                low = middle
+            else:
+                high = middle - 1
+        return (low, point - self._line_starts[low])
+
+    def sel(self):
+        return self._selection
+
+    def set_status(self, key, value):
+        self.status[key] = value
+
+    def erase_status(self, key):
+        self.status.pop(key, None)
+        if key == "clara":
+            self.loaded.set()
+
+    def run_command(self, cmd, args=None):
+        if cmd == "auto_complete":
+            self.completed.set()
@@ -1,110 +1,126 @@
 #pragma once
 
+#include "CompletionBackend.hpp"
+#include "CompletionList.hpp"
+#include "DiagnosticList.hpp"
 #include "PyBind11.hpp"
-#include <atomic>
-#include <clang/Basic/Diagnostic.h>
-#include <clang/Frontend/ASTUnit.h>
-#include <clang/Frontend/CompilerInvocation.h>
-#include <clang/Frontend/PCHContainerOperations.h>
-#include <clang/Sema/CodeCompleteConsumer.h>
-#include <clang/Sema/Overload.h>
-#include <condition_variable>
-#include <future>
-#include <mutex>
+#include "TextBuffer.hpp"
+#include <cstdint>
+#include <memory>
 #include <string>
-#include <utility>
 #include <vector>
 
 namespace Clara
 {
 
-class CodeCompleter : public clang::DiagnosticConsumer,
-                      public clang::CodeCompleteConsumer
+// The code completer of a view. It mirrors the text of the view, keeps
+// track of what is being completed, and hands the actual work to a
+// CompletionBackend: a CompletionEngine in this process, or a
+// RemoteCompletionEngine when the "server" setting is on. Python is entered
+// on the UI thread, and once for every result that the engine delivers.
+class CodeCompleter
 {
   public:
     CodeCompleter(pybind11::object view);
-    ~CodeCompleter() override;
-
-    // clang::CodeCompleteConsumer implementation
-    clang::CodeCompletionAllocator &getAllocator() override;
-    clang::CodeCompletionTUInfo &getCodeCompletionTUInfo() override;
-    void ProcessCodeCompleteResults(clang::Sema &sema,
-                                    clang::CodeCompletionContext context,
-                                    clang::CodeCompletionResult *results,
-                                    unsigned numResults) override;
-    void ProcessOverloadCandidates(
-        clang::Sema &sema, unsigned currentArg,
-        clang::CodeCompleteConsumer::OverloadCandidate *candidates,
-        unsigned numCandidates) override;
-
-    // clang::DiagnosticConsumer implementation
-    void HandleDiagnostic(clang::DiagnosticsEngine::Level level,
-                          const clang::Diagnostic &info) override;
-    void BeginSourceFile(const clang::LangOptions &options,
-                         const clang::Preprocessor *pp) override;
-    void EndSourceFile() override;
-    void finish() override;
+    ~CodeCompleter();
 
     // Methods that will be exported to Python
     // is_applicable must be defined in python because it's a @classmethod.
-    std::vector<std::pair<std::string, std::string>>
-    onQueryCompletions(pybind11::str prefix, pybind11::list locations);
+    CompletionList onQueryCompletions(pybind11::str prefix,
+                                      pybind11::list locations);
     void onPostSave();
-    void reparse();
+    void onTextChanged(pybind11::list changes);
+    void onSelectionModified();
+    void onActivated();
+    void onDeactivated();
+    // Shows the parameters of the call that the caret is in, once a
+    // parenthesis or a comma is typed. Called by onTextChanged when Sublime
+    // reports text changes, and from on_modified otherwise.
+    void onModified();
+    // Start looking up the symbol at a point, to show it in a popup together
+    // with the diagnostics of its row, or to go to its definition. onHover
+    // returns false when the file is not parsed yet.
+    bool onHover(unsigned point);
+    void goToDefinition(unsigned point);
+
+    // Starts over with a new compile command. Called by the
+    // CompilationDatabaseWatcher, from any thread.
+    void reload(std::vector<std::string> command, std::string directory);
+
+    // Reads the options of the engines from the settings. Returns false if
+    // the system headers have not been set up.
+    static bool getOptions(CompletionBackend::Options &options);
 
     static void registerClass(pybind11::module &m);
 
   private:
-    void backgroundWorker();
-    void initAST(std::vector<std::string> command,
-                 std::vector<std::string> systemHeaders,
-                 std::vector<std::string> systemFrameworks,
-                 std::string builtinHeaders);
-    void codeCompleteImpl();
-    clang::CodeCompleteOptions initCodeCompleteOptions() const;
-    void addPath(clang::CompilerInvocation *invocation, const std::string &path,
-                 bool isFramework) const;
-    std::pair<std::string, std::string>
-    ProcessCodeCompleteResult(clang::Sema &sema,
-                              clang::CodeCompletionContext context,
-                              clang::CodeCompletionResult &result);
+    // The engine callbacks. They are called on a worker thread, or on the
+    // thread of the server connection, without the GIL.
+    void showLoaded();
+    void showDiagnostics(DiagnosticList diagnostics);
+    void showCompletions(unsigned generation, std::uint64_t requestTime);
+    void showDeclaration(unsigned request,
+                         CompletionBackend::Declaration declaration);
+    void showSignatures(unsigned request,
+                        std::vector<CompletionBackend::Signature> signatures);
+
+    void requestSignatures(unsigned point, unsigned row, std::size_t offset);
+    void updateSignatures(std::size_t offset);
+    void renderSignatures();
+    void hideSignatures();
+
+    bool lookUp(unsigned point);
+
+    void cancelCompletion();
+    void syncBuffer();
+    // Shares the text of a dirty view with the units of the other views,
+    // through the UnsavedFiles. Done when the view loses focus rather than
+    // on every edit, so that typing neither copies the text nor makes the
+    // units that include the file reparse.
+    void publishText();
+    // Sets the caret, its row, and its offset in the buffer. Returns false
+    // unless there is a single, empty selection.
+    bool getCaret(unsigned &point, unsigned &row, std::size_t &offset);
+    // Masks the buffer with the preamble of the engine, if it has one.
+    TextBuffer::Snapshot getSnapshot();
 
-    void ProcessCodeCompleteString(const clang::CodeCompletionString &ccs,
-                                   unsigned &argCount, std::string &first,
-                                   std::string &second,
-                                   std::string &informative) const;
-    std::atomic_bool mIsLoaded{false};
-    clang::CodeCompletionTUInfo mCCTUInfo;
     pybind11::object mView;
-    clang::SmallVector<clang::StoredDiagnostic, 8>
-        mStoredDiags; // ugly hack, wait for clang devs to fix this
-    clang::SmallVector<const llvm::MemoryBuffer *, 1>
-        mOwnedBuffers; // ugly hack, wait for clang devs to fix this
-    std::shared_ptr<clang::PCHContainerOperations> mPchOps =
-        std::make_shared<clang::PCHContainerOperations>();
-    // SessionOptions mOptions;
-    clang::LangOptions mLangOpts;
-    clang::FileSystemOptions mFileOpts;
-    clang::IntrusiveRefCntPtr<clang::FileManager> mFileMgr;
-    clang::IntrusiveRefCntPtr<clang::DiagnosticIDs> mDiagIds;
-    clang::IntrusiveRefCntPtr<clang::DiagnosticOptions> mDiagOpts;
-    // Clara::DiagnosticConsumer mDiagConsumer;
-    clang::IntrusiveRefCntPtr<clang::DiagnosticsEngine> mDiags;
-    clang::IntrusiveRefCntPtr<clang::SourceManager> mSourceMgr;
-    // std::unique_ptr<Clara::CodeCompleteConsumer> mCodeCompleteConsumer;
-    std::unique_ptr<clang::ASTUnit> mUnit;
-    unsigned mPoint;
-    unsigned mRow;
-    unsigned mColumn;
-    std::string mUnsavedBuffer;
-    bool mDoCompletionJob = false;
     std::string mFilename;
-    std::vector<std::pair<std::string, std::string>> mCompletions;
-    std::thread mInitThread;
-    std::thread mWorkerThread;
-
-    mutable std::mutex mMethodMutex;
-    mutable std::condition_variable mConditionVar;
+    int mViewId = 0;
+    // Only touched on the UI thread.
+    TextBuffer mBuffer;
+    int mSyncedChangeCount = -1;
+    // The version of the text in the UnsavedFiles, or zero if it is not
+    // there, and the change count that it was published at.
+    std::uint64_t mUnsavedVersion = 0;
+    int mPublishedChangeCount = -1;
+    // The completion context is the start of the identifier that is being
+    // completed. It stays the same while typing that identifier, as long as
+    // nothing before it is edited.
+    std::size_t mContextStart = std::string::npos;
+    // The same position, as a Sublime point.
+    unsigned mContextPoint = 0;
+    // The latest look-up, where it was, and whether it was for going to the
+    // definition. Only touched with the GIL held.
+    unsigned mLookUpRequest = 0;
+    unsigned mLookUpPoint = 0;
+    bool mIsGoingToDefinition = false;
+    bool mIsSignatureHelpEnabled = true;
+    // The call that parameter hints are shown for: the offset of its
+    // opening parenthesis, or npos if there is none, and the same position
+    // as a Sublime point.
+    std::size_t mCallStart = std::string::npos;
+    unsigned mCallPoint = 0;
+    unsigned mActiveArgument = 0;
+    // The overloads of the call, once they are in. They are kept while the
+    // caret moves between its arguments, until something up to its
+    // parenthesis is edited. Only touched with the GIL held.
+    std::vector<CompletionBackend::Signature> mSignatures;
+    bool mHasSignatures = false;
+    unsigned mSignatureRequest = 0;
+    std::uint64_t mSignatureRequestTime = 0;
+    // Null when the system headers have not been set up.
+    std::unique_ptr<CompletionBackend> mEngine;
 };
 
 } // Clara
@@ -1,33 +1,124 @@
 #pragma once
 
+#include "IncludeGraph.hpp"
 #include "PyBind11.hpp"
+#include "SymbolIndex.hpp"
 #include <clang/Tooling/CompilationDatabase.h>
 #include <map>
 #include <memory>
 #include <mutex>
 #include <string>
+#include <tuple>
 #include <vector>
 
 namespace Clara
 {
 
+class CodeCompleter;
+
+// Loads the compilation databases of windows, and keeps them up to date.
+// Windows that use the same build directory share a single database. When
+// the build regenerates the database, it is reloaded in the background, and
+// the code completers whose compile command changed are reinitialized.
+//
+// A header that is not in the database gets the command of a unit that
+// includes it, from an IncludeGraph that is built in the background once the
+// database is loaded. The graph is updated when a file is saved.
+//
+// When the "prewarm" setting is on, the shared preambles of the files that
+// are likely to be opened next are built in the background: the files next
+// to the opened ones, the recently opened files, and the files that include
+// an opened header.
+//
+// When the "symbol_index" setting is on, every unit of the database is
+// indexed into a SymbolIndex in the background, for going to a symbol in the
+// project. Saving a file indexes the units that include it again.
 class CompilationDatabaseWatcher
 {
   public:
+    using Command = std::tuple<std::vector<std::string>, std::string>;
+
     void onNew(pybind11::object view);
     void onLoad(pybind11::object view);
     void onClone(pybind11::object view);
     void onActivated(pybind11::object view);
+    void onPostSave(pybind11::object view);
+
+    static Command getForView(pybind11::object view);
+
+    // Returns the symbols of the project of a window whose names start with
+    // the query, as (name, qualified name, kind, file, line, column) tuples.
+    // Empty while the index is being built for the first time.
+    static std::vector<std::tuple<std::string, std::string, std::string,
+                                  std::string, unsigned, unsigned>>
+    findSymbols(pybind11::object window, std::string query,
+                std::size_t maxResults);
 
-    std::tuple<std::vector<std::string>, std::string> static getForView(
-        pybind11::object view);
+    // Like getForView, but also calls completer->reload whenever the compile
+    // command of the view changes, until the completer unsubscribes.
+    static Command subscribe(CodeCompleter *completer, pybind11::object view);
+    static void unsubscribe(CodeCompleter *completer);
 
     static void registerClass(pybind11::module &m);
 
   private:
+    struct Database
+    {
+        ~Database();
+
+        std::string directory;
+        unsigned watchId = 0;
+        // nullptr while the database is still loading. Shared with the job
+        // that builds the include graph.
+        std::shared_ptr<clang::tooling::CompilationDatabase> database;
+        // nullptr while the include graph is still being built.
+        std::shared_ptr<IncludeGraph> includes;
+        // The files of the database by directory, to find the neighbours of
+        // an opened file in. Only filled in once prewarming is on.
+        std::map<std::string, std::vector<std::string>> directories;
+        bool isListed = false;
+        // Whether the recently opened files have been prewarmed.
+        bool isPrewarmed = false;
+        // nullptr unless the "symbol_index" setting is on.
+        std::shared_ptr<SymbolIndex> symbols;
+    };
+
+    struct Subscription
+    {
+        std::shared_ptr<Database> database;
+        std::string filename;
+        Command command;
+    };
+
+    static std::shared_ptr<Database> acquire(const std::string &directory);
+    static void load(std::string directory, std::string indexDirectory);
+    static void buildIncludeGraph(
+        std::string directory,
+        std::shared_ptr<clang::tooling::CompilationDatabase> database,
+        std::shared_ptr<IncludeGraph> includes);
+    // Reloads the code completers of the database whose command changed.
+    static void refresh(const std::shared_ptr<Database> &database);
+    static Command getCommand(const Database &database,
+                              const std::string &filename);
+    static Command getUnitCommand(const Database &database,
+                                  const std::string &filename);
+    // Lets the Prewarmer warm the files that are likely to be opened after
+    // this one.
+    static void prewarm(const std::shared_ptr<Database> &database,
+                        const std::string &filename);
+    // Starts indexing the symbols of the database, if that is turned on and
+    // it hasn't started yet.
+    static void indexSymbols(const std::shared_ptr<Database> &database);
+    static void buildSymbolIndex(
+        std::shared_ptr<clang::tooling::CompilationDatabase> database,
+        std::shared_ptr<SymbolIndex> symbols);
+
     static std::mutex mMethodMutex;
-    static std::map<int, std::unique_ptr<clang::tooling::CompilationDatabase>>
-        mDatabases;
+    // Keyed by canonical directory. A database lives for as long as a window
+    // or a code completer uses it.
+    static std::map<std::string, std::weak_ptr<Database>> mDatabases;
+    static std::map<int, std::shared_ptr<Database>> mWindows;
+    static std::map<CodeCompleter *, Subscription> mSubscriptions;
 };
 
 } // Clara
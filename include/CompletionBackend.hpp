@@ -0,0 +1,141 @@
+#pragma once
+
+#include "CompletionList.hpp"
+#include "DiagnosticList.hpp"
+#include "Metrics.hpp"
+#include "PreambleCache.hpp"
+#include "TextBuffer.hpp"
+#include "WorkerPool.hpp"
+#include <clang/Sema/CodeCompleteConsumer.h>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace Clara
+{
+
+// What a CodeCompleter asks of the thing that parses its file: either a
+// CompletionEngine in this process, or a RemoteCompletionEngine that talks to
+// one in a clara-server process. None of the methods call into Python.
+class CompletionBackend
+{
+  public:
+    struct Options
+    {
+        clang::CodeCompleteOptions codeComplete;
+        std::vector<std::string> systemHeaders;
+        std::vector<std::string> systemFrameworks;
+        std::string builtinHeaders;
+        std::size_t maxResults = 300;
+    };
+
+    // What is known about the symbol at a location of the file. The rows and
+    // columns are one-based, the columns in bytes.
+    struct Declaration
+    {
+        // Empty when there is no symbol at the location.
+        std::string name;
+        std::string kind;
+        // The signature of a function, the type of a variable, or the
+        // definition of a macro.
+        std::string type;
+        // The documentation comment, without its comment markers.
+        std::string documentation;
+        // The first declaration.
+        std::string filename;
+        unsigned row = 0;
+        unsigned column = 0;
+        // Empty when the definition is not in the unit, for instance when it
+        // is in another source file.
+        std::string definitionFilename;
+        unsigned definitionRow = 0;
+        unsigned definitionColumn = 0;
+    };
+
+    // An overload that a call can resolve to, for the parameter hints.
+    struct Signature
+    {
+        // Like "int max(int a, int b)".
+        std::string label;
+        // The byte ranges of the parameters in the label.
+        std::vector<std::pair<unsigned, unsigned>> parameters;
+        std::string documentation;
+    };
+
+    // The callbacks are called on a thread of the backend, never on the
+    // thread that made the request.
+    struct Callbacks
+    {
+        // A parse succeeded, and completions can be requested.
+        std::function<void()> onLoaded;
+        // The diagnostics of a parse, whether it succeeded or not.
+        std::function<void(DiagnosticList diagnostics)> onDiagnostics;
+        // The results of a request are in. The request time is the one that
+        // was passed to complete.
+        std::function<void(unsigned generation, std::uint64_t requestTime)>
+            onCompleted;
+        // The answer to a lookUp. The request is the one that lookUp
+        // returned.
+        std::function<void(unsigned request, Declaration declaration)>
+            onLookedUp;
+        // The overloads of a call. The request is the one that
+        // completeSignatures returned.
+        std::function<void(unsigned request, std::vector<Signature> signatures)>
+            onSignatures;
+    };
+
+    virtual ~CompletionBackend() = default;
+
+    // Drops the queued work and waits for the running work. No callbacks
+    // are called after this returns.
+    virtual void stop() = 0;
+
+    // Parses the file on disk with the given command, from the start. This
+    // is also how a changed compile command is picked up.
+    virtual void load(std::vector<std::string> command,
+                      std::string directory) = 0;
+    // Reparses the file on disk.
+    virtual void reparse() = 0;
+    virtual bool isLoaded() const = 0;
+    virtual void setPriority(WorkerPool::Priority priority) = 0;
+
+    // Returns the shared preamble of the last parse, or nullptr. Snapshots
+    // that are masked with it are parsed without a copy.
+    virtual std::shared_ptr<const PreambleCache::Entry> getPreamble() const = 0;
+
+    // Starts completing at a one-based row and byte column, which should be
+    // the start of the identifier that is being typed. The typed part of the
+    // identifier is used to rank the results. The request supersedes all
+    // earlier ones. Returns its generation.
+    virtual unsigned complete(unsigned row, unsigned column,
+                              TextBuffer::Snapshot snapshot, std::string typed,
+                              std::uint64_t requestTime) = 0;
+    // Makes sure that the results of the current request are dropped.
+    virtual void cancel() = 0;
+    virtual bool isSuperseded(unsigned generation) const = 0;
+    // Returns true while the results of the latest request are not in.
+    virtual bool isCompleting() const = 0;
+    // Filters the results of the latest request by what has been typed
+    // since. Returns false when those results can't serve this text.
+    virtual bool filterCompletions(llvm::StringRef typed,
+                                   CompletionList &completions) const = 0;
+
+    // Starts collecting the overloads of the call that has an argument
+    // starting at a one-based row and byte column, for the parameter hints.
+    // Unlike complete, this never reparses, even when the preamble is out of
+    // date, and the ordinary completions are not collected. The request
+    // supersedes the earlier ones. Returns it, to be passed to onSignatures.
+    virtual unsigned completeSignatures(unsigned row, unsigned column,
+                                        TextBuffer::Snapshot snapshot) = 0;
+
+    // Starts looking up the symbol at a one-based row and byte column of the
+    // file as it was last parsed, without parsing it again. Returns the
+    // request, which is passed to onLookedUp.
+    virtual unsigned lookUp(unsigned row, unsigned column) = 0;
+
+    virtual Metrics::ViewHistograms &getMetrics() = 0;
+};
+
+} // Clara
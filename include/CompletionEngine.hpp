@@ -0,0 +1,246 @@
+#pragma once
+
+#include "CompletionBackend.hpp"
+#include "CompletionStore.hpp"
+#include "IncludeGraph.hpp"
+#include "LocationIndex.hpp"
+#include <atomic>
+#include <clang/Basic/Diagnostic.h>
+#include <clang/Frontend/ASTUnit.h>
+#include <clang/Frontend/CompilerInvocation.h>
+#include <clang/Frontend/PCHContainerOperations.h>
+#include <clang/Sema/CodeCompleteConsumer.h>
+#include <clang/Sema/Overload.h>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace Clara
+{
+
+// Parses one file and completes in it, on the WorkerPool. It is given plain
+// compile commands and text snapshots, and it never calls into Python: the
+// results are reported through callbacks, which are called on the worker
+// that produced them. So parsing and completing in several files runs on
+// several cores, without waiting for the GIL.
+//
+// A header that is not in the compilation database is given the command of
+// a unit that includes it (see IncludeGraph). It is parsed as the main file,
+// after the part of the unit's preamble that comes before the header.
+//
+// The unit counts against the MemoryBudget. When it is evicted, the engine
+// reports that it is not loaded, and parses the file again once it is made
+// interactive.
+//
+// Every parse sees the UnsavedFiles of the other views. When one of them
+// changes, the engine reparses if its preamble includes the file.
+class CompletionEngine : public CompletionBackend,
+                         public clang::DiagnosticConsumer,
+                         public clang::CodeCompleteConsumer
+{
+  public:
+    // The id is used for tracing and metrics.
+    CompletionEngine(std::string filename, int id, Options options,
+                     Callbacks callbacks);
+    // Waits for a running job.
+    ~CompletionEngine() override;
+
+    // Drops the queued jobs and waits for a running one. No callbacks are
+    // called after this returns.
+    void stop() override;
+
+    // clang::CodeCompleteConsumer implementation
+    clang::CodeCompletionAllocator &getAllocator() override;
+    clang::CodeCompletionTUInfo &getCodeCompletionTUInfo() override;
+    void ProcessCodeCompleteResults(clang::Sema &sema,
+                                    clang::CodeCompletionContext context,
+                                    clang::CodeCompletionResult *results,
+                                    unsigned numResults) override;
+    void ProcessOverloadCandidates(
+        clang::Sema &sema, unsigned currentArg,
+        clang::CodeCompleteConsumer::OverloadCandidate *candidates,
+        unsigned numCandidates) override;
+
+    // clang::DiagnosticConsumer implementation
+    void HandleDiagnostic(clang::DiagnosticsEngine::Level level,
+                          const clang::Diagnostic &info) override;
+    void BeginSourceFile(const clang::LangOptions &options,
+                         const clang::Preprocessor *pp) override;
+    void EndSourceFile() override;
+    void finish() override;
+
+    // CompletionBackend implementation
+    void load(std::vector<std::string> command,
+              std::string directory) override;
+    void reparse() override;
+    bool isLoaded() const override { return mIsLoaded; }
+    void setPriority(WorkerPool::Priority priority) override;
+    std::shared_ptr<const PreambleCache::Entry> getPreamble() const override;
+    unsigned complete(unsigned row, unsigned column,
+                      TextBuffer::Snapshot snapshot, std::string typed,
+                      std::uint64_t requestTime) override;
+    void cancel() override;
+    bool isSuperseded(unsigned generation) const override;
+    bool isCompleting() const override;
+    bool filterCompletions(llvm::StringRef typed,
+                           CompletionList &completions) const override;
+    unsigned completeSignatures(unsigned row, unsigned column,
+                                TextBuffer::Snapshot snapshot) override;
+    unsigned lookUp(unsigned row, unsigned column) override;
+    Metrics::ViewHistograms &getMetrics() override { return *mMetrics; }
+
+    // Copies the results of a request, if they are the latest ones. Used by
+    // the clara-server to send them to the editor.
+    bool copyCompletions(unsigned generation, CompletionStore &completions,
+                         bool &isTruncated) const;
+
+    // Adds the results in a store that match the typed text to a list, best
+    // first, at most maxResults of them.
+    static void filter(const CompletionStore &store, llvm::StringRef typed,
+                       std::size_t maxResults, CompletionList &completions);
+
+    // Builds the shared preamble of a file, or finds it in the PreambleCache,
+    // without parsing the rest of the file. An engine that loads the file
+    // with the same command then reuses it, for as long as the result is
+    // held. Used by the Prewarmer.
+    static std::shared_ptr<const PreambleCache::Entry>
+    buildPreamble(const std::string &filename, std::vector<std::string> command,
+                  const std::string &directory, const Options &options);
+
+    // Leaves out the compiler and the -include options of a command.
+    static std::vector<std::string>
+    getCommandLine(std::vector<std::string> command);
+    // Creates an invocation the way every engine does, for the command line
+    // of a file in the given directory. Also used by the SymbolIndex.
+    static std::unique_ptr<clang::CompilerInvocation>
+    createInvocation(const std::vector<std::string> &commandLine,
+                     const std::string &directory, const Options &options,
+                     clang::IntrusiveRefCntPtr<clang::DiagnosticsEngine> diags);
+
+  private:
+    void completionJob(unsigned row, unsigned column,
+                       const TextBuffer::Snapshot &snapshot,
+                       unsigned generation, std::string typed,
+                       std::uint64_t requestTime);
+    void signatureJob(unsigned row, unsigned column,
+                      const TextBuffer::Snapshot &snapshot, unsigned request);
+    void lookUpJob(unsigned row, unsigned column, unsigned request);
+    // Reparses when the preamble includes an unsaved file that changed.
+    void unsavedFileJob(const std::string &filename);
+    bool includes(const std::string &filename) const;
+    bool isPreambleStale(const TextBuffer::Snapshot &snapshot) const;
+    void collectDiagnostic(clang::DiagnosticsEngine::Level level,
+                           const clang::Diagnostic &info);
+    void beginDiagnostics();
+    void publishDiagnostics();
+    void initAST(std::vector<std::string> command);
+    void evict();
+    void restore();
+    void updateFootprint();
+    // The command line of the including unit, retargeted at the header.
+    // Empty if the unit is not in it.
+    std::vector<std::string> getHeaderCommandLine() const;
+    std::unique_ptr<clang::CompilerInvocation>
+    createInvocation(const std::vector<std::string> &commandLine) const;
+    std::shared_ptr<const PreambleCache::Entry> acquireContext() const;
+    bool loadUnit(llvm::StringRef contents);
+    void reparse(const std::string &contents);
+    std::unique_ptr<llvm::MemoryBuffer>
+    createMainBuffer(const std::string &contents) const;
+    void codeCompleteImpl(unsigned row, unsigned column,
+                          const TextBuffer::Snapshot &snapshot);
+    static void addPath(clang::CompilerInvocation *invocation,
+                        const std::string &path, bool isFramework);
+    void ProcessCodeCompleteResult(clang::Sema &sema,
+                                   clang::CodeCompletionContext context,
+                                   clang::CodeCompletionResult &result);
+
+    void ProcessCodeCompleteString(const clang::CodeCompletionString &ccs,
+                                   std::string &first, std::string &second,
+                                   std::string &informative) const;
+    std::atomic_bool mIsLoaded{false};
+    clang::CodeCompletionTUInfo mCCTUInfo;
+    clang::SmallVector<clang::StoredDiagnostic, 8>
+        mStoredDiags; // ugly hack, wait for clang devs to fix this
+    clang::SmallVector<const llvm::MemoryBuffer *, 1>
+        mOwnedBuffers; // ugly hack, wait for clang devs to fix this
+    std::shared_ptr<clang::PCHContainerOperations> mPchOps =
+        std::make_shared<clang::PCHContainerOperations>();
+    clang::LangOptions mLangOpts;
+    clang::FileSystemOptions mFileOpts;
+    clang::IntrusiveRefCntPtr<clang::FileManager> mFileMgr;
+    clang::IntrusiveRefCntPtr<clang::DiagnosticIDs> mDiagIds;
+    clang::IntrusiveRefCntPtr<clang::DiagnosticOptions> mDiagOpts;
+    clang::IntrusiveRefCntPtr<clang::DiagnosticsEngine> mDiags;
+    clang::IntrusiveRefCntPtr<clang::SourceManager> mSourceMgr;
+
+    // Declared before mUnit so that the unit lets go of the shared preamble
+    // before we do.
+    std::shared_ptr<const PreambleCache::Entry> mPreamble;
+    // What the including unit has before a header, when the file is one.
+    std::shared_ptr<const PreambleCache::Entry> mContext;
+    // Shared with mUnit, which parses function bodies for the
+    // LocationIndex, but completes without them.
+    std::shared_ptr<clang::CompilerInvocation> mInvocation;
+    std::unique_ptr<clang::ASTUnit> mUnit;
+    // Built from mUnit on the first lookUp after a parse. Declared after it,
+    // because it points into its AST.
+    std::unique_ptr<LocationIndex> mLocations;
+    // The preamble text that mUnit was last parsed with, for when there is
+    // no shared preamble.
+    std::string mParsedPreamble;
+    std::vector<std::string> mCommandLine;
+    // The including unit of a header, and its command line.
+    IncludeGraph::Includer mIncluder;
+    std::vector<std::string> mContextCommandLine;
+    // The command that was passed to load, to restore an evicted unit with.
+    std::vector<std::string> mCommand;
+    std::atomic_bool mIsEvicted{false};
+    // The diagnostics of the parse in progress. Code completion runs
+    // produce diagnostics as well, but those are not collected.
+    DiagnosticList mDiagnostics;
+    bool mIsCollectingDiagnostics = false;
+    std::vector<std::string> mSystemHeaders;
+    std::vector<std::string> mSystemFrameworks;
+    std::string mBuiltinHeaders;
+    Callbacks mCallbacks;
+    // Every completion request gets a new generation. A job whose generation
+    // is no longer the latest one has been superseded, and must not deliver
+    // its results.
+    std::atomic<unsigned> mGeneration{0};
+    // Likewise for signature requests and look-ups, of which only the
+    // latest ones are answered.
+    std::atomic<unsigned> mSignatureRequest{0};
+    std::atomic<unsigned> mLookUpRequest{0};
+    std::string mFilename;
+    int mId;
+    std::shared_ptr<Metrics::ViewHistograms> mMetrics;
+    std::size_t mMaxResults;
+    // Filled by the clang callbacks on a worker, then swapped with
+    // mCompletions under the mutex, so that both keep their memory.
+    CompletionStore mResults;
+    // Scratch space for the strings of one result.
+    std::string mFirst;
+    std::string mSecond;
+    std::string mInformative;
+    unsigned mJobGeneration = 0;
+    std::string mTyped;
+    bool mResultsTruncated = false;
+    // While a signature request runs, the overloads are collected, and the
+    // ordinary results are dropped.
+    bool mIsCollectingSignatures = false;
+    std::vector<Signature> mSignatures;
+    CompletionStore mCompletions;
+    // The request that mCompletions belong to, the text they were ranked
+    // with, and whether they were cut off at mMaxResults.
+    unsigned mCompletionsGeneration = 0;
+    std::string mCompletionsTyped;
+    bool mCompletionsTruncated = false;
+
+    mutable std::mutex mMethodMutex;
+};
+
+} // Clara
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstdint>
+#include <llvm/ADT/StringRef.h>
+#include <string>
+#include <vector>
+
+namespace Clara
+{
+
+// The completions that are handed to Sublime. All strings live in a single
+// UTF-8 buffer, and the Python strings of an item are only created when
+// Sublime asks for that item. To Python it is a read-only sequence of
+// (display, snippet) tuples.
+class CompletionList
+{
+  public:
+    void reserve(std::size_t count, std::size_t bytes);
+    void add(llvm::StringRef display, llvm::StringRef snippet);
+
+    std::size_t size() const { return mItems.size(); }
+    bool empty() const { return mItems.empty(); }
+
+    llvm::StringRef getDisplay(std::size_t index) const;
+    llvm::StringRef getSnippet(std::size_t index) const;
+
+  private:
+    struct Item
+    {
+        std::uint32_t offset;
+        std::uint32_t displayLength;
+        std::uint32_t snippetLength;
+    };
+
+    std::string mBytes;
+    std::vector<Item> mItems;
+};
+
+} // Clara
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdint>
+#include <llvm/ADT/StringRef.h>
+#include <string>
+#include <vector>
+
+namespace Clara
+{
+
+// The completion results of one code completion run. The strings of all
+// results are stored back to back in a single byte buffer, and the records
+// only hold their lengths. Clearing the store keeps its memory, so once it
+// has grown to the size of a typical run, filling it does not allocate.
+//
+// Snippets are stored as templates, in which the placeholders are delimited
+// by placeholderBegin and placeholderEnd. They are only turned into Sublime
+// snippets by renderSnippet, for the results that are actually shown.
+class CompletionStore
+{
+  public:
+    static const char placeholderBegin = '\x01';
+    static const char placeholderEnd = '\x02';
+
+    void clear();
+    void swap(CompletionStore &other);
+
+    void add(llvm::StringRef name, llvm::StringRef display,
+             llvm::StringRef snippet, unsigned priority);
+
+    std::size_t size() const { return mRecords.size(); }
+    bool empty() const { return mRecords.empty(); }
+
+    // What the typed text is matched against.
+    llvm::StringRef getName(std::size_t index) const;
+    llvm::StringRef getDisplay(std::size_t index) const;
+    llvm::StringRef getSnippet(std::size_t index) const;
+    unsigned getPriority(std::size_t index) const
+    {
+        return mRecords[index].priority;
+    }
+
+    // Appends the snippet with numbered placeholders, and a final $0 when
+    // it has any, to result.
+    static void renderSnippet(llvm::StringRef snippet, std::string &result);
+
+  private:
+    struct Record
+    {
+        std::uint32_t offset;
+        std::uint32_t nameLength;
+        std::uint32_t displayLength;
+        std::uint32_t snippetLength;
+        unsigned priority;
+    };
+
+    std::vector<char> mBytes;
+    std::vector<Record> mRecords;
+};
+
+} // Clara
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstdint>
+#include <llvm/ADT/StringRef.h>
+#include <string>
+#include <tuple>
+#include <vector>
+
+namespace Clara
+{
+
+// The warnings and errors of one parse of a view's file, which are handed
+// to Python in one go when the parse is done. Only the diagnostics of the
+// main file are kept; those of included files are merely counted. The
+// messages live in a single buffer, and a Python string is only created
+// for a message that is actually shown.
+//
+// Positions are zero-based rows and columns in code points, like Sublime's
+// View.text_point wants them.
+class DiagnosticList
+{
+  public:
+    using Range = std::tuple<unsigned, unsigned, unsigned, unsigned>;
+
+    void clear();
+    void add(bool isError, unsigned row, unsigned column, unsigned endRow,
+             unsigned endColumn, llvm::StringRef message);
+    void addElsewhere(bool isError);
+
+    std::size_t size() const { return mItems.size(); }
+    bool isError(std::size_t index) const { return mItems[index].isError; }
+    Range getRange(std::size_t index) const;
+    llvm::StringRef getMessage(std::size_t index) const;
+
+    // Returns the indices of the diagnostics on the given rows.
+    std::vector<unsigned> getIndicesInRows(unsigned firstRow,
+                                           unsigned lastRow) const;
+
+    // Returns the number of errors and warnings in the main file, and in
+    // the files that it includes.
+    std::tuple<unsigned, unsigned, unsigned, unsigned> getCounts() const;
+
+  private:
+    struct Item
+    {
+        bool isError;
+        std::uint32_t row;
+        std::uint32_t column;
+        std::uint32_t endRow;
+        std::uint32_t endColumn;
+        std::uint32_t offset;
+        std::uint32_t length;
+    };
+
+    std::string mMessages;
+    std::vector<Item> mItems;
+    unsigned mErrorCount = 0;
+    unsigned mElsewhereErrorCount = 0;
+    unsigned mElsewhereWarningCount = 0;
+};
+
+} // Clara
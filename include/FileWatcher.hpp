@@ -0,0 +1,64 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+
+namespace Clara
+{
+
+// A process-wide watcher that reports when files are created, written or
+// replaced. On Linux it uses inotify on the directory of each file, so that
+// files that are replaced by a rename are noticed too. Elsewhere, and for
+// files in directories that inotify can't watch, the files are polled.
+//
+// Build tools tend to write a file in several steps, so a burst of changes
+// is reported once, after the file has been quiet for a moment.
+class FileWatcher
+{
+  public:
+    using Callback = std::function<void()>;
+
+    static FileWatcher &get();
+
+    // Starts watching the file at the given path, which doesn't have to
+    // exist yet. The callback is called on the watcher thread, and should
+    // hand off any real work. Returns an id for unwatch.
+    unsigned watch(std::string path, Callback callback);
+
+    // Stops watching. A callback that has already started may still be
+    // running when this returns.
+    void unwatch(unsigned id);
+
+  private:
+    FileWatcher() = default;
+
+    struct Watch
+    {
+        std::string path;
+        std::string filename;
+        Callback callback;
+        // The inotify watch descriptor of the directory, or -1 when the file
+        // is polled.
+        int descriptor = -1;
+        long long modificationTime = 0;
+        unsigned long long size = 0;
+        bool isPending = false;
+        std::chrono::steady_clock::time_point deadline;
+    };
+
+    void run();
+    void readEvents();
+    void pollFiles();
+    void markPending(Watch &watch);
+
+    std::mutex mMutex;
+    std::map<unsigned, Watch> mWatches;
+    unsigned mNextId = 1;
+    int mInotify = -1;
+    bool mIsRunning = false;
+};
+
+} // Clara
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <llvm/ADT/StringRef.h>
+#include <string>
+
+namespace Clara
+{
+
+// Matches completion candidates against what the user has typed so far. A
+// candidate matches when it contains the characters of the pattern in the
+// same order, ignoring case. Matches score higher when the characters are
+// found at the start of the candidate, at the start of a word (after an
+// underscore or at a camelCase hump), or next to each other.
+class FuzzyMatcher
+{
+  public:
+    explicit FuzzyMatcher(llvm::StringRef pattern);
+
+    // Returns false if the candidate does not match. Otherwise, score is set
+    // to the quality of the match; higher is better. Every candidate matches
+    // an empty pattern with a score of zero.
+    bool match(llvm::StringRef candidate, int &score) const;
+
+  private:
+    std::string mLower;
+    std::string mUpper;
+};
+
+} // Clara
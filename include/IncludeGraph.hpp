@@ -0,0 +1,134 @@
+#pragma once
+
+#include <cstddef>
+#include <llvm/ADT/StringRef.h>
+#include <mutex>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace Clara
+{
+
+// Knows, for every header of a project, the cheapest translation unit that
+// includes it, so that a header can be completed in with the flags of that
+// unit. It is built from the compile commands of a compilation database by
+// scanning the #include directives of the units and of the headers that they
+// include, without running the preprocessor. Conditional directives are not
+// evaluated, and only the -I and -iquote directories of a unit are searched:
+// system headers are rarely edited, and scanning them would take long.
+//
+// A unit is cheaper when it includes the header less deeply, and then when
+// it includes fewer headers altogether. Building and updating are slow, and
+// are done on the WorkerPool, one at a time; finding is quick, and can be
+// done from any thread.
+class IncludeGraph
+{
+  public:
+    struct Include
+    {
+        std::string spelling;
+        bool isAngled;
+        // The start of the line of the directive.
+        std::size_t offset;
+    };
+
+    struct Unit
+    {
+        std::string filename;
+        std::vector<std::string> command;
+        std::string directory;
+    };
+
+    struct Includer
+    {
+        std::string filename;
+        // The spelling of the unit's own #include through which it first
+        // includes the header.
+        std::string include;
+    };
+
+    // Returns the #include, #import and #include_next directives of a text,
+    // in order.
+    static std::vector<Include> scan(llvm::StringRef text);
+
+    // Adds a private option to the command of an including unit, which
+    // tells the CompletionEngine of the header which unit it borrows.
+    static void addContext(std::vector<std::string> &command,
+                           const Includer &includer);
+    // Removes the option again. Returns false if there is none.
+    static bool takeContext(std::vector<std::string> &command,
+                            Includer &includer);
+
+    void build(const std::vector<Unit> &units);
+    // Scans a file that changed again. When its includes changed, the units
+    // that include it are walked again, and the headers whose includer
+    // changed are updated.
+    void update(const std::string &path);
+
+    // Returns false if no unit includes the header.
+    bool find(const std::string &header, Includer &includer) const;
+
+  private:
+    struct SearchPath
+    {
+        std::vector<std::string> quoted;
+        std::vector<std::string> angled;
+    };
+
+    struct Edge
+    {
+        std::string target;
+        // Into the includes of the including file.
+        std::size_t include;
+    };
+
+    struct File
+    {
+        bool isScanned = false;
+        std::vector<Include> includes;
+        // The resolved includes, by the search path they were resolved with.
+        std::unordered_map<std::size_t, std::vector<Edge>> edges;
+    };
+
+    struct Best
+    {
+        std::string unit;
+        std::string include;
+        unsigned depth;
+        std::size_t closure;
+    };
+
+    using Candidates = std::unordered_map<std::string, Best>;
+
+    static SearchPath getSearchPath(const Unit &unit);
+    static bool isBetter(const Best &lhs, const Best &rhs);
+    static void consider(Candidates &candidates, const std::string &header,
+                         Best best);
+
+    void scan(File &file, const std::string &filename);
+    const std::vector<Edge> &resolve(const std::string &filename,
+                                     std::size_t searchPath);
+    std::string resolve(const std::string &filename, const Include &include,
+                        const SearchPath &searchPath);
+    bool exists(const std::string &path);
+    // Adds the headers that a unit includes, in the order in which the
+    // preprocessor would first include them.
+    void walk(const std::string &unit, Candidates &candidates);
+    // The units that include the file, directly or not, and the file itself
+    // if it is a unit.
+    std::set<std::string> findUnits(const std::string &filename) const;
+
+    // Only touched by build and update.
+    std::vector<SearchPath> mSearchPaths;
+    std::unordered_map<std::string, std::size_t> mUnits;
+    std::unordered_map<std::string, File> mFiles;
+    std::unordered_map<std::string, std::set<std::string>> mIncluders;
+    std::unordered_map<std::string, bool> mExists;
+
+    mutable std::mutex mMutex;
+    Candidates mBest;
+};
+
+} // Clara
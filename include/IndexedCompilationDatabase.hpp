@@ -0,0 +1,67 @@
+#pragma once
+
+#include <clang/Tooling/CompilationDatabase.h>
+#include <cstdint>
+#include <llvm/Support/MemoryBuffer.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace Clara
+{
+
+// A compilation database for compile_commands.json files with a very large
+// number of entries. Instead of decoding the whole file up front, the file
+// is mapped into memory and a compact index from file names to the byte
+// ranges of their entries is built in a single pass. Entries are decoded
+// only when they are asked for.
+//
+// The index is saved as a binary file in a directory of the caller's choice,
+// and is reused for as long as the database doesn't change.
+class IndexedCompilationDatabase : public clang::tooling::CompilationDatabase
+{
+  public:
+    // Returns nullptr and sets errorMessage if the directory does not contain
+    // a valid compile_commands.json. The index is kept in indexDirectory,
+    // which must not be shared with another database. With an empty
+    // indexDirectory, the index is built every time.
+    static std::unique_ptr<IndexedCompilationDatabase>
+    loadFromDirectory(llvm::StringRef directory, llvm::StringRef indexDirectory,
+                      std::string &errorMessage);
+
+    std::vector<clang::tooling::CompileCommand>
+    getCompileCommands(llvm::StringRef filePath) const override;
+    std::vector<std::string> getAllFiles() const override;
+    std::vector<clang::tooling::CompileCommand>
+    getAllCompileCommands() const override;
+
+    std::size_t getEntryCount() const { return mIndex.size(); }
+
+  private:
+    struct IndexEntry
+    {
+        std::uint64_t fileHash;
+        std::uint64_t offset;
+        std::uint64_t length;
+    };
+
+    explicit IndexedCompilationDatabase(
+        std::unique_ptr<llvm::MemoryBuffer> json);
+
+    bool buildIndex(std::string &errorMessage);
+    bool loadIndex(const std::string &indexPath, long long modificationTime);
+    void saveIndex(const std::string &indexPath,
+                   long long modificationTime) const;
+    bool decodeEntry(const IndexEntry &entry,
+                     clang::tooling::CompileCommand &command) const;
+
+    static std::uint64_t hashPath(llvm::StringRef path);
+    static std::string normalizePath(llvm::StringRef directory,
+                                     llvm::StringRef file);
+
+    std::unique_ptr<llvm::MemoryBuffer> mJSON;
+    // Sorted by file hash. Entries with the same hash are in file order.
+    std::vector<IndexEntry> mIndex;
+};
+
+} // Clara
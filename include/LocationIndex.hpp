@@ -0,0 +1,48 @@
+#pragma once
+
+#include "CompletionBackend.hpp"
+#include <clang/AST/DeclBase.h>
+#include <clang/Frontend/ASTUnit.h>
+#include <vector>
+
+namespace Clara
+{
+
+// Maps the tokens of the main file of a parsed unit to the declarations that
+// they declare or refer to, for going to a definition and for hovering. It is
+// built once from the unit with clang's indexer, as a list of token ranges
+// that is sorted by offset, so that looking up a location is a binary search
+// instead of a walk of the AST. Declarations in other files are found
+// through the SourceManager of the unit, without parsing anything.
+//
+// The index points into the AST of the unit, so it must be thrown away
+// before the unit is reparsed or destroyed.
+class LocationIndex
+{
+  public:
+    explicit LocationIndex(clang::ASTUnit &unit);
+
+    // Returns the symbol at a one-based row and byte column of the main
+    // file. The name is empty if there is none.
+    CompletionBackend::Declaration lookUp(unsigned row, unsigned column) const;
+
+    std::size_t size() const { return mRanges.size(); }
+
+  private:
+    struct Range
+    {
+        unsigned begin;
+        unsigned end;
+        const clang::Decl *decl;
+    };
+
+    bool lookUpMacro(unsigned offset,
+                     CompletionBackend::Declaration &declaration) const;
+    void describe(const clang::Decl *decl,
+                  CompletionBackend::Declaration &declaration) const;
+
+    clang::ASTUnit &mUnit;
+    std::vector<Range> mRanges;
+};
+
+} // Clara
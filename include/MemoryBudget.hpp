@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+
+namespace Clara
+{
+
+// Keeps the translation units of all views within a memory budget. Every
+// owner reports the footprint of its unit after a parse, and is touched when
+// its view is used. When the total exceeds the limit, the least recently
+// used units are evicted until it fits again; the most recently used one is
+// never evicted. An evicted owner parses its file again when its view is
+// used next, which is fast as long as its preamble is still cached.
+class MemoryBudget
+{
+  public:
+    // Asks an owner to drop its unit. Called with the budget's mutex held,
+    // so it must only post a job.
+    using Evictor = std::function<void()>;
+
+    static MemoryBudget &get();
+
+    // Sets the limit in bytes. Zero means no limit.
+    void setLimit(unsigned long long limit);
+
+    void add(const void *owner, Evictor evictor);
+    // No evictor of the owner is called after this returns.
+    void remove(const void *owner);
+
+    // Records the footprint of the owner's unit, and evicts others if it
+    // doesn't fit. Zero means that the owner has no unit.
+    void setFootprint(const void *owner, std::uint64_t bytes);
+    // Marks the owner as the most recently used one.
+    void touch(const void *owner);
+
+    std::uint64_t getTotal() const;
+
+  private:
+    MemoryBudget() = default;
+
+    struct Owner
+    {
+        Evictor evictor;
+        std::uint64_t footprint = 0;
+        std::uint64_t lastUse = 0;
+    };
+
+    void enforce(const void *keep);
+
+    mutable std::mutex mMutex;
+    std::map<const void *, Owner> mOwners;
+    std::uint64_t mTotal = 0;
+    std::uint64_t mLimit = 0;
+    std::uint64_t mClock = 0;
+};
+
+} // Clara
@@ -0,0 +1,160 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace Clara
+{
+
+// A latency histogram in the style of HdrHistogram. Values are counted in
+// buckets whose width grows with the value, so that every percentile is
+// accurate to within about 6%, from a microsecond up to more than an hour.
+// Recording is lock-free and can happen from any thread.
+class Histogram
+{
+  public:
+    Histogram();
+
+    void record(std::uint64_t microseconds);
+    void reset();
+
+    std::uint64_t getCount() const;
+    std::uint64_t getMax() const;
+    double getMean() const;
+    // Returns the value below which the given fraction of the values lie.
+    std::uint64_t getPercentile(double fraction) const;
+
+  private:
+    // Values below this are counted exactly, and every power of two above
+    // it is split into this many buckets.
+    static const unsigned subBucketCount = 16;
+    static const unsigned bucketCount = subBucketCount * 29;
+
+    static unsigned getIndex(std::uint64_t value);
+    static std::uint64_t getValue(unsigned index);
+
+    std::array<std::atomic<std::uint64_t>, bucketCount> mBuckets;
+    std::atomic<std::uint64_t> mCount;
+    std::atomic<std::uint64_t> mSum;
+    std::atomic<std::uint64_t> mMax;
+};
+
+// Times the phases of completion requests, per view and for all views
+// together. Loading a view and building preambles are timed as well.
+class Metrics
+{
+  public:
+    enum class Phase
+    {
+        // From the request until a worker picks up the job.
+        Queue,
+        // Reparsing because the preamble was stale.
+        Reparse,
+        // ASTUnit::CodeComplete, which includes Rank and Strings.
+        Complete,
+        // Matching and sorting the results.
+        Rank,
+        // Building the completion strings.
+        Strings,
+        // Waiting for the GIL to show the results.
+        GIL,
+        // The hide_auto_complete and auto_complete round-trip.
+        Popup,
+        // From the request until the popup is shown.
+        Total,
+        // Filtering cached results while typing.
+        Filter,
+        // The first parse of a view, from the start of loading until
+        // completions are available.
+        Load,
+        // Building a shared preamble. Only recorded globally.
+        Preamble,
+        // From typing a parenthesis or a comma until the parameter hints
+        // are shown.
+        Signatures,
+        Count
+    };
+
+    class ViewHistograms
+    {
+      public:
+        Histogram &get(Phase phase)
+        {
+            return mHistograms[static_cast<unsigned>(phase)];
+        }
+
+      private:
+        friend class Metrics;
+        std::string mName;
+        std::array<Histogram, static_cast<unsigned>(Phase::Count)>
+            mHistograms;
+    };
+
+    // Records the time from its construction until it is destroyed.
+    class Timer
+    {
+      public:
+        Timer(ViewHistograms &view, Phase phase)
+            : mView(view), mPhase(phase), mStart(now())
+        {
+        }
+        ~Timer() { record(mView, mPhase, now() - mStart); }
+        Timer(const Timer &) = delete;
+        Timer &operator=(const Timer &) = delete;
+
+      private:
+        ViewHistograms &mView;
+        Phase mPhase;
+        std::uint64_t mStart;
+    };
+
+    // Returns a steady time in microseconds.
+    static std::uint64_t now();
+
+    static std::shared_ptr<ViewHistograms> addView(int viewId,
+                                                   std::string name);
+    static void removeView(int viewId);
+
+    // Records in the histograms of the view, and in the global ones.
+    static void record(ViewHistograms &view, Phase phase,
+                       std::uint64_t microseconds);
+    // Records in the global histograms only.
+    static void record(Phase phase, std::uint64_t microseconds);
+
+    // The count of a phase, and its mean, p50, p90, p99 and maximum in
+    // milliseconds.
+    struct PhaseStats
+    {
+        const char *name;
+        std::uint64_t count;
+        double mean;
+        double p50;
+        double p90;
+        double p99;
+        double max;
+    };
+
+    struct ViewStats
+    {
+        int id;
+        std::string name;
+        // Only the phases that were recorded.
+        std::vector<PhaseStats> phases;
+    };
+
+    struct Stats
+    {
+        std::vector<PhaseStats> global;
+        std::vector<ViewStats> views;
+    };
+
+    static Stats getStats();
+    static void reset();
+};
+
+} // Clara
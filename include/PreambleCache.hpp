@@ -0,0 +1,132 @@
+#pragma once
+
+#include <clang/Frontend/CompilerInvocation.h>
+#include <clang/Frontend/PCHContainerOperations.h>
+#include <cstdint>
+#include <future>
+#include <llvm/ADT/StringRef.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace Clara
+{
+
+// Process-wide cache of precompiled preambles. Translation units that are
+// compiled with the same (normalized) command and that start with the same
+// preamble share one PCH file instead of each building their own copy.
+//
+// Preambles are built against the UnsavedFiles. One that includes an
+// unsaved file is never stored on disk, because its key doesn't cover the
+// unsaved text.
+class PreambleCache
+{
+  public:
+    struct Dependency
+    {
+        std::string path;
+        long long modificationTime;
+        unsigned long long size;
+        // The version of the unsaved text that the preamble was built with,
+        // or zero if it was built with the file on disk (see UnsavedFiles).
+        std::uint64_t unsavedVersion = 0;
+    };
+
+    class Entry
+    {
+      public:
+        Entry(std::string key, std::string preamble, std::string pchPath,
+              std::vector<Dependency> dependencies, bool isPersistent);
+        ~Entry();
+
+        Entry(const Entry &) = delete;
+        Entry &operator=(const Entry &) = delete;
+
+        const std::string &getKey() const { return mKey; }
+        const std::string &getPreamble() const { return mPreamble; }
+        const std::string &getPCHPath() const { return mPCHPath; }
+        const std::vector<Dependency> &getDependencies() const
+        {
+            return mDependencies;
+        }
+
+        bool isPersistent() const { return mIsPersistent; }
+
+        // Returns true if the PCH file still exists, and none of the files
+        // that were included by the preamble have been modified since the
+        // preamble was built, on disk or in a view.
+        bool isUpToDate() const;
+        // Returns true if the preamble includes the file.
+        bool includes(llvm::StringRef filename) const;
+
+      private:
+        std::string mKey;
+        std::string mPreamble;
+        std::string mPCHPath;
+        std::vector<Dependency> mDependencies;
+        bool mIsPersistent;
+    };
+
+    // Enables the on-disk preamble store in the given directory, so that
+    // preambles survive a restart of Sublime Text. The least recently used
+    // preambles are evicted when the store grows beyond sizeLimit bytes. An
+    // empty directory disables the store.
+    static void configure(std::string directory,
+                          unsigned long long sizeLimit);
+
+    // Returns the number of bytes at the start of the buffer that consist of
+    // comments and preprocessor directives only. The preamble never ends
+    // inside of an unterminated #if block.
+    static unsigned computePreambleSize(const std::string &buffer);
+
+    // Returns a copy of the buffer with every character of the first
+    // preambleSize bytes, except newlines, replaced by a space. Line and
+    // column numbers of the remaining text are unaffected.
+    static std::string blankPreamble(const std::string &buffer,
+                                     unsigned preambleSize);
+
+    // Returns a shared preamble for the given invocation and preamble text,
+    // building it if no other translation unit has done so already. Blocks
+    // when another thread is building the same preamble. Returns nullptr if
+    // the preamble could not be built.
+    static std::shared_ptr<const Entry>
+    acquire(const clang::CompilerInvocation &invocation,
+            const std::vector<std::string> &command,
+            const std::string &filename, const std::string &preamble,
+            std::shared_ptr<clang::PCHContainerOperations> pchOps);
+
+  private:
+    static std::string computeKey(const std::vector<std::string> &command,
+                                  const std::string &workingDir,
+                                  const std::string &filename,
+                                  const std::string &preamble);
+
+    static std::shared_ptr<const Entry> load(const std::string &key,
+                                             const std::string &preamble);
+
+    static std::shared_ptr<const Entry>
+    build(const std::string &key, const clang::CompilerInvocation &invocation,
+          const std::string &filename, const std::string &preamble,
+          std::shared_ptr<clang::PCHContainerOperations> pchOps);
+
+    static std::string getDepsPath(const Entry &entry);
+    static bool store(const Entry &entry);
+    // Deletes the least recently used preambles that are not in use, until
+    // the store fits in sizeLimit again. Called without mMutex held.
+    static void evict(const std::string &directory,
+                      unsigned long long sizeLimit,
+                      const std::set<std::string> &inUse);
+
+    static std::mutex mMutex;
+    static std::string mDirectory;
+    static unsigned long long mSizeLimit;
+    static std::map<std::string, std::weak_ptr<const Entry>> mEntries;
+    static std::map<std::string,
+                    std::shared_future<std::shared_ptr<const Entry>>>
+        mPending;
+};
+
+} // Clara
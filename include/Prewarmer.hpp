@@ -0,0 +1,99 @@
+#pragma once
+
+#include "CompletionBackend.hpp"
+#include "PreambleCache.hpp"
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace Clara
+{
+
+// Builds the shared preambles of the files that are likely to be opened
+// next, in the background, so that opening one of them only parses the rest
+// of the file. The CompilationDatabaseWatcher picks the files; the preambles
+// are built as background jobs on a few strands of the WorkerPool, so they
+// use spare cores and never hold up the active view. The preambles are held
+// until their PCH files take more than the size limit together, and then the
+// ones that were warmed first are let go.
+class Prewarmer
+{
+  public:
+    struct Settings
+    {
+        bool isEnabled = false;
+        // The number of files to warm around each opened file.
+        unsigned fileCount = 8;
+        // In bytes.
+        unsigned long long sizeLimit = 0;
+        // Where the recently opened files are remembered across restarts.
+        // Empty means that they are only remembered in memory.
+        std::string recentFilesPath;
+    };
+
+    struct File
+    {
+        std::string filename;
+        std::vector<std::string> command;
+        std::string directory;
+        // When not empty, the file is only warmed if its preamble includes a
+        // file with this name.
+        std::string include;
+    };
+
+    static Prewarmer &get();
+
+    void configure(Settings settings);
+    bool isEnabled() const;
+    unsigned getFileCount() const;
+
+    // Queues the files that are neither queued nor warm, in order.
+    void warm(std::vector<File> files, CompletionBackend::Options options);
+
+    // Remembers that a file was opened. Warming a file that is open costs
+    // little, as it finds the preamble of its view in the PreambleCache.
+    void addRecent(const std::string &filename);
+    // Most recent first.
+    std::vector<std::string> getRecent() const;
+
+  private:
+    Prewarmer() = default;
+
+    struct Warm
+    {
+        std::shared_ptr<const PreambleCache::Entry> entry;
+        // The size of its PCH file.
+        std::uint64_t size;
+        std::string filename;
+    };
+
+    std::shared_ptr<const PreambleCache::Entry>
+    warm(const File &file, const CompletionBackend::Options &options);
+    // Holds the preamble of the file, if there is one, and otherwise lets
+    // the file be queued again.
+    void keep(const std::string &filename,
+              std::shared_ptr<const PreambleCache::Entry> entry);
+    void loadRecent();
+    void saveRecent();
+
+    // Preambles are built on this many strands at the same time.
+    static constexpr unsigned strandCount = 4;
+
+    mutable std::mutex mMutex;
+    Settings mSettings;
+    std::deque<std::string> mRecent;
+    // The files that are queued, being warmed or warm.
+    std::set<std::string> mQueued;
+    // Oldest first.
+    std::deque<Warm> mWarm;
+    std::uint64_t mWarmSize = 0;
+    char mStrands[strandCount] = {};
+    unsigned mNextStrand = 0;
+};
+
+} // Clara
@@ -0,0 +1,159 @@
+#pragma once
+
+#include "CompletionBackend.hpp"
+#include "CompletionStore.hpp"
+#include "ServerProtocol.hpp"
+#include "UnsavedFiles.hpp"
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace Clara
+{
+
+class RemoteCompletionEngine;
+
+// The connection to one worker process of the clara-server. The server is
+// started when the first file is opened, and it keeps running for as long
+// as the plugin host does. A worker that exits, say because it ran out of
+// its memory limit, is restarted by the server; the connection then
+// reconnects, sends the UnsavedFiles again, and reopens the files that it
+// serves.
+class ServerConnection
+{
+  public:
+    struct Settings
+    {
+        std::string executable;
+        unsigned workerCount = 2;
+        // The sizes are in megabytes; zero means no limit.
+        unsigned long long memoryLimit = 0;
+        unsigned long long memoryBudget = 0;
+        unsigned workerThreads = 0;
+        std::string preambleCacheDirectory;
+        unsigned long long preambleCacheSizeLimit = 0;
+    };
+
+    // Takes effect for the server that is started next.
+    static void configure(Settings settings);
+
+    // Returns the connection to the worker that serves the file. A file is
+    // always served by the same worker.
+    static ServerConnection &get(const std::string &filename);
+
+    // Returns false when the worker is down. The message is dropped then;
+    // the files are reopened once the worker is back.
+    bool send(ServerProtocol::Writer &message);
+
+    std::uint64_t add(RemoteCompletionEngine *engine);
+    // Waits for a running callback of the engine to return.
+    void remove(std::uint64_t id);
+
+  private:
+    // The engines are looked up by the reader thread without holding the
+    // map's mutex, so that it never waits for the GIL with it.
+    struct Handle
+    {
+        std::mutex mutex;
+        RemoteCompletionEngine *engine;
+    };
+
+    explicit ServerConnection(std::string path);
+
+    void run();
+    bool connect();
+    void disconnect();
+    void dispatch(const std::string &frame);
+    // Sent to every worker, since any unit may include the file.
+    void sendUnsavedFile(const UnsavedFiles::File &file);
+    std::vector<std::shared_ptr<Handle>> getHandles();
+
+    std::string mPath;
+    std::mutex mSocketMutex;
+    int mSocket = -1;
+    std::mutex mHandlesMutex;
+    std::map<std::uint64_t, std::shared_ptr<Handle>> mHandles;
+    std::uint64_t mNextId = 1;
+};
+
+// A CompletionBackend that parses and completes in a clara-server worker,
+// so that a crash or a leak in clang takes down that worker instead of the
+// plugin host. The results of the latest request are kept here, so typing
+// on filters them locally, like the CompletionEngine does.
+class RemoteCompletionEngine : public CompletionBackend
+{
+  public:
+    RemoteCompletionEngine(std::string filename, int id, Options options,
+                           Callbacks callbacks);
+    ~RemoteCompletionEngine() override;
+
+    // CompletionBackend implementation
+    void stop() override;
+    void load(std::vector<std::string> command,
+              std::string directory) override;
+    void reparse() override;
+    bool isLoaded() const override { return mIsLoaded; }
+    void setPriority(WorkerPool::Priority priority) override;
+    // The preamble lives in the server, so snapshots are sent unmasked.
+    std::shared_ptr<const PreambleCache::Entry> getPreamble() const override
+    {
+        return nullptr;
+    }
+    unsigned complete(unsigned row, unsigned column,
+                      TextBuffer::Snapshot snapshot, std::string typed,
+                      std::uint64_t requestTime) override;
+    void cancel() override;
+    bool isSuperseded(unsigned generation) const override;
+    bool isCompleting() const override;
+    bool filterCompletions(llvm::StringRef typed,
+                           CompletionList &completions) const override;
+    unsigned completeSignatures(unsigned row, unsigned column,
+                                TextBuffer::Snapshot snapshot) override;
+    unsigned lookUp(unsigned row, unsigned column) override;
+    Metrics::ViewHistograms &getMetrics() override { return *mMetrics; }
+
+  private:
+    friend class ServerConnection;
+
+    // Called on the reader thread of the connection.
+    void handleMessage(ServerProtocol::Reader &message);
+    void handleDisconnect();
+    void handleReconnect();
+
+    void sendOpen();
+    void sendLoad();
+    void sendFileMessage(ServerProtocol::MessageType type);
+
+    std::string mFilename;
+    int mId;
+    Options mOptions;
+    Callbacks mCallbacks;
+    ServerConnection &mConnection;
+    std::uint64_t mRemoteId = 0;
+    std::shared_ptr<Metrics::ViewHistograms> mMetrics;
+    std::atomic_bool mIsLoaded{false};
+    std::atomic<unsigned> mGeneration{0};
+    std::atomic<unsigned> mSignatureRequest{0};
+    std::atomic<unsigned> mLookUpRequest{0};
+
+    mutable std::mutex mMethodMutex;
+    // What the file was last loaded with, to reopen it with.
+    std::vector<std::string> mCommand;
+    std::string mDirectory;
+    WorkerPool::Priority mPriority = WorkerPool::Priority::Background;
+    // The typed text and the time of the latest request.
+    std::string mRequestTyped;
+    std::uint64_t mRequestTime = 0;
+    // The results of the latest request, like in the CompletionEngine.
+    CompletionStore mResults;
+    CompletionStore mCompletions;
+    unsigned mCompletionsGeneration = 0;
+    std::string mCompletionsTyped;
+    bool mCompletionsTruncated = false;
+};
+
+} // Clara
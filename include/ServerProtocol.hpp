@@ -0,0 +1,118 @@
+#pragma once
+
+#include "CompletionStore.hpp"
+#include "DiagnosticList.hpp"
+#include <cstdint>
+#include <llvm/ADT/StringRef.h>
+#include <string>
+#include <vector>
+
+namespace Clara
+{
+
+// The messages between the plugin and a clara-server worker, over a local
+// stream socket. Every frame is a 32-bit length, a message type and the
+// fields of the message in host byte order, since both ends run on the same
+// machine. Payloads of more than inlineLimit bytes, like the text of a
+// large file or the results of a completion run, do not go through the
+// socket: they are put in a POSIX shared memory segment, and only its name
+// is sent. The receiver copies the payload out and unlinks the segment.
+namespace ServerProtocol
+{
+
+enum class MessageType : std::uint8_t
+{
+    // Plugin to server. Every message starts with the id of a file. The
+    // unsaved files are shared by all files of a worker, and have id zero.
+    Open = 1,
+    Load,
+    Reparse,
+    Complete,
+    Cancel,
+    SetPriority,
+    Close,
+    LookUp,
+    CompleteSignatures,
+    SetUnsavedFile,
+    RemoveUnsavedFile,
+    // Server to plugin.
+    Loaded = 64,
+    Diagnostics,
+    Completed,
+    LookedUp,
+    CompletedSignatures
+};
+
+const std::size_t inlineLimit = 64 * 1024;
+// Frames larger than this are a protocol error.
+const std::uint32_t maxFrameSize = 64 * 1024 * 1024;
+
+class Writer
+{
+  public:
+    explicit Writer(MessageType type);
+
+    void writeInt(std::uint64_t value);
+    void writeString(llvm::StringRef value);
+    void writeStrings(const std::vector<std::string> &values);
+    // Writes the payload through shared memory when it is large, and
+    // inline otherwise or when no segment could be created.
+    void writeBlob(llvm::StringRef payload);
+
+    // Returns the frame, with the length filled in.
+    const std::string &finish();
+    // Unlinks the shared memory of a frame that could not be sent.
+    void discard();
+
+  private:
+    std::string mFrame;
+    std::vector<std::string> mSharedMemory;
+};
+
+// Reads the fields of a frame in the order in which they were written. A
+// read past the end, or of a malformed field, makes the reader invalid, and
+// further reads return zeroes.
+class Reader
+{
+  public:
+    explicit Reader(llvm::StringRef frame);
+
+    MessageType getType() const { return mType; }
+    bool isValid() const { return mIsValid; }
+
+    std::uint64_t readInt();
+    std::string readString();
+    std::vector<std::string> readStrings();
+    // Returns a payload that was written by writeBlob, and unlinks its
+    // shared memory segment.
+    std::string readBlob();
+    // Unlinks the shared memory of a message that is not handled.
+    void discard();
+
+  private:
+    llvm::StringRef read(std::size_t size);
+
+    llvm::StringRef mData;
+    MessageType mType = MessageType::Open;
+    bool mIsValid = true;
+};
+
+// Return a connected or a listening socket, or -1 with errno set.
+int connectSocket(const std::string &path);
+int listenSocket(const std::string &path);
+
+// Blocking frame I/O. Both return false when the socket was closed or
+// failed, and neither raises SIGPIPE.
+bool sendFrame(int socket, llvm::StringRef frame);
+bool receiveFrame(int socket, std::string &frame);
+
+// Returns the path of the socket of a worker.
+std::string getSocketPath(const std::string &base, unsigned worker);
+
+void serialize(const CompletionStore &completions, std::string &bytes);
+bool deserialize(llvm::StringRef bytes, CompletionStore &completions);
+void serialize(const DiagnosticList &diagnostics, std::string &bytes);
+bool deserialize(llvm::StringRef bytes, DiagnosticList &diagnostics);
+
+} // ServerProtocol
+} // Clara
@@ -0,0 +1,141 @@
+#pragma once
+
+#include "CompletionBackend.hpp"
+#include "PreambleCache.hpp"
+#include <atomic>
+#include <cstdint>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace Clara
+{
+
+// The declarations, definitions and references of the symbols of a whole
+// project, for going to a symbol by name. Every unit of the compilation
+// database is indexed with clang on the WorkerPool, all of them at once, into
+// a shard file of its own. A shard is kept for as long as the command of its
+// unit and the files that went into it don't change, so after a restart, or
+// after a save, only the units that are out of date are indexed again.
+//
+// Once a pass is done, the shards are merged into a single index file that
+// is sorted by name and mapped into memory, so finding the symbols whose
+// names start with some text is a binary search that never touches the
+// shards. Symbols of system headers are left out.
+class SymbolIndex : public std::enable_shared_from_this<SymbolIndex>
+{
+  public:
+    struct Unit
+    {
+        std::string filename;
+        std::vector<std::string> command;
+        std::string directory;
+    };
+
+    struct Symbol
+    {
+        std::string name;
+        std::string qualifiedName;
+        std::string kind;
+        // Of the definition, or of the first declaration if there is none.
+        std::string filename;
+        unsigned line;
+        unsigned column;
+    };
+
+    // What indexing a single unit gives.
+    struct Shard
+    {
+        struct Symbol
+        {
+            std::string usr;
+            std::string name;
+            std::string qualifiedName;
+            std::string kind;
+        };
+
+        struct Occurrence
+        {
+            std::uint32_t symbol;
+            std::uint32_t file;
+            std::uint32_t line;
+            std::uint32_t column;
+            // Of Roles.
+            std::uint32_t roles;
+        };
+
+        enum Roles : std::uint32_t
+        {
+            Declaration = 1 << 0,
+            Definition = 1 << 1,
+            Reference = 1 << 2
+        };
+
+        // Identifies the command that the unit was indexed with.
+        std::string command;
+        // The unit and the headers that it includes.
+        std::vector<PreambleCache::Dependency> dependencies;
+        std::vector<std::string> files;
+        std::vector<Symbol> symbols;
+        std::vector<Occurrence> occurrences;
+    };
+
+    // The shards and the index live in the given directory.
+    SymbolIndex(std::string directory, CompletionBackend::Options options);
+
+    // Indexes the units whose shards are out of date, and merges the shards
+    // when that is done. The units replace the ones of an earlier call.
+    void build(std::vector<Unit> units);
+    // Indexes the units that include a file that changed again.
+    void update(const std::string &filename);
+    // Lets go of the queued jobs. Running jobs finish, but don't merge.
+    void stop();
+
+    // Returns the symbols whose names start with the query, ignoring case,
+    // at most maxResults of them.
+    std::vector<Symbol> find(llvm::StringRef query,
+                             std::size_t maxResults) const;
+
+    // Indexes one unit with clang. Returns false if it could not be parsed
+    // at all.
+    static bool indexUnit(const Unit &unit,
+                          const CompletionBackend::Options &options,
+                          Shard &shard);
+    // Identifies the command of a unit, which goes with its shard.
+    static std::string hashCommand(const Unit &unit);
+    // Writes a shard to a file, or reads one back.
+    static bool writeShard(const std::string &path, const Shard &shard);
+    static bool readShard(const std::string &path, Shard &shard);
+
+  private:
+    void index(const std::vector<Unit> &units);
+    void indexJob(const Unit &unit);
+    void merge();
+    std::string getShardPath(const std::string &filename) const;
+    // Returns true if the shard was written with the same command, and none
+    // of its files changed since.
+    static bool isUpToDate(const std::string &path,
+                           const std::string &command);
+
+    const std::string mDirectory;
+    const CompletionBackend::Options mOptions;
+    std::atomic_bool mIsStopped{false};
+    // The units are spread over this many strands, so that as many of them
+    // are indexed at once as there are workers.
+    static constexpr unsigned strandCount = 64;
+    char mStrands[strandCount];
+    // The queued and running indexing jobs. The last one to finish merges.
+    std::atomic<std::size_t> mPending{0};
+
+    mutable std::mutex mMutex;
+    std::unordered_map<std::string, Unit> mUnits;
+    // The units that each file went into, as of the last merge.
+    std::unordered_map<std::string, std::vector<std::string>> mDependents;
+    std::shared_ptr<llvm::MemoryBuffer> mIndex;
+};
+
+} // Clara
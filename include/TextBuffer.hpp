@@ -0,0 +1,110 @@
+#pragma once
+
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <memory>
+#include <string>
+
+namespace Clara
+{
+
+// Native mirror of the text of a view. It is kept up to date with the edits
+// that Sublime reports, so that a completion request does not have to copy
+// the whole view through Python.
+//
+// The text is stored contiguously, because that is what clang wants, and it
+// is copy-on-write: a snapshot that is being parsed on a worker thread stays
+// valid while the user keeps on typing. An edit only copies the text when a
+// snapshot of the previous version is still alive.
+//
+// A prefix of the text can be masked, which blanks it out in the snapshots.
+// This is used for the region that is covered by a shared preamble.
+class TextBuffer
+{
+  public:
+    struct Snapshot
+    {
+        // The text, with the masked prefix blanked out.
+        std::shared_ptr<const std::string> text;
+        // The original contents of the masked prefix, or nullptr when
+        // nothing is masked.
+        std::shared_ptr<const std::string> maskedPrefix;
+
+        // Returns a view of the snapshot that does not copy the text. The
+        // snapshot must outlive the returned buffer.
+        std::unique_ptr<llvm::MemoryBuffer>
+        getMemoryBuffer(llvm::StringRef name) const;
+
+        // Returns a copy of the text with the masked prefix restored.
+        std::string getUnmaskedText() const;
+    };
+
+    TextBuffer();
+
+    bool isEmpty() const { return mText->empty(); }
+    std::size_t getSize() const { return mText->size(); }
+
+    // Replaces the whole text, for when the mirror got out of sync.
+    void assign(std::string text);
+
+    // Replaces length bytes at the given byte offset by the given text.
+    void replace(std::size_t offset, std::size_t length, llvm::StringRef text);
+
+    // Returns the byte offset of a zero-based row and a zero-based column
+    // that is counted in bytes.
+    std::size_t getOffset(unsigned row, unsigned column) const;
+
+    // Returns the byte offset of a zero-based row and a zero-based column
+    // that is counted in code points, like Sublime's View.rowcol does.
+    std::size_t getOffsetOfCharacter(unsigned row, unsigned column) const;
+
+    // Bytes of multi-byte UTF-8 sequences count as identifier characters.
+    static bool isIdentifierCharacter(char c);
+
+    // Returns the number of code points in UTF-8 text.
+    static unsigned countCharacters(llvm::StringRef text);
+
+    // Returns the offset of the first character of the identifier that ends
+    // at the given offset, or the offset itself if there is none.
+    std::size_t getStartOfIdentifier(std::size_t offset) const;
+
+    // Returns the offset of the opening parenthesis of the innermost call
+    // whose arguments contain the given offset, or npos if there is none
+    // nearby. Brackets in strings and comments are not told apart.
+    std::size_t getStartOfCall(std::size_t offset) const;
+
+    // Sets the zero-based index of the argument that the given offset is in,
+    // of the call that opens at callStart. Returns false if the call is
+    // closed before the offset.
+    bool getArgumentIndex(std::size_t callStart, std::size_t offset,
+                          unsigned &index) const;
+
+    // Returns a copy of a part of the text, ignoring the mask.
+    std::string getText(std::size_t offset, std::size_t length) const;
+
+    // Returns the smallest offset at which the text was edited since the
+    // last call to resetFirstChangedOffset.
+    std::size_t getFirstChangedOffset() const { return mFirstChangedOffset; }
+    void resetFirstChangedOffset() { mFirstChangedOffset = std::string::npos; }
+
+    // Blanks out the given prefix in snapshots if the text starts with it.
+    // Returns true on success. Edits that touch the masked prefix remove the
+    // mask.
+    bool mask(const std::string &prefix);
+    void unmask();
+    bool isMaskedWith(const std::string &prefix) const;
+
+    Snapshot getSnapshot() const;
+
+  private:
+    std::string &makeUnique();
+    std::size_t getStartOfLine(unsigned row) const;
+    char getCharacter(std::size_t offset) const;
+    std::size_t findFirstDifference(const std::string &text) const;
+
+    std::shared_ptr<std::string> mText;
+    std::shared_ptr<const std::string> mMaskedPrefix;
+    std::size_t mFirstChangedOffset = std::string::npos;
+};
+
+} // Clara
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/raw_ostream.h>
+#include <string>
+#include <vector>
+
+namespace Clara
+{
+
+// Native tracing, for the code that runs on worker threads. Whether tracing
+// is enabled is cached in an atomic flag that the plugin keeps in sync with
+// the "clara_debug" setting, so when it is off, tracing costs a single load
+// and never touches Python.
+//
+// Events go to a fixed-size ring buffer of the thread that records them,
+// without locking. The plugin drains the buffers periodically while tracing
+// is enabled, which prints the events to the console and keeps the most
+// recent ones for an export to the Chrome trace format.
+class Trace
+{
+  public:
+    static bool isEnabled()
+    {
+        return mIsEnabled.load(std::memory_order_relaxed);
+    }
+    static void setEnabled(bool isEnabled);
+
+    // Records a message. The arguments are written separated by spaces, like
+    // print does. Long messages are truncated.
+    template <typename... Args>
+    static void message(int view, const Args &... args)
+    {
+        if (!isEnabled()) return;
+        llvm::SmallString<128> text;
+        llvm::raw_svector_ostream stream(text);
+        format(stream, args...);
+        record(view, nullptr, now(), 0, stream.str());
+    }
+
+    // Records how long it takes until the scope is left. The phase must be a
+    // string literal.
+    class Scope
+    {
+      public:
+        Scope(int view, const char *phase)
+            : mView(view), mPhase(phase), mIsRecording(isEnabled()),
+              mStart(mIsRecording ? now() : 0)
+        {
+        }
+        ~Scope()
+        {
+            if (mIsRecording)
+            {
+                record(mView, mPhase, mStart, now() - mStart,
+                       llvm::StringRef());
+            }
+        }
+        Scope(const Scope &) = delete;
+        Scope &operator=(const Scope &) = delete;
+
+      private:
+        int mView;
+        const char *mPhase;
+        bool mIsRecording;
+        std::uint64_t mStart;
+    };
+
+    // Moves the recorded events out of the ring buffers, and returns them
+    // as lines for the console. Nothing is returned while tracing is off.
+    static std::vector<std::string> drain();
+
+    // Writes the kept events to a file in the Chrome trace event format, for
+    // chrome://tracing.
+    static void exportChromeTrace(const std::string &path);
+
+  private:
+    static std::uint64_t now();
+    static void record(int view, const char *phase, std::uint64_t start,
+                       std::uint64_t duration, llvm::StringRef message);
+
+    static void format(llvm::raw_ostream &) {}
+    template <typename T, typename... Rest>
+    static void format(llvm::raw_ostream &stream, const T &first,
+                       const Rest &... rest)
+    {
+        stream << first;
+        if (sizeof...(rest) != 0) stream << ' ';
+        format(stream, rest...);
+    }
+
+    static std::atomic_bool mIsEnabled;
+};
+
+} // Clara
@@ -0,0 +1,85 @@
+#pragma once
+
+#include "TextBuffer.hpp"
+#include <cstdint>
+#include <functional>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace Clara
+{
+
+// Process-wide store of the text of the files that are edited in a view but
+// not saved, so that every translation unit parses what the user sees
+// instead of what is on disk: completion in a source file picks up the
+// edits of a header that is open in another tab.
+//
+// The texts are snapshots of the TextBuffers of the views, shared by
+// reference count. Clang gets them as remapped files whose buffers point
+// into the snapshots, so no parse copies them. Every version of a file gets
+// a number that is unique in the process, and a shared preamble records the
+// versions of the unsaved files that it includes (see PreambleCache), so
+// that an edit only invalidates the preambles that include the file.
+class UnsavedFiles
+{
+  public:
+    struct File
+    {
+        // Absolute, without "." and ".." components.
+        std::string filename;
+        std::uint64_t version = 0;
+        // Null when the file was saved or closed.
+        std::shared_ptr<const std::string> text;
+
+        // Returns a buffer that points into the text, and keeps it alive.
+        std::unique_ptr<llvm::MemoryBuffer> getMemoryBuffer() const;
+    };
+
+    // Told about every file that is set or removed. Called with the store's
+    // mutex held, so it must only post a job or send a message.
+    using Listener = std::function<void(const File &file)>;
+
+    static UnsavedFiles &get();
+
+    // Publishes the text of a file, and returns its version. A masked
+    // snapshot is unmasked, which copies it.
+    std::uint64_t set(const std::string &filename,
+                      TextBuffer::Snapshot snapshot);
+    // Goes back to the file on disk, when the file was saved or its view
+    // was closed. With a version, only if that is still the current one.
+    void remove(const std::string &filename, std::uint64_t version = 0);
+
+    // Returns the version of the unsaved text of a file, or zero if the
+    // file is not unsaved.
+    std::uint64_t getVersion(llvm::StringRef filename) const;
+    // Returns all unsaved files, except the given one.
+    std::vector<File>
+    getFiles(llvm::StringRef except = llvm::StringRef()) const;
+    // Returns the unsaved text of a file, or else the file on disk. Null
+    // when neither can be read.
+    std::unique_ptr<llvm::MemoryBuffer> read(const std::string &filename) const;
+
+    // The listener is called for the files that are unsaved already, too.
+    void subscribe(const void *owner, Listener listener);
+    // No listener of the owner is called after this returns.
+    void unsubscribe(const void *owner);
+
+    static std::string normalize(llvm::StringRef filename);
+
+  private:
+    UnsavedFiles() = default;
+
+    void notify(const File &file);
+
+    mutable std::mutex mMutex;
+    std::map<std::string, File> mFiles;
+    std::map<const void *, Listener> mListeners;
+    std::uint64_t mLastVersion = 0;
+};
+
+} // Clara
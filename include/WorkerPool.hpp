@@ -0,0 +1,87 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+
+namespace Clara
+{
+
+// A process-wide pool of worker threads that runs the parsing and completion
+// jobs of every view. Jobs are grouped by owner: the jobs of one owner run
+// one after the other, in the order in which they were posted, but never
+// concurrently. Among all owners, the runnable job with the highest priority
+// goes first. Threads are only started when there is work to do, so an idle
+// view costs nothing.
+class WorkerPool
+{
+  public:
+    enum class Priority
+    {
+        Background,
+        Normal,
+        Interactive
+    };
+
+    using Job = std::function<void()>;
+
+    static WorkerPool &get();
+
+    // Sets the maximum number of worker threads. Zero means one less than
+    // the number of hardware threads.
+    void setWorkerCount(unsigned count);
+
+    // Makes a job that runs out of memory end the process, instead of only
+    // being dropped. Only for a clara-server worker, whose supervisor then
+    // starts a fresh one; the plugin host must never be taken down.
+    void setExitOnOutOfMemory(bool isEnabled);
+
+    void post(const void *owner, Priority priority, Job job);
+
+    // Jobs of an owner run with at least this priority. Used to let the
+    // active view jump ahead of views in the background. Does nothing for
+    // an owner that has never posted a job, or was cancelled.
+    void setOwnerPriority(const void *owner, Priority priority);
+
+    // Drops the queued jobs of the owner, and waits for its running job (if
+    // any) to finish. No job of the owner runs after this returns.
+    void cancel(const void *owner);
+
+  private:
+    WorkerPool() = default;
+
+    struct QueuedJob
+    {
+        Priority priority;
+        std::uint64_t sequence;
+        Job job;
+    };
+
+    struct Strand
+    {
+        std::deque<QueuedJob> jobs;
+        Priority priority = Priority::Background;
+        bool isRunning = false;
+    };
+
+    void work();
+    std::map<const void *, Strand>::iterator findNextJob();
+    unsigned getMaxWorkers() const;
+
+    std::mutex mMutex;
+    std::condition_variable mJobAvailable;
+    std::condition_variable mJobFinished;
+    std::map<const void *, Strand> mStrands;
+    std::uint64_t mSequence = 0;
+    unsigned mMaxWorkers = 0;
+    unsigned mWorkerCount = 0;
+    unsigned mIdleWorkers = 0;
+    unsigned mBusyBackgroundWorkers = 0;
+    std::atomic<bool> mExitOnOutOfMemory{false};
+};
+
+} // Clara
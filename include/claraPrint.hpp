@@ -1,14 +1,17 @@
 #pragma once
 
 #include "PyBind11.hpp"
+#include "Trace.hpp"
 
 namespace Clara
 {
 
+// Prints to the Python console when "clara_debug" is on. Only for code that
+// holds the GIL; worker threads use Trace.
 template <typename... Args>
-void claraPrint(const pybind11::object &view, Args &&... args)
+void claraPrint(const pybind11::object & /*view*/, Args &&... args)
 {
-    if (view.attr("settings")().attr("get")("clara_debug", false).cast<bool>())
+    if (Trace::isEnabled())
     {
         pybind11::print("clara:", std::forward<Args>(args)...);
     }
@@ -0,0 +1,571 @@
+// clara-server: parses and completes on behalf of the plugin, so that a
+// crash or a leak in clang does not take Sublime Text's plugin host down.
+//
+// The server is a supervisor that forks a number of worker processes, and
+// restarts those that exit. Each worker listens on its own socket, and owns
+// the translation units of the files that the plugin routes to it. Running
+// out of the memory limit kills a worker, which returns all of its memory
+// to the system; the plugin reconnects and reopens its files. The server
+// exits when the plugin host that started it is gone.
+
+#include "CompletionEngine.hpp"
+#include "MemoryBudget.hpp"
+#include "PreambleCache.hpp"
+#include "ServerProtocol.hpp"
+#include "TextBuffer.hpp"
+#include "UnsavedFiles.hpp"
+#include "WorkerPool.hpp"
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace
+{
+
+using namespace Clara;
+using ServerProtocol::MessageType;
+
+struct Arguments
+{
+    std::string socket;
+    unsigned workerCount = 2;
+    // In megabytes; zero means no limit.
+    unsigned long long memoryLimit = 0;
+    unsigned long long memoryBudget = 0;
+    unsigned workerThreads = 0;
+    pid_t parent = 0;
+    std::string preambleCacheDirectory;
+    unsigned long long preambleCacheSizeLimit = 1024;
+};
+
+bool parseArguments(int argc, char **argv, Arguments &arguments)
+{
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        const std::string option = argv[i];
+        const char *value = argv[i + 1];
+        if (option == "--socket")
+        {
+            arguments.socket = value;
+        }
+        else if (option == "--workers")
+        {
+            arguments.workerCount = std::strtoul(value, nullptr, 10);
+        }
+        else if (option == "--memory-limit")
+        {
+            arguments.memoryLimit = std::strtoull(value, nullptr, 10);
+        }
+        else if (option == "--memory-budget")
+        {
+            arguments.memoryBudget = std::strtoull(value, nullptr, 10);
+        }
+        else if (option == "--worker-threads")
+        {
+            arguments.workerThreads = std::strtoul(value, nullptr, 10);
+        }
+        else if (option == "--parent")
+        {
+            arguments.parent = static_cast<pid_t>(std::atol(value));
+        }
+        else if (option == "--preamble-cache-directory")
+        {
+            arguments.preambleCacheDirectory = value;
+        }
+        else if (option == "--preamble-cache-size-limit")
+        {
+            arguments.preambleCacheSizeLimit =
+                std::strtoull(value, nullptr, 10);
+        }
+        else
+        {
+            return false;
+        }
+    }
+    return argc % 2 == 1 && !arguments.socket.empty() &&
+           arguments.workerCount != 0;
+}
+
+// Masking with the shared preamble lets clang parse the text in place.
+TextBuffer::Snapshot getSnapshot(const CompletionEngine &engine,
+                                 std::string text)
+{
+    TextBuffer buffer;
+    buffer.assign(std::move(text));
+    if (const auto preamble = engine.getPreamble())
+    {
+        buffer.mask(preamble->getPreamble());
+    }
+    return buffer.getSnapshot();
+}
+
+// The files of one plugin host, on one connection.
+class Session
+{
+  public:
+    explicit Session(int socket) : mSocket(socket) {}
+
+    // Handles messages until the plugin disconnects.
+    void run();
+
+  private:
+    struct File
+    {
+        // Maps the generation of the engine's latest request to the one of
+        // the plugin's.
+        std::mutex mutex;
+        unsigned generation = 0;
+        unsigned remoteGeneration = 0;
+        // Likewise for signature requests and look-ups.
+        unsigned signatureRequest = 0;
+        unsigned remoteSignatureRequest = 0;
+        unsigned lookUpRequest = 0;
+        unsigned remoteLookUpRequest = 0;
+        // Declared last, so that its jobs are done before the rest goes.
+        std::unique_ptr<CompletionEngine> engine;
+    };
+
+    void handle(ServerProtocol::Reader &message);
+    void setUnsavedFile(ServerProtocol::Reader &message);
+    void open(std::uint64_t id, ServerProtocol::Reader &message);
+    void complete(std::uint64_t id, File &file,
+                  ServerProtocol::Reader &message);
+    void sendCompletions(std::uint64_t id, File &file, unsigned generation);
+    void completeSignatures(File &file, ServerProtocol::Reader &message);
+    void sendSignatures(
+        std::uint64_t id, File &file, unsigned request,
+        const std::vector<CompletionBackend::Signature> &signatures);
+    void lookUp(File &file, ServerProtocol::Reader &message);
+    void sendDeclaration(std::uint64_t id, File &file, unsigned request,
+                         const CompletionBackend::Declaration &declaration);
+    void send(ServerProtocol::Writer &message);
+
+    int mSocket;
+    std::mutex mSendMutex;
+    std::map<std::uint64_t, std::unique_ptr<File>> mFiles;
+    // The versions of the files that the plugin has unsaved, which are
+    // shared with the other sessions of the worker.
+    std::map<std::string, std::uint64_t> mUnsavedFiles;
+};
+
+void Session::run()
+{
+    std::string frame;
+    while (ServerProtocol::receiveFrame(mSocket, frame))
+    {
+        ServerProtocol::Reader message(frame);
+        handle(message);
+    }
+    // Waits for the running jobs, which may still send.
+    mFiles.clear();
+    // Unless a new session of the plugin has set them again.
+    for (const auto &file : mUnsavedFiles)
+    {
+        UnsavedFiles::get().remove(file.first, file.second);
+    }
+    close(mSocket);
+}
+
+void Session::handle(ServerProtocol::Reader &message)
+{
+    const auto id = message.readInt();
+    if (message.getType() == MessageType::Open)
+    {
+        open(id, message);
+        return;
+    }
+    if (message.getType() == MessageType::SetUnsavedFile ||
+        message.getType() == MessageType::RemoveUnsavedFile)
+    {
+        setUnsavedFile(message);
+        return;
+    }
+    const auto found = mFiles.find(id);
+    if (found == mFiles.end())
+    {
+        message.discard();
+        return;
+    }
+    auto &file = *found->second;
+    switch (message.getType())
+    {
+    case MessageType::Load:
+    {
+        auto command = message.readStrings();
+        auto directory = message.readString();
+        if (message.isValid())
+        {
+            file.engine->load(std::move(command), std::move(directory));
+        }
+        break;
+    }
+    case MessageType::Reparse:
+        file.engine->reparse();
+        break;
+    case MessageType::Complete:
+        complete(id, file, message);
+        break;
+    case MessageType::Cancel:
+        file.engine->cancel();
+        break;
+    case MessageType::CompleteSignatures:
+        completeSignatures(file, message);
+        break;
+    case MessageType::LookUp:
+        lookUp(file, message);
+        break;
+    case MessageType::SetPriority:
+    {
+        const auto priority = message.readInt();
+        if (priority <= static_cast<std::uint64_t>(
+                            WorkerPool::Priority::Interactive))
+        {
+            file.engine->setPriority(
+                static_cast<WorkerPool::Priority>(priority));
+        }
+        break;
+    }
+    case MessageType::Close:
+        mFiles.erase(found);
+        break;
+    default:
+        message.discard();
+        break;
+    }
+}
+
+void Session::setUnsavedFile(ServerProtocol::Reader &message)
+{
+    auto filename = message.readString();
+    if (message.getType() == MessageType::RemoveUnsavedFile)
+    {
+        if (!message.isValid()) return;
+        UnsavedFiles::get().remove(filename);
+        mUnsavedFiles.erase(filename);
+        return;
+    }
+    TextBuffer::Snapshot snapshot;
+    snapshot.text = std::make_shared<const std::string>(message.readBlob());
+    if (!message.isValid()) return;
+    mUnsavedFiles[filename] =
+        UnsavedFiles::get().set(filename, std::move(snapshot));
+}
+
+void Session::open(std::uint64_t id, ServerProtocol::Reader &message)
+{
+    auto filename = message.readString();
+    CompletionEngine::Options options;
+    options.codeComplete.IncludeMacros = message.readInt() != 0;
+    options.codeComplete.IncludeCodePatterns = message.readInt() != 0;
+    options.codeComplete.IncludeGlobals = message.readInt() != 0;
+    options.codeComplete.IncludeBriefComments = message.readInt() != 0;
+    options.systemHeaders = message.readStrings();
+    options.systemFrameworks = message.readStrings();
+    options.builtinHeaders = message.readString();
+    options.maxResults = message.readInt();
+    if (!message.isValid()) return;
+    // The plugin opens a file again after a reconnect, which replaces it.
+    mFiles.erase(id);
+    std::unique_ptr<File> file(new File());
+    auto *filePointer = file.get();
+    CompletionEngine::Callbacks callbacks;
+    callbacks.onLoaded = [this, id]() {
+        ServerProtocol::Writer event(MessageType::Loaded);
+        event.writeInt(id);
+        send(event);
+    };
+    callbacks.onDiagnostics = [this, id](DiagnosticList diagnostics) {
+        std::string bytes;
+        ServerProtocol::serialize(diagnostics, bytes);
+        ServerProtocol::Writer event(MessageType::Diagnostics);
+        event.writeInt(id);
+        event.writeBlob(bytes);
+        send(event);
+    };
+    callbacks.onCompleted = [this, id, filePointer](unsigned generation,
+                                                    std::uint64_t) {
+        sendCompletions(id, *filePointer, generation);
+    };
+    callbacks.onSignatures = [this, id, filePointer](
+        unsigned request, std::vector<CompletionBackend::Signature> signatures) {
+        sendSignatures(id, *filePointer, request, signatures);
+    };
+    callbacks.onLookedUp = [this, id, filePointer](
+        unsigned request, CompletionBackend::Declaration declaration) {
+        sendDeclaration(id, *filePointer, request, declaration);
+    };
+    file->engine.reset(new CompletionEngine(std::move(filename),
+                                            static_cast<int>(id),
+                                            std::move(options),
+                                            std::move(callbacks)));
+    mFiles.emplace(id, std::move(file));
+}
+
+void Session::complete(std::uint64_t id, File &file,
+                       ServerProtocol::Reader &message)
+{
+    const auto remoteGeneration = static_cast<unsigned>(message.readInt());
+    const auto row = static_cast<unsigned>(message.readInt());
+    const auto column = static_cast<unsigned>(message.readInt());
+    auto typed = message.readString();
+    auto text = message.readBlob();
+    if (!message.isValid()) return;
+    auto snapshot = getSnapshot(*file.engine, std::move(text));
+    // Held while posting, so that the results can't come in before the
+    // generations are known.
+    std::lock_guard<std::mutex> lock(file.mutex);
+    file.generation = file.engine->complete(
+        row, column, std::move(snapshot), std::move(typed), Metrics::now());
+    file.remoteGeneration = remoteGeneration;
+}
+
+void Session::completeSignatures(File &file, ServerProtocol::Reader &message)
+{
+    const auto remoteRequest = static_cast<unsigned>(message.readInt());
+    const auto row = static_cast<unsigned>(message.readInt());
+    const auto column = static_cast<unsigned>(message.readInt());
+    auto text = message.readBlob();
+    if (!message.isValid()) return;
+    auto snapshot = getSnapshot(*file.engine, std::move(text));
+    std::lock_guard<std::mutex> lock(file.mutex);
+    file.signatureRequest =
+        file.engine->completeSignatures(row, column, std::move(snapshot));
+    file.remoteSignatureRequest = remoteRequest;
+}
+
+void Session::sendSignatures(
+    std::uint64_t id, File &file, unsigned request,
+    const std::vector<CompletionBackend::Signature> &signatures)
+{
+    unsigned remoteRequest;
+    {
+        std::lock_guard<std::mutex> lock(file.mutex);
+        if (request != file.signatureRequest) return;
+        remoteRequest = file.remoteSignatureRequest;
+    }
+    ServerProtocol::Writer event(MessageType::CompletedSignatures);
+    event.writeInt(id);
+    event.writeInt(remoteRequest);
+    event.writeInt(signatures.size());
+    for (const auto &signature : signatures)
+    {
+        event.writeString(signature.label);
+        event.writeString(signature.documentation);
+        event.writeInt(signature.parameters.size());
+        for (const auto &parameter : signature.parameters)
+        {
+            event.writeInt(parameter.first);
+            event.writeInt(parameter.second);
+        }
+    }
+    send(event);
+}
+
+void Session::sendCompletions(std::uint64_t id, File &file,
+                              unsigned generation)
+{
+    unsigned remoteGeneration;
+    {
+        std::lock_guard<std::mutex> lock(file.mutex);
+        if (generation != file.generation) return;
+        remoteGeneration = file.remoteGeneration;
+    }
+    CompletionStore completions;
+    bool isTruncated;
+    if (!file.engine->copyCompletions(generation, completions, isTruncated))
+    {
+        return;
+    }
+    std::string bytes;
+    ServerProtocol::serialize(completions, bytes);
+    ServerProtocol::Writer event(MessageType::Completed);
+    event.writeInt(id);
+    event.writeInt(remoteGeneration);
+    event.writeInt(isTruncated ? 1 : 0);
+    event.writeBlob(bytes);
+    send(event);
+}
+
+void Session::lookUp(File &file, ServerProtocol::Reader &message)
+{
+    const auto remoteRequest = static_cast<unsigned>(message.readInt());
+    const auto row = static_cast<unsigned>(message.readInt());
+    const auto column = static_cast<unsigned>(message.readInt());
+    if (!message.isValid()) return;
+    std::lock_guard<std::mutex> lock(file.mutex);
+    file.lookUpRequest = file.engine->lookUp(row, column);
+    file.remoteLookUpRequest = remoteRequest;
+}
+
+void Session::sendDeclaration(std::uint64_t id, File &file, unsigned request,
+                              const CompletionBackend::Declaration &declaration)
+{
+    unsigned remoteRequest;
+    {
+        std::lock_guard<std::mutex> lock(file.mutex);
+        if (request != file.lookUpRequest) return;
+        remoteRequest = file.remoteLookUpRequest;
+    }
+    ServerProtocol::Writer event(MessageType::LookedUp);
+    event.writeInt(id);
+    event.writeInt(remoteRequest);
+    event.writeString(declaration.name);
+    event.writeString(declaration.kind);
+    event.writeString(declaration.type);
+    event.writeString(declaration.documentation);
+    event.writeString(declaration.filename);
+    event.writeInt(declaration.row);
+    event.writeInt(declaration.column);
+    event.writeString(declaration.definitionFilename);
+    event.writeInt(declaration.definitionRow);
+    event.writeInt(declaration.definitionColumn);
+    send(event);
+}
+
+void Session::send(ServerProtocol::Writer &message)
+{
+    const auto &frame = message.finish();
+    std::lock_guard<std::mutex> lock(mSendMutex);
+    if (!ServerProtocol::sendFrame(mSocket, frame)) message.discard();
+}
+
+int runWorker(const Arguments &arguments, unsigned index)
+{
+    const auto supervisor = getppid();
+    if (arguments.memoryLimit != 0)
+    {
+        rlimit limit;
+        limit.rlim_cur = limit.rlim_max =
+            static_cast<rlim_t>(arguments.memoryLimit * 1024 * 1024);
+        setrlimit(RLIMIT_AS, &limit);
+    }
+    PreambleCache::configure(arguments.preambleCacheDirectory,
+                             arguments.preambleCacheSizeLimit * 1024 * 1024);
+    WorkerPool::get().setWorkerCount(arguments.workerThreads);
+    WorkerPool::get().setExitOnOutOfMemory(true);
+    MemoryBudget::get().setLimit(arguments.memoryBudget * 1024 * 1024);
+    const auto path = ServerProtocol::getSocketPath(arguments.socket, index);
+    const int listener = ServerProtocol::listenSocket(path);
+    if (listener == -1)
+    {
+        std::fprintf(stderr, "clara-server: can't listen on %s: %s\n",
+                     path.c_str(), std::strerror(errno));
+        return 1;
+    }
+    // Don't outlive a supervisor that was killed.
+    std::thread([supervisor]() {
+        while (getppid() == supervisor)
+        {
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+        }
+        std::_Exit(0);
+    }).detach();
+    for (;;)
+    {
+        const int socket = accept(listener, nullptr, nullptr);
+        if (socket == -1)
+        {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            return 1;
+        }
+        std::thread([socket]() { Session(socket).run(); }).detach();
+    }
+}
+
+pid_t startWorker(const Arguments &arguments, unsigned index)
+{
+    // The supervisor has no other threads, so forking is safe.
+    const auto pid = fork();
+    if (pid == 0) std::_Exit(runWorker(arguments, index));
+    if (pid == -1)
+    {
+        std::fprintf(stderr, "clara-server: can't fork: %s\n",
+                     std::strerror(errno));
+    }
+    return pid;
+}
+
+bool isParentAlive(pid_t parent)
+{
+    if (parent == 0) return true;
+    return getppid() == parent || kill(parent, 0) == 0 || errno == EPERM;
+}
+
+} // anonymous namespace
+
+int main(int argc, char **argv)
+{
+    Arguments arguments;
+    if (!parseArguments(argc, argv, arguments))
+    {
+        std::fprintf(stderr,
+                     "usage: clara-server --socket PATH [--workers N] "
+                     "[--memory-limit MB] [--memory-budget MB] "
+                     "[--worker-threads N] [--parent PID] "
+                     "[--preamble-cache-directory DIR] "
+                     "[--preamble-cache-size-limit MB]\n");
+        return 2;
+    }
+    // Keyboard signals for the editor's terminal are not meant for us.
+    setsid();
+    std::signal(SIGPIPE, SIG_IGN);
+    using Clock = std::chrono::steady_clock;
+    std::vector<pid_t> workers(arguments.workerCount, -1);
+    std::vector<Clock::time_point> startTimes(workers.size());
+    for (unsigned i = 0; i < workers.size(); ++i)
+    {
+        workers[i] = startWorker(arguments, i);
+        startTimes[i] = Clock::now();
+    }
+    while (isParentAlive(arguments.parent))
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        int status;
+        pid_t pid;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+        {
+            for (unsigned i = 0; i < workers.size(); ++i)
+            {
+                if (workers[i] != pid) continue;
+                if (WIFSIGNALED(status))
+                {
+                    std::fprintf(stderr,
+                                 "clara-server: worker %u died of signal %d\n",
+                                 i, WTERMSIG(status));
+                }
+                workers[i] = -1;
+            }
+        }
+        // A worker that can't start at all is not restarted in a tight loop.
+        const auto now = Clock::now();
+        for (unsigned i = 0; i < workers.size(); ++i)
+        {
+            if (workers[i] != -1 ||
+                now - startTimes[i] < std::chrono::seconds(1))
+            {
+                continue;
+            }
+            workers[i] = startWorker(arguments, i);
+            startTimes[i] = now;
+        }
+    }
+    for (unsigned i = 0; i < workers.size(); ++i)
+    {
+        if (workers[i] != -1) kill(workers[i], SIGTERM);
+        unlink(ServerProtocol::getSocketPath(arguments.socket, i).c_str());
+    }
+    return 0;
+}
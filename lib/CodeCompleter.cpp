@@ -1,15 +1,17 @@
 #include "CodeCompleter.hpp"
 #include "CompilationDatabaseWatcher.hpp"
+#include "CompletionEngine.hpp"
+#include "MemoryBudget.hpp"
+#include "Metrics.hpp"
+#include "PreambleCache.hpp"
+#include "UnsavedFiles.hpp"
+#include "WorkerPool.hpp"
+#ifndef _WIN32
+#include "RemoteCompletionEngine.hpp"
+#endif
 #include "claraPrint.hpp"
-#include <clang/Frontend/CompilerInvocation.h>
-#include <clang/Frontend/Utils.h> // for clang::createInvocationFromCommandLine
-#include <future>
-#include <llvm/Support/FileSystem.h>
 #include <llvm/Support/Path.h>
-#include <pybind11/functional.h>
 #include <pybind11/stl.h>
-#include <sstream>
-#include <thread>
 
 static std::string getHeadersKey()
 {
@@ -20,694 +22,655 @@ static std::string getHeadersKey()
     return username + "@" + hostname;
 }
 
-static std::shared_ptr<clang::GlobalCodeCompletionAllocator>
-    gCodeCompleteAlloc(new clang::GlobalCodeCompletionAllocator());
-
-namespace Clara
-{
-
-clang::CodeCompleteOptions CodeCompleter::initCodeCompleteOptions() const
+static clang::CodeCompleteOptions
+getCodeCompleteOptions(const pybind11::object &get)
 {
     clang::CodeCompleteOptions options;
-    pybind11::module sublime = pybind11::module::import("sublime");
-    auto settings = sublime.attr("load_settings")("Clara.sublime-settings");
-    auto get = settings.attr("get");
-    options.IncludeMacros = get("code_complete_include_macros", true) ? 1 : 0;
+    options.IncludeMacros =
+        get("code_complete_include_macros", true).cast<bool>() ? 1 : 0;
     options.IncludeCodePatterns =
-        get("code_complete_code_patterns", true) ? 1 : 0;
-    options.IncludeGlobals = get("code_complete_include_globals", true) ? 1 : 0;
+        get("code_complete_code_patterns", true).cast<bool>() ? 1 : 0;
+    options.IncludeGlobals =
+        get("code_complete_include_globals", true).cast<bool>() ? 1 : 0;
     options.IncludeBriefComments =
-        get("code_complete_include_brief_comments", false) ? 1 : 0;
+        get("code_complete_include_brief_comments", false).cast<bool>() ? 1
+                                                                        : 0;
     return options;
 }
 
-CodeCompleter::CodeCompleter(pybind11::object view)
-    : clang::DiagnosticConsumer{},
-      clang::CodeCompleteConsumer{initCodeCompleteOptions(), false},
-      mCCTUInfo{gCodeCompleteAlloc}, mView{std::move(view)},
-      mDiagIds{new clang::DiagnosticIDs()},
-      mDiagOpts{new clang::DiagnosticOptions()},
-      mDiags{new clang::DiagnosticsEngine{mDiagIds.get(), mDiagOpts.get(), this,
-                                          false}}
+namespace Clara
+{
+
+CodeCompleter::CodeCompleter(pybind11::object view) : mView{std::move(view)}
 {
     pybind11::module sublime = pybind11::module::import("sublime");
     claraPrint(mView, "constructing CodeCompleter");
     mFilename = mView.attr("file_name")().cast<std::string>();
-    const auto compileCommand = CompilationDatabaseWatcher::getForView(mView);
-    auto command = std::get<0>(compileCommand);
-    mFileOpts.WorkingDir = std::get<1>(compileCommand);
-    if (mFileOpts.WorkingDir.empty() || command.empty())
-    {
-        throw std::runtime_error("no compile command");
-    }
+    mViewId = mView.attr("id")().cast<int>();
     auto settings = sublime.attr("load_settings")("Clara.sublime-settings");
     auto getsetting = settings.attr("get");
-    const auto headersKey = getHeadersKey();
-    claraPrint(mView, "loading key", headersKey);
-    auto headersDict = getsetting(headersKey, pybind11::none());
-    if (headersDict.is_none())
+    CompletionBackend::Options options;
+    if (!getOptions(options))
     {
         sublime.attr("error_message")(
-            "Headers have not been set up (attempted to access " + headersKey +
-            "). Please set up headers and restart sublime.");
+            "Headers have not been set up (attempted to access " +
+            getHeadersKey() + "). Please set up headers and restart sublime.");
         return;
     }
-    claraPrint(mView, "loading system headers");
-    auto systemHeaders =
-        headersDict["system_headers"].cast<std::vector<std::string>>();
-    claraPrint(mView, "loading system frameworks");
-    auto systemFrameworks =
-        headersDict["system_frameworks"].cast<std::vector<std::string>>();
-    llvm::SmallString<64> builtinHeadersTemp =
-        llvm::StringRef(sublime.attr("packages_path")().cast<std::string>());
-    llvm::sys::path::append(builtinHeadersTemp, "Clara", "include");
-    std::string builtinHeaders = builtinHeadersTemp.c_str();
-    claraPrint(mView, "begin parsing main file");
-    mView.attr("set_status")("clara", "parsing...");
-    mInitThread =
-        std::thread{&CodeCompleter::initAST,     this,
-                    std::move(command),          std::move(systemHeaders),
-                    std::move(systemFrameworks), std::move(builtinHeaders)};
-}
-
-void CodeCompleter::initAST(std::vector<std::string> command,
-                            std::vector<std::string> systemHeaders,
-                            std::vector<std::string> systemFrameworks,
-                            std::string builtinHeaders)
-{
-    mFileMgr = new clang::FileManager(mFileOpts);
-    mSourceMgr = new clang::SourceManager(*mDiags, *mFileMgr);
-    std::vector<const char *> commandLine;
-    bool skipNext = true;
-    for (const auto &str : command)
-        if (skipNext)
-        {
-            skipNext = false;
-        }
-        else if (str == "-include")
-        {
-            skipNext = true;
-        }
-        else
-        {
-            commandLine.push_back(str.c_str());
-        }
-    auto invocation =
-        clang::createInvocationFromCommandLine(commandLine, mDiags);
-    if (invocation)
+    auto cacheDirectory =
+        getsetting("preamble_cache_directory", "").cast<std::string>();
+    if (!cacheDirectory.empty())
     {
-        invocation->getFileSystemOpts().WorkingDir =
-            mFileMgr->getFileSystemOpts().WorkingDir;
-        auto &headerSearchOpts = invocation->getHeaderSearchOpts();
-        invocation->getFrontendOpts().SkipFunctionBodies = 1;
-        // headerSearchOpts.Verbose = true;
-        headerSearchOpts.UseBuiltinIncludes = false;
-        headerSearchOpts.UseStandardSystemIncludes = true;
-        headerSearchOpts.UseStandardCXXIncludes = true;
-
-        addPath(invocation.get(), builtinHeaders, false);
-        for (const auto &systemHeader : systemHeaders)
-        {
-            addPath(invocation.get(), systemHeader, false);
-        }
-        for (const auto &framework : systemFrameworks)
-        {
-            addPath(invocation.get(), framework, true);
-        }
+        cacheDirectory = pybind11::module::import("os")
+                             .attr("path")
+                             .attr("expanduser")(cacheDirectory)
+                             .cast<std::string>();
     }
-
-    mUnit = clang::ASTUnit::LoadFromCompilerInvocation(
-        std::shared_ptr<clang::CompilerInvocation>(invocation.release()),
-        mPchOps, mDiags, mFileMgr.get(),
-        /*OnlyLocalDecls*/ false,
-        /*CaptureDiagnostics*/ false,
-        /*PrecompilePreambleAfterNParses*/ 2, /* bug, can't set to 1 */
-        /*TranslationUnitKind*/ clang::TU_Complete,
-        /*CacheCodeCompletionResults*/ true,
-        /*IncludeBriefCommentsInCodeCompletion*/ false,
-        /*UserFilesAreVolatile*/ true);
-    if (!mUnit)
+    const auto cacheSizeLimit =
+        getsetting("preamble_cache_size_limit", 1024).cast<unsigned>();
+    const auto workerThreads = getsetting("worker_threads", 0).cast<unsigned>();
+    const auto memoryBudget =
+        getsetting("memory_budget", 4096).cast<unsigned long long>();
+    mIsSignatureHelpEnabled = getsetting("signature_help", true).cast<bool>();
+#ifndef _WIN32
+    const bool useServer = getsetting("server", false).cast<bool>();
+    if (useServer)
     {
-        return;
+        ServerConnection::Settings server;
+        llvm::SmallString<64> executable = llvm::StringRef(
+            sublime.attr("packages_path")().cast<std::string>());
+        llvm::sys::path::append(executable, "Clara", "clara-server");
+        server.executable = executable.c_str();
+        server.workerCount = getsetting("server_workers", 2).cast<unsigned>();
+        server.memoryLimit =
+            getsetting("server_memory_limit", 4096).cast<unsigned>();
+        server.workerThreads = workerThreads;
+        server.memoryBudget = memoryBudget;
+        server.preambleCacheDirectory = cacheDirectory;
+        server.preambleCacheSizeLimit = cacheSizeLimit;
+        ServerConnection::configure(std::move(server));
     }
-    if (mUnit->Reparse(mPchOps))
+#else
+    const bool useServer = false;
+#endif
+    PreambleCache::configure(std::move(cacheDirectory),
+                             cacheSizeLimit * 1024ull * 1024ull);
+    WorkerPool::get().setWorkerCount(workerThreads);
+    MemoryBudget::get().setLimit(memoryBudget * 1024 * 1024);
+    CompletionBackend::Callbacks callbacks;
+    callbacks.onLoaded = [this]() { showLoaded(); };
+    callbacks.onDiagnostics = [this](DiagnosticList diagnostics) {
+        showDiagnostics(std::move(diagnostics));
+    };
+    callbacks.onCompleted = [this](unsigned generation,
+                                   std::uint64_t requestTime) {
+        showCompletions(generation, requestTime);
+    };
+    callbacks.onSignatures =
+        [this](unsigned request,
+               std::vector<CompletionBackend::Signature> signatures) {
+            showSignatures(request, std::move(signatures));
+        };
+    callbacks.onLookedUp = [this](unsigned request,
+                                  CompletionBackend::Declaration declaration) {
+        showDeclaration(request, std::move(declaration));
+    };
+    // The engine has to exist before the CompilationDatabaseWatcher can call
+    // reload.
+#ifndef _WIN32
+    if (useServer)
     {
-        return;
+        mEngine.reset(new RemoteCompletionEngine(mFilename, mViewId,
+                                                 std::move(options),
+                                                 std::move(callbacks)));
     }
-    mWorkerThread = std::thread(&CodeCompleter::backgroundWorker, this);
-    mIsLoaded = true;
+#endif
+    if (!mEngine)
     {
-        pybind11::gil_scoped_acquire lock;
-        claraPrint(mView, "loaded", mFilename);
-        mView.attr("erase_status")("clara");
+        mEngine.reset(new CompletionEngine(mFilename, mViewId,
+                                           std::move(options),
+                                           std::move(callbacks)));
     }
+    auto compileCommand = CompilationDatabaseWatcher::subscribe(this, mView);
+    if (std::get<0>(compileCommand).empty() ||
+        std::get<1>(compileCommand).empty())
+    {
+        CompilationDatabaseWatcher::unsubscribe(this);
+        throw std::runtime_error("no compile command");
+    }
+    claraPrint(mView, "begin parsing main file");
+    mView.attr("set_status")("clara", "parsing...");
+    mEngine->load(std::move(std::get<0>(compileCommand)),
+                  std::move(std::get<1>(compileCommand)));
 }
 
-void CodeCompleter::backgroundWorker()
+bool CodeCompleter::getOptions(CompletionBackend::Options &options)
 {
-    std::unique_lock<std::mutex> lock(mMethodMutex);
-    while (true)
-    {
-        mConditionVar.wait(lock, [this]() { return mDoCompletionJob; });
-        if (!mIsLoaded) break;
+    pybind11::module sublime = pybind11::module::import("sublime");
+    auto settings = sublime.attr("load_settings")("Clara.sublime-settings");
+    auto getsetting = settings.attr("get");
+    auto headersDict = getsetting(getHeadersKey(), pybind11::none());
+    if (headersDict.is_none()) return false;
+    options.codeComplete = getCodeCompleteOptions(getsetting);
+    options.maxResults =
+        getsetting("max_completion_results", 300).cast<unsigned>();
+    options.systemHeaders =
+        headersDict["system_headers"].cast<std::vector<std::string>>();
+    options.systemFrameworks =
+        headersDict["system_frameworks"].cast<std::vector<std::string>>();
+    llvm::SmallString<64> builtinHeaders =
+        llvm::StringRef(sublime.attr("packages_path")().cast<std::string>());
+    llvm::sys::path::append(builtinHeaders, "Clara", "include");
+    options.builtinHeaders = builtinHeaders.c_str();
+    return true;
+}
 
-        // reparsing the ASTUnit makes sure that the preamble is
-        // up-to-date
-        this->reparse();
-        codeCompleteImpl();
-        {
-            pybind11::gil_scoped_acquire pythonLock;
-            auto runCommand = mView.attr("run_command");
-            runCommand("hide_auto_complete");
-            using namespace pybind11::literals; // for the _a literal
-            runCommand("auto_complete",
-                       "args"_a = pybind11::dict(
-                           "disable_auto_insert"_a = true,
-                           "api_completions_only"_a = false,
-                           "next_completion_if_showing"_a = false));
-        }
-        mDoCompletionJob = false;
+CodeCompleter::~CodeCompleter()
+{
+    pybind11::gil_scoped_release releaser;
+    CompilationDatabaseWatcher::unsubscribe(this);
+    // A running job may be waiting for the GIL to deliver its results.
+    if (mEngine) mEngine->stop();
+    // Closed without saving. Another view of the file may have published a
+    // newer version, which stays.
+    if (mUnsavedVersion != 0)
+    {
+        UnsavedFiles::get().remove(mFilename, mUnsavedVersion);
     }
 }
 
-void CodeCompleter::codeCompleteImpl()
-{
-    using namespace clang;
-    using namespace clang::frontend;
-    SmallVector<ASTUnit::RemappedFile, 1> remappedFiles;
-    auto memBuffer =
-        llvm::MemoryBuffer::getMemBufferCopy(mUnsavedBuffer.c_str());
-    remappedFiles.emplace_back(mFilename, memBuffer.get());
-    LangOptions langOpts = mUnit->getLangOpts();
-    mDiags->Reset();
-    // IntrusiveRefCntPtr<SourceManager> sourceManager(
-    //     new SourceManager(*mDiags, *mFileMgr));
-    mUnit->CodeComplete(mFilename, mRow, mColumn, remappedFiles,
-                        includeMacros(), includeCodePatterns(),
-                        /*includeBriefComments()*/ false, *this, mPchOps,
-                        *mDiags, langOpts, *mSourceMgr, *mFileMgr, mStoredDiags,
-                        mOwnedBuffers);
+void CodeCompleter::showLoaded()
+{
+    pybind11::gil_scoped_acquire lock;
+    mView.attr("erase_status")("clara");
+}
+
+void CodeCompleter::showDiagnostics(DiagnosticList diagnostics)
+{
+    // One call per parse, however many diagnostics there are.
+    pybind11::gil_scoped_acquire acquire;
+    pybind11::module::import("Clara.eventlisteners.diagnostics")
+        .attr("show_diagnostics")(
+            mView, pybind11::cast(std::move(diagnostics),
+                                  pybind11::return_value_policy::move));
 }
 
-void CodeCompleter::addPath(clang::CompilerInvocation *invocation,
-                            const std::string &path, bool isFramework) const
+void CodeCompleter::showCompletions(unsigned generation,
+                                    std::uint64_t requestTime)
 {
-    auto &headerSearchOpts = invocation->getHeaderSearchOpts();
-    headerSearchOpts.AddPath(path, clang::frontend::System, isFramework,
-                             /*ignoreSysRoot=*/false);
+    auto &metrics = mEngine->getMetrics();
+    const auto lockTime = Metrics::now();
+    pybind11::gil_scoped_acquire pythonLock;
+    const auto popupTime = Metrics::now();
+    Metrics::record(metrics, Metrics::Phase::GIL, popupTime - lockTime);
+    // The UI thread only supersedes requests while it holds the GIL, so the
+    // view can't have moved on once this check passes.
+    if (mEngine->isSuperseded(generation)) return;
+    auto runCommand = mView.attr("run_command");
+    runCommand("hide_auto_complete");
+    using namespace pybind11::literals; // for the _a literal
+    runCommand("auto_complete",
+               "args"_a = pybind11::dict("disable_auto_insert"_a = true,
+                                         "api_completions_only"_a = false,
+                                         "next_completion_if_showing"_a =
+                                             false));
+    const auto doneTime = Metrics::now();
+    Metrics::record(metrics, Metrics::Phase::Popup, doneTime - popupTime);
+    Metrics::record(metrics, Metrics::Phase::Total, doneTime - requestTime);
 }
 
-std::vector<std::pair<std::string, std::string>>
-CodeCompleter::onQueryCompletions(pybind11::str prefix,
-                                  pybind11::list locations)
+void CodeCompleter::showDeclaration(unsigned request,
+                                    CompletionBackend::Declaration declaration)
+{
+    pybind11::gil_scoped_acquire acquire;
+    // Requests are only made with the GIL held, so a later one has been
+    // made already if this one is not the latest.
+    if (request != mLookUpRequest) return;
+    pybind11::object result = pybind11::none();
+    if (!declaration.name.empty())
+    {
+        using namespace pybind11::literals; // for the _a literal
+        result = pybind11::dict(
+            "name"_a = declaration.name, "kind"_a = declaration.kind,
+            "type"_a = declaration.type,
+            "documentation"_a = declaration.documentation,
+            "filename"_a = declaration.filename, "row"_a = declaration.row,
+            "column"_a = declaration.column,
+            "definition_filename"_a = declaration.definitionFilename,
+            "definition_row"_a = declaration.definitionRow,
+            "definition_column"_a = declaration.definitionColumn);
+    }
+    auto declarations =
+        pybind11::module::import("Clara.eventlisteners.declarations");
+    if (mIsGoingToDefinition)
+    {
+        declarations.attr("go_to_definition")(mView, mLookUpPoint, result);
+    }
+    else
+    {
+        declarations.attr("show_popup")(mView, mLookUpPoint, result);
+    }
+}
+
+CompletionList CodeCompleter::onQueryCompletions(pybind11::str prefix,
+                                                pybind11::list locations)
 {
     claraPrint(mView, "start on_query_completions");
+    CompletionList empty;
+    if (!mEngine) return empty;
+    if (pybind11::len(locations) != 1)
+    {
+        claraPrint(mView, "too many locations");
+        return empty;
+    }
+    syncBuffer();
     const auto point = locations[0].cast<unsigned>();
-    std::vector<std::pair<std::string, std::string>> empty;
-    if (mPoint == point || mPoint + 3 == point)
+    unsigned row, column;
+    std::tie(row, column) = mView.attr("rowcol")(locations[0])
+                                .cast<std::pair<unsigned, unsigned>>();
+    // Sublime counts columns in code points, clang counts them in bytes.
+    const auto offset = mBuffer.getOffsetOfCharacter(row, column);
+    const auto tokenStart = mBuffer.getStartOfIdentifier(offset);
+    auto typed = mBuffer.getText(tokenStart, offset - tokenStart);
+    if (tokenStart == mContextStart &&
+        mBuffer.getFirstChangedOffset() >= tokenStart)
     {
-        mPoint = (unsigned)-1;
-        if (!mCompletions.empty())
+        // Still typing the same identifier, and nothing before it changed.
+        // The results of the last run are still valid, they only have to be
+        // filtered by what has been typed since.
+        if (mEngine->isCompleting())
         {
-            claraPrint(mView, "returning completions");
-            return std::move(mCompletions);
+            claraPrint(mView, "code completion run is still in progress");
+            return empty;
         }
-        else
+        CompletionList completions;
+        bool isFiltered;
         {
-            claraPrint(mView, "found no completions");
-            return empty;
+            // Filtering doesn't touch Python.
+            pybind11::gil_scoped_release releaser;
+            isFiltered = mEngine->filterCompletions(typed, completions);
+        }
+        if (isFiltered)
+        {
+            claraPrint(mView, "returning", completions.size(),
+                       "cached completions");
+            return completions;
         }
     }
-    if (!mIsLoaded)
+    if (!mEngine->isLoaded())
     {
         claraPrint(mView, "TU is not yet loaded or is reparsing");
+        cancelCompletion();
         return empty;
     }
-    if (pybind11::len(locations) != 1)
-    {
-        claraPrint(mView, "too many locations");
-        return empty;
-    }
-    pybind11::module sublime = pybind11::module::import("sublime");
-    std::tie(mRow, mColumn) = mView.attr("rowcol")(locations[0])
-                                  .cast<std::pair<unsigned, unsigned>>();
-    mPoint = point;
-    mRow++;
-    mColumn++;
-    auto everything = sublime.attr("Region")(0, mView.attr("size")());
-    mUnsavedBuffer = mView.attr("substr")(everything).cast<std::string>();
-    claraPrint(mView, "starting code completion run at row", mRow, "column",
-               mColumn);
-    mDoCompletionJob = true;
-    mConditionVar.notify_one();
+    // Complete at the start of the identifier, so that clang's results are
+    // not specific to what has been typed so far.
+    mContextStart = tokenStart;
+    mContextPoint = point - TextBuffer::countCharacters(typed);
+    mBuffer.resetFirstChangedOffset();
+    column = static_cast<unsigned>(tokenStart - mBuffer.getOffset(row, 0));
+    row++;
+    column++;
+    claraPrint(mView, "starting code completion run at row", row, "column",
+               column);
+    mEngine->complete(row, column, getSnapshot(), std::move(typed),
+                      Metrics::now());
     return empty;
 }
 
-clang::CodeCompletionAllocator &CodeCompleter::getAllocator()
+TextBuffer::Snapshot CodeCompleter::getSnapshot()
 {
-    return mCCTUInfo.getAllocator();
+    const auto preamble = mEngine->getPreamble();
+    if (preamble)
+    {
+        mBuffer.mask(preamble->getPreamble());
+    }
+    else
+    {
+        mBuffer.unmask();
+    }
+    return mBuffer.getSnapshot();
 }
 
-clang::CodeCompletionTUInfo &CodeCompleter::getCodeCompletionTUInfo()
+bool CodeCompleter::getCaret(unsigned &point, unsigned &row,
+                             std::size_t &offset)
 {
-    return mCCTUInfo;
+    auto selection = mView.attr("sel")();
+    if (pybind11::len(selection) != 1) return false;
+    auto region = selection[pybind11::int_(0)];
+    if (!region.attr("empty")().cast<bool>()) return false;
+    point = region.attr("b").cast<unsigned>();
+    syncBuffer();
+    unsigned column;
+    std::tie(row, column) =
+        mView.attr("rowcol")(point).cast<std::pair<unsigned, unsigned>>();
+    offset = mBuffer.getOffsetOfCharacter(row, column);
+    return true;
 }
 
-void CodeCompleter::registerClass(pybind11::module &m)
+void CodeCompleter::onModified()
 {
-    using namespace pybind11;
-    class_<CodeCompleter>(m, "CodeCompleter")
-        .def(init<pybind11::object>())
-        .def("on_query_completions", &CodeCompleter::onQueryCompletions)
-        .def("on_post_save", &CodeCompleter::onPostSave);
+    if (!mEngine || !mIsSignatureHelpEnabled) return;
+    unsigned point, row;
+    std::size_t offset;
+    if (!getCaret(point, row, offset))
+    {
+        if (mCallStart != std::string::npos) hideSignatures();
+        return;
+    }
+    const auto typed = offset > 0 ? mBuffer.getText(offset - 1, 1) : "";
+    if (typed == "(" || typed == ",")
+    {
+        requestSignatures(point, row, offset);
+    }
+    else
+    {
+        updateSignatures(offset);
+    }
 }
 
-void CodeCompleter::ProcessCodeCompleteResults(
-    clang::Sema &sema, clang::CodeCompletionContext context,
-    clang::CodeCompletionResult *results, unsigned numResults)
+void CodeCompleter::requestSignatures(unsigned point, unsigned row,
+                                      std::size_t offset)
 {
-    // Clear the list, from other runs.
-    mCompletions.clear();
-    mCompletions.reserve(numResults);
-
-    std::sort(results, results + numResults,
-              [](const auto &lhs, const auto &rhs) {
-                  return lhs.Priority < rhs.Priority;
-              });
-
-    for (unsigned i = 0; i < numResults; ++i)
+    const auto callStart = mBuffer.getStartOfCall(offset);
+    unsigned argument = 0;
+    if (callStart == std::string::npos ||
+        !mBuffer.getArgumentIndex(callStart, offset, argument))
     {
-        if (results[i].Availability == CXAvailability_NotAvailable ||
-            results[i].Availability == CXAvailability_NotAccessible)
-        {
-            continue;
-        }
-        else
-        {
-            mCompletions.emplace_back(
-                ProcessCodeCompleteResult(sema, context, results[i]));
-        }
+        if (mCallStart != std::string::npos) hideSignatures();
+        return;
+    }
+    mActiveArgument = argument;
+    if (callStart == mCallStart)
+    {
+        // Another argument of the same call. Its overloads are in already,
+        // or on their way.
+        if (mHasSignatures) renderSignatures();
+        return;
     }
+    if (!mEngine->isLoaded()) return;
+    // The hints of an enclosing call stay up until these are in.
+    mCallStart = callStart;
+    mCallPoint = point - TextBuffer::countCharacters(
+                             mBuffer.getText(callStart, offset - callStart));
+    mSignatures.clear();
+    mHasSignatures = false;
+    const auto column =
+        static_cast<unsigned>(offset - mBuffer.getOffset(row, 0));
+    mSignatureRequestTime = Metrics::now();
+    mSignatureRequest =
+        mEngine->completeSignatures(row + 1, column + 1, getSnapshot());
 }
 
-void CodeCompleter::ProcessOverloadCandidates(
-    clang::Sema &sema, unsigned currentArg,
-    clang::CodeCompleteConsumer::OverloadCandidate *candidates,
-    unsigned numCandidates)
+void CodeCompleter::updateSignatures(std::size_t offset)
 {
-    for (unsigned i = 0; i < numCandidates; ++i)
+    if (mCallStart == std::string::npos) return;
+    unsigned argument;
+    // Don't scan half of the view when the caret jumps far away.
+    if (offset <= mCallStart || offset - mCallStart > 4096 ||
+        !mBuffer.getArgumentIndex(mCallStart, offset, argument))
     {
-        if (auto ccs = candidates[i].CreateSignatureString(
-                currentArg, sema, getAllocator(), mCCTUInfo, true))
-        {
-            unsigned argCount = 0;
-            std::string first, second, informative;
-            ProcessCodeCompleteString(*ccs, argCount, first, second,
-                                      informative);
-            if (argCount > 0) second += "$0";
-            if (!informative.empty())
-            {
-                first += "\t";
-                first += informative;
-            }
-            mCompletions.emplace_back(std::move(first), std::move(second));
-        }
+        hideSignatures();
+        return;
     }
+    if (argument == mActiveArgument) return;
+    mActiveArgument = argument;
+    if (mHasSignatures) renderSignatures();
 }
 
-std::pair<std::string, std::string>
-CodeCompleter::ProcessCodeCompleteResult(clang::Sema &sema,
-                                         clang::CodeCompletionContext context,
-                                         clang::CodeCompletionResult &result)
+void CodeCompleter::showSignatures(
+    unsigned request, std::vector<CompletionBackend::Signature> signatures)
 {
-    using namespace clang;
-
-    std::string first, second, informative;
-    unsigned argCount = 0;
+    auto &metrics = mEngine->getMetrics();
+    pybind11::gil_scoped_acquire acquire;
+    // Requests are only made with the GIL held, like look-ups.
+    if (request != mSignatureRequest) return;
+    mSignatures = std::move(signatures);
+    mHasSignatures = true;
+    renderSignatures();
+    Metrics::record(metrics, Metrics::Phase::Signatures,
+                    Metrics::now() - mSignatureRequestTime);
+}
 
-    switch (result.Kind)
-    {
-    case CodeCompletionResult::RK_Declaration:
+void CodeCompleter::renderSignatures()
+{
+    auto popup = pybind11::module::import("Clara.eventlisteners.signatures");
+    if (mSignatures.empty())
     {
-        auto completion = result.CreateCodeCompletionString(
-            sema, context, getAllocator(), mCCTUInfo, includeBriefComments());
-        if (completion == nullptr)
-        {
-            second = result.Declaration->getNameAsString();
-            first = second + "\t[DECL]";
-        }
-        else
-        {
-            ProcessCodeCompleteString(*completion, argCount, first, second,
-                                      informative);
-            if (informative.empty()) informative = "[DECL]";
-        }
-        break;
+        // Not a call after all, or one that clang can't resolve.
+        popup.attr("hide")(mView);
+        return;
     }
-
-    case CodeCompletionResult::RK_Keyword:
-        second = result.Keyword;
-        first = second + "\t[KEYWORD]";
-        break;
-
-    case CodeCompletionResult::RK_Macro:
+    pybind11::list signatures;
+    for (const auto &signature : mSignatures)
     {
-        auto completion = result.CreateCodeCompletionString(
-            sema, context, getAllocator(), mCCTUInfo, includeBriefComments());
-        if (completion == nullptr)
+        // Python counts in code points.
+        const llvm::StringRef label = signature.label;
+        pybind11::list parameters;
+        for (const auto &parameter : signature.parameters)
         {
-            second = result.Macro->getNameStart();
-            first = second + "\t[MACRO]";
+            parameters.append(pybind11::make_tuple(
+                TextBuffer::countCharacters(label.take_front(parameter.first)),
+                TextBuffer::countCharacters(
+                    label.take_front(parameter.second))));
         }
-        else
-        {
-            ProcessCodeCompleteString(*completion, argCount, first, second,
-                                      informative);
-            if (informative.empty()) informative = "[MACRO]";
-        }
-        break;
+        signatures.append(pybind11::make_tuple(signature.label, parameters,
+                                               signature.documentation));
     }
+    popup.attr("show")(mView, mCallPoint, signatures, mActiveArgument);
+}
 
-    case CodeCompletionResult::RK_Pattern:
-    {
-        auto completion = result.CreateCodeCompletionString(
-            sema, context, getAllocator(), mCCTUInfo, includeBriefComments());
-        if (completion == nullptr)
-        {
-            second = result.Macro->getNameStart();
-            first = second + "\t[PATTERN]";
-        }
-        else
-        {
-            ProcessCodeCompleteString(*completion, argCount, first, second,
-                                      informative);
-            // FIXME: For some reason, clang reports macro's as patterns ?!
-            // Let's not confuse the user and just not put this informational
-            // banner in the completion widget.
-            // if (informative.empty()) informative = "[PATTERN]";
-        }
-        break;
-    }
-    }
+void CodeCompleter::hideSignatures()
+{
+    mCallStart = std::string::npos;
+    mSignatures.clear();
+    mHasSignatures = false;
+    // Engine requests start at one, so a late result is dropped.
+    mSignatureRequest = 0;
+    pybind11::module::import("Clara.eventlisteners.signatures")
+        .attr("hide")(mView);
+}
 
-    if (argCount > 0)
-    {
-        second += "$0";
-    }
 
-    if (!informative.empty())
+bool CodeCompleter::onHover(unsigned point)
+{
+    mIsGoingToDefinition = false;
+    return lookUp(point);
+}
+
+void CodeCompleter::goToDefinition(unsigned point)
+{
+    mIsGoingToDefinition = true;
+    if (!lookUp(point))
     {
-        first += "\t";
-        first += informative;
+        pybind11::module::import("sublime").attr("status_message")(
+            "Clara: the file is not parsed yet");
     }
+}
 
-    return std::make_pair<std::string, std::string>(std::move(first),
-                                                    std::move(second));
+bool CodeCompleter::lookUp(unsigned point)
+{
+    if (!mEngine || !mEngine->isLoaded()) return false;
+    syncBuffer();
+    unsigned row, column;
+    std::tie(row, column) =
+        mView.attr("rowcol")(point).cast<std::pair<unsigned, unsigned>>();
+    // The unit is the one of the last parse, which matches the view unless
+    // lines were added or removed since.
+    column = static_cast<unsigned>(mBuffer.getOffsetOfCharacter(row, column) -
+                                   mBuffer.getOffset(row, 0));
+    mLookUpPoint = point;
+    mLookUpRequest = mEngine->lookUp(row + 1, column + 1);
+    return true;
 }
 
-void CodeCompleter::ProcessCodeCompleteString(
-    const clang::CodeCompletionString &ccs, unsigned &argCount,
-    std::string &first, std::string &second, std::string &informative) const
+void CodeCompleter::cancelCompletion()
 {
-    using namespace clang;
+    mEngine->cancel();
+    mContextStart = std::string::npos;
+}
 
-    for (unsigned j = 0; j < ccs.getAnnotationCount(); ++j)
+void CodeCompleter::onSelectionModified()
+{
+    if (mCallStart != std::string::npos)
     {
-        const char *annotation = ccs.getAnnotation(j);
-        informative += annotation;
-        if (j != ccs.getAnnotationCount() - 1) informative += ' ';
+        unsigned point, row;
+        std::size_t offset;
+        if (getCaret(point, row, offset))
+        {
+            updateSignatures(offset);
+        }
+        else
+        {
+            hideSignatures();
+        }
     }
-
-    std::string resultType;
-    for (const auto &chunk : ccs)
+    if (!mEngine || mContextStart == std::string::npos) return;
+    // Nothing to cancel when the results are already in.
+    if (!mEngine->isCompleting()) return;
+    // The request is still valid as long as the caret is at the end of the
+    // identifier that is being completed.
+    auto selection = mView.attr("sel")();
+    if (pybind11::len(selection) == 1)
     {
-        switch (chunk.Kind)
+        auto region = selection[pybind11::int_(0)];
+        const auto point = region.attr("b").cast<unsigned>();
+        // Don't copy half of the view when the caret jumps far away.
+        if (region.attr("empty")().cast<bool>() && point >= mContextPoint &&
+            point - mContextPoint <= 256)
         {
-        case CodeCompletionString::CK_TypedText:
-            // The piece of text that the user is expected to type to match the
-            // code-completion string,
-            // typically a keyword or the name of a declarator or macro.
-            first += chunk.Text;
-            second += chunk.Text;
-            break;
-        case CodeCompletionString::CK_Text:
-            // A piece of text that should be placed in the buffer,
-            // e.g., parentheses or a comma in a function call.
-            informative += chunk.Text;
-            second += chunk.Text;
-            break;
-        case CodeCompletionString::CK_Optional:
-            // A code completion string that is entirely optional.
-            // For example, an optional code completion string that
-            // describes the default arguments in a function call.
-            // if (includeOptionalArguments)
-            // {
-            //     ProcessCodeCompleteString(*chunk.Optional, argCount, first,
-            //                               second, informative);
-            // }
-            break;
-        case CodeCompletionString::CK_Placeholder:
-            // A string that acts as a placeholder for, e.g., a function call
-            // argument.
-            ++argCount;
-            second += "${";
-            second += std::to_string(argCount);
-            second += ":";
-            // Try to ignore leading underscores for standard library function
-            // arguments. This makes the completions cleaner.
-            if (strncmp("__", chunk.Text, 2) == 0)
-            {
-                informative += (chunk.Text + 2);
-                second += (chunk.Text + 2);
-            }
-            else
-            {
-                informative += chunk.Text;
-                second += chunk.Text;
-            }
-            second += "}";
-            break;
-        case CodeCompletionString::CK_Informative:
-            // A piece of text that describes something about the result
-            // but should not be inserted into the buffer.
-            informative += chunk.Text;
-            break;
-        case CodeCompletionString::CK_ResultType:
-            // A piece of text that describes the type of an entity or,
-            // for functions and methods, the return type.
-            resultType = chunk.Text;
-            // informative += chunk.Text;
-            // informative += " -> ";
-            break;
-        case CodeCompletionString::CK_CurrentParameter:
-            // A piece of text that describes the parameter that corresponds to
-            // the code-completion location within a function call, message
-            // send,
-            // macro invocation, etc.
-            ++argCount;
-            second += "${";
-            second += std::to_string(argCount);
-            second += ":";
-            // Try to ignore leading underscores for standard library function
-            // arguments. This makes the completions cleaner.
-            if (strncmp("__", chunk.Text, 2) == 0)
+            auto sublime = pybind11::module::import("sublime");
+            const auto typed =
+                mView.attr("substr")(sublime.attr("Region")(mContextPoint,
+                                                            point))
+                    .cast<std::string>();
+            if (std::all_of(typed.begin(), typed.end(),
+                            TextBuffer::isIdentifierCharacter))
             {
-                informative += (chunk.Text + 2);
-                second += (chunk.Text + 2);
+                return;
             }
-            else
-            {
-                informative += chunk.Text;
-                second += chunk.Text;
-            }
-            second += "}";
-            break;
-        case CodeCompletionString::CK_LeftParen:
-            // A left parenthesis ('(').
-            informative += chunk.Text;
-            second += chunk.Text;
-            break;
-        case CodeCompletionString::CK_RightParen:
-            // A right parenthesis (')').
-            informative += chunk.Text;
-            second += chunk.Text;
-            break;
-        case CodeCompletionString::CK_LeftBracket:
-            // A left bracket ('[').
-            informative += chunk.Text;
-            second += chunk.Text;
-            break;
-        case CodeCompletionString::CK_RightBracket:
-            // A right bracket (']').
-            informative += chunk.Text;
-            second += chunk.Text;
-            break;
-        case CodeCompletionString::CK_LeftBrace:
-            // A left brace ('{').
-            informative += chunk.Text;
-            second += chunk.Text;
-            break;
-        case CodeCompletionString::CK_RightBrace:
-            // A right brace ('}').
-            informative += chunk.Text;
-            second += chunk.Text;
-            break;
-        case CodeCompletionString::CK_LeftAngle:
-            // A left angle bracket ('<').
-            informative += chunk.Text;
-            second += chunk.Text;
-            break;
-        case CodeCompletionString::CK_RightAngle:
-            // A right angle bracket ('>').
-            informative += chunk.Text;
-            second += chunk.Text;
-            break;
-        case CodeCompletionString::CK_Comma:
-            // A comma separator (',').
-            informative += chunk.Text;
-            second += chunk.Text;
-            break;
-        case CodeCompletionString::CK_Colon:
-            // A colon (':').
-            informative += chunk.Text;
-            second += chunk.Text;
-            break;
-        case CodeCompletionString::CK_SemiColon:
-            // A semicolon (';').
-            informative += chunk.Text;
-            second += chunk.Text;
-            break;
-        case CodeCompletionString::CK_Equal:
-            // An '=' sign.
-            informative += chunk.Text;
-            second += chunk.Text;
-            break;
-        case CodeCompletionString::CK_HorizontalSpace:
-            // Horizontal whitespace (' ').
-            informative += chunk.Text;
-            second += chunk.Text;
-            break;
-        case CodeCompletionString::CK_VerticalSpace:
-            // Vertical whitespace ('\n' or '\r\n', depending on the platform).
-            informative += chunk.Text;
-            second += chunk.Text;
-            break;
         }
     }
-    if (first.empty() == false && first.find('~') != std::string::npos)
-    {
-        informative = "[DESTR]";
-    }
-    else if (resultType.empty() == false)
+    claraPrint(mView, "caret left the completion context, cancelling");
+    cancelCompletion();
+}
+
+
+void CodeCompleter::onTextChanged(pybind11::list changes)
+{
+    // Nothing to update before the first full synchronization, and nothing
+    // to update when a full synchronization already picked up these changes.
+    const auto changeCount = mView.attr("change_count")().cast<int>();
+    if (mSyncedChangeCount < 0 || mSyncedChangeCount == changeCount) return;
+    bool isCallEdited = false;
+    for (auto change : changes)
     {
-        if (informative == "()")
-        {
-            informative = "(void) -> ";
-        }
-        else if (informative.find('(') != std::string::npos &&
-                 informative.find(')') != std::string::npos)
+        const auto begin = change.attr("a");
+        const auto end = change.attr("b");
+        const auto beginOffset =
+            mBuffer.getOffset(begin.attr("row").cast<unsigned>(),
+                              begin.attr("col_utf8").cast<unsigned>());
+        const auto endOffset =
+            mBuffer.getOffset(end.attr("row").cast<unsigned>(),
+                              end.attr("col_utf8").cast<unsigned>());
+        mBuffer.replace(beginOffset, endOffset - beginOffset,
+                        change.attr("str").cast<std::string>());
+        if (mCallStart != std::string::npos && beginOffset <= mCallStart)
         {
-            informative += " -> ";
+            isCallEdited = true;
         }
-        informative += resultType;
     }
-    if (ccs.getBriefComment() != nullptr)
+    mSyncedChangeCount = changeCount;
+    // The overloads may be different now.
+    if (isCallEdited) hideSignatures();
+    // Here rather than in on_modified, which may come first, and would then
+    // copy the whole view.
+    onModified();
+    if (mBuffer.getFirstChangedOffset() < mContextStart)
     {
-        informative += " : ";
-        informative += ccs.getBriefComment();
+        // Something before the identifier that is being completed changed.
+        cancelCompletion();
     }
 }
 
-void CodeCompleter::onPostSave()
+void CodeCompleter::syncBuffer()
 {
-    claraPrint(mView, "reparsing...");
-    if (mInitThread.joinable()) mInitThread.join();
-    mIsLoaded.store(false);
-    mInitThread = std::thread{&CodeCompleter::reparse, this};
+    const auto changeCount = mView.attr("change_count")().cast<int>();
+    if (changeCount == mSyncedChangeCount) return;
+    // Either this is the first time, or this version of Sublime Text does not
+    // report text changes. Copy everything.
+    pybind11::module sublime = pybind11::module::import("sublime");
+    auto everything = sublime.attr("Region")(0, mView.attr("size")());
+    mBuffer.assign(mView.attr("substr")(everything).cast<std::string>());
+    mSyncedChangeCount = changeCount;
+    // Whatever changed, the offset of the call may not be right anymore.
+    if (mCallStart != std::string::npos) hideSignatures();
 }
 
-void CodeCompleter::reparse()
+void CodeCompleter::registerClass(pybind11::module &m)
 {
-    // do this twice because we want the preamble to be up to date too. The
-    // preamble is reparsed after two calls to ASTUnit::Reparse.
-    mUnit->Reparse(mPchOps);
-    mUnit->Reparse(mPchOps);
-    mIsLoaded.store(true);
-    {
-        pybind11::gil_scoped_acquire acquire;
-        claraPrint(mView, "done reparsing");
-    }
+    using namespace pybind11;
+    class_<CodeCompleter>(m, "CodeCompleter")
+        .def(init<pybind11::object>())
+        .def("on_query_completions", &CodeCompleter::onQueryCompletions)
+        .def("on_post_save", &CodeCompleter::onPostSave)
+        .def("on_text_changed", &CodeCompleter::onTextChanged)
+        .def("on_selection_modified", &CodeCompleter::onSelectionModified)
+        .def("on_activated", &CodeCompleter::onActivated)
+        .def("on_deactivated", &CodeCompleter::onDeactivated)
+        .def("on_modified", &CodeCompleter::onModified)
+        .def("on_hover", &CodeCompleter::onHover)
+        .def("go_to_definition", &CodeCompleter::goToDefinition);
 }
 
-void CodeCompleter::HandleDiagnostic(clang::DiagnosticsEngine::Level level,
-                                     const clang::Diagnostic &info)
-{
-    clang::DiagnosticConsumer::HandleDiagnostic(level, info);
-    // if (!mSourceMgr->isInMainFile(info.getLocation()))
-    // {
-    //     // not interested in diagnostics that are somewhere outside of the
-    //     // file that we're looking at.
-    //     return;
-    // }
-    const auto loc = mSourceMgr->getPresumedLoc(info.getLocation());
-    std::ostringstream ss;
-    if (loc.isValid())
-    {
-        ss << loc.getFilename() << ":" << loc.getLine() << ":"
-           << loc.getColumn() << ": ";
-    }
-    else
-    {
-        ss << "<unknown>: ";
-    }
-    llvm::SmallString<128> message;
-    info.FormatDiagnostic(message);
-    ss << message.c_str();
-    pybind11::gil_scoped_acquire acquire;
-    pybind11::print(ss.str());
+
+void CodeCompleter::onPostSave()
+{
+    // Before reparsing, so that the engines read the file from disk.
+    UnsavedFiles::get().remove(mFilename);
+    mUnsavedVersion = 0;
+    mPublishedChangeCount = -1;
+    if (!mEngine) return;
+    claraPrint(mView, "reparsing...");
+    mEngine->reparse();
 }
 
-void CodeCompleter::BeginSourceFile(const clang::LangOptions &options,
-                                    const clang::Preprocessor *pp)
+void CodeCompleter::reload(std::vector<std::string> command,
+                           std::string directory)
 {
-    clang::DiagnosticConsumer::BeginSourceFile(options, pp);
-    pybind11::gil_scoped_acquire acquire;
-    claraPrint(mView, "--- BEGIN DIAGNOSTICS ---");
+    mEngine->load(std::move(command), std::move(directory));
 }
-void CodeCompleter::EndSourceFile()
+
+void CodeCompleter::onActivated()
 {
-    clang::DiagnosticConsumer::EndSourceFile();
-    pybind11::gil_scoped_acquire acquire;
-    claraPrint(mView, "--- END DIAGNOSTICS ---");
+    if (mEngine) mEngine->setPriority(WorkerPool::Priority::Interactive);
 }
-void CodeCompleter::finish()
+
+void CodeCompleter::onDeactivated()
 {
-    clang::DiagnosticConsumer::finish();
-    pybind11::gil_scoped_acquire acquire;
-    claraPrint(mView, "finished diagnostics");
+    publishText();
+    if (mEngine) mEngine->setPriority(WorkerPool::Priority::Background);
 }
 
-CodeCompleter::~CodeCompleter()
+void CodeCompleter::publishText()
 {
-    pybind11::gil_scoped_release releaser;
-    auto self = mDiags->takeClient();
-    if (self.get() == this)
+    if (!mView.attr("is_dirty")().cast<bool>())
     {
-        self.release(); // Don't want to delete ourselves twice!
-    }
-    if (mInitThread.joinable())
-    {
-        // Joining the init and worker thread can be user-unfriendly. But I
-        // do not know of another way to safely discard these resources.
-        mInitThread.join();
-    }
-    mIsLoaded = false;
-    mDoCompletionJob = true;
-    mConditionVar.notify_one();
-    if (mWorkerThread.joinable())
-    {
-        mWorkerThread.join();
+        // Undone back to what is on disk.
+        if (mUnsavedVersion != 0)
+        {
+            UnsavedFiles::get().remove(mFilename, mUnsavedVersion);
+        }
+        mUnsavedVersion = 0;
+        mPublishedChangeCount = -1;
+        return;
     }
+    syncBuffer();
+    // Just switching between views doesn't make the other units reparse.
+    if (mSyncedChangeCount == mPublishedChangeCount) return;
+    mUnsavedVersion =
+        UnsavedFiles::get().set(mFilename, mBuffer.getSnapshot());
+    mPublishedChangeCount = mSyncedChangeCount;
 }
 
 } // Clara
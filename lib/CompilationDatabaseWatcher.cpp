@@ -1,18 +1,213 @@
 #include "CompilationDatabaseWatcher.hpp"
+#include "CodeCompleter.hpp"
+#include "FileWatcher.hpp"
+#include "IncludeGraph.hpp"
+#include "IndexedCompilationDatabase.hpp"
+#include "Prewarmer.hpp"
+#include "WorkerPool.hpp"
 #include "claraPrint.hpp"
-#include <thread>
+#include <pybind11/stl.h>
+#include <algorithm>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MD5.h>
+#include <llvm/Support/Path.h>
+#include <set>
 
 namespace Clara
 {
 
-std::map<int, std::unique_ptr<clang::tooling::CompilationDatabase>>
-    CompilationDatabaseWatcher::mDatabases =
-        std::map<int, std::unique_ptr<clang::tooling::CompilationDatabase>>();
+std::map<std::string, std::weak_ptr<CompilationDatabaseWatcher::Database>>
+    CompilationDatabaseWatcher::mDatabases;
+
+std::map<int, std::shared_ptr<CompilationDatabaseWatcher::Database>>
+    CompilationDatabaseWatcher::mWindows;
+
+std::map<CodeCompleter *, CompilationDatabaseWatcher::Subscription>
+    CompilationDatabaseWatcher::mSubscriptions;
 
 std::mutex CompilationDatabaseWatcher::mMethodMutex;
 
 pybind11::module sublime = pybind11::module::import("sublime");
 
+namespace
+{
+
+// Makes sure that the same build directory always gives the same key.
+// Symbolic links are not resolved.
+std::string canonicalizeDirectory(const std::string &directory)
+{
+    llvm::SmallString<256> result(directory);
+    llvm::sys::fs::make_absolute(result);
+    llvm::sys::path::remove_dots(result, true);
+    llvm::sys::path::native(result);
+    while (result.size() > 1 && llvm::sys::path::is_separator(result.back()))
+    {
+        result.pop_back();
+    }
+    return result.str().str();
+}
+
+std::set<int> getWindowIds()
+{
+    std::set<int> result;
+    pybind11::list windows = sublime.attr("windows")();
+    for (auto window : windows)
+    {
+        result.insert(window.attr("id")().cast<int>());
+    }
+    return result;
+}
+
+// Read on every view, so that changing the settings doesn't need a restart.
+void configurePrewarmer()
+{
+    auto get =
+        sublime.attr("load_settings")("Clara.sublime-settings").attr("get");
+    Prewarmer::Settings settings;
+    settings.isEnabled = get("prewarm", false).cast<bool>();
+    // The clara-server only finds the preambles that are warmed in this
+    // process in the on-disk store.
+    if (get("server", false).cast<bool>() &&
+        get("preamble_cache_directory", "").cast<std::string>().empty())
+    {
+        settings.isEnabled = false;
+    }
+    settings.fileCount = get("prewarm_files", 8).cast<unsigned>();
+    settings.sizeLimit =
+        get("prewarm_memory_limit", 1024).cast<unsigned long long>() * 1024 *
+        1024;
+    if (pybind11::hasattr(sublime, "cache_path"))
+    {
+        llvm::SmallString<256> path(
+            sublime.attr("cache_path")().cast<std::string>());
+        llvm::sys::path::append(path, "Clara", "recent_files");
+        settings.recentFilesPath = path.c_str();
+    }
+    Prewarmer::get().configure(std::move(settings));
+}
+
+// Each build directory gets an index directory of its own in the cache, for
+// the index of its database and its symbol index. Empty when Sublime Text
+// has no cache directory.
+std::string getIndexDirectory(const std::string &directory)
+{
+    if (!pybind11::hasattr(sublime, "cache_path")) return std::string();
+    llvm::MD5 md5;
+    md5.update(directory);
+    llvm::MD5::MD5Result result;
+    md5.final(result);
+    llvm::SmallString<32> hex;
+    llvm::MD5::stringifyResult(result, hex);
+    llvm::SmallString<256> path(
+        sublime.attr("cache_path")().cast<std::string>());
+    llvm::sys::path::append(path, "Clara", "index", hex.str());
+    return path.str().str();
+}
+
+// Visits the views of a window again, to enable the code completers of the
+// views that have a compile command now.
+void visitViews(pybind11::handle window)
+{
+    CompilationDatabaseWatcher watcher;
+    pybind11::list views = window.attr("views")();
+    for (auto view : views)
+    {
+        watcher.onNew(pybind11::reinterpret_borrow<pybind11::object>(view));
+    }
+}
+
+bool isHeader(llvm::StringRef filename)
+{
+    const auto extension = llvm::sys::path::extension(filename).lower();
+    return extension == ".h" || extension == ".hh" || extension == ".hpp" ||
+           extension == ".hxx" || extension == ".h++" || extension == ".inl" ||
+           extension == ".ipp" || extension == ".tcc";
+}
+
+// Returns the files of the database by directory.
+std::map<std::string, std::vector<std::string>>
+listDirectories(clang::tooling::CompilationDatabase &database)
+{
+    std::map<std::string, std::vector<std::string>> directories;
+    for (auto &file : database.getAllFiles())
+    {
+        auto &files = directories[llvm::sys::path::parent_path(file).str()];
+        files.push_back(std::move(file));
+    }
+    return directories;
+}
+
+// Returns the files that are most likely to be opened after the given one,
+// best first: those in the same directory, the ones whose names start like
+// its name first. For a header, the directories below its parent directory
+// are searched as well, as sources often live next to their headers'
+// directory rather than in it.
+std::vector<std::string>
+findNeighbours(const std::map<std::string, std::vector<std::string>> &directories,
+               const std::string &filename, bool isHeader, std::size_t count)
+{
+    // Directories of a header that are searched, at most.
+    const std::size_t maxDirectories = 64;
+    const auto directory = llvm::sys::path::parent_path(filename);
+    const auto stem = llvm::sys::path::stem(filename);
+    std::vector<std::pair<std::size_t, const std::string *>> candidates;
+    const auto add = [&](const std::vector<std::string> &files,
+                         bool isSibling) {
+        for (const auto &path : files)
+        {
+            const auto other = llvm::sys::path::stem(path);
+            std::size_t common = 0;
+            while (common < stem.size() && common < other.size() &&
+                   stem[common] == other[common])
+            {
+                ++common;
+            }
+            candidates.emplace_back(2 * common + (isSibling ? 1 : 0), &path);
+        }
+    };
+    const auto found = directories.find(directory.str());
+    if (found != directories.end()) add(found->second, true);
+    if (isHeader)
+    {
+        const auto parent = llvm::sys::path::parent_path(directory);
+        std::size_t searched = 0;
+        for (auto i = directories.lower_bound(parent.str());
+             i != directories.end() && searched < maxDirectories; ++i)
+        {
+            const llvm::StringRef path(i->first);
+            if (!path.startswith(parent)) break;
+            if (path.size() > parent.size() &&
+                !llvm::sys::path::is_separator(path[parent.size()]))
+            {
+                continue;
+            }
+            if (i != found) add(i->second, false);
+            ++searched;
+        }
+    }
+    std::stable_sort(
+        candidates.begin(), candidates.end(),
+        [](const std::pair<std::size_t, const std::string *> &lhs,
+           const std::pair<std::size_t, const std::string *> &rhs) {
+            return lhs.first > rhs.first;
+        });
+    std::vector<std::string> result;
+    for (const auto &candidate : candidates)
+    {
+        if (result.size() == count) break;
+        if (*candidate.second != filename) result.push_back(*candidate.second);
+    }
+    return result;
+}
+
+} // anonymous namespace
+
+CompilationDatabaseWatcher::Database::~Database()
+{
+    FileWatcher::get().unwatch(watchId);
+    if (symbols) symbols->stop();
+}
+
 void CompilationDatabaseWatcher::onNew(pybind11::object view)
 {
     if (view.is_none()) return;
@@ -55,44 +250,250 @@ void CompilationDatabaseWatcher::onNew(pybind11::object view)
 
     // OK, everything looks good at this point. Start enabling the code
     // completer.
+    compile_commands = sublime.attr("expand_variables")(
+        compile_commands, window.attr("extract_variables")());
+    const auto compilation_dir =
+        canonicalizeDirectory(compile_commands.cast<std::string>());
+    configurePrewarmer();
     std::unique_lock<std::mutex> lock(mMethodMutex);
-    const auto findResult = mDatabases.find(window_id);
-    if (findResult != mDatabases.end())
+    auto findResult = mWindows.find(window_id);
+    if (findResult == mWindows.end())
+    {
+        // A new window. Let go of the databases of closed windows.
+        const auto windowIds = getWindowIds();
+        for (auto i = mWindows.begin(); i != mWindows.end();)
+        {
+            if (windowIds.count(i->first) == 0)
+            {
+                i = mWindows.erase(i);
+            }
+            else
+            {
+                ++i;
+            }
+        }
+        findResult = mWindows.emplace(window_id, nullptr).first;
+    }
+    auto &database = findResult->second;
+    if (!database || database->directory != compilation_dir)
+    {
+        claraPrint(view, "loading compile commands for", filename);
+        database = acquire(compilation_dir);
+    }
+    if (!database->database)
+    {
+        // Views of this window are visited again once it is loaded.
+        claraPrint(view, "compile commands are still loading");
+        return;
+    }
+    const auto shared = database;
+    lock.unlock();
+    prewarm(shared, filename.cast<std::string>());
+    indexSymbols(shared);
+    if (std::get<1>(this->getForView(view)).empty())
+    {
+        claraPrint(view, filename, "doesn't have compile commands");
+        return;
+    }
+    if (!settings.attr("get")("_clara_code_completer", false).cast<bool>())
+    {
+        settings.attr("set")("_clara_code_completer", true);
+    }
+}
+
+std::shared_ptr<CompilationDatabaseWatcher::Database>
+CompilationDatabaseWatcher::acquire(const std::string &directory)
+{
+    auto &entry = mDatabases[directory];
+    auto database = entry.lock();
+    if (database) return database;
+    database = std::make_shared<Database>();
+    database->directory = directory;
+    llvm::SmallString<256> path(directory);
+    llvm::sys::path::append(path, "compile_commands.json");
+    // Looked up here, as the jobs can't call into Sublime Text.
+    const auto indexDirectory = getIndexDirectory(directory);
+    database->watchId = FileWatcher::get().watch(
+        path.str().str(), [directory, indexDirectory]() {
+            WorkerPool::get().post(
+                &mDatabases, WorkerPool::Priority::Normal,
+                [directory, indexDirectory]() {
+                    load(directory, indexDirectory);
+                });
+        });
+    entry = database;
+    // Loading a large database takes a while, and must not stall the UI.
+    WorkerPool::get().post(
+        &mDatabases, WorkerPool::Priority::Normal,
+        [directory, indexDirectory]() { load(directory, indexDirectory); });
+    return database;
+}
+
+void CompilationDatabaseWatcher::load(std::string directory,
+                                      std::string indexDirectory)
+{
+    std::string error_message;
+    std::unique_ptr<clang::tooling::CompilationDatabase> database;
+    {
+        Trace::Scope scope(0, "load compilation database");
+        database = IndexedCompilationDatabase::loadFromDirectory(
+            directory, indexDirectory, error_message);
+        if (!database)
+        {
+            // Not a compile_commands.json; maybe clang knows what it is.
+            error_message.clear();
+            database =
+                clang::tooling::CompilationDatabase::autoDetectFromDirectory(
+                    directory, error_message);
+        }
+    }
+    const bool isLoaded = database && error_message.empty();
+    // Listing a large database takes a while too, so it is done before
+    // taking the lock.
+    // Prewarming may be turned on later, in which case prewarm() lists it.
+    std::map<std::string, std::vector<std::string>> directories;
+    const bool isListed = isLoaded && Prewarmer::get().isEnabled();
+    if (isListed) directories = listDirectories(*database);
+    bool isReload = false;
+    std::set<int> windowIds;
     {
-        lock.unlock();
-        if (std::get<1>(this->getForView(view)).empty())
+        std::lock_guard<std::mutex> lock(mMethodMutex);
+        const auto findResult = mDatabases.find(directory);
+        if (findResult == mDatabases.end()) return;
+        const auto shared = findResult->second.lock();
+        if (!shared)
         {
-            claraPrint(view, filename, "doesn't have compile commands");
+            // Nobody uses it anymore.
+            mDatabases.erase(findResult);
             return;
         }
-        if (!settings.attr("get")("_clara_code_completer", false).cast<bool>())
+        isReload = shared->database != nullptr;
+        for (const auto &window : mWindows)
         {
-            settings.attr("set")("_clara_code_completer", true);
+            if (window.second == shared) windowIds.insert(window.first);
         }
-        return;
+        if (isLoaded)
+        {
+            shared->database = std::move(database);
+            shared->directories = std::move(directories);
+            shared->isListed = isListed;
+            // The old graph serves the headers until the new one is built.
+            auto includes = std::make_shared<IncludeGraph>();
+            WorkerPool::get().post(
+                includes.get(), WorkerPool::Priority::Background,
+                [directory, database = shared->database, includes ]() {
+                    buildIncludeGraph(directory, database, includes);
+                });
+            // Only the units whose command changed are indexed again.
+            if (auto symbols = shared->symbols)
+            {
+                WorkerPool::get().post(
+                    symbols.get(), WorkerPool::Priority::Background,
+                    [ database = shared->database, symbols ]() {
+                        buildSymbolIndex(database, symbols);
+                    });
+            }
+        }
+        else if (!isReload)
+        {
+            // Try again the next time one of its views is activated.
+            mDatabases.erase(findResult);
+            for (const auto windowId : windowIds) mWindows.erase(windowId);
+        }
+        if (isLoaded && isReload) refresh(shared);
     }
-    claraPrint(view, "loading compile commands for", filename);
-    compile_commands = sublime.attr("expand_variables")(
-        compile_commands, window.attr("extract_variables")());
-    const auto compilation_dir = compile_commands.cast<std::string>();
-    std::string error_message;
-    std::unique_ptr<clang::tooling::CompilationDatabase> database =
-        clang::tooling::CompilationDatabase::autoDetectFromDirectory(
-            compilation_dir, error_message);
-    if (!database)
+    pybind11::gil_scoped_acquire pythonLock;
+    pybind11::list windows = sublime.attr("windows")();
+    for (auto window : windows)
     {
-        claraPrint(view, "failed to load compilation database for ", filename);
-        return;
+        if (windowIds.count(window.attr("id")().cast<int>()) == 0) continue;
+        if (!isLoaded)
+        {
+            auto view = window.attr("active_view")();
+            if (view.is_none()) continue;
+            claraPrint(view, "failed to load compilation database in",
+                       directory);
+            if (!error_message.empty()) claraPrint(view, error_message);
+            continue;
+        }
+        // Now enable the code completer for the views that were waiting, or
+        // that have compile commands now.
+        visitViews(window);
     }
-    if (!error_message.empty())
+}
+
+void CompilationDatabaseWatcher::buildIncludeGraph(
+    std::string directory,
+    std::shared_ptr<clang::tooling::CompilationDatabase> database,
+    std::shared_ptr<IncludeGraph> includes)
+{
+    std::vector<IncludeGraph::Unit> units;
+    for (auto &command : database->getAllCompileCommands())
     {
-        claraPrint(view, error_message);
-        return;
+        units.push_back({std::move(command.Filename),
+                         std::move(command.CommandLine),
+                         std::move(command.Directory)});
+    }
+    includes->build(units);
+    std::set<int> windowIds;
+    {
+        std::lock_guard<std::mutex> lock(mMethodMutex);
+        const auto findResult = mDatabases.find(directory);
+        if (findResult == mDatabases.end()) return;
+        const auto shared = findResult->second.lock();
+        // Reloaded in the meantime, and another graph is on its way.
+        if (!shared || shared->database != database) return;
+        shared->includes = std::move(includes);
+        refresh(shared);
+        for (const auto &window : mWindows)
+        {
+            if (window.second == shared) windowIds.insert(window.first);
+        }
+    }
+    // The headers have compile commands now.
+    pybind11::gil_scoped_acquire pythonLock;
+    pybind11::list windows = sublime.attr("windows")();
+    for (auto window : windows)
+    {
+        if (windowIds.count(window.attr("id")().cast<int>()) != 0)
+        {
+            visitViews(window);
+        }
+    }
+}
+
+void CompilationDatabaseWatcher::buildSymbolIndex(
+    std::shared_ptr<clang::tooling::CompilationDatabase> database,
+    std::shared_ptr<SymbolIndex> symbols)
+{
+    std::vector<SymbolIndex::Unit> units;
+    for (auto &command : database->getAllCompileCommands())
+    {
+        units.push_back({std::move(command.Filename),
+                         std::move(command.CommandLine),
+                         std::move(command.Directory)});
+    }
+    symbols->build(std::move(units));
+}
+
+void CompilationDatabaseWatcher::refresh(
+    const std::shared_ptr<Database> &database)
+{
+    // Only the code completers whose flags changed need to start over. A
+    // file that was dropped from the database keeps its old flags.
+    for (auto &subscription : mSubscriptions)
+    {
+        auto &value = subscription.second;
+        if (value.database != database) continue;
+        auto command = getCommand(*database, value.filename);
+        if (std::get<1>(command).empty() || command == value.command)
+        {
+            continue;
+        }
+        value.command = command;
+        subscription.first->reload(std::move(std::get<0>(command)),
+                                   std::move(std::get<1>(command)));
     }
-    mDatabases.emplace(window_id, std::move(database));
-    lock.unlock();
-    claraPrint(view, "enabling code completer for", filename);
-    settings.attr("set")("_clara_code_completer", true);
 }
 
 void CompilationDatabaseWatcher::onLoad(pybind11::object view)
@@ -110,23 +511,131 @@ void CompilationDatabaseWatcher::onActivated(pybind11::object view)
     onNew(std::move(view));
 }
 
-std::tuple<std::vector<std::string>, std::string>
+void CompilationDatabaseWatcher::onPostSave(pybind11::object view)
+{
+    if (view.is_none()) return;
+    const auto filename = view.attr("file_name")();
+    auto window = view.attr("window")();
+    if (filename.is_none() || window.is_none()) return;
+    const auto path = filename.cast<std::string>();
+    std::lock_guard<std::mutex> lock(mMethodMutex);
+    const auto findResult = mWindows.find(window.attr("id")().cast<int>());
+    if (findResult == mWindows.end() || !findResult->second) return;
+    if (auto symbols = findResult->second->symbols)
+    {
+        WorkerPool::get().post(symbols.get(), WorkerPool::Priority::Background,
+                               [symbols, path]() { symbols->update(path); });
+    }
+    if (!findResult->second->includes) return;
+    const std::weak_ptr<Database> database = findResult->second;
+    auto includes = findResult->second->includes;
+    WorkerPool::get().post(
+        includes.get(), WorkerPool::Priority::Background,
+        [database, includes, path]() {
+            includes->update(path);
+            std::lock_guard<std::mutex> lock(mMethodMutex);
+            const auto shared = database.lock();
+            if (shared && shared->includes == includes) refresh(shared);
+        });
+}
+
+CompilationDatabaseWatcher::Command
 CompilationDatabaseWatcher::getForView(pybind11::object view)
 {
     std::lock_guard<std::mutex> lock(mMethodMutex);
-    std::vector<std::string> result;
     const auto findResult =
-        mDatabases.find(view.attr("window")().attr("id")().cast<int>());
-    if (findResult == mDatabases.end())
+        mWindows.find(view.attr("window")().attr("id")().cast<int>());
+    if (findResult == mWindows.end() || !findResult->second->database)
+    {
+        return Command();
+    }
+    return getCommand(*findResult->second,
+                      view.attr("file_name")().cast<std::string>());
+}
+
+std::vector<std::tuple<std::string, std::string, std::string, std::string,
+                       unsigned, unsigned>>
+CompilationDatabaseWatcher::findSymbols(pybind11::object window,
+                                        std::string query,
+                                        std::size_t maxResults)
+{
+    std::shared_ptr<SymbolIndex> symbols;
+    {
+        std::lock_guard<std::mutex> lock(mMethodMutex);
+        const auto findResult = mWindows.find(window.attr("id")().cast<int>());
+        if (findResult != mWindows.end() && findResult->second)
+        {
+            symbols = findResult->second->symbols;
+        }
+    }
+    std::vector<std::tuple<std::string, std::string, std::string, std::string,
+                           unsigned, unsigned>>
+        result;
+    if (!symbols) return result;
+    for (auto &symbol : symbols->find(query, maxResults))
+    {
+        result.emplace_back(std::move(symbol.name),
+                            std::move(symbol.qualifiedName),
+                            std::move(symbol.kind), std::move(symbol.filename),
+                            symbol.line, symbol.column);
+    }
+    return result;
+}
+
+CompilationDatabaseWatcher::Command
+CompilationDatabaseWatcher::subscribe(CodeCompleter *completer,
+                                      pybind11::object view)
+{
+    std::lock_guard<std::mutex> lock(mMethodMutex);
+    const auto findResult =
+        mWindows.find(view.attr("window")().attr("id")().cast<int>());
+    if (findResult == mWindows.end() || !findResult->second->database)
+    {
+        return Command();
+    }
+    Subscription subscription;
+    subscription.database = findResult->second;
+    subscription.filename = view.attr("file_name")().cast<std::string>();
+    subscription.command =
+        getCommand(*subscription.database, subscription.filename);
+    auto result = subscription.command;
+    mSubscriptions[completer] = std::move(subscription);
+    return result;
+}
+
+void CompilationDatabaseWatcher::unsubscribe(CodeCompleter *completer)
+{
+    std::lock_guard<std::mutex> lock(mMethodMutex);
+    mSubscriptions.erase(completer);
+}
+
+CompilationDatabaseWatcher::Command
+CompilationDatabaseWatcher::getCommand(const Database &database,
+                                       const std::string &filename)
+{
+    auto result = getUnitCommand(database, filename);
+    if (!std::get<1>(result).empty()) return result;
+    IncludeGraph::Includer includer;
+    if (!database.includes || !database.includes->find(filename, includer))
     {
-        return std::make_tuple(result, "");
+        return Command();
     }
-    const auto filename = view.attr("file_name")().cast<std::string>();
+    result = getUnitCommand(database, includer.filename);
+    if (std::get<1>(result).empty()) return Command();
+    IncludeGraph::addContext(std::get<0>(result), includer);
+    return result;
+}
+
+CompilationDatabaseWatcher::Command
+CompilationDatabaseWatcher::getUnitCommand(const Database &database,
+                                           const std::string &filename)
+{
+    std::vector<std::string> result;
     const auto compile_commands =
-        findResult->second->getCompileCommands(filename);
+        database.database->getCompileCommands(filename);
     if (compile_commands.empty())
     {
-        return std::make_tuple(result, "");
+        return Command();
     }
     // FIXME: What to do in case there are multiple (different) compile commands
     // for the same translation unit? Right now we take the first that we
@@ -143,6 +652,100 @@ CompilationDatabaseWatcher::getForView(pybind11::object view)
     return std::make_tuple(std::move(result), compile_commands[0].Directory);
 }
 
+void CompilationDatabaseWatcher::prewarm(
+    const std::shared_ptr<Database> &database, const std::string &filename)
+{
+    auto &prewarmer = Prewarmer::get();
+    if (!prewarmer.isEnabled()) return;
+    const auto count = prewarmer.getFileCount();
+    const auto recent = prewarmer.getRecent();
+    prewarmer.addRecent(filename);
+    // Listed outside of the lock, as it takes a while for a large database.
+    std::shared_ptr<clang::tooling::CompilationDatabase> unlisted;
+    {
+        std::lock_guard<std::mutex> lock(mMethodMutex);
+        if (!database->isListed) unlisted = database->database;
+    }
+    if (unlisted)
+    {
+        auto directories = listDirectories(*unlisted);
+        std::lock_guard<std::mutex> lock(mMethodMutex);
+        // Unless it was reloaded in the meantime.
+        if (database->database == unlisted)
+        {
+            database->directories = std::move(directories);
+            database->isListed = true;
+        }
+    }
+    std::vector<Prewarmer::File> files;
+    {
+        std::lock_guard<std::mutex> lock(mMethodMutex);
+        if (!database->database) return;
+        const auto add = [&](const std::string &path, std::string include) {
+            if (path == filename) return false;
+            auto command = getUnitCommand(*database, path);
+            if (std::get<1>(command).empty()) return false;
+            files.push_back({path, std::move(std::get<0>(command)),
+                             std::move(std::get<1>(command)),
+                             std::move(include)});
+            return true;
+        };
+        // A header has no preamble of its own, but the files that include it
+        // are likely to be opened next. More of them are looked at, as only
+        // the ones that actually include it are warmed.
+        const bool header =
+            isHeader(filename) ||
+            std::get<1>(getUnitCommand(*database, filename)).empty();
+        const auto include =
+            header ? llvm::sys::path::filename(filename).str() : std::string();
+        for (const auto &path :
+             findNeighbours(database->directories, filename, header,
+                            header ? 4 * count : count))
+        {
+            add(path, include);
+        }
+        if (!database->isPrewarmed)
+        {
+            database->isPrewarmed = true;
+            unsigned added = 0;
+            for (const auto &path : recent)
+            {
+                if (added == count) break;
+                if (add(path, std::string())) ++added;
+            }
+        }
+    }
+    if (files.empty()) return;
+    CompletionBackend::Options options;
+    if (!CodeCompleter::getOptions(options)) return;
+    prewarmer.warm(std::move(files), std::move(options));
+}
+
+void CompilationDatabaseWatcher::indexSymbols(
+    const std::shared_ptr<Database> &database)
+{
+    auto get =
+        sublime.attr("load_settings")("Clara.sublime-settings").attr("get");
+    if (!get("symbol_index", false).cast<bool>()) return;
+    {
+        std::lock_guard<std::mutex> lock(mMethodMutex);
+        if (database->symbols || !database->database) return;
+    }
+    CompletionBackend::Options options;
+    if (!CodeCompleter::getOptions(options)) return;
+    const auto directory = getIndexDirectory(database->directory);
+    if (directory.empty()) return;
+    std::lock_guard<std::mutex> lock(mMethodMutex);
+    if (database->symbols) return;
+    database->symbols =
+        std::make_shared<SymbolIndex>(directory, std::move(options));
+    WorkerPool::get().post(
+        database->symbols.get(), WorkerPool::Priority::Background,
+        [ database = database->database, symbols = database->symbols ]() {
+            buildSymbolIndex(database, symbols);
+        });
+}
+
 void CompilationDatabaseWatcher::registerClass(pybind11::module &m)
 {
     using namespace pybind11;
@@ -152,7 +755,9 @@ void CompilationDatabaseWatcher::registerClass(pybind11::module &m)
         .def("on_load", &CompilationDatabaseWatcher::onLoad)
         .def("on_clone", &CompilationDatabaseWatcher::onClone)
         .def("on_activated", &CompilationDatabaseWatcher::onActivated)
-        .def_static("get_for_view", &CompilationDatabaseWatcher::getForView);
+        .def("on_post_save", &CompilationDatabaseWatcher::onPostSave)
+        .def_static("get_for_view", &CompilationDatabaseWatcher::getForView)
+        .def_static("find_symbols", &CompilationDatabaseWatcher::findSymbols);
 }
 
 } // Clara
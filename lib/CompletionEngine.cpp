@@ -0,0 +1,1424 @@
+#include "CompletionEngine.hpp"
+#include "FuzzyMatcher.hpp"
+#include "IncludeGraph.hpp"
+#include "MemoryBudget.hpp"
+#include "Trace.hpp"
+#include "UnsavedFiles.hpp"
+#include <algorithm>
+#include <clang/AST/ASTContext.h>
+#include <clang/Frontend/CompilerInvocation.h>
+#include <clang/Frontend/Utils.h> // for clang::createInvocationFromCommandLine
+#include <clang/Lex/Lexer.h>
+#include <clang/Lex/Preprocessor.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Path.h>
+
+// Returns the text that the user types to select the result, which is what
+// the typed text is matched against. Constructors, destructors, conversions
+// and operators have no identifier, so that their name is spelled out into
+// the storage.
+static llvm::StringRef getTypedText(const clang::CodeCompletionResult &result,
+                                    std::string &storage)
+{
+    using namespace clang;
+    switch (result.Kind)
+    {
+    case CodeCompletionResult::RK_Declaration:
+        if (const auto *identifier = result.Declaration->getIdentifier())
+        {
+            return identifier->getName();
+        }
+        storage = result.Declaration->getDeclName().getAsString();
+        return storage;
+    case CodeCompletionResult::RK_Keyword:
+        return result.Keyword;
+    case CodeCompletionResult::RK_Macro:
+        return result.Macro->getName();
+    case CodeCompletionResult::RK_Pattern:
+        if (const auto *typedText = result.Pattern->getTypedText())
+        {
+            return typedText;
+        }
+        return llvm::StringRef();
+    }
+    return llvm::StringRef();
+}
+
+// Clang priorities are lower-is-better and mostly range from 0 to 80. A good
+// match of the typed text outweighs a couple of priority classes.
+static int combineScores(int matchScore, unsigned priority)
+{
+    return matchScore * 4 - static_cast<int>(priority);
+}
+
+// Keeps the count candidates with the highest score, best first. Equal
+// scores keep their original order.
+static void selectBest(std::vector<std::pair<int, unsigned>> &ranking,
+                       std::size_t count)
+{
+    count = std::min(count, ranking.size());
+    std::partial_sort(ranking.begin(), ranking.begin() + count, ranking.end(),
+                      [](const auto &lhs, const auto &rhs) {
+                          return lhs.first > rhs.first ||
+                                 (lhs.first == rhs.first &&
+                                  lhs.second < rhs.second);
+                      });
+    ranking.resize(count);
+}
+
+// Appends the chunks of an overload to the label of a signature, and notes
+// where its parameters are. The optional parameters are nested.
+static void appendSignature(const clang::CodeCompletionString &ccs,
+                            Clara::CompletionBackend::Signature &signature)
+{
+    using clang::CodeCompletionString;
+    auto &label = signature.label;
+    for (const auto &chunk : ccs)
+    {
+        switch (chunk.Kind)
+        {
+        case CodeCompletionString::CK_Optional:
+            if (chunk.Optional) appendSignature(*chunk.Optional, signature);
+            break;
+        case CodeCompletionString::CK_Placeholder:
+        case CodeCompletionString::CK_CurrentParameter:
+        {
+            const auto begin = static_cast<unsigned>(label.size());
+            label += chunk.Text;
+            signature.parameters.emplace_back(
+                begin, static_cast<unsigned>(label.size()));
+            break;
+        }
+        case CodeCompletionString::CK_ResultType:
+            label += chunk.Text;
+            label += ' ';
+            break;
+        case CodeCompletionString::CK_VerticalSpace:
+            break;
+        default:
+            if (chunk.Text) label += chunk.Text;
+            break;
+        }
+    }
+}
+
+// Returns the bytes that the unit allocated, the way libclang's
+// clang_getCUResourceUsage counts them. Memory-mapped files are left out,
+// because the system can drop those pages by itself.
+static std::uint64_t measureUnit(clang::ASTUnit &unit)
+{
+    const auto &context = unit.getASTContext();
+    const auto &sourceManager = unit.getSourceManager();
+    std::uint64_t bytes = context.getASTAllocatedMemory() +
+                          context.getSideTableAllocatedMemory() +
+                          sourceManager.getContentCacheSize() +
+                          sourceManager.getDataStructureSizes() +
+                          sourceManager.getMemoryBufferSizes().malloc_bytes +
+                          unit.getPreprocessor().getTotalMemory();
+    if (const auto completions = unit.getCachedCompletionAllocator())
+    {
+        bytes += completions->getTotalMemory();
+    }
+    return bytes;
+}
+
+// Adds the unsaved files other than the main file, whose text comes with
+// every parse, to the remapped files. The list owns the buffers.
+static void
+addUnsavedFiles(const std::string &mainFile,
+                llvm::SmallVectorImpl<clang::ASTUnit::RemappedFile> &files)
+{
+    for (const auto &file : Clara::UnsavedFiles::get().getFiles(mainFile))
+    {
+        files.emplace_back(file.filename, file.getMemoryBuffer().release());
+    }
+}
+
+static std::shared_ptr<clang::GlobalCodeCompletionAllocator>
+    gCodeCompleteAlloc(new clang::GlobalCodeCompletionAllocator());
+
+namespace Clara
+{
+
+CompletionEngine::CompletionEngine(std::string filename, int id,
+                                   Options options, Callbacks callbacks)
+    : clang::DiagnosticConsumer{},
+      clang::CodeCompleteConsumer{options.codeComplete, false},
+      mCCTUInfo{gCodeCompleteAlloc}, mDiagIds{new clang::DiagnosticIDs()},
+      mDiagOpts{new clang::DiagnosticOptions()},
+      mDiags{new clang::DiagnosticsEngine{mDiagIds.get(), mDiagOpts.get(), this,
+                                          false}},
+      mSystemHeaders{std::move(options.systemHeaders)},
+      mSystemFrameworks{std::move(options.systemFrameworks)},
+      mBuiltinHeaders{std::move(options.builtinHeaders)},
+      mCallbacks{std::move(callbacks)}, mFilename{std::move(filename)},
+      mId{id}, mMetrics{Metrics::addView(id, mFilename)},
+      mMaxResults{options.maxResults}
+{
+    MemoryBudget::get().add(this, [this]() {
+        WorkerPool::get().post(this, WorkerPool::Priority::Background,
+                               [this]() { evict(); });
+    });
+    UnsavedFiles::get().subscribe(this, [this](const UnsavedFiles::File &file) {
+        WorkerPool::get().post(
+            this, WorkerPool::Priority::Background,
+            [ this, filename = file.filename ]() { unsavedFileJob(filename); });
+    });
+}
+
+CompletionEngine::~CompletionEngine()
+{
+    // A running job still uses the diagnostics engine and the unit.
+    stop();
+    MemoryBudget::get().remove(this);
+    UnsavedFiles::get().unsubscribe(this);
+    // Drops an eviction or an unsaved file that was posted in the meantime.
+    WorkerPool::get().cancel(this);
+    auto self = mDiags->takeClient();
+    if (self.get() == this)
+    {
+        self.release(); // Don't want to delete ourselves twice!
+    }
+    Metrics::removeView(mId);
+}
+
+void CompletionEngine::stop()
+{
+    // Waiting for a running job can be user-unfriendly. But I do not know
+    // of another way to safely discard these resources.
+    WorkerPool::get().cancel(this);
+    mIsLoaded = false;
+}
+
+void CompletionEngine::load(std::vector<std::string> command,
+                            std::string directory)
+{
+    mIsLoaded.store(false);
+    WorkerPool::get().post(
+        this, WorkerPool::Priority::Background,
+        [ this, command = std::move(command),
+          directory = std::move(directory) ]() {
+            mFileOpts.WorkingDir = directory;
+            mCommand = command;
+            mIsEvicted = false;
+            initAST(command);
+        });
+}
+
+void CompletionEngine::reparse()
+{
+    mIsLoaded.store(false);
+    WorkerPool::get().post(this, WorkerPool::Priority::Normal, [this]() {
+        if (!mUnit) return;
+        auto buffer = UnsavedFiles::get().read(mFilename);
+        if (!buffer) return;
+        reparse(buffer->getBuffer().str());
+    });
+}
+
+void CompletionEngine::setPriority(WorkerPool::Priority priority)
+{
+    WorkerPool::get().setOwnerPriority(this, priority);
+    if (priority != WorkerPool::Priority::Interactive) return;
+    MemoryBudget::get().touch(this);
+    if (mIsEvicted)
+    {
+        WorkerPool::get().post(this, WorkerPool::Priority::Normal,
+                               [this]() { restore(); });
+    }
+}
+
+void CompletionEngine::evict()
+{
+    if (!mUnit) return;
+    Trace::message(mId, "evicting", mFilename);
+    mIsLoaded = false;
+    mIsEvicted = true;
+    mLocations.reset();
+    mUnit.reset();
+    mInvocation.reset();
+    {
+        std::lock_guard<std::mutex> lock(mMethodMutex);
+        mPreamble.reset();
+    }
+    mContext.reset();
+    std::string().swap(mParsedPreamble);
+    CompletionStore().swap(mResults);
+    mSourceMgr = nullptr;
+    mFileMgr = nullptr;
+    MemoryBudget::get().setFootprint(this, 0);
+}
+
+void CompletionEngine::restore()
+{
+    // Loaded again in the meantime, or activated twice.
+    if (!mIsEvicted.exchange(false)) return;
+    Trace::message(mId, "restoring", mFilename);
+    initAST(mCommand);
+}
+
+void CompletionEngine::updateFootprint()
+{
+    MemoryBudget::get().setFootprint(this, mUnit ? measureUnit(*mUnit) : 0);
+}
+
+std::shared_ptr<const PreambleCache::Entry>
+CompletionEngine::getPreamble() const
+{
+    std::lock_guard<std::mutex> lock(mMethodMutex);
+    return mPreamble;
+}
+
+
+void CompletionEngine::initAST(std::vector<std::string> command)
+{
+    Trace::Scope scope(mId, "load");
+    const auto loadTime = Metrics::now();
+    mFileMgr = new clang::FileManager(mFileOpts);
+    mSourceMgr = new clang::SourceManager(*mDiags, *mFileMgr);
+    // A header borrows the command of a unit that includes it.
+    mIncluder = IncludeGraph::Includer();
+    const bool isHeader = IncludeGraph::takeContext(command, mIncluder);
+    mCommandLine = getCommandLine(std::move(command));
+    mContextCommandLine.clear();
+    if (isHeader)
+    {
+        mContextCommandLine = std::move(mCommandLine);
+        mCommandLine = getHeaderCommandLine();
+    }
+
+    auto buffer = UnsavedFiles::get().read(mFilename);
+    if (!buffer)
+    {
+        return;
+    }
+    beginDiagnostics();
+    const bool isLoaded = loadUnit(buffer->getBuffer());
+    publishDiagnostics();
+    if (!isLoaded)
+    {
+        return;
+    }
+    mIsLoaded = true;
+    updateFootprint();
+    Metrics::record(*mMetrics, Metrics::Phase::Load, Metrics::now() - loadTime);
+    Trace::message(mId, "loaded", mFilename);
+    mCallbacks.onLoaded();
+}
+
+std::vector<std::string>
+CompletionEngine::getCommandLine(std::vector<std::string> command)
+{
+    std::vector<std::string> result;
+    bool skipNext = true;
+    for (auto &str : command)
+        if (skipNext)
+        {
+            skipNext = false;
+        }
+        else if (str == "-include")
+        {
+            skipNext = true;
+        }
+        else
+        {
+            result.push_back(std::move(str));
+        }
+    return result;
+}
+
+std::vector<std::string> CompletionEngine::getHeaderCommandLine() const
+{
+    // The header takes the place of the unit, in the language of the unit.
+    const auto &directory = mFileOpts.WorkingDir;
+    const auto unitName = llvm::sys::path::filename(mIncluder.filename);
+    const auto extension = llvm::sys::path::extension(mIncluder.filename);
+    const char *language = "c++";
+    if (extension == ".c") language = "c";
+    if (extension == ".m") language = "objective-c";
+    if (extension == ".mm") language = "objective-c++";
+    std::vector<std::string> result;
+    bool isFound = false;
+    for (const auto &argument : mContextCommandLine)
+    {
+        if (!isFound && llvm::sys::path::filename(argument) == unitName)
+        {
+            llvm::SmallString<256> path;
+            if (llvm::sys::path::is_relative(argument)) path = directory;
+            llvm::sys::path::append(path, argument);
+            if (llvm::sys::fs::equivalent(path, mIncluder.filename))
+            {
+                result.push_back("-x");
+                result.push_back(language);
+                result.push_back(mFilename);
+                isFound = true;
+                continue;
+            }
+        }
+        result.push_back(argument);
+    }
+    if (!isFound) return std::vector<std::string>();
+    // It is the main file now, which it may not expect.
+    result.push_back("-Wno-pragma-once-outside-header");
+    return result;
+}
+
+std::unique_ptr<clang::CompilerInvocation> CompletionEngine::createInvocation(
+    const std::vector<std::string> &commandLine) const
+{
+    Options options;
+    options.systemHeaders = mSystemHeaders;
+    options.systemFrameworks = mSystemFrameworks;
+    options.builtinHeaders = mBuiltinHeaders;
+    return createInvocation(commandLine,
+                            mFileMgr->getFileSystemOpts().WorkingDir, options,
+                            mDiags);
+}
+
+std::unique_ptr<clang::CompilerInvocation> CompletionEngine::createInvocation(
+    const std::vector<std::string> &commandLine, const std::string &directory,
+    const Options &options,
+    clang::IntrusiveRefCntPtr<clang::DiagnosticsEngine> diags)
+{
+    std::vector<const char *> arguments;
+    for (const auto &str : commandLine)
+    {
+        arguments.push_back(str.c_str());
+    }
+    auto invocation =
+        clang::createInvocationFromCommandLine(arguments, std::move(diags));
+    if (invocation)
+    {
+        invocation->getFileSystemOpts().WorkingDir = directory;
+        auto &headerSearchOpts = invocation->getHeaderSearchOpts();
+        invocation->getFrontendOpts().SkipFunctionBodies = 1;
+        // headerSearchOpts.Verbose = true;
+        headerSearchOpts.UseBuiltinIncludes = false;
+        headerSearchOpts.UseStandardSystemIncludes = true;
+        headerSearchOpts.UseStandardCXXIncludes = true;
+
+        addPath(invocation.get(), options.builtinHeaders, false);
+        for (const auto &systemHeader : options.systemHeaders)
+        {
+            addPath(invocation.get(), systemHeader, false);
+        }
+        for (const auto &framework : options.systemFrameworks)
+        {
+            addPath(invocation.get(), framework, true);
+        }
+    }
+    return invocation;
+}
+
+std::shared_ptr<const PreambleCache::Entry>
+CompletionEngine::buildPreamble(const std::string &filename,
+                                std::vector<std::string> command,
+                                const std::string &directory,
+                                const Options &options)
+{
+    // Built exactly like loadUnit does, so that the cache key matches the
+    // one of the engine that opens the file later.
+    const auto commandLine = getCommandLine(std::move(command));
+    clang::IntrusiveRefCntPtr<clang::DiagnosticsEngine> diags(
+        new clang::DiagnosticsEngine(
+            new clang::DiagnosticIDs(), new clang::DiagnosticOptions(),
+            new clang::IgnoringDiagConsumer(), /*ShouldOwnClient*/ true));
+    auto invocation = createInvocation(commandLine, directory, options, diags);
+    if (!invocation) return nullptr;
+    auto file = UnsavedFiles::get().read(filename);
+    if (!file) return nullptr;
+    const auto buffer = file->getBuffer().str();
+    const auto preambleSize = PreambleCache::computePreambleSize(buffer);
+    return PreambleCache::acquire(
+        *invocation, commandLine, filename, buffer.substr(0, preambleSize),
+        std::make_shared<clang::PCHContainerOperations>());
+}
+
+std::shared_ptr<const PreambleCache::Entry>
+CompletionEngine::acquireContext() const
+{
+    auto invocation = createInvocation(mContextCommandLine);
+    if (!invocation) return nullptr;
+    auto file = UnsavedFiles::get().read(mIncluder.filename);
+    if (!file) return nullptr;
+    const auto buffer = file->getBuffer().str();
+    const auto preambleSize = PreambleCache::computePreambleSize(buffer);
+    // The preamble of the unit, up to the line that includes the header. A
+    // header that is included further down gets the whole preamble, which
+    // the unit itself uses as well.
+    std::size_t end = preambleSize;
+    for (const auto &include :
+         IncludeGraph::scan(llvm::StringRef(buffer).substr(0, preambleSize)))
+    {
+        if (include.spelling != mIncluder.include) continue;
+        end = include.offset;
+        break;
+    }
+    // The header comes first, and has the ASTUnit's own preamble instead.
+    if (end == 0) return nullptr;
+    auto context =
+        PreambleCache::acquire(*invocation, mContextCommandLine,
+                               mIncluder.filename, buffer.substr(0, end),
+                               mPchOps);
+    if (!context) return nullptr;
+    // Its include guard would hide all of it.
+    const auto name = llvm::sys::path::filename(mFilename);
+    for (const auto &dependency : context->getDependencies())
+    {
+        if (llvm::sys::path::filename(dependency.path) == name &&
+            llvm::sys::fs::equivalent(dependency.path, mFilename))
+        {
+            return nullptr;
+        }
+    }
+    return context;
+}
+
+bool CompletionEngine::loadUnit(llvm::StringRef contents)
+{
+    mLocations.reset();
+    auto invocation = createInvocation(mCommandLine);
+    if (!invocation)
+    {
+        return false;
+    }
+    const auto buffer = contents.str();
+    const auto preambleSize = PreambleCache::computePreambleSize(buffer);
+    std::shared_ptr<const PreambleCache::Entry> preamble;
+    std::shared_ptr<const PreambleCache::Entry> context;
+    if (mContextCommandLine.empty())
+    {
+        preamble = PreambleCache::acquire(*invocation, mCommandLine, mFilename,
+                                          buffer.substr(0, preambleSize),
+                                          mPchOps);
+    }
+    else
+    {
+        context = acquireContext();
+    }
+    unsigned precompilePreambleAfterNParses = 2; /* bug, can't set to 1 */
+    if (context)
+    {
+        // The header is parsed after what the unit has before it. The
+        // ASTUnit can't have a preamble of its own on top of that, but the
+        // headers that the header includes mostly come from the context.
+        precompilePreambleAfterNParses = 0;
+        invocation->getPreprocessorOpts().ImplicitPCHInclude =
+            context->getPCHPath();
+    }
+    auto &ppOpts = invocation->getPreprocessorOpts();
+    if (preamble)
+    {
+        // The shared preamble takes the place of the preamble that the
+        // ASTUnit would otherwise build for itself. The preamble region of
+        // the main file is blanked out so that it is not parsed twice.
+        precompilePreambleAfterNParses = 0;
+        ppOpts.ImplicitPCHInclude = preamble->getPCHPath();
+        ppOpts.addRemappedFile(mFilename,
+                               llvm::MemoryBuffer::getMemBufferCopy(
+                                   PreambleCache::blankPreamble(buffer,
+                                                                preambleSize),
+                                   mFilename)
+                                   .release());
+    }
+    else
+    {
+        // The contents may be unsaved.
+        ppOpts.addRemappedFile(
+            mFilename,
+            llvm::MemoryBuffer::getMemBufferCopy(buffer, mFilename).release());
+    }
+    llvm::SmallVector<clang::ASTUnit::RemappedFile, 4> unsavedFiles;
+    addUnsavedFiles(mFilename, unsavedFiles);
+    for (const auto &file : unsavedFiles)
+    {
+        ppOpts.addRemappedFile(file.first, file.second);
+    }
+
+    // The bodies in the main file are where most of the references are that
+    // the LocationIndex has to find. The shared preamble, which is built
+    // with the same invocation, still goes without.
+    invocation->getFrontendOpts().SkipFunctionBodies = 0;
+    mInvocation.reset(invocation.release());
+    mUnit = clang::ASTUnit::LoadFromCompilerInvocation(
+        mInvocation, mPchOps, mDiags, mFileMgr.get(),
+        /*OnlyLocalDecls*/ false,
+        /*CaptureDiagnostics*/ false,
+        /*PrecompilePreambleAfterNParses*/ precompilePreambleAfterNParses,
+        /*TranslationUnitKind*/ clang::TU_Complete,
+        /*CacheCodeCompletionResults*/ true,
+        /*IncludeBriefCommentsInCodeCompletion*/ false,
+        /*UserFilesAreVolatile*/ true);
+    {
+        // The UI thread reads the preamble to mask the text buffer.
+        std::lock_guard<std::mutex> lock(mMethodMutex);
+        mPreamble = std::move(preamble);
+    }
+    mContext = std::move(context);
+    if (!mUnit)
+    {
+        return false;
+    }
+    if (!mPreamble && !mContext)
+    {
+        // Builds the ASTUnit's own preamble. A reparse replaces all of the
+        // remapped files, so they are given again.
+        llvm::SmallVector<clang::ASTUnit::RemappedFile, 4> remappedFiles;
+        remappedFiles.emplace_back(
+            mFilename,
+            llvm::MemoryBuffer::getMemBufferCopy(buffer, mFilename).release());
+        addUnsavedFiles(mFilename, remappedFiles);
+        if (mUnit->Reparse(mPchOps, remappedFiles)) return false;
+    }
+    mParsedPreamble = buffer.substr(0, preambleSize);
+    return true;
+}
+
+std::unique_ptr<llvm::MemoryBuffer>
+CompletionEngine::createMainBuffer(const std::string &contents) const
+{
+    if (mPreamble &&
+        contents.compare(0, mPreamble->getPreamble().size(),
+                         mPreamble->getPreamble()) == 0)
+    {
+        return llvm::MemoryBuffer::getMemBufferCopy(
+            PreambleCache::blankPreamble(contents,
+                                         mPreamble->getPreamble().size()),
+            mFilename);
+    }
+    // The preamble was edited. Everything still works because the headers
+    // in the shared preamble are guarded, but it's slower until the next
+    // reparse picks up a new shared preamble.
+    return llvm::MemoryBuffer::getMemBufferCopy(contents, mFilename);
+}
+
+unsigned CompletionEngine::complete(unsigned row, unsigned column,
+                                    TextBuffer::Snapshot snapshot,
+                                    std::string typed,
+                                    std::uint64_t requestTime)
+{
+    const auto generation = ++mGeneration;
+    MemoryBudget::get().touch(this);
+    WorkerPool::get().post(
+        this, WorkerPool::Priority::Interactive,
+        [ this, row, column, generation, snapshot = std::move(snapshot),
+          typed = std::move(typed), requestTime ]() mutable {
+            completionJob(row, column, snapshot, generation, std::move(typed),
+                          requestTime);
+        });
+    return generation;
+}
+
+void CompletionEngine::completionJob(unsigned row, unsigned column,
+                                     const TextBuffer::Snapshot &snapshot,
+                                     unsigned generation, std::string typed,
+                                     std::uint64_t requestTime)
+{
+    Metrics::record(*mMetrics, Metrics::Phase::Queue,
+                    Metrics::now() - requestTime);
+    // Under fast typing, the jobs of older requests are still queued when a
+    // new one comes in. Those are dropped without running clang at all.
+    if (isSuperseded(generation)) return;
+    // A view can be typed in without being activated, for instance when the
+    // unit was evicted in a clara-server.
+    if (mIsEvicted) restore();
+    // CodeComplete reparses the main file from the snapshot anyway, so the
+    // unit only has to be reparsed when its preamble can't be reused.
+    if (isPreambleStale(snapshot))
+    {
+        Trace::message(mId, "preamble is stale, reparsing");
+        Metrics::Timer timer(*mMetrics, Metrics::Phase::Reparse);
+        reparse(snapshot.maskedPrefix ? snapshot.getUnmaskedText()
+                                      : *snapshot.text);
+        if (isSuperseded(generation)) return;
+    }
+    mResults.clear();
+    mResultsTruncated = false;
+    mTyped = std::move(typed);
+    mJobGeneration = generation;
+    {
+        Trace::Scope scope(mId, "complete");
+        Metrics::Timer timer(*mMetrics, Metrics::Phase::Complete);
+        codeCompleteImpl(row, column, snapshot);
+    }
+    {
+        std::lock_guard<std::mutex> lock(mMethodMutex);
+        if (isSuperseded(generation))
+        {
+            mResults.clear();
+            return;
+        }
+        mCompletions.swap(mResults);
+        mCompletionsGeneration = generation;
+        mCompletionsTyped = mTyped;
+        mCompletionsTruncated = mResultsTruncated;
+    }
+    mResults.clear();
+    mCallbacks.onCompleted(generation, requestTime);
+}
+
+unsigned CompletionEngine::completeSignatures(unsigned row, unsigned column,
+                                              TextBuffer::Snapshot snapshot)
+{
+    const auto request = ++mSignatureRequest;
+    MemoryBudget::get().touch(this);
+    WorkerPool::get().post(
+        this, WorkerPool::Priority::Interactive,
+        [ this, row, column, snapshot = std::move(snapshot), request ]() {
+            signatureJob(row, column, snapshot, request);
+        });
+    return request;
+}
+
+void CompletionEngine::signatureJob(unsigned row, unsigned column,
+                                    const TextBuffer::Snapshot &snapshot,
+                                    unsigned request)
+{
+    // Typing a couple of arguments quickly queues a request for every comma.
+    if (request != mSignatureRequest.load()) return;
+    if (mIsEvicted) restore();
+    mSignatures.clear();
+    if (mUnit)
+    {
+        // No reparse, even with a stale preamble: the hints have to be
+        // quick, and the overloads of a call rarely depend on the includes
+        // that were just edited.
+        Trace::Scope scope(mId, "signatures");
+        mIsCollectingSignatures = true;
+        codeCompleteImpl(row, column, snapshot);
+        mIsCollectingSignatures = false;
+    }
+    std::vector<Signature> signatures;
+    signatures.swap(mSignatures);
+    mCallbacks.onSignatures(request, std::move(signatures));
+}
+
+unsigned CompletionEngine::lookUp(unsigned row, unsigned column)
+{
+    const auto request = ++mLookUpRequest;
+    MemoryBudget::get().touch(this);
+    WorkerPool::get().post(this, WorkerPool::Priority::Interactive,
+                           [this, row, column, request]() {
+                               lookUpJob(row, column, request);
+                           });
+    return request;
+}
+
+void CompletionEngine::lookUpJob(unsigned row, unsigned column,
+                                 unsigned request)
+{
+    // Hovering along a line queues a request for every word.
+    if (request != mLookUpRequest.load()) return;
+    if (mIsEvicted) restore();
+    Declaration declaration;
+    if (mUnit)
+    {
+        if (!mLocations)
+        {
+            Trace::Scope scope(mId, "index locations");
+            mLocations.reset(new LocationIndex(*mUnit));
+            Trace::message(mId, mLocations->size(), "locations");
+        }
+        Trace::Scope scope(mId, "look up");
+        declaration = mLocations->lookUp(row, column);
+    }
+    mCallbacks.onLookedUp(request, std::move(declaration));
+}
+
+void CompletionEngine::unsavedFileJob(const std::string &filename)
+{
+    // The edits of the main file itself come with every request.
+    if (!mUnit || filename == UnsavedFiles::normalize(mFilename)) return;
+    if (!includes(filename)) return;
+    Trace::message(mId, "an unsaved file changed:", filename);
+    auto buffer = UnsavedFiles::get().read(mFilename);
+    if (!buffer) return;
+    Metrics::Timer timer(*mMetrics, Metrics::Phase::Reparse);
+    reparse(buffer->getBuffer().str());
+}
+
+bool CompletionEngine::includes(const std::string &filename) const
+{
+    if (mPreamble) return mPreamble->includes(filename);
+    if (mContext && mContext->includes(filename)) return true;
+    // The ASTUnit's own preamble, if it has one, is in its SourceManager.
+    const auto *entry =
+        mUnit->getFileManager().getFile(filename, /*OpenFile*/ false);
+    return entry && mUnit->getSourceManager().translateFile(entry).isValid();
+}
+
+bool CompletionEngine::isPreambleStale(
+    const TextBuffer::Snapshot &snapshot) const
+{
+    if (!mUnit) return false;
+    const auto &text = *snapshot.text;
+    const auto preambleSize = PreambleCache::computePreambleSize(text);
+    llvm::StringRef preamble;
+    if (!snapshot.maskedPrefix)
+    {
+        preamble = llvm::StringRef(text).substr(0, preambleSize);
+    }
+    else if (preambleSize <= snapshot.maskedPrefix->size())
+    {
+        // The masked prefix reads as whitespace, so the preamble only ends
+        // beyond it when directives were added right after it.
+        preamble = *snapshot.maskedPrefix;
+    }
+    else
+    {
+        return true;
+    }
+    if (mContext && !mContext->isUpToDate()) return true;
+    // Without a shared preamble there is no list of dependencies. The ASTUnit
+    // checks those by itself, and just parses without its preamble when one
+    // of them changed.
+    if (!mPreamble) return preamble != mParsedPreamble;
+    return preamble != mPreamble->getPreamble() || !mPreamble->isUpToDate();
+}
+
+void CompletionEngine::codeCompleteImpl(unsigned row, unsigned column,
+                                        const TextBuffer::Snapshot &snapshot)
+{
+    using namespace clang;
+    using namespace clang::frontend;
+    if (!mUnit) return;
+    SmallVector<ASTUnit::RemappedFile, 4> remappedFiles;
+    std::unique_ptr<llvm::MemoryBuffer> memBuffer;
+    if (snapshot.maskedPrefix
+            ? mPreamble && *snapshot.maskedPrefix == mPreamble->getPreamble()
+            : !mPreamble)
+    {
+        // The common case: clang reads straight from the text buffer.
+        memBuffer = snapshot.getMemoryBuffer(mFilename);
+    }
+    else
+    {
+        // The snapshot was masked for a different preamble than the one of
+        // the current unit.
+        memBuffer = createMainBuffer(snapshot.getUnmaskedText());
+    }
+    remappedFiles.emplace_back(mFilename, memBuffer.get());
+    // Unlike a reparse, completion leaves the buffers to us.
+    std::vector<std::unique_ptr<llvm::MemoryBuffer>> unsavedBuffers;
+    for (const auto &file : UnsavedFiles::get().getFiles(mFilename))
+    {
+        unsavedBuffers.push_back(file.getMemoryBuffer());
+        remappedFiles.emplace_back(file.filename, unsavedBuffers.back().get());
+    }
+    LangOptions langOpts = mUnit->getLangOpts();
+    mDiags->Reset();
+    // IntrusiveRefCntPtr<SourceManager> sourceManager(
+    //     new SourceManager(*mDiags, *mFileMgr));
+    // Completion copies the invocation of the unit. Only the body that is
+    // completed in has to be parsed.
+    mInvocation->getFrontendOpts().SkipFunctionBodies = 1;
+    // The overloads don't need the macros and patterns.
+    mUnit->CodeComplete(mFilename, row, column, remappedFiles,
+                        includeMacros() && !mIsCollectingSignatures,
+                        includeCodePatterns() && !mIsCollectingSignatures,
+                        /*includeBriefComments()*/ false, *this, mPchOps,
+                        *mDiags, langOpts, *mSourceMgr, *mFileMgr, mStoredDiags,
+                        mOwnedBuffers);
+    mInvocation->getFrontendOpts().SkipFunctionBodies = 0;
+}
+
+void CompletionEngine::addPath(clang::CompilerInvocation *invocation,
+                               const std::string &path, bool isFramework)
+{
+    auto &headerSearchOpts = invocation->getHeaderSearchOpts();
+    headerSearchOpts.AddPath(path, clang::frontend::System, isFramework,
+                             /*ignoreSysRoot=*/false);
+}
+
+bool CompletionEngine::isSuperseded(unsigned generation) const
+{
+    return generation != mGeneration.load();
+}
+
+void CompletionEngine::cancel()
+{
+    // The running job notices this, and drops its results.
+    ++mGeneration;
+}
+
+bool CompletionEngine::isCompleting() const
+{
+    std::lock_guard<std::mutex> lock(mMethodMutex);
+    return mCompletionsGeneration != mGeneration;
+}
+
+bool CompletionEngine::filterCompletions(llvm::StringRef typed,
+                                         CompletionList &completions) const
+{
+    std::lock_guard<std::mutex> lock(mMethodMutex);
+    // Results that were cut off at the maximum are only complete for the
+    // exact text they were ranked with.
+    if (mCompletionsGeneration != mGeneration ||
+        !typed.startswith(mCompletionsTyped) ||
+        (mCompletionsTruncated && typed != mCompletionsTyped))
+    {
+        return false;
+    }
+    Metrics::Timer timer(*mMetrics, Metrics::Phase::Filter);
+    filter(mCompletions, typed, mMaxResults, completions);
+    Trace::message(mId, "returning", completions.size(), "of",
+                   mCompletions.size(), "cached completions");
+    return true;
+}
+
+bool CompletionEngine::copyCompletions(unsigned generation,
+                                       CompletionStore &completions,
+                                       bool &isTruncated) const
+{
+    std::lock_guard<std::mutex> lock(mMethodMutex);
+    if (mCompletionsGeneration != generation || isSuperseded(generation))
+    {
+        return false;
+    }
+    completions = mCompletions;
+    isTruncated = mCompletionsTruncated;
+    return true;
+}
+
+void CompletionEngine::filter(const CompletionStore &store,
+                              llvm::StringRef typed, std::size_t maxResults,
+                              CompletionList &completions)
+{
+    const FuzzyMatcher matcher(typed);
+    std::vector<std::pair<int, unsigned>> ranking;
+    ranking.reserve(store.size());
+    for (unsigned i = 0; i < store.size(); ++i)
+    {
+        int score;
+        if (matcher.match(store.getName(i), score))
+        {
+            ranking.emplace_back(combineScores(score, store.getPriority(i)), i);
+        }
+    }
+    selectBest(ranking, maxResults);
+    std::size_t bytes = 0;
+    for (const auto &ranked : ranking)
+    {
+        // Leave some room for the placeholder numbers.
+        bytes += store.getDisplay(ranked.second).size() +
+                 store.getSnippet(ranked.second).size() + 16;
+    }
+    completions.reserve(ranking.size(), bytes);
+    std::string snippet;
+    for (const auto &ranked : ranking)
+    {
+        snippet.clear();
+        CompletionStore::renderSnippet(store.getSnippet(ranked.second),
+                                       snippet);
+        completions.add(store.getDisplay(ranked.second), snippet);
+    }
+}
+
+clang::CodeCompletionAllocator &CompletionEngine::getAllocator()
+{
+    return mCCTUInfo.getAllocator();
+}
+
+clang::CodeCompletionTUInfo &CompletionEngine::getCodeCompletionTUInfo()
+{
+    return mCCTUInfo;
+}
+
+void CompletionEngine::ProcessCodeCompleteResults(
+    clang::Sema &sema, clang::CodeCompletionContext context,
+    clang::CodeCompletionResult *results, unsigned numResults)
+{
+    if (mIsCollectingSignatures) return;
+    // Clear the list, from other runs.
+    mResults.clear();
+    // Clang offers no way to abort the parse itself, but ranking and
+    // building the strings is skipped for a request that was superseded.
+    if (isSuperseded(mJobGeneration)) return;
+
+    // Global completions easily produce tens of thousands of results. Rank
+    // them by their names first, and only build the completion strings of
+    // the ones that are actually shown.
+    const auto rankTime = Metrics::now();
+    const FuzzyMatcher matcher(mTyped);
+    std::vector<std::pair<int, unsigned>> ranking;
+    ranking.reserve(numResults);
+    std::string name;
+    for (unsigned i = 0; i < numResults; ++i)
+    {
+        if (results[i].Availability == CXAvailability_NotAvailable ||
+            results[i].Availability == CXAvailability_NotAccessible)
+        {
+            continue;
+        }
+        int score;
+        if (matcher.match(getTypedText(results[i], name), score))
+        {
+            ranking.emplace_back(combineScores(score, results[i].Priority), i);
+        }
+    }
+    mResultsTruncated = ranking.size() > mMaxResults;
+    selectBest(ranking, mMaxResults);
+
+    const auto stringsTime = Metrics::now();
+    Metrics::record(*mMetrics, Metrics::Phase::Rank, stringsTime - rankTime);
+    for (const auto &ranked : ranking)
+    {
+        ProcessCodeCompleteResult(sema, context, results[ranked.second]);
+    }
+    Metrics::record(*mMetrics, Metrics::Phase::Strings,
+                    Metrics::now() - stringsTime);
+}
+
+void CompletionEngine::ProcessOverloadCandidates(
+    clang::Sema &sema, unsigned currentArg,
+    clang::CodeCompleteConsumer::OverloadCandidate *candidates,
+    unsigned numCandidates)
+{
+    // Only signature requests want them. Among the completions, they could
+    // not show which parameter is next.
+    if (!mIsCollectingSignatures) return;
+    for (unsigned i = 0; i < numCandidates; ++i)
+    {
+        const auto *ccs = candidates[i].CreateSignatureString(
+            currentArg, sema, getAllocator(), mCCTUInfo,
+            includeBriefComments());
+        if (!ccs) continue;
+        Signature signature;
+        appendSignature(*ccs, signature);
+        if (const auto *comment = ccs->getBriefComment())
+        {
+            signature.documentation = comment;
+        }
+        mSignatures.push_back(std::move(signature));
+    }
+}
+
+void CompletionEngine::ProcessCodeCompleteResult(
+    clang::Sema &sema, clang::CodeCompletionContext context,
+    clang::CodeCompletionResult &result)
+{
+    using namespace clang;
+
+    // The scratch strings keep their capacity from one result to the next.
+    auto &first = mFirst;
+    auto &second = mSecond;
+    auto &informative = mInformative;
+    first.clear();
+    second.clear();
+    informative.clear();
+
+    switch (result.Kind)
+    {
+    case CodeCompletionResult::RK_Declaration:
+    {
+        auto completion = result.CreateCodeCompletionString(
+            sema, context, getAllocator(), mCCTUInfo, includeBriefComments());
+        if (completion == nullptr)
+        {
+            second = result.Declaration->getNameAsString();
+            first = second;
+            first += "\t[DECL]";
+        }
+        else
+        {
+            ProcessCodeCompleteString(*completion, first, second, informative);
+            if (informative.empty()) informative = "[DECL]";
+        }
+        break;
+    }
+
+    case CodeCompletionResult::RK_Keyword:
+        second = result.Keyword;
+        first = second;
+        first += "\t[KEYWORD]";
+        break;
+
+    case CodeCompletionResult::RK_Macro:
+    {
+        auto completion = result.CreateCodeCompletionString(
+            sema, context, getAllocator(), mCCTUInfo, includeBriefComments());
+        if (completion == nullptr)
+        {
+            second = result.Macro->getNameStart();
+            first = second;
+            first += "\t[MACRO]";
+        }
+        else
+        {
+            ProcessCodeCompleteString(*completion, first, second, informative);
+            if (informative.empty()) informative = "[MACRO]";
+        }
+        break;
+    }
+
+    case CodeCompletionResult::RK_Pattern:
+    {
+        auto completion = result.CreateCodeCompletionString(
+            sema, context, getAllocator(), mCCTUInfo, includeBriefComments());
+        if (completion == nullptr)
+        {
+            second = result.Macro->getNameStart();
+            first = second;
+            first += "\t[PATTERN]";
+        }
+        else
+        {
+            ProcessCodeCompleteString(*completion, first, second, informative);
+            // FIXME: For some reason, clang reports macro's as patterns ?!
+            // Let's not confuse the user and just not put this informational
+            // banner in the completion widget.
+            // if (informative.empty()) informative = "[PATTERN]";
+        }
+        break;
+    }
+    }
+
+    if (!informative.empty())
+    {
+        first += "\t";
+        first += informative;
+    }
+
+    std::string name;
+    mResults.add(getTypedText(result, name), first, second, result.Priority);
+}
+
+void CompletionEngine::ProcessCodeCompleteString(
+    const clang::CodeCompletionString &ccs, std::string &first,
+    std::string &second, std::string &informative) const
+{
+    using namespace clang;
+
+    for (unsigned j = 0; j < ccs.getAnnotationCount(); ++j)
+    {
+        const char *annotation = ccs.getAnnotation(j);
+        informative += annotation;
+        if (j != ccs.getAnnotationCount() - 1) informative += ' ';
+    }
+
+    llvm::StringRef resultType;
+    for (const auto &chunk : ccs)
+    {
+        switch (chunk.Kind)
+        {
+        case CodeCompletionString::CK_TypedText:
+            // The piece of text that the user is expected to type to match the
+            // code-completion string,
+            // typically a keyword or the name of a declarator or macro.
+            first += chunk.Text;
+            second += chunk.Text;
+            break;
+        case CodeCompletionString::CK_Text:
+            // A piece of text that should be placed in the buffer,
+            // e.g., parentheses or a comma in a function call.
+            informative += chunk.Text;
+            second += chunk.Text;
+            break;
+        case CodeCompletionString::CK_Optional:
+            // A code completion string that is entirely optional.
+            // For example, an optional code completion string that
+            // describes the default arguments in a function call.
+            // if (includeOptionalArguments)
+            // {
+            //     ProcessCodeCompleteString(*chunk.Optional, first, second,
+            //                               informative);
+            // }
+            break;
+        case CodeCompletionString::CK_Placeholder:
+            // A string that acts as a placeholder for, e.g., a function call
+            // argument.
+            second += CompletionStore::placeholderBegin;
+            // Try to ignore leading underscores for standard library function
+            // arguments. This makes the completions cleaner.
+            if (strncmp("__", chunk.Text, 2) == 0)
+            {
+                informative += (chunk.Text + 2);
+                second += (chunk.Text + 2);
+            }
+            else
+            {
+                informative += chunk.Text;
+                second += chunk.Text;
+            }
+            second += CompletionStore::placeholderEnd;
+            break;
+        case CodeCompletionString::CK_Informative:
+            // A piece of text that describes something about the result
+            // but should not be inserted into the buffer.
+            informative += chunk.Text;
+            break;
+        case CodeCompletionString::CK_ResultType:
+            // A piece of text that describes the type of an entity or,
+            // for functions and methods, the return type.
+            resultType = chunk.Text;
+            // informative += chunk.Text;
+            // informative += " -> ";
+            break;
+        case CodeCompletionString::CK_CurrentParameter:
+            // A piece of text that describes the parameter that corresponds to
+            // the code-completion location within a function call, message
+            // send,
+            // macro invocation, etc.
+            second += CompletionStore::placeholderBegin;
+            // Try to ignore leading underscores for standard library function
+            // arguments. This makes the completions cleaner.
+            if (strncmp("__", chunk.Text, 2) == 0)
+            {
+                informative += (chunk.Text + 2);
+                second += (chunk.Text + 2);
+            }
+            else
+            {
+                informative += chunk.Text;
+                second += chunk.Text;
+            }
+            second += CompletionStore::placeholderEnd;
+            break;
+        case CodeCompletionString::CK_LeftParen:
+            // A left parenthesis ('(').
+            informative += chunk.Text;
+            second += chunk.Text;
+            break;
+        case CodeCompletionString::CK_RightParen:
+            // A right parenthesis (')').
+            informative += chunk.Text;
+            second += chunk.Text;
+            break;
+        case CodeCompletionString::CK_LeftBracket:
+            // A left bracket ('[').
+            informative += chunk.Text;
+            second += chunk.Text;
+            break;
+        case CodeCompletionString::CK_RightBracket:
+            // A right bracket (']').
+            informative += chunk.Text;
+            second += chunk.Text;
+            break;
+        case CodeCompletionString::CK_LeftBrace:
+            // A left brace ('{').
+            informative += chunk.Text;
+            second += chunk.Text;
+            break;
+        case CodeCompletionString::CK_RightBrace:
+            // A right brace ('}').
+            informative += chunk.Text;
+            second += chunk.Text;
+            break;
+        case CodeCompletionString::CK_LeftAngle:
+            // A left angle bracket ('<').
+            informative += chunk.Text;
+            second += chunk.Text;
+            break;
+        case CodeCompletionString::CK_RightAngle:
+            // A right angle bracket ('>').
+            informative += chunk.Text;
+            second += chunk.Text;
+            break;
+        case CodeCompletionString::CK_Comma:
+            // A comma separator (',').
+            informative += chunk.Text;
+            second += chunk.Text;
+            break;
+        case CodeCompletionString::CK_Colon:
+            // A colon (':').
+            informative += chunk.Text;
+            second += chunk.Text;
+            break;
+        case CodeCompletionString::CK_SemiColon:
+            // A semicolon (';').
+            informative += chunk.Text;
+            second += chunk.Text;
+            break;
+        case CodeCompletionString::CK_Equal:
+            // An '=' sign.
+            informative += chunk.Text;
+            second += chunk.Text;
+            break;
+        case CodeCompletionString::CK_HorizontalSpace:
+            // Horizontal whitespace (' ').
+            informative += chunk.Text;
+            second += chunk.Text;
+            break;
+        case CodeCompletionString::CK_VerticalSpace:
+            // Vertical whitespace ('\n' or '\r\n', depending on the platform).
+            informative += chunk.Text;
+            second += chunk.Text;
+            break;
+        }
+    }
+    if (first.empty() == false && first.find('~') != std::string::npos)
+    {
+        informative = "[DESTR]";
+    }
+    else if (resultType.empty() == false)
+    {
+        if (informative == "()")
+        {
+            informative = "(void) -> ";
+        }
+        else if (informative.find('(') != std::string::npos &&
+                 informative.find(')') != std::string::npos)
+        {
+            informative += " -> ";
+        }
+        informative.append(resultType.data(), resultType.size());
+    }
+    if (ccs.getBriefComment() != nullptr)
+    {
+        informative += " : ";
+        informative += ccs.getBriefComment();
+    }
+}
+
+void CompletionEngine::reparse(const std::string &contents)
+{
+    if (!mUnit) return;
+    Trace::Scope scope(mId, "reparse");
+    mLocations.reset();
+    beginDiagnostics();
+    const auto preambleSize = PreambleCache::computePreambleSize(contents);
+    if ((mContext && !mContext->isUpToDate()) ||
+        (mPreamble &&
+         (contents.compare(0, preambleSize, mPreamble->getPreamble()) != 0 ||
+          !mPreamble->isUpToDate())))
+    {
+        // The includes changed, or one of the included files did, so we need
+        // a different shared preamble.
+        if (!loadUnit(contents))
+        {
+            Trace::message(mId, "failed to reload", mFilename);
+            publishDiagnostics();
+            updateFootprint();
+            return;
+        }
+    }
+    else
+    {
+        // The ASTUnit owns the remapped buffers. Once the unit has a
+        // preamble, a single reparse rebuilds it when it is out of date,
+        // which includes an unsaved file that was edited.
+        llvm::SmallVector<clang::ASTUnit::RemappedFile, 4> remappedFiles;
+        remappedFiles.emplace_back(mFilename,
+                                   createMainBuffer(contents).release());
+        addUnsavedFiles(mFilename, remappedFiles);
+        mUnit->Reparse(mPchOps, remappedFiles);
+        if (!mPreamble) mParsedPreamble = contents.substr(0, preambleSize);
+    }
+    publishDiagnostics();
+    mIsLoaded.store(true);
+    updateFootprint();
+    Trace::message(mId, "done reparsing");
+}
+
+void CompletionEngine::HandleDiagnostic(clang::DiagnosticsEngine::Level level,
+                                        const clang::Diagnostic &info)
+{
+    clang::DiagnosticConsumer::HandleDiagnostic(level, info);
+    if (mIsCollectingDiagnostics) collectDiagnostic(level, info);
+    if (!Trace::isEnabled()) return;
+    // if (!mSourceMgr->isInMainFile(info.getLocation()))
+    // {
+    //     // not interested in diagnostics that are somewhere outside of the
+    //     // file that we're looking at.
+    //     return;
+    // }
+    const auto loc = mSourceMgr->getPresumedLoc(info.getLocation());
+    llvm::SmallString<256> text;
+    llvm::raw_svector_ostream stream(text);
+    if (loc.isValid())
+    {
+        stream << loc.getFilename() << ":" << loc.getLine() << ":"
+               << loc.getColumn() << ": ";
+    }
+    else
+    {
+        stream << "<unknown>: ";
+    }
+    llvm::SmallString<128> message;
+    info.FormatDiagnostic(message);
+    stream << message;
+    Trace::message(mId, stream.str());
+}
+
+void CompletionEngine::collectDiagnostic(clang::DiagnosticsEngine::Level level,
+                                         const clang::Diagnostic &info)
+{
+    using namespace clang;
+    if (level < DiagnosticsEngine::Warning) return;
+    const bool isError = level >= DiagnosticsEngine::Error;
+    if (!info.hasSourceManager() || !info.getLocation().isValid())
+    {
+        mDiagnostics.addElsewhere(isError);
+        return;
+    }
+    const auto &sourceManager = info.getSourceManager();
+    const auto location = sourceManager.getExpansionLoc(info.getLocation());
+    if (!sourceManager.isInMainFile(location))
+    {
+        // Included files can produce thousands of diagnostics that nobody
+        // looks at, so they are not even formatted.
+        mDiagnostics.addElsewhere(isError);
+        return;
+    }
+    const auto decomposed = sourceManager.getDecomposedLoc(location);
+    bool isInvalid = false;
+    const auto text = sourceManager.getBufferData(decomposed.first, &isInvalid);
+    if (isInvalid) return;
+    const auto offset = decomposed.second;
+    const auto row =
+        sourceManager.getLineNumber(decomposed.first, offset, &isInvalid) - 1;
+    const auto lineStart =
+        offset -
+        (sourceManager.getColumnNumber(decomposed.first, offset, &isInvalid) -
+         1);
+    if (isInvalid) return;
+    // Sublime counts columns in code points, clang counts them in bytes.
+    const auto column =
+        TextBuffer::countCharacters(text.slice(lineStart, offset));
+    // Underline the token at the location, but don't run past the line.
+    const auto length =
+        Lexer::MeasureTokenLength(location, sourceManager, mLangOpts);
+    auto end = std::min<std::size_t>(offset + std::max(length, 1u),
+                                     text.size());
+    end = std::min(end, text.find_first_of("\r\n", offset));
+    const auto endColumn =
+        column + TextBuffer::countCharacters(text.slice(offset, end));
+    llvm::SmallString<128> message;
+    info.FormatDiagnostic(message);
+    mDiagnostics.add(isError, row, column, row, endColumn, message);
+}
+
+void CompletionEngine::beginDiagnostics()
+{
+    mDiagnostics.clear();
+    mIsCollectingDiagnostics = true;
+}
+
+void CompletionEngine::publishDiagnostics()
+{
+    mIsCollectingDiagnostics = false;
+    auto diagnostics = std::move(mDiagnostics);
+    mDiagnostics.clear();
+    mCallbacks.onDiagnostics(std::move(diagnostics));
+}
+
+void CompletionEngine::BeginSourceFile(const clang::LangOptions &options,
+                                       const clang::Preprocessor *pp)
+{
+    clang::DiagnosticConsumer::BeginSourceFile(options, pp);
+    // For measuring the tokens that diagnostics point at.
+    mLangOpts = options;
+    Trace::message(mId, "--- BEGIN DIAGNOSTICS ---");
+}
+void CompletionEngine::EndSourceFile()
+{
+    clang::DiagnosticConsumer::EndSourceFile();
+    Trace::message(mId, "--- END DIAGNOSTICS ---");
+}
+void CompletionEngine::finish()
+{
+    clang::DiagnosticConsumer::finish();
+    Trace::message(mId, "finished diagnostics");
+}
+
+} // Clara
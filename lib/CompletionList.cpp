@@ -0,0 +1,36 @@
+#include "CompletionList.hpp"
+
+namespace Clara
+{
+
+void CompletionList::reserve(std::size_t count, std::size_t bytes)
+{
+    mItems.reserve(count);
+    mBytes.reserve(bytes);
+}
+
+void CompletionList::add(llvm::StringRef display, llvm::StringRef snippet)
+{
+    Item item;
+    item.offset = static_cast<std::uint32_t>(mBytes.size());
+    item.displayLength = static_cast<std::uint32_t>(display.size());
+    item.snippetLength = static_cast<std::uint32_t>(snippet.size());
+    mBytes.append(display.data(), display.size());
+    mBytes.append(snippet.data(), snippet.size());
+    mItems.push_back(item);
+}
+
+llvm::StringRef CompletionList::getDisplay(std::size_t index) const
+{
+    const auto &item = mItems[index];
+    return llvm::StringRef(mBytes.data() + item.offset, item.displayLength);
+}
+
+llvm::StringRef CompletionList::getSnippet(std::size_t index) const
+{
+    const auto &item = mItems[index];
+    return llvm::StringRef(mBytes.data() + item.offset + item.displayLength,
+                           item.snippetLength);
+}
+
+} // Clara
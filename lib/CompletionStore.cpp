@@ -0,0 +1,98 @@
+#include "CompletionStore.hpp"
+#include <algorithm>
+
+namespace Clara
+{
+
+namespace
+{
+
+void appendNumber(std::string &result, unsigned number)
+{
+    char digits[10];
+    unsigned count = 0;
+    do
+    {
+        digits[count++] = static_cast<char>('0' + number % 10);
+        number /= 10;
+    } while (number != 0);
+    while (count != 0) result += digits[--count];
+}
+
+} // anonymous namespace
+
+void CompletionStore::clear()
+{
+    mBytes.clear();
+    mRecords.clear();
+}
+
+void CompletionStore::swap(CompletionStore &other)
+{
+    mBytes.swap(other.mBytes);
+    mRecords.swap(other.mRecords);
+}
+
+void CompletionStore::add(llvm::StringRef name, llvm::StringRef display,
+                          llvm::StringRef snippet, unsigned priority)
+{
+    Record record;
+    record.offset = static_cast<std::uint32_t>(mBytes.size());
+    record.nameLength = static_cast<std::uint32_t>(name.size());
+    record.displayLength = static_cast<std::uint32_t>(display.size());
+    record.snippetLength = static_cast<std::uint32_t>(snippet.size());
+    record.priority = priority;
+    mBytes.insert(mBytes.end(), name.begin(), name.end());
+    mBytes.insert(mBytes.end(), display.begin(), display.end());
+    mBytes.insert(mBytes.end(), snippet.begin(), snippet.end());
+    mRecords.push_back(record);
+}
+
+llvm::StringRef CompletionStore::getName(std::size_t index) const
+{
+    const auto &record = mRecords[index];
+    return llvm::StringRef(mBytes.data() + record.offset, record.nameLength);
+}
+
+llvm::StringRef CompletionStore::getDisplay(std::size_t index) const
+{
+    const auto &record = mRecords[index];
+    return llvm::StringRef(mBytes.data() + record.offset + record.nameLength,
+                           record.displayLength);
+}
+
+llvm::StringRef CompletionStore::getSnippet(std::size_t index) const
+{
+    const auto &record = mRecords[index];
+    return llvm::StringRef(mBytes.data() + record.offset + record.nameLength +
+                               record.displayLength,
+                           record.snippetLength);
+}
+
+void CompletionStore::renderSnippet(llvm::StringRef snippet,
+                                    std::string &result)
+{
+    const char delimiters[] = {placeholderBegin, placeholderEnd};
+    const llvm::StringRef delimiterSet(delimiters, sizeof(delimiters));
+    unsigned placeholders = 0;
+    while (!snippet.empty())
+    {
+        const auto pos = snippet.find_first_of(delimiterSet);
+        result.append(snippet.data(), std::min(pos, snippet.size()));
+        if (pos == llvm::StringRef::npos) break;
+        if (snippet[pos] == placeholderBegin)
+        {
+            result += "${";
+            appendNumber(result, ++placeholders);
+            result += ':';
+        }
+        else
+        {
+            result += '}';
+        }
+        snippet = snippet.drop_front(pos + 1);
+    }
+    if (placeholders > 0) result += "$0";
+}
+
+} // Clara
@@ -0,0 +1,79 @@
+#include "DiagnosticList.hpp"
+
+namespace Clara
+{
+
+void DiagnosticList::clear()
+{
+    mMessages.clear();
+    mItems.clear();
+    mErrorCount = 0;
+    mElsewhereErrorCount = 0;
+    mElsewhereWarningCount = 0;
+}
+
+void DiagnosticList::add(bool isError, unsigned row, unsigned column,
+                         unsigned endRow, unsigned endColumn,
+                         llvm::StringRef message)
+{
+    Item item;
+    item.isError = isError;
+    item.row = row;
+    item.column = column;
+    item.endRow = endRow;
+    item.endColumn = endColumn;
+    item.offset = static_cast<std::uint32_t>(mMessages.size());
+    item.length = static_cast<std::uint32_t>(message.size());
+    mMessages.append(message.data(), message.size());
+    mItems.push_back(item);
+    if (isError) ++mErrorCount;
+}
+
+void DiagnosticList::addElsewhere(bool isError)
+{
+    if (isError)
+    {
+        ++mElsewhereErrorCount;
+    }
+    else
+    {
+        ++mElsewhereWarningCount;
+    }
+}
+
+DiagnosticList::Range DiagnosticList::getRange(std::size_t index) const
+{
+    const auto &item = mItems[index];
+    return std::make_tuple(item.row, item.column, item.endRow, item.endColumn);
+}
+
+llvm::StringRef DiagnosticList::getMessage(std::size_t index) const
+{
+    const auto &item = mItems[index];
+    return llvm::StringRef(mMessages.data() + item.offset, item.length);
+}
+
+std::vector<unsigned> DiagnosticList::getIndicesInRows(unsigned firstRow,
+                                                       unsigned lastRow) const
+{
+    std::vector<unsigned> result;
+    for (unsigned i = 0; i < mItems.size(); ++i)
+    {
+        if (mItems[i].row >= firstRow && mItems[i].row <= lastRow)
+        {
+            result.push_back(i);
+        }
+    }
+    return result;
+}
+
+std::tuple<unsigned, unsigned, unsigned, unsigned>
+DiagnosticList::getCounts() const
+{
+    const auto warningCount =
+        static_cast<unsigned>(mItems.size()) - mErrorCount;
+    return std::make_tuple(mErrorCount, warningCount, mElsewhereErrorCount,
+                           mElsewhereWarningCount);
+}
+
+} // Clara
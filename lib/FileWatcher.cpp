@@ -0,0 +1,214 @@
+#include "FileWatcher.hpp"
+#include <algorithm>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Path.h>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+
+// How long a file has to be left alone before its change is reported.
+const std::chrono::milliseconds quietPeriod(500);
+
+// How often polled files are checked.
+const std::chrono::milliseconds pollInterval(2000);
+
+void getStatus(const std::string &path, long long &modificationTime,
+               unsigned long long &size)
+{
+    llvm::sys::fs::file_status status;
+    if (llvm::sys::fs::status(path, status))
+    {
+        modificationTime = 0;
+        size = 0;
+        return;
+    }
+    modificationTime = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                           status.getLastModificationTime().time_since_epoch())
+                           .count();
+    size = status.getSize();
+}
+
+} // anonymous namespace
+
+namespace Clara
+{
+
+FileWatcher &FileWatcher::get()
+{
+    // Intentionally leaked, for the same reason as the WorkerPool.
+    static auto *watcher = new FileWatcher();
+    return *watcher;
+}
+
+unsigned FileWatcher::watch(std::string path, Callback callback)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    Watch watch;
+    watch.filename = llvm::sys::path::filename(path).str();
+    watch.callback = std::move(callback);
+    getStatus(path, watch.modificationTime, watch.size);
+#ifdef __linux__
+    if (mInotify == -1) mInotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (mInotify != -1)
+    {
+        // Watch the directory, because build tools often write a new file
+        // and rename it over the old one.
+        const auto directory = llvm::sys::path::parent_path(path).str();
+        watch.descriptor = inotify_add_watch(
+            mInotify, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+    }
+#endif
+    watch.path = std::move(path);
+    const auto id = mNextId++;
+    mWatches.emplace(id, std::move(watch));
+    if (!mIsRunning)
+    {
+        mIsRunning = true;
+        std::thread(&FileWatcher::run, this).detach();
+    }
+    return id;
+}
+
+void FileWatcher::unwatch(unsigned id)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    const auto findResult = mWatches.find(id);
+    if (findResult == mWatches.end()) return;
+    const auto descriptor = findResult->second.descriptor;
+    mWatches.erase(findResult);
+#ifdef __linux__
+    if (descriptor == -1) return;
+    // inotify hands out one descriptor per directory.
+    for (const auto &watch : mWatches)
+    {
+        if (watch.second.descriptor == descriptor) return;
+    }
+    inotify_rm_watch(mInotify, descriptor);
+#endif
+}
+
+void FileWatcher::markPending(Watch &watch)
+{
+    watch.isPending = true;
+    watch.deadline = std::chrono::steady_clock::now() + quietPeriod;
+}
+
+void FileWatcher::run()
+{
+    while (true)
+    {
+        std::vector<Callback> callbacks;
+        auto timeout = pollInterval;
+        int inotify;
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            inotify = mInotify;
+            const auto now = std::chrono::steady_clock::now();
+            for (auto &entry : mWatches)
+            {
+                auto &watch = entry.second;
+                if (!watch.isPending) continue;
+                if (watch.deadline <= now)
+                {
+                    watch.isPending = false;
+                    callbacks.push_back(watch.callback);
+                }
+                else
+                {
+                    timeout = std::min(
+                        timeout,
+                        std::chrono::duration_cast<std::chrono::milliseconds>(
+                            watch.deadline - now) +
+                            std::chrono::milliseconds(1));
+                }
+            }
+        }
+        for (const auto &callback : callbacks)
+        {
+            try
+            {
+                callback();
+            }
+            catch (...)
+            {
+                // A failing callback must not take the watcher down with it.
+            }
+        }
+        if (!callbacks.empty()) continue;
+#ifdef __linux__
+        if (inotify != -1)
+        {
+            pollfd descriptor{inotify, POLLIN, 0};
+            if (poll(&descriptor, 1, static_cast<int>(timeout.count())) > 0)
+            {
+                readEvents();
+            }
+        }
+        else
+#endif
+        {
+            std::this_thread::sleep_for(timeout);
+        }
+        pollFiles();
+    }
+}
+
+void FileWatcher::readEvents()
+{
+#ifdef __linux__
+    alignas(inotify_event) char buffer[4096];
+    while (true)
+    {
+        const auto length = read(mInotify, buffer, sizeof(buffer));
+        if (length <= 0) return;
+        std::lock_guard<std::mutex> lock(mMutex);
+        for (const char *pos = buffer; pos < buffer + length;)
+        {
+            const auto *event = reinterpret_cast<const inotify_event *>(pos);
+            pos += sizeof(inotify_event) + event->len;
+            for (auto &entry : mWatches)
+            {
+                auto &watch = entry.second;
+                if (watch.descriptor == -1) continue;
+                // After an overflow, any file may have changed.
+                if ((event->mask & IN_Q_OVERFLOW) ||
+                    (event->wd == watch.descriptor && event->len > 0 &&
+                     watch.filename == event->name))
+                {
+                    markPending(watch);
+                }
+            }
+        }
+    }
+#endif
+}
+
+void FileWatcher::pollFiles()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    for (auto &entry : mWatches)
+    {
+        auto &watch = entry.second;
+        if (watch.descriptor != -1) continue;
+        long long modificationTime;
+        unsigned long long size;
+        getStatus(watch.path, modificationTime, size);
+        if (modificationTime == watch.modificationTime && size == watch.size)
+        {
+            continue;
+        }
+        watch.modificationTime = modificationTime;
+        watch.size = size;
+        markPending(watch);
+    }
+}
+
+} // Clara
@@ -0,0 +1,108 @@
+#include "FuzzyMatcher.hpp"
+#include <algorithm>
+#include <cctype>
+#include <llvm/Support/MathExtras.h>
+
+#if defined(__SSE2__) || defined(_M_X64) ||                                    \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define CLARA_FUZZYMATCHER_SSE2 1
+#include <emmintrin.h>
+#endif
+
+namespace Clara
+{
+
+namespace
+{
+
+// Returns the first occurrence of either lower or upper, or end.
+const char *findEither(const char *begin, const char *end, char lower,
+                       char upper)
+{
+#ifdef CLARA_FUZZYMATCHER_SSE2
+    const auto lowerVector = _mm_set1_epi8(lower);
+    const auto upperVector = _mm_set1_epi8(upper);
+    while (end - begin >= 16)
+    {
+        const auto chunk =
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(begin));
+        const auto equal = _mm_or_si128(_mm_cmpeq_epi8(chunk, lowerVector),
+                                        _mm_cmpeq_epi8(chunk, upperVector));
+        const auto mask = static_cast<unsigned>(_mm_movemask_epi8(equal));
+        if (mask != 0) return begin + llvm::countTrailingZeros(mask);
+        begin += 16;
+    }
+#endif
+    for (; begin != end; ++begin)
+    {
+        if (*begin == lower || *begin == upper) return begin;
+    }
+    return end;
+}
+
+bool isLower(char c) { return std::islower(static_cast<unsigned char>(c)); }
+bool isUpper(char c) { return std::isupper(static_cast<unsigned char>(c)); }
+bool isAlnum(char c) { return std::isalnum(static_cast<unsigned char>(c)); }
+
+// Returns true if a word starts at the given position, as in "get_value" or
+// "getValue".
+bool isWordStart(llvm::StringRef candidate, std::size_t pos)
+{
+    if (pos == 0) return true;
+    const auto previous = candidate[pos - 1];
+    const auto current = candidate[pos];
+    if (!isAlnum(previous)) return true;
+    return isLower(previous) && isUpper(current);
+}
+
+} // namespace
+
+FuzzyMatcher::FuzzyMatcher(llvm::StringRef pattern)
+    : mLower(pattern.lower()), mUpper(pattern.upper())
+{
+}
+
+bool FuzzyMatcher::match(llvm::StringRef candidate, int &score) const
+{
+    score = 0;
+    if (mLower.empty()) return true;
+    if (candidate.size() < mLower.size()) return false;
+    const char *begin = candidate.data();
+    const char *end = begin + candidate.size();
+    const char *pos = begin;
+    std::size_t previous = 0;
+    for (std::size_t i = 0; i < mLower.size(); ++i)
+    {
+        pos = findEither(pos, end, mLower[i], mUpper[i]);
+        if (pos == end) return false;
+        const auto index = static_cast<std::size_t>(pos - begin);
+        score += 1;
+        if (index == 0)
+        {
+            score += 8;
+        }
+        else if (isWordStart(candidate, index))
+        {
+            score += 6;
+        }
+        if (i > 0 && index == previous + 1)
+        {
+            score += 4;
+        }
+        else
+        {
+            // Gaps cost a little, but a long gap is not much worse than a
+            // short one.
+            const auto gap = i == 0 ? index : index - previous - 1;
+            score -= static_cast<int>(std::min<std::size_t>(gap, 3));
+        }
+        previous = index;
+        ++pos;
+    }
+    // Among equal matches, prefer the shorter candidate.
+    score -= static_cast<int>(
+        std::min<std::size_t>(candidate.size() - mLower.size(), 7) / 4);
+    return true;
+}
+
+} // Clara
@@ -0,0 +1,476 @@
+#include "IncludeGraph.hpp"
+#include "Trace.hpp"
+#include <algorithm>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <map>
+#include <tuple>
+#include <unordered_set>
+
+namespace
+{
+
+// Marks the unit that a header borrows in the header's command. It is not a
+// clang option; the CompletionEngine takes it out again.
+const char *const contextOption = "-clara-include-context";
+
+bool isHorizontalSpace(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\f' || c == '\v';
+}
+
+bool isIdentifierChar(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+           (c >= '0' && c <= '9') || c == '_';
+}
+
+// Returns the position right after a string or character literal that
+// starts at pos.
+std::size_t skipLiteral(llvm::StringRef text, std::size_t pos)
+{
+    const char quote = text[pos];
+    if (quote == '"' && pos > 0 && text[pos - 1] == 'R')
+    {
+        // A raw string literal, which may span lines.
+        const auto open = text.find('(', pos);
+        if (open == llvm::StringRef::npos) return text.size();
+        const auto close = (")" + text.slice(pos + 1, open) + "\"").str();
+        const auto end = text.find(close, open);
+        return end == llvm::StringRef::npos ? text.size() : end + close.size();
+    }
+    for (++pos; pos < text.size(); ++pos)
+    {
+        if (text[pos] == '\\')
+        {
+            ++pos;
+        }
+        else if (text[pos] == quote || text[pos] == '\n')
+        {
+            return pos + 1;
+        }
+    }
+    return pos;
+}
+
+std::string normalize(llvm::StringRef directory, llvm::StringRef path)
+{
+    llvm::SmallString<256> result;
+    if (llvm::sys::path::is_absolute(path))
+    {
+        result = path;
+    }
+    else
+    {
+        result = directory;
+        llvm::sys::path::append(result, path);
+    }
+    llvm::sys::path::remove_dots(result, true);
+    llvm::sys::path::native(result);
+    return result.c_str();
+}
+
+} // anonymous namespace
+
+namespace Clara
+{
+
+std::vector<IncludeGraph::Include> IncludeGraph::scan(llvm::StringRef text)
+{
+    std::vector<Include> result;
+    const auto size = text.size();
+    std::size_t pos = 0;
+    std::size_t lineStart = 0;
+    bool atStartOfLine = true;
+    while (pos < size)
+    {
+        const char c = text[pos];
+        if (c == '\n')
+        {
+            atStartOfLine = true;
+            lineStart = ++pos;
+        }
+        else if (isHorizontalSpace(c))
+        {
+            ++pos;
+        }
+        else if (c == '/' && pos + 1 < size && text[pos + 1] == '/')
+        {
+            pos = std::min(text.find('\n', pos), size);
+        }
+        else if (c == '/' && pos + 1 < size && text[pos + 1] == '*')
+        {
+            const auto end = text.find("*/", pos + 2);
+            const auto next = end == llvm::StringRef::npos ? size : end + 2;
+            // A directive may follow a comment that ends on its line.
+            const auto newline = text.slice(pos, next).rfind('\n');
+            if (newline != llvm::StringRef::npos)
+            {
+                atStartOfLine = true;
+                lineStart = pos + newline + 1;
+            }
+            pos = next;
+        }
+        else if (c == '#' && atStartOfLine)
+        {
+            atStartOfLine = false;
+            ++pos;
+            while (pos < size && isHorizontalSpace(text[pos])) ++pos;
+            auto end = pos;
+            while (end < size && isIdentifierChar(text[end])) ++end;
+            const auto directive = text.slice(pos, end);
+            pos = end;
+            if (directive != "include" && directive != "import" &&
+                directive != "include_next")
+            {
+                continue;
+            }
+            while (pos < size && isHorizontalSpace(text[pos])) ++pos;
+            if (pos == size || (text[pos] != '"' && text[pos] != '<'))
+            {
+                // Included through a macro.
+                continue;
+            }
+            const bool isAngled = text[pos] == '<';
+            end = text.find_first_of(isAngled ? ">\n" : "\"\n", pos + 1);
+            if (end == llvm::StringRef::npos || text[end] == '\n') continue;
+            Include include;
+            include.spelling = text.slice(pos + 1, end).str();
+            include.isAngled = isAngled;
+            include.offset = lineStart;
+            result.push_back(std::move(include));
+            pos = end + 1;
+        }
+        else if (c == '"' || c == '\'')
+        {
+            atStartOfLine = false;
+            pos = skipLiteral(text, pos);
+        }
+        else
+        {
+            atStartOfLine = false;
+            ++pos;
+        }
+    }
+    return result;
+}
+
+void IncludeGraph::addContext(std::vector<std::string> &command,
+                              const Includer &includer)
+{
+    command.push_back(contextOption);
+    command.push_back(includer.filename);
+    command.push_back(includer.include);
+}
+
+bool IncludeGraph::takeContext(std::vector<std::string> &command,
+                               Includer &includer)
+{
+    const auto found = std::find(command.begin(), command.end(),
+                                 std::string(contextOption));
+    if (command.end() - found < 3) return false;
+    includer.filename = found[1];
+    includer.include = found[2];
+    command.erase(found, found + 3);
+    return true;
+}
+
+void IncludeGraph::build(const std::vector<Unit> &units)
+{
+    Trace::Scope scope(0, "build include graph");
+    mSearchPaths.clear();
+    mUnits.clear();
+    mFiles.clear();
+    mIncluders.clear();
+    mExists.clear();
+    // Most units of a project share their include directories, and their
+    // headers only have to be resolved once for all of them.
+    std::map<std::string, std::size_t> searchPaths;
+    for (const auto &unit : units)
+    {
+        auto searchPath = getSearchPath(unit);
+        std::string key;
+        for (const auto &directory : searchPath.quoted) key += directory + '\n';
+        key += '\n';
+        for (const auto &directory : searchPath.angled) key += directory + '\n';
+        const auto inserted = searchPaths.emplace(key, mSearchPaths.size());
+        if (inserted.second) mSearchPaths.push_back(std::move(searchPath));
+        mUnits[normalize(unit.directory, unit.filename)] =
+            inserted.first->second;
+    }
+    std::vector<std::string> filenames;
+    for (const auto &unit : mUnits) filenames.push_back(unit.first);
+    // Ties go to the same unit every time.
+    std::sort(filenames.begin(), filenames.end());
+    Candidates candidates;
+    for (const auto &filename : filenames) walk(filename, candidates);
+    std::lock_guard<std::mutex> lock(mMutex);
+    mBest.swap(candidates);
+}
+
+void IncludeGraph::update(const std::string &path)
+{
+    // Headers may have been created since they were looked for, like the
+    // saved file itself. Files are rarely deleted, so the positive entries
+    // are kept.
+    for (auto entry = mExists.begin(); entry != mExists.end();)
+    {
+        if (entry->second)
+        {
+            ++entry;
+        }
+        else
+        {
+            entry = mExists.erase(entry);
+        }
+    }
+    const auto filename = normalize("", path);
+    const auto found = mFiles.find(filename);
+    if (found == mFiles.end() || !found->second.isScanned) return;
+    auto &file = found->second;
+    const auto includes = std::move(file.includes);
+    scan(file, filename);
+    if (includes.size() == file.includes.size() &&
+        std::equal(includes.begin(), includes.end(), file.includes.begin(),
+                   [](const Include &lhs, const Include &rhs) {
+                       return lhs.spelling == rhs.spelling &&
+                              lhs.isAngled == rhs.isAngled;
+                   }))
+    {
+        // Only the offsets may have changed, and the includers keep the
+        // spellings of their includes only.
+        return;
+    }
+    Trace::Scope scope(0, "update include graph");
+    // Found through the edges from before the change.
+    const auto units = findUnits(filename);
+    for (const auto &edges : file.edges)
+    {
+        for (const auto &edge : edges.second)
+        {
+            mIncluders[edge.target].erase(filename);
+        }
+    }
+    file.edges.clear();
+    Candidates candidates;
+    for (const auto &unit : units) walk(unit, candidates);
+    // The headers whose includer changed for the worse may have a better one
+    // elsewhere now. Those units are walked as well.
+    std::vector<std::string> orphans;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        for (const auto &best : mBest)
+        {
+            if (units.count(best.second.unit) == 0) continue;
+            const auto candidate = candidates.find(best.first);
+            if (candidate == candidates.end() ||
+                isBetter(best.second, candidate->second))
+            {
+                orphans.push_back(best.first);
+            }
+        }
+    }
+    std::set<std::string> walked = units;
+    for (const auto &orphan : orphans)
+    {
+        for (const auto &unit : findUnits(orphan))
+        {
+            if (walked.insert(unit).second) walk(unit, candidates);
+        }
+    }
+    std::lock_guard<std::mutex> lock(mMutex);
+    for (const auto &orphan : orphans) mBest.erase(orphan);
+    for (auto &candidate : candidates)
+    {
+        const auto best = mBest.find(candidate.first);
+        if (best == mBest.end() || units.count(best->second.unit) != 0 ||
+            isBetter(candidate.second, best->second))
+        {
+            mBest[candidate.first] = std::move(candidate.second);
+        }
+    }
+}
+
+bool IncludeGraph::find(const std::string &header, Includer &includer) const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    const auto found = mBest.find(normalize("", header));
+    if (found == mBest.end()) return false;
+    includer.filename = found->second.unit;
+    includer.include = found->second.include;
+    return true;
+}
+
+IncludeGraph::SearchPath IncludeGraph::getSearchPath(const Unit &unit)
+{
+    SearchPath result;
+    const auto &command = unit.command;
+    for (std::size_t i = 0; i < command.size(); ++i)
+    {
+        const llvm::StringRef argument(command[i]);
+        for (const llvm::StringRef option : {"-iquote", "-I"})
+        {
+            if (!argument.startswith(option)) continue;
+            llvm::StringRef directory = argument.drop_front(option.size());
+            if (directory.empty())
+            {
+                if (i + 1 == command.size()) break;
+                directory = command[++i];
+            }
+            auto &directories =
+                option == "-I" ? result.angled : result.quoted;
+            directories.push_back(normalize(unit.directory, directory));
+            break;
+        }
+    }
+    return result;
+}
+
+bool IncludeGraph::isBetter(const Best &lhs, const Best &rhs)
+{
+    return lhs.depth != rhs.depth ? lhs.depth < rhs.depth
+                                  : lhs.closure < rhs.closure;
+}
+
+void IncludeGraph::consider(Candidates &candidates, const std::string &header,
+                            Best best)
+{
+    const auto found = candidates.find(header);
+    if (found == candidates.end())
+    {
+        candidates.emplace(header, std::move(best));
+    }
+    else if (isBetter(best, found->second))
+    {
+        found->second = std::move(best);
+    }
+}
+
+void IncludeGraph::scan(File &file, const std::string &filename)
+{
+    file.isScanned = true;
+    file.includes.clear();
+    auto buffer = llvm::MemoryBuffer::getFile(filename);
+    if (buffer) file.includes = scan((*buffer)->getBuffer());
+}
+
+const std::vector<IncludeGraph::Edge> &
+IncludeGraph::resolve(const std::string &filename, std::size_t searchPath)
+{
+    // The unordered_map never moves its values, so the result stays valid
+    // while more files are added.
+    auto &file = mFiles[filename];
+    if (!file.isScanned) scan(file, filename);
+    const auto found = file.edges.find(searchPath);
+    if (found != file.edges.end()) return found->second;
+    auto &edges = file.edges[searchPath];
+    for (std::size_t i = 0; i < file.includes.size(); ++i)
+    {
+        auto target =
+            resolve(filename, file.includes[i], mSearchPaths[searchPath]);
+        if (target.empty()) continue;
+        mIncluders[target].insert(filename);
+        edges.push_back({std::move(target), i});
+    }
+    return edges;
+}
+
+std::string IncludeGraph::resolve(const std::string &filename,
+                                  const Include &include,
+                                  const SearchPath &searchPath)
+{
+    if (llvm::sys::path::is_absolute(include.spelling))
+    {
+        return exists(include.spelling) ? include.spelling : std::string();
+    }
+    if (!include.isAngled)
+    {
+        auto path = normalize(llvm::sys::path::parent_path(filename),
+                              include.spelling);
+        if (exists(path)) return path;
+        for (const auto &directory : searchPath.quoted)
+        {
+            path = normalize(directory, include.spelling);
+            if (exists(path)) return path;
+        }
+    }
+    for (const auto &directory : searchPath.angled)
+    {
+        auto path = normalize(directory, include.spelling);
+        if (exists(path)) return path;
+    }
+    return std::string();
+}
+
+bool IncludeGraph::exists(const std::string &path)
+{
+    const auto found = mExists.find(path);
+    if (found != mExists.end()) return found->second;
+    const bool result = llvm::sys::fs::is_regular_file(path);
+    mExists.emplace(path, result);
+    return result;
+}
+
+void IncludeGraph::walk(const std::string &unit, Candidates &candidates)
+{
+    const auto searchPath = mUnits.at(unit);
+    struct Frame
+    {
+        const std::vector<Edge> *edges;
+        std::size_t next;
+        // Into the includes of the unit.
+        std::size_t include;
+    };
+    // The headers, their depth, and the include of the unit that they are
+    // first included through.
+    std::vector<std::tuple<const std::string *, unsigned, std::size_t>>
+        reached;
+    std::unordered_set<std::string> visited{unit};
+    std::vector<Frame> stack{{&resolve(unit, searchPath), 0, 0}};
+    while (!stack.empty())
+    {
+        auto &frame = stack.back();
+        if (frame.next == frame.edges->size())
+        {
+            stack.pop_back();
+            continue;
+        }
+        const auto &edge = (*frame.edges)[frame.next++];
+        if (!visited.insert(edge.target).second) continue;
+        const auto include = stack.size() == 1 ? edge.include : frame.include;
+        reached.emplace_back(&edge.target,
+                             static_cast<unsigned>(stack.size()), include);
+        stack.push_back({&resolve(edge.target, searchPath), 0, include});
+    }
+    const auto &includes = mFiles[unit].includes;
+    for (const auto &header : reached)
+    {
+        consider(candidates, *std::get<0>(header),
+                 {unit, includes[std::get<2>(header)].spelling,
+                  std::get<1>(header), reached.size()});
+    }
+}
+
+std::set<std::string>
+IncludeGraph::findUnits(const std::string &filename) const
+{
+    std::set<std::string> result;
+    std::unordered_set<std::string> visited{filename};
+    std::vector<std::string> pending{filename};
+    while (!pending.empty())
+    {
+        const auto file = std::move(pending.back());
+        pending.pop_back();
+        if (mUnits.count(file) != 0) result.insert(file);
+        const auto found = mIncluders.find(file);
+        if (found == mIncluders.end()) continue;
+        for (const auto &includer : found->second)
+        {
+            if (visited.insert(includer).second) pending.push_back(includer);
+        }
+    }
+    return result;
+}
+
+} // Clara
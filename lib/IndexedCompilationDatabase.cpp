@@ -0,0 +1,568 @@
+#include "IndexedCompilationDatabase.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/Support/Allocator.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/ConvertUTF.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/StringSaver.h>
+#include <llvm/Support/raw_ostream.h>
+
+namespace
+{
+
+// A reader for the subset of JSON that compilation databases use. Values
+// that are not needed can be skipped without decoding them.
+class JSONReader
+{
+  public:
+    JSONReader(const char *begin, const char *end) : mPos(begin), mEnd(end) {}
+
+    const char *getPosition() const { return mPos; }
+
+    // Skips whitespace, and returns true if c is the next character.
+    bool peek(char c)
+    {
+        skipWhitespace();
+        return mPos != mEnd && *mPos == c;
+    }
+
+    // Skips whitespace, and consumes c if it is the next character.
+    bool consume(char c)
+    {
+        if (!peek(c)) return false;
+        ++mPos;
+        return true;
+    }
+
+    bool readString(std::string &result);
+    bool skipString();
+    bool skipValue();
+
+  private:
+    void skipWhitespace()
+    {
+        while (mPos != mEnd &&
+               (*mPos == ' ' || *mPos == '\n' || *mPos == '\r' || *mPos == '\t'))
+        {
+            ++mPos;
+        }
+    }
+
+    bool readHex4(unsigned &result);
+
+    const char *mPos;
+    const char *mEnd;
+};
+
+bool JSONReader::readHex4(unsigned &result)
+{
+    if (mEnd - mPos < 4) return false;
+    result = 0;
+    for (int i = 0; i < 4; ++i)
+    {
+        const auto digit = llvm::hexDigitValue(*mPos++);
+        if (digit == -1U) return false;
+        result = result * 16 + digit;
+    }
+    return true;
+}
+
+bool JSONReader::readString(std::string &result)
+{
+    result.clear();
+    if (!consume('"')) return false;
+    while (mPos != mEnd)
+    {
+        const char *chunk = mPos;
+        while (mPos != mEnd && *mPos != '"' && *mPos != '\\') ++mPos;
+        result.append(chunk, mPos);
+        if (mPos == mEnd) return false;
+        if (*mPos++ == '"') return true;
+        if (mPos == mEnd) return false;
+        const char escaped = *mPos++;
+        switch (escaped)
+        {
+        case '"':
+        case '\\':
+        case '/':
+            result.push_back(escaped);
+            break;
+        case 'b':
+            result.push_back('\b');
+            break;
+        case 'f':
+            result.push_back('\f');
+            break;
+        case 'n':
+            result.push_back('\n');
+            break;
+        case 'r':
+            result.push_back('\r');
+            break;
+        case 't':
+            result.push_back('\t');
+            break;
+        case 'u':
+        {
+            unsigned codePoint;
+            if (!readHex4(codePoint)) return false;
+            if (codePoint >= 0xD800 && codePoint < 0xDC00)
+            {
+                // A high surrogate must be followed by a low surrogate.
+                unsigned low;
+                if (mEnd - mPos < 2 || mPos[0] != '\\' || mPos[1] != 'u')
+                {
+                    return false;
+                }
+                mPos += 2;
+                if (!readHex4(low) || low < 0xDC00 || low >= 0xE000)
+                {
+                    return false;
+                }
+                codePoint = 0x10000 + ((codePoint - 0xD800) << 10) +
+                            (low - 0xDC00);
+            }
+            char buffer[UNI_MAX_UTF8_BYTES_PER_CODE_POINT];
+            char *end = buffer;
+            if (!llvm::ConvertCodePointToUTF8(codePoint, end)) return false;
+            result.append(buffer, end);
+            break;
+        }
+        default:
+            return false;
+        }
+    }
+    return false;
+}
+
+bool JSONReader::skipString()
+{
+    if (!consume('"')) return false;
+    while (mPos != mEnd)
+    {
+        if (*mPos == '\\')
+        {
+            mPos += mEnd - mPos >= 2 ? 2 : 1;
+        }
+        else if (*mPos++ == '"')
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool JSONReader::skipValue()
+{
+    skipWhitespace();
+    if (mPos == mEnd) return false;
+    switch (*mPos)
+    {
+    case '"':
+        return skipString();
+    case '{':
+        ++mPos;
+        if (consume('}')) return true;
+        do
+        {
+            if (!skipString() || !consume(':') || !skipValue()) return false;
+        } while (consume(','));
+        return consume('}');
+    case '[':
+        ++mPos;
+        if (consume(']')) return true;
+        do
+        {
+            if (!skipValue()) return false;
+        } while (consume(','));
+        return consume(']');
+    default:
+    {
+        // A number, true, false or null.
+        const auto begin = mPos;
+        while (mPos != mEnd && !std::strchr(",]} \t\r\n", *mPos)) ++mPos;
+        return mPos != begin;
+    }
+    }
+}
+
+struct IndexHeader
+{
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t entrySize;
+    std::uint64_t jsonSize;
+    std::int64_t jsonModificationTime;
+    std::uint64_t entryCount;
+};
+
+const char indexMagic[8] = {'C', 'L', 'A', 'R', 'A', 'I', 'D', 'X'};
+const std::uint32_t indexVersion = 1;
+
+long long getModificationTime(const llvm::sys::fs::file_status &status)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               status.getLastModificationTime().time_since_epoch())
+        .count();
+}
+
+} // anonymous namespace
+
+namespace Clara
+{
+
+IndexedCompilationDatabase::IndexedCompilationDatabase(
+    std::unique_ptr<llvm::MemoryBuffer> json)
+    : mJSON(std::move(json))
+{
+}
+
+std::unique_ptr<IndexedCompilationDatabase>
+IndexedCompilationDatabase::loadFromDirectory(llvm::StringRef directory,
+                                              llvm::StringRef indexDirectory,
+                                              std::string &errorMessage)
+{
+    llvm::SmallString<256> jsonPath(directory);
+    llvm::sys::path::append(jsonPath, "compile_commands.json");
+    llvm::sys::fs::file_status status;
+    if (llvm::sys::fs::status(jsonPath, status))
+    {
+        errorMessage = "could not find " + jsonPath.str().str();
+        return nullptr;
+    }
+    // Read, never memory-mapped: build tools rewrite the file in place, and
+    // a mapping of a file that is truncated under it faults on access.
+    auto json = llvm::MemoryBuffer::getFile(jsonPath, /*FileSize*/ -1,
+                                            /*RequiresNullTerminator*/ false,
+                                            /*IsVolatileSize*/ true);
+    if (!json)
+    {
+        errorMessage = "could not read " + jsonPath.str().str() + ": " +
+                       json.getError().message();
+        return nullptr;
+    }
+    std::unique_ptr<IndexedCompilationDatabase> database(
+        new IndexedCompilationDatabase(std::move(*json)));
+    llvm::SmallString<256> indexPath(indexDirectory);
+    llvm::sys::path::append(indexPath, "compile_commands.index");
+    const auto modificationTime = getModificationTime(status);
+    if (!indexDirectory.empty() &&
+        database->loadIndex(indexPath.str().str(), modificationTime))
+    {
+        return database;
+    }
+    if (!database->buildIndex(errorMessage))
+    {
+        errorMessage = jsonPath.str().str() + ": " + errorMessage;
+        return nullptr;
+    }
+    if (!indexDirectory.empty() &&
+        !llvm::sys::fs::create_directories(indexDirectory))
+    {
+        database->saveIndex(indexPath.str().str(), modificationTime);
+    }
+    return database;
+}
+
+bool IndexedCompilationDatabase::buildIndex(std::string &errorMessage)
+{
+    const char *start = mJSON->getBufferStart();
+    JSONReader reader(start, mJSON->getBufferEnd());
+    const auto fail = [&]() {
+        errorMessage = "malformed JSON at byte " +
+                       std::to_string(reader.getPosition() - start);
+        mIndex.clear();
+        return false;
+    };
+    if (!reader.consume('[')) return fail();
+    std::string key;
+    std::string directory;
+    std::string file;
+    if (!reader.consume(']'))
+    {
+        do
+        {
+            if (!reader.peek('{')) return fail();
+            const auto begin = reader.getPosition();
+            reader.consume('{');
+            directory.clear();
+            file.clear();
+            if (!reader.consume('}'))
+            {
+                do
+                {
+                    if (!reader.readString(key) || !reader.consume(':'))
+                    {
+                        return fail();
+                    }
+                    bool isValid;
+                    if (key == "directory")
+                    {
+                        isValid = reader.readString(directory);
+                    }
+                    else if (key == "file")
+                    {
+                        isValid = reader.readString(file);
+                    }
+                    else
+                    {
+                        isValid = reader.skipValue();
+                    }
+                    if (!isValid) return fail();
+                } while (reader.consume(','));
+                if (!reader.consume('}')) return fail();
+            }
+            mIndex.push_back(IndexEntry{
+                hashPath(normalizePath(directory, file)),
+                static_cast<std::uint64_t>(begin - start),
+                static_cast<std::uint64_t>(reader.getPosition() - begin)});
+        } while (reader.consume(','));
+        if (!reader.consume(']')) return fail();
+    }
+    std::sort(mIndex.begin(), mIndex.end(),
+              [](const IndexEntry &lhs, const IndexEntry &rhs) {
+                  return lhs.fileHash < rhs.fileHash ||
+                         (lhs.fileHash == rhs.fileHash &&
+                          lhs.offset < rhs.offset);
+              });
+    return true;
+}
+
+bool IndexedCompilationDatabase::loadIndex(const std::string &indexPath,
+                                           long long modificationTime)
+{
+    auto buffer = llvm::MemoryBuffer::getFile(
+        indexPath, /*FileSize*/ -1, /*RequiresNullTerminator*/ false);
+    if (!buffer) return false;
+    const auto size = (*buffer)->getBufferSize();
+    if (size < sizeof(IndexHeader)) return false;
+    IndexHeader header;
+    std::memcpy(&header, (*buffer)->getBufferStart(), sizeof(header));
+    if (std::memcmp(header.magic, indexMagic, sizeof(indexMagic)) != 0 ||
+        header.version != indexVersion ||
+        header.entrySize != sizeof(IndexEntry) ||
+        header.jsonSize != mJSON->getBufferSize() ||
+        header.jsonModificationTime != modificationTime ||
+        (size - sizeof(header)) / sizeof(IndexEntry) != header.entryCount ||
+        (size - sizeof(header)) % sizeof(IndexEntry) != 0)
+    {
+        return false;
+    }
+    mIndex.resize(header.entryCount);
+    std::memcpy(mIndex.data(), (*buffer)->getBufferStart() + sizeof(header),
+                header.entryCount * sizeof(IndexEntry));
+    const auto jsonSize = mJSON->getBufferSize();
+    for (const auto &entry : mIndex)
+    {
+        if (entry.offset > jsonSize || entry.length > jsonSize - entry.offset)
+        {
+            mIndex.clear();
+            return false;
+        }
+    }
+    return true;
+}
+
+void IndexedCompilationDatabase::saveIndex(const std::string &indexPath,
+                                           long long modificationTime) const
+{
+    // Write to a temporary file first, so that a concurrent reader never
+    // sees a partial index.
+    int fd;
+    llvm::SmallString<256> tempPath;
+    if (llvm::sys::fs::createUniqueFile(indexPath + "-%%%%%%%%.tmp", fd,
+                                        tempPath))
+    {
+        return;
+    }
+    IndexHeader header;
+    std::memcpy(header.magic, indexMagic, sizeof(indexMagic));
+    header.version = indexVersion;
+    header.entrySize = sizeof(IndexEntry);
+    header.jsonSize = mJSON->getBufferSize();
+    header.jsonModificationTime = modificationTime;
+    header.entryCount = mIndex.size();
+    bool isWritten;
+    {
+        llvm::raw_fd_ostream file(fd, /*shouldClose*/ true);
+        file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char *>(mIndex.data()),
+                   mIndex.size() * sizeof(IndexEntry));
+        file.close();
+        isWritten = !file.has_error();
+        file.clear_error();
+    }
+    if (!isWritten || llvm::sys::fs::rename(tempPath, indexPath))
+    {
+        llvm::sys::fs::remove(tempPath);
+    }
+}
+
+bool IndexedCompilationDatabase::decodeEntry(
+    const IndexEntry &entry, clang::tooling::CompileCommand &command) const
+{
+    const char *begin = mJSON->getBufferStart() + entry.offset;
+    JSONReader reader(begin, begin + entry.length);
+    std::string key;
+    std::string directory;
+    std::string file;
+    std::string commandString;
+    std::vector<std::string> arguments;
+    bool hasArguments = false;
+    if (!reader.consume('{')) return false;
+    if (!reader.consume('}'))
+    {
+        do
+        {
+            if (!reader.readString(key) || !reader.consume(':')) return false;
+            bool isValid;
+            if (key == "directory")
+            {
+                isValid = reader.readString(directory);
+            }
+            else if (key == "file")
+            {
+                isValid = reader.readString(file);
+            }
+            else if (key == "command")
+            {
+                isValid = reader.readString(commandString);
+            }
+            else if (key == "arguments")
+            {
+                hasArguments = true;
+                isValid = reader.consume('[');
+                if (isValid && !reader.consume(']'))
+                {
+                    do
+                    {
+                        arguments.emplace_back();
+                        isValid = reader.readString(arguments.back());
+                    } while (isValid && reader.consume(','));
+                    isValid = isValid && reader.consume(']');
+                }
+            }
+            else
+            {
+                isValid = reader.skipValue();
+            }
+            if (!isValid) return false;
+        } while (reader.consume(','));
+        if (!reader.consume('}')) return false;
+    }
+    if (!hasArguments)
+    {
+        // "arguments" takes precedence over "command", like in clang's own
+        // JSONCompilationDatabase.
+        llvm::BumpPtrAllocator allocator;
+        llvm::StringSaver saver(allocator);
+        llvm::SmallVector<const char *, 64> argv;
+#ifdef _WIN32
+        llvm::cl::TokenizeWindowsCommandLine(commandString, saver, argv);
+#else
+        llvm::cl::TokenizeGNUCommandLine(commandString, saver, argv);
+#endif
+        arguments.assign(argv.begin(), argv.end());
+    }
+    command = clang::tooling::CompileCommand(directory, file,
+                                             std::move(arguments));
+    return true;
+}
+
+std::vector<clang::tooling::CompileCommand>
+IndexedCompilationDatabase::getCompileCommands(llvm::StringRef filePath) const
+{
+    std::vector<clang::tooling::CompileCommand> result;
+    const auto path = normalizePath("", filePath);
+    const auto hash = hashPath(path);
+    auto iter = std::lower_bound(
+        mIndex.begin(), mIndex.end(), hash,
+        [](const IndexEntry &entry, std::uint64_t value) {
+            return entry.fileHash < value;
+        });
+    for (; iter != mIndex.end() && iter->fileHash == hash; ++iter)
+    {
+        clang::tooling::CompileCommand command;
+        if (!decodeEntry(*iter, command)) continue;
+        // Different paths can have the same hash.
+        if (normalizePath(command.Directory, command.Filename) != path)
+        {
+            continue;
+        }
+        result.push_back(std::move(command));
+    }
+    return result;
+}
+
+std::vector<std::string> IndexedCompilationDatabase::getAllFiles() const
+{
+    std::vector<std::string> result;
+    for (const auto &command : getAllCompileCommands())
+    {
+        result.push_back(normalizePath(command.Directory, command.Filename));
+    }
+    std::sort(result.begin(), result.end());
+    result.erase(std::unique(result.begin(), result.end()), result.end());
+    return result;
+}
+
+std::vector<clang::tooling::CompileCommand>
+IndexedCompilationDatabase::getAllCompileCommands() const
+{
+    auto entries = mIndex;
+    std::sort(entries.begin(), entries.end(),
+              [](const IndexEntry &lhs, const IndexEntry &rhs) {
+                  return lhs.offset < rhs.offset;
+              });
+    std::vector<clang::tooling::CompileCommand> result;
+    result.reserve(entries.size());
+    for (const auto &entry : entries)
+    {
+        clang::tooling::CompileCommand command;
+        if (decodeEntry(entry, command)) result.push_back(std::move(command));
+    }
+    return result;
+}
+
+std::uint64_t IndexedCompilationDatabase::hashPath(llvm::StringRef path)
+{
+    // FNV-1a. The index is saved to disk, so the hash must not depend on
+    // the process or on the version of LLVM.
+    std::uint64_t hash = 14695981039346656037ull;
+    for (const char c : path)
+    {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+std::string IndexedCompilationDatabase::normalizePath(llvm::StringRef directory,
+                                                      llvm::StringRef file)
+{
+    llvm::SmallString<256> path;
+    if (llvm::sys::path::is_absolute(file))
+    {
+        path = file;
+    }
+    else if (!directory.empty())
+    {
+        path = directory;
+        llvm::sys::path::append(path, file);
+    }
+    else
+    {
+        path = file;
+        llvm::sys::fs::make_absolute(path);
+    }
+    llvm::sys::path::remove_dots(path, /*remove_dot_dot*/ true);
+    llvm::sys::path::native(path);
+    return path.str().str();
+}
+
+} // Clara
@@ -0,0 +1,307 @@
+#include "LocationIndex.hpp"
+#include <algorithm>
+#include <clang/AST/ASTContext.h>
+#include <clang/AST/Decl.h>
+#include <clang/AST/RawCommentList.h>
+#include <clang/Index/IndexDataConsumer.h>
+#include <clang/Index/IndexSymbol.h>
+#include <clang/Index/IndexingAction.h>
+#include <clang/Lex/Lexer.h>
+#include <clang/Lex/MacroInfo.h>
+#include <clang/Lex/Preprocessor.h>
+#include <iterator>
+#include <llvm/Support/Path.h>
+
+namespace
+{
+
+// Collects the token ranges of the occurrences in the main file.
+class RangeConsumer : public clang::index::IndexDataConsumer
+{
+  public:
+    struct Occurrence
+    {
+        unsigned offset;
+        const clang::Decl *decl;
+    };
+
+    RangeConsumer(const clang::SourceManager &sourceManager,
+                  std::vector<Occurrence> &occurrences)
+        : mMainFile(sourceManager.getMainFileID()), mOccurrences(occurrences)
+    {
+    }
+
+    bool handleDeclOccurence(const clang::Decl *decl,
+                             clang::index::SymbolRoleSet roles,
+                             llvm::ArrayRef<clang::index::SymbolRelation>,
+                             clang::FileID file, unsigned offset,
+                             ASTNodeInfo) override
+    {
+        if (file != mMainFile) return true;
+        if (roles & static_cast<clang::index::SymbolRoleSet>(
+                        clang::index::SymbolRole::Implicit))
+        {
+            return true;
+        }
+        if (!llvm::isa<clang::NamedDecl>(decl)) return true;
+        mOccurrences.push_back({offset, decl});
+        return true;
+    }
+
+  private:
+    const clang::FileID mMainFile;
+    std::vector<Occurrence> &mOccurrences;
+};
+
+// Sets the absolute filename and the one-based row and byte column of a
+// location. Returns false for locations that are not in a file, like those
+// of builtins.
+bool getPosition(const clang::SourceManager &sourceManager,
+                 clang::SourceLocation location, llvm::StringRef directory,
+                 std::string &filename, unsigned &row, unsigned &column)
+{
+    if (location.isInvalid()) return false;
+    const auto decomposed =
+        sourceManager.getDecomposedLoc(sourceManager.getFileLoc(location));
+    const auto *entry = sourceManager.getFileEntryForID(decomposed.first);
+    if (!entry) return false;
+    llvm::SmallString<256> path;
+    if (llvm::sys::path::is_relative(entry->getName())) path = directory;
+    llvm::sys::path::append(path, entry->getName());
+    llvm::sys::path::remove_dots(path, /*remove_dot_dot=*/true);
+    llvm::sys::path::native(path);
+    filename = path.str().str();
+    row = sourceManager.getLineNumber(decomposed.first, decomposed.second);
+    column = sourceManager.getColumnNumber(decomposed.first, decomposed.second);
+    return true;
+}
+
+const clang::Decl *getDefinition(const clang::Decl *decl)
+{
+    if (const auto *function = llvm::dyn_cast<clang::FunctionDecl>(decl))
+    {
+        const clang::FunctionDecl *definition = nullptr;
+        return function->isDefined(definition) ? definition : nullptr;
+    }
+    if (const auto *tag = llvm::dyn_cast<clang::TagDecl>(decl))
+    {
+        return tag->getDefinition();
+    }
+    if (const auto *variable = llvm::dyn_cast<clang::VarDecl>(decl))
+    {
+        return variable->getDefinition();
+    }
+    // Fields, enumerators, typedefs, namespaces and the like are defined
+    // where they are declared.
+    return decl;
+}
+
+std::string getType(const clang::Decl *decl)
+{
+    const auto &context = decl->getASTContext();
+    const auto &policy = context.getPrintingPolicy();
+    if (const auto *function = llvm::dyn_cast<clang::FunctionDecl>(decl))
+    {
+        auto type = function->getReturnType().getAsString(policy);
+        type += " (";
+        for (unsigned i = 0; i < function->getNumParams(); ++i)
+        {
+            const auto *parameter = function->getParamDecl(i);
+            if (i != 0) type += ", ";
+            type += parameter->getType().getAsString(policy);
+            if (!parameter->getName().empty())
+            {
+                type += ' ';
+                type += parameter->getName().str();
+            }
+        }
+        if (function->isVariadic())
+        {
+            type += function->getNumParams() == 0 ? "..." : ", ...";
+        }
+        type += ')';
+        return type;
+    }
+    if (const auto *value = llvm::dyn_cast<clang::ValueDecl>(decl))
+    {
+        return value->getType().getAsString(policy);
+    }
+    if (const auto *alias = llvm::dyn_cast<clang::TypedefNameDecl>(decl))
+    {
+        return alias->getUnderlyingType().getAsString(policy);
+    }
+    return std::string();
+}
+
+// Leaves out the slashes and stars of a comment, and the indentation.
+std::string stripCommentMarkers(llvm::StringRef comment)
+{
+    std::string result;
+    llvm::SmallVector<llvm::StringRef, 16> lines;
+    comment.split(lines, '\n');
+    for (auto line : lines)
+    {
+        line = line.trim();
+        if (line.startswith("/**") || line.startswith("/*!") ||
+            line.startswith("///") || line.startswith("//!"))
+        {
+            line = line.drop_front(3);
+        }
+        else if (line.startswith("/*") || line.startswith("//"))
+        {
+            line = line.drop_front(2);
+        }
+        if (line.endswith("*/")) line = line.drop_back(2);
+        line = line.trim();
+        if (line.startswith("*")) line = line.drop_front(1).ltrim();
+        if (line.startswith("<")) line = line.drop_front(1).ltrim();
+        if (line.empty() && (result.empty() || result.back() == '\n')) continue;
+        result += line;
+        result += '\n';
+    }
+    while (!result.empty() && result.back() == '\n') result.pop_back();
+    return result;
+}
+
+std::string getDocumentation(const clang::Decl *decl)
+{
+    const auto &context = decl->getASTContext();
+    const auto *comment = context.getRawCommentForAnyRedecl(decl);
+    if (!comment) return std::string();
+    return stripCommentMarkers(
+        comment->getRawText(context.getSourceManager()));
+}
+
+} // anonymous namespace
+
+namespace Clara
+{
+
+LocationIndex::LocationIndex(clang::ASTUnit &unit) : mUnit(unit)
+{
+    const auto &sourceManager = unit.getSourceManager();
+    std::vector<RangeConsumer::Occurrence> occurrences;
+    clang::index::IndexingOptions options;
+    options.SystemSymbolFilter =
+        clang::index::IndexingOptions::SystemSymbolFilterKind::None;
+    options.IndexFunctionLocals = true;
+    clang::index::indexASTUnit(
+        unit, std::make_shared<RangeConsumer>(sourceManager, occurrences),
+        options);
+    const auto mainFile = sourceManager.getMainFileID();
+    mRanges.reserve(occurrences.size());
+    for (const auto &occurrence : occurrences)
+    {
+        const auto location =
+            sourceManager.getComposedLoc(mainFile, occurrence.offset);
+        const auto length = clang::Lexer::MeasureTokenLength(
+            location, sourceManager, unit.getLangOpts());
+        if (length == 0) continue;
+        mRanges.push_back(
+            {occurrence.offset, occurrence.offset + length, occurrence.decl});
+    }
+    // A token that both declares something and refers to something else,
+    // like the name of a constructor, keeps the first of them.
+    std::stable_sort(
+        mRanges.begin(), mRanges.end(),
+        [](const Range &lhs, const Range &rhs) { return lhs.begin < rhs.begin; });
+}
+
+CompletionBackend::Declaration LocationIndex::lookUp(unsigned row,
+                                                     unsigned column) const
+{
+    CompletionBackend::Declaration declaration;
+    const auto &sourceManager = mUnit.getSourceManager();
+    const auto location = sourceManager.translateLineCol(
+        sourceManager.getMainFileID(), row, column);
+    if (location.isInvalid()) return declaration;
+    const auto offset = sourceManager.getFileOffset(location);
+    // The indexer attributes everything that a macro expands to to the name
+    // of the macro, so a macro name is the macro itself.
+    if (lookUpMacro(offset, declaration)) return declaration;
+    auto range = std::upper_bound(
+        mRanges.begin(), mRanges.end(), offset,
+        [](unsigned offset, const Range &range) { return offset < range.begin; });
+    if (range == mRanges.begin()) return declaration;
+    --range;
+    const auto begin = range->begin;
+    while (range != mRanges.begin() && std::prev(range)->begin == begin)
+    {
+        --range;
+    }
+    // At the end of the token counts, so that the cursor may be right after
+    // the name.
+    if (offset > range->end) return declaration;
+    describe(range->decl, declaration);
+    return declaration;
+}
+
+bool LocationIndex::lookUpMacro(
+    unsigned offset, CompletionBackend::Declaration &declaration) const
+{
+    const auto &sourceManager = mUnit.getSourceManager();
+    const auto &langOpts = mUnit.getLangOpts();
+    auto &preprocessor = mUnit.getPreprocessor();
+    const auto location = clang::Lexer::GetBeginningOfToken(
+        sourceManager.getComposedLoc(sourceManager.getMainFileID(), offset),
+        sourceManager, langOpts);
+    clang::Token token;
+    if (clang::Lexer::getRawToken(location, token, sourceManager, langOpts,
+                                  /*IgnoreWhiteSpace=*/false) ||
+        token.isNot(clang::tok::raw_identifier))
+    {
+        return false;
+    }
+    auto *identifier = preprocessor.getIdentifierInfo(token.getRawIdentifier());
+    if (!identifier || !identifier->hadMacroDefinition()) return false;
+    const auto definition =
+        preprocessor.getMacroDefinitionAtLoc(identifier, location);
+    const auto *info = definition.getMacroInfo();
+    if (!info) return false;
+    const auto directory = mUnit.getFileManager().getFileSystemOpts().WorkingDir;
+    if (!getPosition(sourceManager, info->getDefinitionLoc(), directory,
+                     declaration.filename, declaration.row,
+                     declaration.column))
+    {
+        // A predefined macro.
+        return false;
+    }
+    declaration.name = identifier->getName().str();
+    declaration.kind = "macro";
+    declaration.type = "#define " +
+                       clang::Lexer::getSourceText(
+                           clang::CharSourceRange::getTokenRange(
+                               info->getDefinitionLoc(),
+                               info->getDefinitionEndLoc()),
+                           sourceManager, langOpts)
+                           .str();
+    declaration.definitionFilename = declaration.filename;
+    declaration.definitionRow = declaration.row;
+    declaration.definitionColumn = declaration.column;
+    return true;
+}
+
+void LocationIndex::describe(const clang::Decl *decl,
+                             CompletionBackend::Declaration &declaration) const
+{
+    const auto &sourceManager = mUnit.getSourceManager();
+    const auto directory = mUnit.getFileManager().getFileSystemOpts().WorkingDir;
+    const auto *named = llvm::cast<clang::NamedDecl>(decl);
+    declaration.name = named->getQualifiedNameAsString();
+    declaration.kind = clang::index::getSymbolKindString(
+                           clang::index::getSymbolInfo(decl).Kind)
+                           .str();
+    declaration.type = getType(decl);
+    declaration.documentation = getDocumentation(decl);
+    getPosition(sourceManager, decl->getCanonicalDecl()->getLocation(),
+                directory, declaration.filename, declaration.row,
+                declaration.column);
+    if (const auto *definition = getDefinition(decl))
+    {
+        getPosition(sourceManager, definition->getLocation(), directory,
+                    declaration.definitionFilename, declaration.definitionRow,
+                    declaration.definitionColumn);
+    }
+}
+
+} // Clara
@@ -0,0 +1,95 @@
+#include "MemoryBudget.hpp"
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+namespace Clara
+{
+
+MemoryBudget &MemoryBudget::get()
+{
+    // Intentionally leaked, for the same reason as the WorkerPool.
+    static auto *budget = new MemoryBudget();
+    return *budget;
+}
+
+void MemoryBudget::setLimit(unsigned long long limit)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mLimit = limit;
+    enforce(nullptr);
+}
+
+void MemoryBudget::add(const void *owner, Evictor evictor)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto &entry = mOwners[owner];
+    entry.evictor = std::move(evictor);
+    entry.lastUse = ++mClock;
+}
+
+void MemoryBudget::remove(const void *owner)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    const auto found = mOwners.find(owner);
+    if (found == mOwners.end()) return;
+    mTotal -= found->second.footprint;
+    mOwners.erase(found);
+}
+
+void MemoryBudget::setFootprint(const void *owner, std::uint64_t bytes)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    const auto found = mOwners.find(owner);
+    if (found == mOwners.end()) return;
+    mTotal = mTotal - found->second.footprint + bytes;
+    found->second.footprint = bytes;
+    enforce(owner);
+}
+
+void MemoryBudget::touch(const void *owner)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    const auto found = mOwners.find(owner);
+    if (found != mOwners.end()) found->second.lastUse = ++mClock;
+}
+
+std::uint64_t MemoryBudget::getTotal() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mTotal;
+}
+
+void MemoryBudget::enforce(const void *keep)
+{
+    if (mLimit == 0 || mTotal <= mLimit) return;
+    std::vector<std::pair<std::uint64_t, Owner *>> candidates;
+    std::uint64_t newest = 0;
+    for (auto &entry : mOwners)
+    {
+        newest = std::max(newest, entry.second.lastUse);
+        if (entry.first != keep && entry.second.footprint != 0)
+        {
+            candidates.emplace_back(entry.second.lastUse, &entry.second);
+        }
+    }
+    std::sort(candidates.begin(), candidates.end(),
+              [](const std::pair<std::uint64_t, Owner *> &lhs,
+                 const std::pair<std::uint64_t, Owner *> &rhs) {
+                  return lhs.first < rhs.first;
+              });
+    for (const auto &candidate : candidates)
+    {
+        if (mTotal <= mLimit) break;
+        // The view that is being worked in stays, even on its own.
+        if (candidate.first == newest) continue;
+        auto &owner = *candidate.second;
+        // Counted as gone right away, so that the next parse doesn't evict
+        // yet another unit while this one is still on its way out.
+        mTotal -= owner.footprint;
+        owner.footprint = 0;
+        owner.evictor();
+    }
+}
+
+} // Clara
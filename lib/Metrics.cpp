@@ -0,0 +1,202 @@
+#include "Metrics.hpp"
+#include <llvm/Support/MathExtras.h>
+#include <map>
+#include <mutex>
+
+namespace Clara
+{
+
+namespace
+{
+
+const char *const phaseNames[] = {
+    "queue",  "reparse", "complete", "rank", "strings",  "gil",
+    "popup",  "total",   "filter",   "load", "preamble", "signatures"};
+
+static_assert(sizeof(phaseNames) / sizeof(phaseNames[0]) ==
+                  static_cast<unsigned>(Metrics::Phase::Count),
+              "every phase needs a name");
+
+struct Registry
+{
+    std::mutex mutex;
+    Metrics::ViewHistograms global;
+    std::map<int, std::shared_ptr<Metrics::ViewHistograms>> views;
+};
+
+Registry &getRegistry()
+{
+    // Intentionally leaked, for the same reason as the WorkerPool.
+    static auto *registry = new Registry();
+    return *registry;
+}
+
+std::vector<Metrics::PhaseStats> getPhaseStats(Metrics::ViewHistograms &view)
+{
+    std::vector<Metrics::PhaseStats> result;
+    for (unsigned i = 0; i < static_cast<unsigned>(Metrics::Phase::Count);
+         ++i)
+    {
+        auto &histogram = view.get(static_cast<Metrics::Phase>(i));
+        const auto count = histogram.getCount();
+        if (count == 0) continue;
+        result.push_back(Metrics::PhaseStats{
+            phaseNames[i], count, histogram.getMean() / 1000.0,
+            histogram.getPercentile(0.5) / 1000.0,
+            histogram.getPercentile(0.9) / 1000.0,
+            histogram.getPercentile(0.99) / 1000.0,
+            histogram.getMax() / 1000.0});
+    }
+    return result;
+}
+
+} // anonymous namespace
+
+Histogram::Histogram() { reset(); }
+
+void Histogram::reset()
+{
+    for (auto &bucket : mBuckets) bucket.store(0, std::memory_order_relaxed);
+    mCount.store(0, std::memory_order_relaxed);
+    mSum.store(0, std::memory_order_relaxed);
+    mMax.store(0, std::memory_order_relaxed);
+}
+
+unsigned Histogram::getIndex(std::uint64_t value)
+{
+    if (value < subBucketCount) return static_cast<unsigned>(value);
+    const auto magnitude = llvm::Log2_64(value); // at least 4
+    const auto subBucket =
+        static_cast<unsigned>(value >> (magnitude - 4)) - subBucketCount;
+    const auto index = subBucketCount * (magnitude - 3) + subBucket;
+    return std::min(index, bucketCount - 1);
+}
+
+std::uint64_t Histogram::getValue(unsigned index)
+{
+    if (index < subBucketCount) return index;
+    const auto magnitude = index / subBucketCount + 3;
+    const auto subBucket = index % subBucketCount;
+    const auto lower = std::uint64_t(subBucketCount + subBucket)
+                       << (magnitude - 4);
+    // The middle of the bucket.
+    return lower + (std::uint64_t(1) << (magnitude - 4)) / 2;
+}
+
+void Histogram::record(std::uint64_t microseconds)
+{
+    mBuckets[getIndex(microseconds)].fetch_add(1, std::memory_order_relaxed);
+    mCount.fetch_add(1, std::memory_order_relaxed);
+    mSum.fetch_add(microseconds, std::memory_order_relaxed);
+    auto max = mMax.load(std::memory_order_relaxed);
+    while (microseconds > max &&
+           !mMax.compare_exchange_weak(max, microseconds,
+                                       std::memory_order_relaxed))
+    {
+    }
+}
+
+std::uint64_t Histogram::getCount() const
+{
+    return mCount.load(std::memory_order_relaxed);
+}
+
+std::uint64_t Histogram::getMax() const
+{
+    return mMax.load(std::memory_order_relaxed);
+}
+
+double Histogram::getMean() const
+{
+    const auto count = getCount();
+    if (count == 0) return 0.0;
+    return static_cast<double>(mSum.load(std::memory_order_relaxed)) / count;
+}
+
+std::uint64_t Histogram::getPercentile(double fraction) const
+{
+    // The buckets may be updated while we read them, so the total is taken
+    // from the buckets themselves.
+    std::uint64_t total = 0;
+    for (const auto &bucket : mBuckets)
+    {
+        total += bucket.load(std::memory_order_relaxed);
+    }
+    if (total == 0) return 0;
+    const auto target =
+        std::max<std::uint64_t>(1, static_cast<std::uint64_t>(
+                                       fraction * static_cast<double>(total) +
+                                       0.5));
+    std::uint64_t seen = 0;
+    for (unsigned i = 0; i < bucketCount; ++i)
+    {
+        seen += mBuckets[i].load(std::memory_order_relaxed);
+        if (seen >= target) return std::min(getValue(i), getMax());
+    }
+    return getMax();
+}
+
+std::uint64_t Metrics::now()
+{
+    return static_cast<std::uint64_t>(
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch())
+            .count());
+}
+
+std::shared_ptr<Metrics::ViewHistograms> Metrics::addView(int viewId,
+                                                          std::string name)
+{
+    auto view = std::make_shared<ViewHistograms>();
+    view->mName = std::move(name);
+    auto &registry = getRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    registry.views[viewId] = view;
+    return view;
+}
+
+void Metrics::removeView(int viewId)
+{
+    auto &registry = getRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    registry.views.erase(viewId);
+}
+
+void Metrics::record(ViewHistograms &view, Phase phase,
+                     std::uint64_t microseconds)
+{
+    view.get(phase).record(microseconds);
+    record(phase, microseconds);
+}
+
+void Metrics::record(Phase phase, std::uint64_t microseconds)
+{
+    getRegistry().global.get(phase).record(microseconds);
+}
+
+Metrics::Stats Metrics::getStats()
+{
+    auto &registry = getRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    Stats stats;
+    stats.global = getPhaseStats(registry.global);
+    for (const auto &view : registry.views)
+    {
+        stats.views.push_back(ViewStats{view.first, view.second->mName,
+                                        getPhaseStats(*view.second)});
+    }
+    return stats;
+}
+
+void Metrics::reset()
+{
+    auto &registry = getRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    const auto resetAll = [](ViewHistograms &view) {
+        for (auto &histogram : view.mHistograms) histogram.reset();
+    };
+    resetAll(registry.global);
+    for (const auto &view : registry.views) resetAll(*view.second);
+}
+
+} // Clara
@@ -0,0 +1,656 @@
+#include "PreambleCache.hpp"
+#include "Metrics.hpp"
+#include "UnsavedFiles.hpp"
+#include <algorithm>
+#include <chrono>
+#include <clang/Basic/Diagnostic.h>
+#include <clang/Basic/Version.h>
+#include <clang/Frontend/CompilerInstance.h>
+#include <clang/Frontend/FrontendActions.h>
+#include <clang/Frontend/Utils.h> // for clang::DependencyCollector
+#include <fstream>
+#include <llvm/ADT/ScopeExit.h>
+#include <llvm/Support/Chrono.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MD5.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/raw_ostream.h>
+#include <set>
+#include <unistd.h>
+
+namespace
+{
+
+class PreambleDependencyCollector : public clang::DependencyCollector
+{
+  public:
+    bool needSystemDependencies() override { return true; }
+};
+
+bool isHorizontalSpace(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\f' || c == '\v';
+}
+
+bool isIdentifierChar(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+           (c >= '0' && c <= '9') || c == '_';
+}
+
+// Returns the position of the newline that ends the logical line starting at
+// pos, taking backslash line continuations into account.
+std::size_t findEndOfLine(const std::string &buffer, std::size_t pos)
+{
+    while (true)
+    {
+        pos = buffer.find('\n', pos);
+        if (pos == std::string::npos) return buffer.size();
+        auto last = pos;
+        if (last > 0 && buffer[last - 1] == '\r') --last;
+        if (last == 0 || buffer[last - 1] != '\\') return pos;
+        ++pos;
+    }
+}
+
+const char *const storeMagic = "clara-preamble-store 1";
+
+// Preambles that were used this recently are never evicted, as another
+// process that shares the store may still have them open.
+const auto evictionGracePeriod = std::chrono::hours(1);
+
+// Marks a file in the store as recently used, without rewriting it.
+void touch(const llvm::Twine &path)
+{
+    int fd;
+    if (llvm::sys::fs::openFileForRead(path, fd)) return;
+    llvm::sys::fs::setLastModificationAndAccessTime(
+        fd, std::chrono::system_clock::now());
+    close(fd);
+}
+
+} // anonymous namespace
+
+namespace Clara
+{
+
+std::mutex PreambleCache::mMutex;
+
+std::string PreambleCache::mDirectory;
+
+unsigned long long PreambleCache::mSizeLimit = 0;
+
+std::map<std::string, std::weak_ptr<const PreambleCache::Entry>>
+    PreambleCache::mEntries;
+
+std::map<std::string,
+         std::shared_future<std::shared_ptr<const PreambleCache::Entry>>>
+    PreambleCache::mPending;
+
+PreambleCache::Entry::Entry(std::string key, std::string preamble,
+                            std::string pchPath,
+                            std::vector<Dependency> dependencies,
+                            bool isPersistent)
+    : mKey(std::move(key)), mPreamble(std::move(preamble)),
+      mPCHPath(std::move(pchPath)), mDependencies(std::move(dependencies)),
+      mIsPersistent(isPersistent)
+{
+}
+
+PreambleCache::Entry::~Entry()
+{
+    if (!mIsPersistent) llvm::sys::fs::remove(mPCHPath);
+}
+
+bool PreambleCache::Entry::isUpToDate() const
+{
+    // Another process that shares the store may have evicted it.
+    if (!llvm::sys::fs::exists(mPCHPath)) return false;
+    const auto &unsavedFiles = UnsavedFiles::get();
+    for (const auto &dependency : mDependencies)
+    {
+        const auto version = unsavedFiles.getVersion(dependency.path);
+        if (version != dependency.unsavedVersion) return false;
+        // Still the same unsaved text, whatever happens on disk.
+        if (version != 0) continue;
+        llvm::sys::fs::file_status status;
+        if (llvm::sys::fs::status(dependency.path, status)) return false;
+        const auto modificationTime =
+            std::chrono::duration_cast<std::chrono::nanoseconds>(
+                status.getLastModificationTime().time_since_epoch())
+                .count();
+        if (modificationTime != dependency.modificationTime ||
+            status.getSize() != dependency.size)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool PreambleCache::Entry::includes(llvm::StringRef filename) const
+{
+    const auto path = UnsavedFiles::normalize(filename);
+    for (const auto &dependency : mDependencies)
+    {
+        if (dependency.path == path) return true;
+    }
+    return false;
+}
+
+void PreambleCache::configure(std::string directory,
+                              unsigned long long sizeLimit)
+{
+    if (!directory.empty() && llvm::sys::fs::create_directories(directory))
+    {
+        directory.clear();
+    }
+    std::lock_guard<std::mutex> lock(mMutex);
+    mDirectory = std::move(directory);
+    mSizeLimit = sizeLimit;
+}
+
+unsigned PreambleCache::computePreambleSize(const std::string &buffer)
+{
+    const auto size = buffer.size();
+    std::size_t pos = 0;
+    std::size_t end = 0;
+    unsigned depth = 0;
+    bool atStartOfLine = true;
+    while (pos < size)
+    {
+        const char c = buffer[pos];
+        if (c == '\n')
+        {
+            atStartOfLine = true;
+            ++pos;
+        }
+        else if (isHorizontalSpace(c))
+        {
+            ++pos;
+        }
+        else if (c == '/' && pos + 1 < size && buffer[pos + 1] == '/')
+        {
+            pos = findEndOfLine(buffer, pos);
+        }
+        else if (c == '/' && pos + 1 < size && buffer[pos + 1] == '*')
+        {
+            pos = buffer.find("*/", pos + 2);
+            if (pos == std::string::npos) break;
+            pos += 2;
+        }
+        else if (c == '#' && atStartOfLine)
+        {
+            auto nameBegin = pos + 1;
+            while (nameBegin < size && isHorizontalSpace(buffer[nameBegin]))
+            {
+                ++nameBegin;
+            }
+            auto nameEnd = nameBegin;
+            while (nameEnd < size && isIdentifierChar(buffer[nameEnd]))
+            {
+                ++nameEnd;
+            }
+            const auto name = buffer.substr(nameBegin, nameEnd - nameBegin);
+            if (name == "if" || name == "ifdef" || name == "ifndef")
+            {
+                ++depth;
+            }
+            else if (name == "endif" && depth > 0)
+            {
+                --depth;
+            }
+            pos = findEndOfLine(buffer, nameEnd);
+            if (pos < size) ++pos; // eat the newline
+            atStartOfLine = true;
+            // The preamble may not end in the middle of a conditional block.
+            if (depth == 0) end = pos;
+        }
+        else
+        {
+            break;
+        }
+    }
+    return static_cast<unsigned>(end);
+}
+
+std::string PreambleCache::blankPreamble(const std::string &buffer,
+                                         unsigned preambleSize)
+{
+    std::string result(buffer);
+    for (unsigned i = 0; i < preambleSize && i < result.size(); ++i)
+    {
+        if (result[i] != '\n' && result[i] != '\r') result[i] = ' ';
+    }
+    return result;
+}
+
+std::string PreambleCache::computeKey(const std::vector<std::string> &command,
+                                      const std::string &workingDir,
+                                      const std::string &filename,
+                                      const std::string &preamble)
+{
+    llvm::MD5 md5;
+    const auto update = [&md5](llvm::StringRef str) {
+        md5.update(str);
+        md5.update(llvm::StringRef("\0", 1));
+    };
+    // PCH files can only be read by the exact same version of clang.
+    update(clang::getClangFullRepositoryVersion());
+    update(workingDir);
+    // Quoted includes are resolved relative to the directory of the main
+    // file, so two files in different directories never share a preamble.
+    update(llvm::sys::path::parent_path(filename));
+    bool skipNext = false;
+    for (const auto &arg : command)
+    {
+        if (skipNext)
+        {
+            skipNext = false;
+            continue;
+        }
+        // Normalize the command by throwing away everything that does not
+        // influence the contents of the preamble.
+        if (arg == "-o" || arg == "-MF" || arg == "-MT" || arg == "-MQ")
+        {
+            skipNext = true;
+            continue;
+        }
+        if (arg == "-c" || arg == "-MD" || arg == "-MMD") continue;
+        llvm::SmallString<256> path(arg);
+        if (llvm::sys::path::is_relative(path))
+        {
+            path = workingDir;
+            llvm::sys::path::append(path, arg);
+        }
+        llvm::sys::path::remove_dots(path, /*remove_dot_dot=*/true);
+        if (path.str() == filename) continue;
+        update(arg);
+    }
+    update(preamble);
+    llvm::MD5::MD5Result result;
+    md5.final(result);
+    llvm::SmallString<32> hex;
+    llvm::MD5::stringifyResult(result, hex);
+    return hex.str().str();
+}
+
+std::shared_ptr<const PreambleCache::Entry>
+PreambleCache::acquire(const clang::CompilerInvocation &invocation,
+                       const std::vector<std::string> &command,
+                       const std::string &filename, const std::string &preamble,
+                       std::shared_ptr<clang::PCHContainerOperations> pchOps)
+{
+    if (preamble.empty()) return nullptr;
+    const auto key =
+        computeKey(command, invocation.getFileSystemOpts().WorkingDir,
+                   filename, preamble);
+    std::promise<std::shared_ptr<const Entry>> promise;
+    for (;;)
+    {
+        std::shared_ptr<const Entry> cached;
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            const auto pending = mPending.find(key);
+            if (pending != mPending.end())
+            {
+                auto future = pending->second;
+                lock.unlock();
+                return future.get();
+            }
+            const auto findResult = mEntries.find(key);
+            if (findResult != mEntries.end())
+            {
+                cached = findResult->second.lock();
+            }
+            if (!cached)
+            {
+                mPending.emplace(key, promise.get_future().share());
+                break;
+            }
+        }
+        // This stats every file that the preamble includes, which must not
+        // hold up the lookups of the other views.
+        if (cached->isUpToDate())
+        {
+            // So that no process evicts it while this one uses it.
+            if (cached->isPersistent()) touch(getDepsPath(*cached));
+            return cached;
+        }
+        std::lock_guard<std::mutex> lock(mMutex);
+        const auto findResult = mEntries.find(key);
+        // Unless another thread replaced it in the meantime.
+        if (findResult != mEntries.end() &&
+            findResult->second.lock() == cached)
+        {
+            mEntries.erase(findResult);
+        }
+    }
+    // If loading or building throws, the key must not stay pending, or the
+    // threads that wait for it would get a broken promise, now and later.
+    bool isFulfilled = false;
+    const auto fulfill = llvm::make_scope_exit([&]() {
+        if (isFulfilled) return;
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mPending.erase(key);
+        }
+        promise.set_value(nullptr);
+    });
+    auto entry = load(key, preamble);
+    const bool isLoaded = entry != nullptr;
+    if (!isLoaded)
+    {
+        const auto buildTime = Metrics::now();
+        entry = build(key, invocation, filename, preamble, std::move(pchOps));
+        Metrics::record(Metrics::Phase::Preamble, Metrics::now() - buildTime);
+    }
+    std::string directory;
+    unsigned long long sizeLimit = 0;
+    std::set<std::string> inUse;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        // Forget about entries of preambles that are no longer in use.
+        for (auto iter = mEntries.begin(); iter != mEntries.end();)
+        {
+            if (iter->second.expired())
+            {
+                iter = mEntries.erase(iter);
+            }
+            else
+            {
+                inUse.insert(iter->first);
+                ++iter;
+            }
+        }
+        if (entry) mEntries[key] = entry;
+        mPending.erase(key);
+        if (entry && !isLoaded)
+        {
+            directory = mDirectory;
+            sizeLimit = mSizeLimit;
+        }
+    }
+    isFulfilled = true;
+    promise.set_value(entry);
+    // Scanning the store must not hold up the lookups of the other views.
+    if (!directory.empty())
+    {
+        inUse.insert(key);
+        evict(directory, sizeLimit, inUse);
+    }
+    return entry;
+}
+
+std::shared_ptr<const PreambleCache::Entry>
+PreambleCache::build(const std::string &key,
+                     const clang::CompilerInvocation &invocation,
+                     const std::string &filename, const std::string &preamble,
+                     std::shared_ptr<clang::PCHContainerOperations> pchOps)
+{
+    using namespace clang;
+    if (invocation.getFrontendOpts().Inputs.empty()) return nullptr;
+    const auto inputKind = invocation.getFrontendOpts().Inputs[0].getKind();
+
+    std::string directory;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        directory = mDirectory;
+    }
+    llvm::SmallString<128> pchPath;
+    if (directory.empty())
+    {
+        if (llvm::sys::fs::createTemporaryFile("clara-preamble", "pch",
+                                               pchPath))
+        {
+            return nullptr;
+        }
+    }
+    else
+    {
+        // Build into a unique file first, so that a half-written PCH never
+        // shows up under its final name in the store.
+        llvm::SmallString<128> model(directory);
+        llvm::sys::path::append(model, key + "-%%%%%%%%.tmp");
+        if (llvm::sys::fs::createUniqueFile(model, pchPath)) return nullptr;
+    }
+
+    // The preamble is compiled as if it were a file that lives right next to
+    // the main file, so that quoted includes are resolved in the same way.
+    std::string preamblePath = filename + ".preamble";
+
+    auto pchInvocation = std::make_shared<CompilerInvocation>(invocation);
+    auto &frontendOpts = pchInvocation->getFrontendOpts();
+    frontendOpts.Inputs.clear();
+    frontendOpts.Inputs.emplace_back(preamblePath, inputKind);
+    frontendOpts.OutputFile = pchPath.str().str();
+    frontendOpts.ProgramAction = frontend::GeneratePCH;
+    frontendOpts.DisableFree = false;
+    auto &ppOpts = pchInvocation->getPreprocessorOpts();
+    ppOpts.clearRemappedFiles();
+    ppOpts.RetainRemappedFileBuffers = false;
+    ppOpts.ImplicitPCHInclude.clear();
+    ppOpts.addRemappedFile(
+        preamblePath,
+        llvm::MemoryBuffer::getMemBufferCopy(preamble, preamblePath).release());
+    // The versions that are remapped here are the ones that the entry
+    // records, even if the files are edited while it is built.
+    const auto unsavedFiles = UnsavedFiles::get().getFiles(filename);
+    for (const auto &file : unsavedFiles)
+    {
+        ppOpts.addRemappedFile(file.filename,
+                               file.getMemoryBuffer().release());
+    }
+
+    CompilerInstance compiler(std::move(pchOps));
+    compiler.setInvocation(std::move(pchInvocation));
+    compiler.createDiagnostics(new IgnoringDiagConsumer(),
+                               /*ShouldOwnClient*/ true);
+    auto collector = std::make_shared<PreambleDependencyCollector>();
+    compiler.addDependencyCollector(collector);
+    GeneratePCHAction action;
+    if (!compiler.ExecuteAction(action) ||
+        compiler.getDiagnostics().hasErrorOccurred())
+    {
+        llvm::sys::fs::remove(pchPath);
+        return nullptr;
+    }
+    std::vector<Dependency> dependencies;
+    bool isUnsaved = false;
+    const auto &workingDir = invocation.getFileSystemOpts().WorkingDir;
+    for (const auto &path : collector->getDependencies())
+    {
+        if (path == preamblePath) continue;
+        // Absolute, so that they can be checked from anywhere, and compared
+        // with the names of the unsaved files.
+        llvm::SmallString<256> absolutePath;
+        if (llvm::sys::path::is_relative(path)) absolutePath = workingDir;
+        llvm::sys::path::append(absolutePath, path);
+        Dependency dependency;
+        dependency.path = UnsavedFiles::normalize(absolutePath);
+        for (const auto &file : unsavedFiles)
+        {
+            if (file.filename != dependency.path) continue;
+            dependency.unsavedVersion = file.version;
+            isUnsaved = true;
+            break;
+        }
+        llvm::sys::fs::file_status status;
+        if (llvm::sys::fs::status(dependency.path, status))
+        {
+            if (dependency.unsavedVersion == 0) continue;
+            // A new file that only exists in a view.
+            dependency.modificationTime = 0;
+            dependency.size = 0;
+        }
+        else
+        {
+            dependency.modificationTime =
+                std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    status.getLastModificationTime().time_since_epoch())
+                    .count();
+            dependency.size = status.getSize();
+        }
+        dependencies.push_back(std::move(dependency));
+    }
+    if (directory.empty() || isUnsaved)
+    {
+        // Left under its temporary name, which the store doesn't count, and
+        // removed once it is no longer used.
+        return std::make_shared<const Entry>(key, preamble,
+                                             pchPath.str().str(),
+                                             std::move(dependencies), false);
+    }
+    llvm::SmallString<128> finalPath(directory);
+    llvm::sys::path::append(finalPath, key + ".pch");
+    auto entry = std::make_shared<const Entry>(key, preamble,
+                                               finalPath.str().str(),
+                                               std::move(dependencies), true);
+    // The .deps first, as the .pch is what publishes the preamble to the
+    // other processes that share the store.
+    if (!store(*entry) || llvm::sys::fs::rename(pchPath, finalPath))
+    {
+        llvm::sys::fs::remove(pchPath);
+        return nullptr;
+    }
+    return entry;
+}
+
+// The store consists of two files per preamble: <key>.pch holds the PCH and
+// <key>.deps lists the files that went into it, one "mtime size path" triple
+// per line. The modification time of the .deps file is the time the preamble
+// was last used, which is what eviction goes by.
+//
+// Several processes may share the store: the plugin host and the workers of
+// the clara-server. Both files are only ever replaced by renaming, the .deps
+// before the .pch, so that a reader never sees half of either. A preamble
+// that can't be read is a miss, and only eviction deletes files.
+
+std::string PreambleCache::getDepsPath(const Entry &entry)
+{
+    llvm::SmallString<128> depsPath(
+        llvm::sys::path::parent_path(entry.getPCHPath()));
+    llvm::sys::path::append(depsPath, entry.getKey() + ".deps");
+    return depsPath.str().str();
+}
+
+std::shared_ptr<const PreambleCache::Entry>
+PreambleCache::load(const std::string &key, const std::string &preamble)
+{
+    llvm::SmallString<128> pchPath;
+    llvm::SmallString<128> depsPath;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (mDirectory.empty()) return nullptr;
+        pchPath = mDirectory;
+        depsPath = mDirectory;
+    }
+    llvm::sys::path::append(pchPath, key + ".pch");
+    llvm::sys::path::append(depsPath, key + ".deps");
+    if (!llvm::sys::fs::exists(pchPath)) return nullptr;
+    std::vector<Dependency> dependencies;
+    {
+        std::ifstream file(depsPath.str().str());
+        std::string line;
+        if (!std::getline(file, line) || line != storeMagic) return nullptr;
+        Dependency dependency;
+        while (file >> dependency.modificationTime >> dependency.size &&
+               file.get() == ' ' && std::getline(file, dependency.path))
+        {
+            dependencies.push_back(dependency);
+        }
+    }
+    auto entry = std::make_shared<const Entry>(key, preamble,
+                                               pchPath.str().str(),
+                                               std::move(dependencies), true);
+    // A stale preamble is replaced by the one that is built instead.
+    if (!entry->isUpToDate()) return nullptr;
+    touch(depsPath);
+    return entry;
+}
+
+bool PreambleCache::store(const Entry &entry)
+{
+    const auto depsPath = getDepsPath(entry);
+    int fd;
+    llvm::SmallString<128> temporary;
+    if (llvm::sys::fs::createUniqueFile(depsPath + "-%%%%%%%%.tmp", fd,
+                                        temporary))
+    {
+        return false;
+    }
+    bool isWritten;
+    {
+        llvm::raw_fd_ostream file(fd, /*shouldClose*/ true);
+        file << storeMagic << '\n';
+        for (const auto &dependency : entry.getDependencies())
+        {
+            file << dependency.modificationTime << ' ' << dependency.size
+                 << ' ' << dependency.path << '\n';
+        }
+        file.close();
+        isWritten = !file.has_error();
+        file.clear_error();
+    }
+    if (!isWritten || llvm::sys::fs::rename(temporary, depsPath))
+    {
+        llvm::sys::fs::remove(temporary);
+        return false;
+    }
+    return true;
+}
+
+void PreambleCache::evict(const std::string &directory,
+                          unsigned long long sizeLimit,
+                          const std::set<std::string> &inUse)
+{
+    struct StoredPreamble
+    {
+        std::string key;
+        llvm::sys::TimePoint<> lastUsed;
+        unsigned long long size;
+    };
+    std::vector<StoredPreamble> preambles;
+    unsigned long long totalSize = 0;
+    std::error_code error;
+    for (llvm::sys::fs::directory_iterator iter(directory, error), end;
+         !error && iter != end; iter.increment(error))
+    {
+        const auto path = iter->path();
+        if (llvm::sys::path::extension(path) != ".pch") continue;
+        llvm::sys::fs::file_status pchStatus;
+        llvm::sys::fs::file_status depsStatus;
+        llvm::SmallString<128> depsPath(path);
+        llvm::sys::path::replace_extension(depsPath, ".deps");
+        if (llvm::sys::fs::status(path, pchStatus)) continue;
+        if (llvm::sys::fs::status(depsPath, depsStatus)) continue;
+        StoredPreamble preamble;
+        preamble.key = llvm::sys::path::stem(path).str();
+        preamble.lastUsed = depsStatus.getLastModificationTime();
+        preamble.size = pchStatus.getSize();
+        totalSize += preamble.size;
+        preambles.push_back(std::move(preamble));
+    }
+    std::sort(preambles.begin(), preambles.end(),
+              [](const StoredPreamble &lhs, const StoredPreamble &rhs) {
+                  return lhs.lastUsed < rhs.lastUsed;
+              });
+    const auto graceStart =
+        std::chrono::system_clock::now() - evictionGracePeriod;
+    for (const auto &preamble : preambles)
+    {
+        if (totalSize <= sizeLimit) break;
+        // Still in use by an open view, of this process or another one.
+        if (inUse.count(preamble.key) != 0) continue;
+        if (preamble.lastUsed > graceStart) continue;
+        llvm::SmallString<128> path(directory);
+        llvm::sys::path::append(path, preamble.key + ".pch");
+        llvm::sys::fs::remove(path);
+        llvm::sys::path::replace_extension(path, ".deps");
+        llvm::sys::fs::remove(path);
+        totalSize -= preamble.size;
+    }
+}
+
+} // Clara
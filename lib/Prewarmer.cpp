@@ -0,0 +1,202 @@
+#include "Prewarmer.hpp"
+#include "CompletionEngine.hpp"
+#include "IncludeGraph.hpp"
+#include "Trace.hpp"
+#include "WorkerPool.hpp"
+#include <algorithm>
+#include <fstream>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+
+namespace
+{
+
+// Remembered, and persisted, at most.
+const std::size_t maxRecentFiles = 64;
+
+// Returns true if the preamble of the text has an #include of a file with the
+// given name, from any directory.
+bool includes(const std::string &text, llvm::StringRef name)
+{
+    const auto preamble = llvm::StringRef(text).substr(
+        0, Clara::PreambleCache::computePreambleSize(text));
+    for (const auto &include : Clara::IncludeGraph::scan(preamble))
+    {
+        if (llvm::sys::path::filename(include.spelling) == name) return true;
+    }
+    return false;
+}
+
+} // anonymous namespace
+
+namespace Clara
+{
+
+Prewarmer &Prewarmer::get()
+{
+    // Intentionally leaked, for the same reason as the WorkerPool.
+    static auto *prewarmer = new Prewarmer();
+    return *prewarmer;
+}
+
+void Prewarmer::configure(Settings settings)
+{
+    std::vector<std::shared_ptr<const PreambleCache::Entry>> released;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        const bool isNewPath =
+            settings.recentFilesPath != mSettings.recentFilesPath;
+        mSettings = std::move(settings);
+        if (isNewPath) loadRecent();
+        if (!mSettings.isEnabled)
+        {
+            for (auto &warm : mWarm)
+            {
+                mQueued.erase(warm.filename);
+                released.push_back(std::move(warm.entry));
+            }
+            mWarm.clear();
+            mWarmSize = 0;
+        }
+    }
+}
+
+bool Prewarmer::isEnabled() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mSettings.isEnabled;
+}
+
+unsigned Prewarmer::getFileCount() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mSettings.fileCount;
+}
+
+void Prewarmer::warm(std::vector<File> files,
+                     CompletionBackend::Options options)
+{
+    const auto shared =
+        std::make_shared<const CompletionBackend::Options>(std::move(options));
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (!mSettings.isEnabled) return;
+    for (auto &file : files)
+    {
+        if (!mQueued.insert(file.filename).second) continue;
+        const auto *strand = &mStrands[mNextStrand++ % strandCount];
+        WorkerPool::get().post(
+            strand, WorkerPool::Priority::Background,
+            [ this, shared, file = std::move(file) ]() {
+                keep(file.filename, warm(file, *shared));
+            });
+    }
+}
+
+std::shared_ptr<const PreambleCache::Entry>
+Prewarmer::warm(const File &file, const CompletionBackend::Options &options)
+{
+    // Turned off while the job was queued.
+    if (!isEnabled()) return nullptr;
+    if (!file.include.empty())
+    {
+        auto buffer = llvm::MemoryBuffer::getFile(file.filename);
+        if (!buffer || !includes((*buffer)->getBuffer().str(), file.include))
+        {
+            return nullptr;
+        }
+    }
+    Trace::Scope scope(0, "prewarm");
+    Trace::message(0, "prewarming", file.filename);
+    return CompletionEngine::buildPreamble(file.filename, file.command,
+                                           file.directory, options);
+}
+
+void Prewarmer::keep(const std::string &filename,
+                     std::shared_ptr<const PreambleCache::Entry> entry)
+{
+    std::uint64_t size = 0;
+    llvm::sys::fs::file_status status;
+    if (entry && !llvm::sys::fs::status(entry->getPCHPath(), status))
+    {
+        size = status.getSize();
+    }
+    // Let go of them outside of the lock, as that may remove PCH files.
+    std::vector<std::shared_ptr<const PreambleCache::Entry>> released;
+    std::lock_guard<std::mutex> lock(mMutex);
+    const auto found = std::find_if(
+        mWarm.begin(), mWarm.end(),
+        [&entry](const Warm &warm) { return warm.entry == entry; });
+    if (!entry || !mSettings.isEnabled || found != mWarm.end())
+    {
+        mQueued.erase(filename);
+        released.push_back(std::move(entry));
+        return;
+    }
+    mWarm.push_back(Warm{std::move(entry), size, filename});
+    mWarmSize += size;
+    while (mWarmSize > mSettings.sizeLimit && !mWarm.empty())
+    {
+        mWarmSize -= mWarm.front().size;
+        mQueued.erase(mWarm.front().filename);
+        released.push_back(std::move(mWarm.front().entry));
+        mWarm.pop_front();
+    }
+}
+
+void Prewarmer::addRecent(const std::string &filename)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (!mRecent.empty() && mRecent.front() == filename) return;
+    mRecent.erase(std::remove(mRecent.begin(), mRecent.end(), filename),
+                  mRecent.end());
+    mRecent.push_front(filename);
+    if (mRecent.size() > maxRecentFiles) mRecent.pop_back();
+    if (!mSettings.recentFilesPath.empty())
+    {
+        WorkerPool::get().post(&mRecent, WorkerPool::Priority::Background,
+                               [this]() { saveRecent(); });
+    }
+}
+
+std::vector<std::string> Prewarmer::getRecent() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return std::vector<std::string>(mRecent.begin(), mRecent.end());
+}
+
+void Prewarmer::loadRecent()
+{
+    mRecent.clear();
+    if (mSettings.recentFilesPath.empty()) return;
+    std::ifstream file(mSettings.recentFilesPath);
+    std::string line;
+    while (mRecent.size() < maxRecentFiles && std::getline(file, line))
+    {
+        if (!line.empty()) mRecent.push_back(line);
+    }
+}
+
+void Prewarmer::saveRecent()
+{
+    std::string path;
+    std::vector<std::string> recent;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        path = mSettings.recentFilesPath;
+        recent.assign(mRecent.begin(), mRecent.end());
+    }
+    if (path.empty()) return;
+    llvm::sys::fs::create_directories(llvm::sys::path::parent_path(path));
+    // Written next to it and then renamed, so that a crash never leaves half
+    // a list behind.
+    const auto temporary = path + ".tmp";
+    {
+        std::ofstream file(temporary, std::ios::trunc);
+        for (const auto &filename : recent) file << filename << '\n';
+        if (!file) return;
+    }
+    llvm::sys::fs::rename(temporary, path);
+}
+
+} // Clara
@@ -1,19 +1,22 @@
 #include "CodeCompleter.hpp"
 #include "CompilationDatabaseWatcher.hpp"
+#include "CompletionList.hpp"
+#include "DiagnosticList.hpp"
 #include "Configuration.hpp"
+#include "Metrics.hpp"
+#include "PyBind11.hpp"
+#include "Trace.hpp"
 #include <pybind11/stl.h>
 #include <pybind11/stl_bind.h>
 
+// The classes that the clara-server shares with the module don't know about
+// Python, so that the server builds without it. Their bindings live here.
+
 namespace pybind11
 {
 namespace detail
 {
 template <>
-class type_caster<std::vector<std::pair<std::string, std::string>>>
-    : public type_caster_base<std::vector<std::pair<std::string, std::string>>>
-{
-};
-template <>
 class type_caster<std::vector<std::string>>
     : public type_caster_base<std::vector<std::string>>
 {
@@ -21,13 +24,121 @@ class type_caster<std::vector<std::string>>
 } // namespace detail
 } // namespace pybind11
 
+namespace
+{
+
+using namespace Clara;
+
+pybind11::dict toDict(const std::vector<Metrics::PhaseStats> &phases)
+{
+    using namespace pybind11::literals; // for the _a literal
+    pybind11::dict result;
+    for (const auto &phase : phases)
+    {
+        result[phase.name] = pybind11::dict(
+            "count"_a = phase.count, "mean"_a = phase.mean,
+            "p50"_a = phase.p50, "p90"_a = phase.p90, "p99"_a = phase.p99,
+            "max"_a = phase.max);
+    }
+    return result;
+}
+
+// Returns {"global": phases, "views": {view id: phases}}, where phases maps
+// the name of each phase to its count and its mean, p50, p90, p99 and
+// maximum in milliseconds.
+pybind11::dict getStats()
+{
+    using namespace pybind11::literals; // for the _a literal
+    const auto stats = Metrics::getStats();
+    pybind11::dict views;
+    for (const auto &view : stats.views)
+    {
+        auto phases = toDict(view.phases);
+        phases["name"] = pybind11::str(view.name);
+        views[pybind11::int_(view.id)] = phases;
+    }
+    return pybind11::dict("global"_a = toDict(stats.global),
+                          "views"_a = views);
+}
+
+// To Python, a CompletionList is a read-only sequence of (display, snippet)
+// tuples, whose strings are only created when Sublime asks for an item.
+void registerCompletionList(pybind11::module &m)
+{
+    using namespace pybind11;
+    class_<CompletionList>(m, "CompletionList")
+        .def("__len__", &CompletionList::size)
+        .def("__getitem__", [](const CompletionList &self, long long index) {
+            const auto count = static_cast<long long>(self.size());
+            if (index < 0) index += count;
+            // Python stops iterating over a sequence at the IndexError.
+            if (index < 0 || index >= count) throw index_error();
+            const auto item = static_cast<std::size_t>(index);
+            const auto display = self.getDisplay(item);
+            const auto snippet = self.getSnippet(item);
+            return make_tuple(str(display.data(), display.size()),
+                              str(snippet.data(), snippet.size()));
+        });
+}
+
+void registerDiagnosticList(pybind11::module &m)
+{
+    using namespace pybind11;
+    class_<DiagnosticList>(m, "DiagnosticList")
+        .def("__len__", &DiagnosticList::size)
+        .def("is_error",
+             [](const DiagnosticList &self, std::size_t index) {
+                 if (index >= self.size()) throw index_error();
+                 return self.isError(index);
+             })
+        .def("range",
+             [](const DiagnosticList &self, std::size_t index) {
+                 if (index >= self.size()) throw index_error();
+                 return self.getRange(index);
+             })
+        .def("message",
+             [](const DiagnosticList &self, std::size_t index) {
+                 if (index >= self.size()) throw index_error();
+                 const auto message = self.getMessage(index);
+                 return str(message.data(), message.size());
+             })
+        .def("in_rows", &DiagnosticList::getIndicesInRows)
+        .def("counts", &DiagnosticList::getCounts);
+}
+
+void drainTrace()
+{
+    for (const auto &line : Trace::drain()) pybind11::print("clara:", line);
+}
+
+void registerTrace(pybind11::module &m)
+{
+    using namespace pybind11;
+    class_<Trace>(m, "Trace")
+        .def_static("set_enabled", &Trace::setEnabled)
+        .def_static("is_enabled", &Trace::isEnabled)
+        .def_static("drain", &drainTrace)
+        .def_static("export_chrome_trace", [](const std::string &path) {
+            // Print what the export would otherwise drain unseen.
+            drainTrace();
+            Trace::exportChromeTrace(path);
+        });
+}
+
+} // anonymous namespace
+
 PYBIND11_PLUGIN(Clara)
 {
     using namespace pybind11;
     using namespace Clara;
     module m("Clara", "Clara plugin");
     m.def("version", [] { return SUBLIME_VERSION; });
+    m.def("stats", &getStats);
+    m.def("reset_stats", &Metrics::reset);
     CompilationDatabaseWatcher::registerClass(m);
+    registerTrace(m);
+    registerCompletionList(m);
+    registerDiagnosticList(m);
     CodeCompleter::registerClass(m);
     return m.ptr();
 }
@@ -0,0 +1,610 @@
+#include "RemoteCompletionEngine.hpp"
+#include "CompletionEngine.hpp"
+#include "Trace.hpp"
+#include "UnsavedFiles.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <spawn.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+
+extern char **environ;
+
+namespace
+{
+
+using Clara::ServerConnection;
+
+// The clara-server of this plugin host, and the connections to its
+// workers.
+struct Server
+{
+    std::mutex mutex;
+    ServerConnection::Settings settings;
+    std::string base;
+    pid_t pid = 0;
+    std::chrono::steady_clock::time_point lastStart;
+    std::vector<ServerConnection *> connections;
+};
+
+Server &getServer()
+{
+    // Intentionally leaked, for the same reason as the WorkerPool.
+    static auto *server = new Server();
+    return *server;
+}
+
+// Must be called with the server's mutex held.
+void startServer(Server &server)
+{
+    const auto &settings = server.settings;
+    if (settings.executable.empty()) return;
+    // Don't keep on starting a server that exits right away.
+    const auto now = std::chrono::steady_clock::now();
+    if (server.pid == -1 && now - server.lastStart < std::chrono::seconds(5))
+    {
+        return;
+    }
+    server.lastStart = now;
+    std::vector<std::string> arguments{
+        settings.executable,
+        "--socket",
+        server.base,
+        "--workers",
+        std::to_string(settings.workerCount),
+        "--memory-limit",
+        std::to_string(settings.memoryLimit),
+        "--memory-budget",
+        std::to_string(settings.memoryBudget),
+        "--worker-threads",
+        std::to_string(settings.workerThreads),
+        "--parent",
+        std::to_string(getpid())};
+    if (!settings.preambleCacheDirectory.empty())
+    {
+        arguments.insert(arguments.end(),
+                         {"--preamble-cache-directory",
+                          settings.preambleCacheDirectory,
+                          "--preamble-cache-size-limit",
+                          std::to_string(settings.preambleCacheSizeLimit)});
+    }
+    std::vector<char *> argv;
+    for (auto &argument : arguments) argv.push_back(&argument[0]);
+    argv.push_back(nullptr);
+    pid_t pid;
+    const int error = posix_spawn(&pid, settings.executable.c_str(), nullptr,
+                                  nullptr, argv.data(), environ);
+    if (error != 0)
+    {
+        Clara::Trace::message(0, "could not start", settings.executable,
+                              ":", std::strerror(error));
+        server.pid = -1;
+        return;
+    }
+    Clara::Trace::message(0, "started clara-server with pid", pid);
+    server.pid = pid;
+}
+
+// Starts the server again when it is no longer running. The workers are
+// restarted by the server itself, so this only happens when the server
+// crashed or could not be started.
+void restartServerIfExited()
+{
+    auto &server = getServer();
+    std::lock_guard<std::mutex> lock(server.mutex);
+    if (server.pid > 0)
+    {
+        int status;
+        if (waitpid(server.pid, &status, WNOHANG) == 0) return;
+        server.pid = -1;
+    }
+    startServer(server);
+}
+
+} // anonymous namespace
+
+namespace Clara
+{
+
+void ServerConnection::configure(Settings settings)
+{
+    auto &server = getServer();
+    std::lock_guard<std::mutex> lock(server.mutex);
+    settings.workerCount = std::max(settings.workerCount, 1u);
+    server.settings = std::move(settings);
+}
+
+ServerConnection &ServerConnection::get(const std::string &filename)
+{
+    auto &server = getServer();
+    std::lock_guard<std::mutex> lock(server.mutex);
+    if (server.connections.empty())
+    {
+        // One server per plugin host.
+        server.base = "/tmp/clara-" + std::to_string(getuid()) + "-" +
+                      std::to_string(getpid());
+        startServer(server);
+        for (unsigned i = 0; i < server.settings.workerCount; ++i)
+        {
+            server.connections.push_back(new ServerConnection(
+                ServerProtocol::getSocketPath(server.base, i)));
+        }
+    }
+    const auto index =
+        std::hash<std::string>()(filename) % server.connections.size();
+    return *server.connections[index];
+}
+
+ServerConnection::ServerConnection(std::string path) : mPath(std::move(path))
+{
+    std::thread([this]() { run(); }).detach();
+}
+
+bool ServerConnection::send(ServerProtocol::Writer &message)
+{
+    const auto &frame = message.finish();
+    std::lock_guard<std::mutex> lock(mSocketMutex);
+    if (mSocket != -1 && ServerProtocol::sendFrame(mSocket, frame))
+    {
+        return true;
+    }
+    message.discard();
+    // A partly sent frame breaks the stream. The reader notices, and
+    // reconnects.
+    if (mSocket != -1) shutdown(mSocket, SHUT_RDWR);
+    return false;
+}
+
+void ServerConnection::sendUnsavedFile(const UnsavedFiles::File &file)
+{
+    using ServerProtocol::MessageType;
+    ServerProtocol::Writer message(file.text ? MessageType::SetUnsavedFile
+                                             : MessageType::RemoveUnsavedFile);
+    message.writeInt(0);
+    message.writeString(file.filename);
+    if (file.text) message.writeBlob(*file.text);
+    send(message);
+}
+
+std::uint64_t ServerConnection::add(RemoteCompletionEngine *engine)
+{
+    auto handle = std::make_shared<Handle>();
+    handle->engine = engine;
+    std::lock_guard<std::mutex> lock(mHandlesMutex);
+    const auto id = mNextId++;
+    mHandles.emplace(id, std::move(handle));
+    return id;
+}
+
+void ServerConnection::remove(std::uint64_t id)
+{
+    std::shared_ptr<Handle> handle;
+    {
+        std::lock_guard<std::mutex> lock(mHandlesMutex);
+        const auto found = mHandles.find(id);
+        if (found == mHandles.end()) return;
+        handle = std::move(found->second);
+        mHandles.erase(found);
+    }
+    std::lock_guard<std::mutex> lock(handle->mutex);
+    handle->engine = nullptr;
+}
+
+std::vector<std::shared_ptr<ServerConnection::Handle>>
+ServerConnection::getHandles()
+{
+    std::vector<std::shared_ptr<Handle>> handles;
+    std::lock_guard<std::mutex> lock(mHandlesMutex);
+    for (const auto &entry : mHandles) handles.push_back(entry.second);
+    return handles;
+}
+
+bool ServerConnection::connect()
+{
+    const int socket = ServerProtocol::connectSocket(mPath);
+    if (socket == -1) return false;
+    std::lock_guard<std::mutex> lock(mSocketMutex);
+    mSocket = socket;
+    return true;
+}
+
+void ServerConnection::disconnect()
+{
+    std::lock_guard<std::mutex> lock(mSocketMutex);
+    close(mSocket);
+    mSocket = -1;
+}
+
+void ServerConnection::run()
+{
+    unsigned delay = 10;
+    std::string frame;
+    for (;;)
+    {
+        if (!connect())
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(delay));
+            delay = std::min(delay * 2, 1000u);
+            restartServerIfExited();
+            continue;
+        }
+        delay = 10;
+        Trace::message(0, "connected to", mPath);
+        int socket;
+        {
+            std::lock_guard<std::mutex> lock(mSocketMutex);
+            socket = mSocket;
+        }
+        // A worker starts out without unsaved files. They go first, so that
+        // the files that are opened next are parsed against them.
+        UnsavedFiles::get().subscribe(
+            this, [this](const UnsavedFiles::File &file) {
+                sendUnsavedFile(file);
+            });
+        // The files that were opened while the worker was down.
+        for (const auto &handle : getHandles())
+        {
+            std::lock_guard<std::mutex> lock(handle->mutex);
+            if (handle->engine) handle->engine->handleReconnect();
+        }
+        while (ServerProtocol::receiveFrame(socket, frame)) dispatch(frame);
+        Trace::message(0, "lost the connection to", mPath);
+        UnsavedFiles::get().unsubscribe(this);
+        disconnect();
+        for (const auto &handle : getHandles())
+        {
+            std::lock_guard<std::mutex> lock(handle->mutex);
+            if (handle->engine) handle->engine->handleDisconnect();
+        }
+    }
+}
+
+void ServerConnection::dispatch(const std::string &frame)
+{
+    ServerProtocol::Reader message(frame);
+    const auto id = message.readInt();
+    if (!message.isValid()) return;
+    std::shared_ptr<Handle> handle;
+    {
+        std::lock_guard<std::mutex> lock(mHandlesMutex);
+        const auto found = mHandles.find(id);
+        if (found != mHandles.end()) handle = found->second;
+    }
+    if (handle)
+    {
+        std::lock_guard<std::mutex> lock(handle->mutex);
+        if (handle->engine)
+        {
+            handle->engine->handleMessage(message);
+            return;
+        }
+    }
+    // The file was closed in the meantime.
+    message.discard();
+}
+
+RemoteCompletionEngine::RemoteCompletionEngine(std::string filename, int id,
+                                               Options options,
+                                               Callbacks callbacks)
+    : mFilename{std::move(filename)}, mId{id}, mOptions{std::move(options)},
+      mCallbacks{std::move(callbacks)},
+      mConnection{ServerConnection::get(mFilename)},
+      mMetrics{Metrics::addView(id, mFilename)}
+{
+    // The reader thread may reopen the file as soon as it is added.
+    std::lock_guard<std::mutex> lock(mMethodMutex);
+    mRemoteId = mConnection.add(this);
+    sendOpen();
+}
+
+RemoteCompletionEngine::~RemoteCompletionEngine()
+{
+    stop();
+    Metrics::removeView(mId);
+}
+
+void RemoteCompletionEngine::stop()
+{
+    std::uint64_t remoteId;
+    {
+        std::lock_guard<std::mutex> lock(mMethodMutex);
+        remoteId = mRemoteId;
+        if (remoteId == 0) return;
+        sendFileMessage(ServerProtocol::MessageType::Close);
+        mRemoteId = 0;
+    }
+    mConnection.remove(remoteId);
+    mIsLoaded = false;
+}
+
+void RemoteCompletionEngine::sendFileMessage(ServerProtocol::MessageType type)
+{
+    ServerProtocol::Writer message(type);
+    message.writeInt(mRemoteId);
+    mConnection.send(message);
+}
+
+void RemoteCompletionEngine::sendOpen()
+{
+    using ServerProtocol::MessageType;
+    ServerProtocol::Writer message(MessageType::Open);
+    message.writeInt(mRemoteId);
+    message.writeString(mFilename);
+    const auto &codeComplete = mOptions.codeComplete;
+    message.writeInt(codeComplete.IncludeMacros);
+    message.writeInt(codeComplete.IncludeCodePatterns);
+    message.writeInt(codeComplete.IncludeGlobals);
+    message.writeInt(codeComplete.IncludeBriefComments);
+    message.writeStrings(mOptions.systemHeaders);
+    message.writeStrings(mOptions.systemFrameworks);
+    message.writeString(mOptions.builtinHeaders);
+    message.writeInt(mOptions.maxResults);
+    mConnection.send(message);
+}
+
+void RemoteCompletionEngine::sendLoad()
+{
+    if (mCommand.empty()) return;
+    ServerProtocol::Writer message(ServerProtocol::MessageType::Load);
+    message.writeInt(mRemoteId);
+    message.writeStrings(mCommand);
+    message.writeString(mDirectory);
+    mConnection.send(message);
+    // The worker only applies a priority to a file that has queued a job,
+    // so that it has to follow the load.
+    if (mPriority != WorkerPool::Priority::Background)
+    {
+        ServerProtocol::Writer priority(
+            ServerProtocol::MessageType::SetPriority);
+        priority.writeInt(mRemoteId);
+        priority.writeInt(static_cast<std::uint64_t>(mPriority));
+        mConnection.send(priority);
+    }
+}
+
+void RemoteCompletionEngine::load(std::vector<std::string> command,
+                                  std::string directory)
+{
+    std::lock_guard<std::mutex> lock(mMethodMutex);
+    mCommand = std::move(command);
+    mDirectory = std::move(directory);
+    mIsLoaded = false;
+    sendLoad();
+}
+
+void RemoteCompletionEngine::reparse()
+{
+    std::lock_guard<std::mutex> lock(mMethodMutex);
+    sendFileMessage(ServerProtocol::MessageType::Reparse);
+}
+
+void RemoteCompletionEngine::setPriority(WorkerPool::Priority priority)
+{
+    std::lock_guard<std::mutex> lock(mMethodMutex);
+    mPriority = priority;
+    ServerProtocol::Writer message(ServerProtocol::MessageType::SetPriority);
+    message.writeInt(mRemoteId);
+    message.writeInt(static_cast<std::uint64_t>(priority));
+    mConnection.send(message);
+}
+
+unsigned RemoteCompletionEngine::complete(unsigned row, unsigned column,
+                                          TextBuffer::Snapshot snapshot,
+                                          std::string typed,
+                                          std::uint64_t requestTime)
+{
+    const auto generation = ++mGeneration;
+    ServerProtocol::Writer message(ServerProtocol::MessageType::Complete);
+    std::lock_guard<std::mutex> lock(mMethodMutex);
+    message.writeInt(mRemoteId);
+    message.writeInt(generation);
+    message.writeInt(row);
+    message.writeInt(column);
+    message.writeString(typed);
+    if (snapshot.maskedPrefix)
+    {
+        message.writeBlob(snapshot.getUnmaskedText());
+    }
+    else
+    {
+        message.writeBlob(*snapshot.text);
+    }
+    mRequestTyped = std::move(typed);
+    mRequestTime = requestTime;
+    mConnection.send(message);
+    return generation;
+}
+
+void RemoteCompletionEngine::cancel()
+{
+    ++mGeneration;
+    std::lock_guard<std::mutex> lock(mMethodMutex);
+    sendFileMessage(ServerProtocol::MessageType::Cancel);
+}
+
+bool RemoteCompletionEngine::isSuperseded(unsigned generation) const
+{
+    return generation != mGeneration.load();
+}
+
+bool RemoteCompletionEngine::isCompleting() const
+{
+    std::lock_guard<std::mutex> lock(mMethodMutex);
+    return mCompletionsGeneration != mGeneration;
+}
+
+bool RemoteCompletionEngine::filterCompletions(
+    llvm::StringRef typed, CompletionList &completions) const
+{
+    std::lock_guard<std::mutex> lock(mMethodMutex);
+    if (!mIsLoaded || mCompletionsGeneration != mGeneration ||
+        !typed.startswith(mCompletionsTyped) ||
+        (mCompletionsTruncated && typed != mCompletionsTyped))
+    {
+        return false;
+    }
+    Metrics::Timer timer(*mMetrics, Metrics::Phase::Filter);
+    CompletionEngine::filter(mCompletions, typed, mOptions.maxResults,
+                             completions);
+    Trace::message(mId, "returning", completions.size(), "of",
+                   mCompletions.size(), "cached completions");
+    return true;
+}
+
+unsigned RemoteCompletionEngine::completeSignatures(
+    unsigned row, unsigned column, TextBuffer::Snapshot snapshot)
+{
+    const auto request = ++mSignatureRequest;
+    ServerProtocol::Writer message(
+        ServerProtocol::MessageType::CompleteSignatures);
+    std::lock_guard<std::mutex> lock(mMethodMutex);
+    message.writeInt(mRemoteId);
+    message.writeInt(request);
+    message.writeInt(row);
+    message.writeInt(column);
+    if (snapshot.maskedPrefix)
+    {
+        message.writeBlob(snapshot.getUnmaskedText());
+    }
+    else
+    {
+        message.writeBlob(*snapshot.text);
+    }
+    mConnection.send(message);
+    return request;
+}
+
+unsigned RemoteCompletionEngine::lookUp(unsigned row, unsigned column)
+{
+    const auto request = ++mLookUpRequest;
+    ServerProtocol::Writer message(ServerProtocol::MessageType::LookUp);
+    std::lock_guard<std::mutex> lock(mMethodMutex);
+    message.writeInt(mRemoteId);
+    message.writeInt(request);
+    message.writeInt(row);
+    message.writeInt(column);
+    mConnection.send(message);
+    return request;
+}
+
+void RemoteCompletionEngine::handleMessage(ServerProtocol::Reader &message)
+{
+    using ServerProtocol::MessageType;
+    switch (message.getType())
+    {
+    case MessageType::Loaded:
+        mIsLoaded = true;
+        mCallbacks.onLoaded();
+        break;
+    case MessageType::Diagnostics:
+    {
+        DiagnosticList diagnostics;
+        if (ServerProtocol::deserialize(message.readBlob(), diagnostics) &&
+            message.isValid())
+        {
+            mCallbacks.onDiagnostics(std::move(diagnostics));
+        }
+        break;
+    }
+    case MessageType::Completed:
+    {
+        const auto generation = static_cast<unsigned>(message.readInt());
+        const bool isTruncated = message.readInt() != 0;
+        if (!ServerProtocol::deserialize(message.readBlob(), mResults) ||
+            !message.isValid())
+        {
+            mResults.clear();
+            break;
+        }
+        std::uint64_t requestTime;
+        {
+            std::lock_guard<std::mutex> lock(mMethodMutex);
+            if (isSuperseded(generation))
+            {
+                mResults.clear();
+                break;
+            }
+            mCompletions.swap(mResults);
+            mCompletionsGeneration = generation;
+            mCompletionsTyped = mRequestTyped;
+            mCompletionsTruncated = isTruncated;
+            requestTime = mRequestTime;
+        }
+        mResults.clear();
+        mCallbacks.onCompleted(generation, requestTime);
+        break;
+    }
+    case MessageType::CompletedSignatures:
+    {
+        const auto request = static_cast<unsigned>(message.readInt());
+        std::vector<Signature> signatures;
+        // Like in Reader::readStrings, a bogus count can't make us allocate
+        // much.
+        const auto count = message.readInt();
+        for (std::uint64_t i = 0; i < count && message.isValid(); ++i)
+        {
+            Signature signature;
+            signature.label = message.readString();
+            signature.documentation = message.readString();
+            const auto parameterCount = message.readInt();
+            for (std::uint64_t j = 0; j < parameterCount && message.isValid();
+                 ++j)
+            {
+                const auto begin = static_cast<unsigned>(message.readInt());
+                const auto end = static_cast<unsigned>(message.readInt());
+                signature.parameters.emplace_back(begin, end);
+            }
+            signatures.push_back(std::move(signature));
+        }
+        if (!message.isValid() || request != mSignatureRequest.load()) break;
+        mCallbacks.onSignatures(request, std::move(signatures));
+        break;
+    }
+    case MessageType::LookedUp:
+    {
+        const auto request = static_cast<unsigned>(message.readInt());
+        Declaration declaration;
+        declaration.name = message.readString();
+        declaration.kind = message.readString();
+        declaration.type = message.readString();
+        declaration.documentation = message.readString();
+        declaration.filename = message.readString();
+        declaration.row = static_cast<unsigned>(message.readInt());
+        declaration.column = static_cast<unsigned>(message.readInt());
+        declaration.definitionFilename = message.readString();
+        declaration.definitionRow = static_cast<unsigned>(message.readInt());
+        declaration.definitionColumn = static_cast<unsigned>(message.readInt());
+        if (!message.isValid() || request != mLookUpRequest.load()) break;
+        mCallbacks.onLookedUp(request, std::move(declaration));
+        break;
+    }
+    default:
+        message.discard();
+        break;
+    }
+}
+
+void RemoteCompletionEngine::handleDisconnect()
+{
+    // Completions are requested again once the worker has parsed the file.
+    mIsLoaded = false;
+    // The results of a pending request never come, so it is dropped, or
+    // isCompleting would stay true.
+    std::lock_guard<std::mutex> lock(mMethodMutex);
+    mCompletionsGeneration = ++mGeneration;
+    mCompletions.clear();
+}
+
+void RemoteCompletionEngine::handleReconnect()
+{
+    std::lock_guard<std::mutex> lock(mMethodMutex);
+    if (mRemoteId == 0) return;
+    sendOpen();
+    sendLoad();
+}
+
+} // Clara
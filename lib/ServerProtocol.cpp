@@ -0,0 +1,481 @@
+#include "ServerProtocol.hpp"
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace Clara
+{
+namespace ServerProtocol
+{
+
+namespace
+{
+
+const std::size_t headerSize = sizeof(std::uint32_t) + 1;
+
+enum class BlobKind : std::uint8_t
+{
+    Inline,
+    Shared
+};
+
+void appendBytes(std::string &bytes, const void *data, std::size_t size)
+{
+    bytes.append(static_cast<const char *>(data), size);
+}
+
+void append32(std::string &bytes, std::uint32_t value)
+{
+    appendBytes(bytes, &value, sizeof(value));
+}
+
+void appendString32(std::string &bytes, llvm::StringRef value)
+{
+    append32(bytes, static_cast<std::uint32_t>(value.size()));
+    bytes.append(value.data(), value.size());
+}
+
+// Reads the fields that append32 and appendString32 wrote.
+class Cursor
+{
+  public:
+    explicit Cursor(llvm::StringRef bytes) : mBytes(bytes) {}
+
+    bool read32(std::uint32_t &value)
+    {
+        if (mBytes.size() < sizeof(value)) return false;
+        std::memcpy(&value, mBytes.data(), sizeof(value));
+        mBytes = mBytes.drop_front(sizeof(value));
+        return true;
+    }
+
+    bool readString32(llvm::StringRef &value)
+    {
+        std::uint32_t size;
+        if (!read32(size) || mBytes.size() < size) return false;
+        value = mBytes.take_front(size);
+        mBytes = mBytes.drop_front(size);
+        return true;
+    }
+
+    bool isAtEnd() const { return mBytes.empty(); }
+
+  private:
+    llvm::StringRef mBytes;
+};
+
+std::string createSharedMemoryName()
+{
+    static std::atomic<unsigned> counter{0};
+    // Short, because macOS allows 31 characters.
+    return "/clara-" + std::to_string(getpid()) + "-" +
+           std::to_string(counter++);
+}
+
+bool writeSharedMemory(const std::string &name, llvm::StringRef payload)
+{
+    const int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd == -1) return false;
+    void *address = MAP_FAILED;
+    if (ftruncate(fd, static_cast<off_t>(payload.size())) == 0)
+    {
+        address = mmap(nullptr, payload.size(), PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (address == MAP_FAILED)
+    {
+        shm_unlink(name.c_str());
+        return false;
+    }
+    std::memcpy(address, payload.data(), payload.size());
+    munmap(address, payload.size());
+    return true;
+}
+
+bool readSharedMemory(const std::string &name, std::size_t size,
+                      std::string &payload)
+{
+    const int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd == -1) return false;
+    // The segment is not needed by anybody else.
+    shm_unlink(name.c_str());
+    // Reading beyond the end of a shorter segment would raise SIGBUS. macOS
+    // rounds the size up to whole pages, so it may be larger.
+    struct stat status;
+    if (fstat(fd, &status) != 0 || status.st_size < 0 ||
+        static_cast<std::uint64_t>(status.st_size) < size)
+    {
+        close(fd);
+        return false;
+    }
+    void *address = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (address == MAP_FAILED) return false;
+    payload.assign(static_cast<const char *>(address), size);
+    munmap(address, size);
+    return true;
+}
+
+bool fillAddress(const std::string &path, sockaddr_un &address)
+{
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    return true;
+}
+
+int createSocket()
+{
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) return -1;
+    // Neither the plugin host nor a worker should inherit the other's
+    // sockets.
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+#ifdef SO_NOSIGPIPE
+    const int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+    return fd;
+}
+
+} // anonymous namespace
+
+Writer::Writer(MessageType type)
+{
+    mFrame.resize(headerSize);
+    mFrame[sizeof(std::uint32_t)] = static_cast<char>(type);
+}
+
+void Writer::writeInt(std::uint64_t value)
+{
+    appendBytes(mFrame, &value, sizeof(value));
+}
+
+void Writer::writeString(llvm::StringRef value)
+{
+    writeInt(value.size());
+    mFrame.append(value.data(), value.size());
+}
+
+void Writer::writeStrings(const std::vector<std::string> &values)
+{
+    writeInt(values.size());
+    for (const auto &value : values) writeString(value);
+}
+
+void Writer::writeBlob(llvm::StringRef payload)
+{
+    if (payload.size() > inlineLimit)
+    {
+        auto name = createSharedMemoryName();
+        if (writeSharedMemory(name, payload))
+        {
+            writeInt(static_cast<std::uint64_t>(BlobKind::Shared));
+            writeString(name);
+            writeInt(payload.size());
+            mSharedMemory.push_back(std::move(name));
+            return;
+        }
+    }
+    writeInt(static_cast<std::uint64_t>(BlobKind::Inline));
+    writeString(payload);
+}
+
+const std::string &Writer::finish()
+{
+    const auto size = static_cast<std::uint32_t>(mFrame.size());
+    std::memcpy(&mFrame[0], &size, sizeof(size));
+    return mFrame;
+}
+
+void Writer::discard()
+{
+    for (const auto &name : mSharedMemory) shm_unlink(name.c_str());
+    mSharedMemory.clear();
+}
+
+Reader::Reader(llvm::StringRef frame)
+{
+    if (frame.size() < headerSize)
+    {
+        mIsValid = false;
+        return;
+    }
+    mType = static_cast<MessageType>(frame[sizeof(std::uint32_t)]);
+    mData = frame.drop_front(headerSize);
+}
+
+llvm::StringRef Reader::read(std::size_t size)
+{
+    if (!mIsValid || mData.size() < size)
+    {
+        mIsValid = false;
+        return llvm::StringRef();
+    }
+    const auto result = mData.take_front(size);
+    mData = mData.drop_front(size);
+    return result;
+}
+
+std::uint64_t Reader::readInt()
+{
+    std::uint64_t value = 0;
+    const auto bytes = read(sizeof(value));
+    if (!bytes.empty()) std::memcpy(&value, bytes.data(), sizeof(value));
+    return value;
+}
+
+std::string Reader::readString()
+{
+    return read(readInt()).str();
+}
+
+std::vector<std::string> Reader::readStrings()
+{
+    std::vector<std::string> values;
+    const auto count = readInt();
+    // Every string takes at least its length, so a bogus count can't make
+    // us allocate much.
+    for (std::uint64_t i = 0; i < count && mIsValid; ++i)
+    {
+        values.push_back(readString());
+    }
+    return values;
+}
+
+std::string Reader::readBlob()
+{
+    const auto kind = static_cast<BlobKind>(readInt());
+    if (kind == BlobKind::Inline) return readString();
+    const auto name = readString();
+    const auto size = readInt();
+    std::string payload;
+    if (kind != BlobKind::Shared || !mIsValid ||
+        !readSharedMemory(name, size, payload))
+    {
+        mIsValid = false;
+    }
+    return payload;
+}
+
+void Reader::discard()
+{
+    // Only these messages carry a blob, after their other fields.
+    switch (mType)
+    {
+    case MessageType::Complete:
+        readInt();
+        readInt();
+        readInt();
+        readString();
+        readBlob();
+        break;
+    case MessageType::CompleteSignatures:
+        readInt();
+        readInt();
+        readInt();
+        readBlob();
+        break;
+    case MessageType::SetUnsavedFile:
+        readString();
+        readBlob();
+        break;
+    case MessageType::Diagnostics:
+        readBlob();
+        break;
+    case MessageType::Completed:
+        readInt();
+        readInt();
+        readBlob();
+        break;
+    default:
+        break;
+    }
+}
+
+int connectSocket(const std::string &path)
+{
+    sockaddr_un address;
+    if (!fillAddress(path, address)) return -1;
+    const int fd = createSocket();
+    if (fd == -1) return -1;
+    if (connect(fd, reinterpret_cast<const sockaddr *>(&address),
+                sizeof(address)) == -1)
+    {
+        const int error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+    return fd;
+}
+
+int listenSocket(const std::string &path)
+{
+    sockaddr_un address;
+    if (!fillAddress(path, address)) return -1;
+    const int fd = createSocket();
+    if (fd == -1) return -1;
+    // A worker that crashed leaves its socket file behind.
+    unlink(path.c_str());
+    if (bind(fd, reinterpret_cast<const sockaddr *>(&address),
+             sizeof(address)) == -1 ||
+        chmod(path.c_str(), 0600) == -1 || listen(fd, 8) == -1)
+    {
+        const int error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+    return fd;
+}
+
+bool sendFrame(int socket, llvm::StringRef frame)
+{
+    int flags = 0;
+#ifdef MSG_NOSIGNAL
+    flags = MSG_NOSIGNAL;
+#endif
+    while (!frame.empty())
+    {
+        const auto sent = send(socket, frame.data(), frame.size(), flags);
+        if (sent == -1)
+        {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        frame = frame.drop_front(static_cast<std::size_t>(sent));
+    }
+    return true;
+}
+
+bool receiveFrame(int socket, std::string &frame)
+{
+    const auto receive = [socket](char *data, std::size_t size) {
+        while (size != 0)
+        {
+            const auto received = recv(socket, data, size, 0);
+            if (received == 0) return false;
+            if (received == -1)
+            {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            data += received;
+            size -= static_cast<std::size_t>(received);
+        }
+        return true;
+    };
+    std::uint32_t size;
+    if (!receive(reinterpret_cast<char *>(&size), sizeof(size))) return false;
+    if (size < headerSize || size > maxFrameSize) return false;
+    frame.resize(size);
+    std::memcpy(&frame[0], &size, sizeof(size));
+    return receive(&frame[sizeof(size)], size - sizeof(size));
+}
+
+std::string getSocketPath(const std::string &base, unsigned worker)
+{
+    return base + "." + std::to_string(worker);
+}
+
+void serialize(const CompletionStore &completions, std::string &bytes)
+{
+    bytes.clear();
+    append32(bytes, static_cast<std::uint32_t>(completions.size()));
+    for (std::size_t i = 0; i < completions.size(); ++i)
+    {
+        append32(bytes, completions.getPriority(i));
+        appendString32(bytes, completions.getName(i));
+        appendString32(bytes, completions.getDisplay(i));
+        appendString32(bytes, completions.getSnippet(i));
+    }
+}
+
+bool deserialize(llvm::StringRef bytes, CompletionStore &completions)
+{
+    completions.clear();
+    Cursor cursor(bytes);
+    std::uint32_t count;
+    if (!cursor.read32(count)) return false;
+    for (std::uint32_t i = 0; i < count; ++i)
+    {
+        std::uint32_t priority;
+        llvm::StringRef name, display, snippet;
+        if (!cursor.read32(priority) || !cursor.readString32(name) ||
+            !cursor.readString32(display) || !cursor.readString32(snippet))
+        {
+            return false;
+        }
+        completions.add(name, display, snippet, priority);
+    }
+    return cursor.isAtEnd();
+}
+
+void serialize(const DiagnosticList &diagnostics, std::string &bytes)
+{
+    bytes.clear();
+    const auto counts = diagnostics.getCounts();
+    append32(bytes, std::get<2>(counts));
+    append32(bytes, std::get<3>(counts));
+    append32(bytes, static_cast<std::uint32_t>(diagnostics.size()));
+    for (std::size_t i = 0; i < diagnostics.size(); ++i)
+    {
+        const auto range = diagnostics.getRange(i);
+        append32(bytes, diagnostics.isError(i) ? 1 : 0);
+        append32(bytes, std::get<0>(range));
+        append32(bytes, std::get<1>(range));
+        append32(bytes, std::get<2>(range));
+        append32(bytes, std::get<3>(range));
+        appendString32(bytes, diagnostics.getMessage(i));
+    }
+}
+
+bool deserialize(llvm::StringRef bytes, DiagnosticList &diagnostics)
+{
+    diagnostics.clear();
+    Cursor cursor(bytes);
+    std::uint32_t elsewhereErrors, elsewhereWarnings, count;
+    if (!cursor.read32(elsewhereErrors) || !cursor.read32(elsewhereWarnings) ||
+        !cursor.read32(count))
+    {
+        return false;
+    }
+    // These are only counted, so this is cheap even for huge counts.
+    for (std::uint32_t i = 0; i < elsewhereErrors; ++i)
+    {
+        diagnostics.addElsewhere(true);
+    }
+    for (std::uint32_t i = 0; i < elsewhereWarnings; ++i)
+    {
+        diagnostics.addElsewhere(false);
+    }
+    for (std::uint32_t i = 0; i < count; ++i)
+    {
+        std::uint32_t isError, row, column, endRow, endColumn;
+        llvm::StringRef message;
+        if (!cursor.read32(isError) || !cursor.read32(row) ||
+            !cursor.read32(column) || !cursor.read32(endRow) ||
+            !cursor.read32(endColumn) || !cursor.readString32(message))
+        {
+            return false;
+        }
+        diagnostics.add(isError != 0, row, column, endRow, endColumn,
+                        message);
+    }
+    return cursor.isAtEnd();
+}
+
+} // ServerProtocol
+} // Clara
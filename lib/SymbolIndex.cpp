@@ -0,0 +1,1034 @@
+#include "SymbolIndex.hpp"
+#include "CompletionEngine.hpp"
+#include "Trace.hpp"
+#include "WorkerPool.hpp"
+#include <algorithm>
+#include <chrono>
+#include <clang/AST/ASTConsumer.h>
+#include <clang/AST/ASTContext.h>
+#include <clang/AST/Decl.h>
+#include <clang/Basic/Version.h>
+#include <clang/Frontend/CompilerInstance.h>
+#include <clang/Frontend/FrontendAction.h>
+#include <clang/Frontend/Utils.h>
+#include <clang/Index/IndexDataConsumer.h>
+#include <clang/Index/IndexSymbol.h>
+#include <clang/Index/IndexingAction.h>
+#include <clang/Index/USRGeneration.h>
+#include <clang/Lex/MacroInfo.h>
+#include <clang/Lex/PPCallbacks.h>
+#include <clang/Lex/Preprocessor.h>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MD5.h>
+#include <llvm/Support/Path.h>
+#include <set>
+#include <tuple>
+
+namespace
+{
+
+// Bumped whenever the shards or the index change shape.
+const char *const shardHeader = "clara-shard 2";
+// The last line of a complete shard.
+const char *const shardTrailer = "end";
+const char indexMagic[8] = {'C', 'L', 'A', 'R', 'A', 'I', 'X', '1'};
+
+const std::uint32_t noFile = std::numeric_limits<std::uint32_t>::max();
+
+// The index file is a header, followed by the offsets of the file names, the
+// symbols sorted by name, their occurrences, and finally the strings that
+// all of these point into. Every string ends with a null character.
+struct IndexHeader
+{
+    char magic[8];
+    std::uint32_t fileCount;
+    std::uint32_t symbolCount;
+    std::uint32_t occurrenceCount;
+    std::uint32_t stringSize;
+};
+
+struct SymbolRecord
+{
+    std::uint32_t name;
+    std::uint32_t qualifiedName;
+    std::uint32_t kind;
+    // The best location first: definitions, then declarations.
+    std::uint32_t firstOccurrence;
+    std::uint32_t occurrenceCount;
+};
+
+struct OccurrenceRecord
+{
+    std::uint32_t file;
+    std::uint32_t line;
+    std::uint32_t column;
+    std::uint32_t roles;
+};
+
+// The parts of a mapped index file.
+struct IndexView
+{
+    IndexHeader header;
+    const std::uint32_t *files;
+    const SymbolRecord *symbols;
+    const OccurrenceRecord *occurrences;
+    const char *strings;
+};
+
+// Returns false if the buffer is too small for the parts that its header
+// claims. Doesn't look at the records.
+bool getIndexView(const llvm::MemoryBuffer &buffer, IndexView &view)
+{
+    const auto *data = buffer.getBufferStart();
+    const auto size = buffer.getBufferSize();
+    if (size < sizeof(IndexHeader)) return false;
+    std::memcpy(&view.header, data, sizeof(view.header));
+    if (std::memcmp(view.header.magic, indexMagic, sizeof(indexMagic)) != 0)
+    {
+        return false;
+    }
+    const auto filesOffset = sizeof(IndexHeader);
+    const auto symbolsOffset =
+        filesOffset +
+        std::size_t(view.header.fileCount) * sizeof(std::uint32_t);
+    const auto occurrencesOffset =
+        symbolsOffset +
+        std::size_t(view.header.symbolCount) * sizeof(SymbolRecord);
+    const auto stringsOffset =
+        occurrencesOffset +
+        std::size_t(view.header.occurrenceCount) * sizeof(OccurrenceRecord);
+    if (stringsOffset + view.header.stringSize > size) return false;
+    view.files = reinterpret_cast<const std::uint32_t *>(data + filesOffset);
+    view.symbols = reinterpret_cast<const SymbolRecord *>(data + symbolsOffset);
+    view.occurrences =
+        reinterpret_cast<const OccurrenceRecord *>(data + occurrencesOffset);
+    view.strings = data + stringsOffset;
+    return true;
+}
+
+// Returns true if every offset in the index points into its tables, so that
+// lookups need not check them. The index may be left over from a crash, or
+// from another version.
+bool isValidIndex(const llvm::MemoryBuffer &buffer)
+{
+    IndexView view;
+    if (!getIndexView(buffer, view)) return false;
+    const auto &header = view.header;
+    // A string that runs off the end would be read past the buffer.
+    if (header.stringSize != 0 && view.strings[header.stringSize - 1] != '\0')
+    {
+        return false;
+    }
+    for (std::uint32_t i = 0; i < header.fileCount; ++i)
+    {
+        if (view.files[i] >= header.stringSize) return false;
+    }
+    for (std::uint32_t i = 0; i < header.symbolCount; ++i)
+    {
+        const auto &symbol = view.symbols[i];
+        if (symbol.name >= header.stringSize ||
+            symbol.qualifiedName >= header.stringSize ||
+            symbol.kind >= header.stringSize ||
+            symbol.firstOccurrence >= header.occurrenceCount)
+        {
+            return false;
+        }
+    }
+    for (std::uint32_t i = 0; i < header.occurrenceCount; ++i)
+    {
+        if (view.occurrences[i].file >= header.fileCount) return false;
+    }
+    return true;
+}
+
+char toLower(char c)
+{
+    return c >= 'A' && c <= 'Z' ? static_cast<char>(c - 'A' + 'a') : c;
+}
+
+// Compares the first characters of lhs, at most as many as rhs has, with
+// rhs, ignoring case. Zero means that lhs starts with rhs.
+int comparePrefix(const char *lhs, llvm::StringRef rhs)
+{
+    for (const char c : rhs)
+    {
+        const char l = toLower(*lhs++);
+        const char r = toLower(c);
+        if (l != r) return l < r ? -1 : 1;
+    }
+    return 0;
+}
+
+int compareLower(llvm::StringRef lhs, llvm::StringRef rhs)
+{
+    const auto size = std::min(lhs.size(), rhs.size());
+    for (std::size_t i = 0; i < size; ++i)
+    {
+        const char l = toLower(lhs[i]);
+        const char r = toLower(rhs[i]);
+        if (l != r) return l < r ? -1 : 1;
+    }
+    if (lhs.size() == rhs.size()) return 0;
+    return lhs.size() < rhs.size() ? -1 : 1;
+}
+
+long long getModificationTime(const llvm::sys::fs::file_status &status)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               status.getLastModificationTime().time_since_epoch())
+        .count();
+}
+
+std::string getAbsolutePath(llvm::StringRef path, llvm::StringRef directory)
+{
+    llvm::SmallString<256> result;
+    if (llvm::sys::path::is_relative(path)) result = directory;
+    llvm::sys::path::append(result, path);
+    llvm::sys::path::remove_dots(result, /*remove_dot_dot=*/true);
+    llvm::sys::path::native(result);
+    return result.str().str();
+}
+
+std::string hash(llvm::ArrayRef<llvm::StringRef> strings)
+{
+    llvm::MD5 md5;
+    for (const auto str : strings)
+    {
+        md5.update(str);
+        md5.update(llvm::StringRef("\0", 1));
+    }
+    llvm::MD5::MD5Result result;
+    md5.final(result);
+    llvm::SmallString<32> hex;
+    llvm::MD5::stringifyResult(result, hex);
+    return hex.str().str();
+}
+
+// Drops the occurrences that were reported more than once, keeping all of
+// their roles. Sorts them by symbol and location.
+void removeDuplicates(
+    std::vector<Clara::SymbolIndex::Shard::Occurrence> &occurrences)
+{
+    using Occurrence = Clara::SymbolIndex::Shard::Occurrence;
+    std::sort(occurrences.begin(), occurrences.end(),
+              [](const Occurrence &lhs, const Occurrence &rhs) {
+                  return std::tie(lhs.symbol, lhs.file, lhs.line,
+                                  lhs.column) <
+                         std::tie(rhs.symbol, rhs.file, rhs.line, rhs.column);
+              });
+    std::size_t size = 0;
+    for (const auto &occurrence : occurrences)
+    {
+        if (size != 0)
+        {
+            auto &last = occurrences[size - 1];
+            if (last.symbol == occurrence.symbol &&
+                last.file == occurrence.file &&
+                last.line == occurrence.line &&
+                last.column == occurrence.column)
+            {
+                last.roles |= occurrence.roles;
+                continue;
+            }
+        }
+        occurrences[size++] = occurrence;
+    }
+    occurrences.resize(size);
+}
+
+class UserDependencyCollector : public clang::DependencyCollector
+{
+  public:
+    // System headers are not indexed, so they don't make a shard stale.
+    bool needSystemDependencies() override { return false; }
+};
+
+// Collects the symbols and occurrences of one unit into a shard. Files are
+// looked up once, and those of system headers are skipped.
+class ShardBuilder
+{
+  public:
+    ShardBuilder(Clara::SymbolIndex::Shard &shard, std::string directory)
+        : mShard(shard), mDirectory(std::move(directory))
+    {
+    }
+
+    void setSourceManager(const clang::SourceManager &sourceManager)
+    {
+        mSourceManager = &sourceManager;
+    }
+
+    void addDecl(const clang::Decl *decl, clang::index::SymbolRoleSet roles,
+                 clang::FileID file, unsigned offset)
+    {
+        using clang::index::SymbolRole;
+        if (roles & static_cast<clang::index::SymbolRoleSet>(
+                        SymbolRole::Implicit))
+        {
+            return;
+        }
+        const auto *named = llvm::dyn_cast<clang::NamedDecl>(decl);
+        if (!named) return;
+        const auto fileIndex = addFile(file);
+        if (fileIndex == noFile) return;
+        auto name = named->getNameAsString();
+        if (name.empty()) return;
+        llvm::SmallString<128> usr;
+        if (clang::index::generateUSRForDecl(decl, usr)) return;
+        std::uint32_t ownRoles = 0;
+        if (roles & static_cast<clang::index::SymbolRoleSet>(
+                        SymbolRole::Declaration))
+        {
+            ownRoles |= Clara::SymbolIndex::Shard::Declaration;
+        }
+        if (roles & static_cast<clang::index::SymbolRoleSet>(
+                        SymbolRole::Definition))
+        {
+            ownRoles |= Clara::SymbolIndex::Shard::Definition;
+        }
+        if (roles & static_cast<clang::index::SymbolRoleSet>(
+                        SymbolRole::Reference))
+        {
+            ownRoles |= Clara::SymbolIndex::Shard::Reference;
+        }
+        if (ownRoles == 0) return;
+        const auto symbol = addSymbol(
+            usr.str().str(), std::move(name), named->getQualifiedNameAsString(),
+            clang::index::getSymbolKindString(
+                clang::index::getSymbolInfo(decl).Kind));
+        addOccurrence(symbol, fileIndex, file, offset, ownRoles);
+    }
+
+    void addMacro(const clang::Token &name, const clang::MacroInfo *info,
+                  std::uint32_t roles)
+    {
+        if (!mSourceManager || !info || !name.getIdentifierInfo()) return;
+        const auto location =
+            mSourceManager->getDecomposedLoc(
+                mSourceManager->getFileLoc(name.getLocation()));
+        const auto definition = mSourceManager->getDecomposedLoc(
+            mSourceManager->getFileLoc(info->getDefinitionLoc()));
+        const auto definitionFile = addFile(definition.first);
+        const auto fileIndex = addFile(location.first);
+        if (definitionFile == noFile || fileIndex == noFile) return;
+        // Like clang's own USRs of macros. Macros that are defined in
+        // different files are different symbols.
+        const auto macroName = name.getIdentifierInfo()->getName();
+        auto usr = "c:" + mShard.files[definitionFile] + "@macro@" +
+                   macroName.str();
+        const auto symbol = addSymbol(std::move(usr), macroName.str(),
+                                      macroName.str(), "macro");
+        addOccurrence(symbol, fileIndex, location.first, location.second,
+                      roles);
+    }
+
+    void finish() { removeDuplicates(mShard.occurrences); }
+
+  private:
+    std::uint32_t addFile(clang::FileID file)
+    {
+        const auto *entry = mSourceManager->getFileEntryForID(file);
+        if (!entry) return noFile;
+        const auto found = mFiles.find(entry);
+        if (found != mFiles.end()) return found->second;
+        auto result = noFile;
+        if (!mSourceManager->isInSystemHeader(
+                mSourceManager->getComposedLoc(file, 0)))
+        {
+            result = static_cast<std::uint32_t>(mShard.files.size());
+            mShard.files.push_back(
+                getAbsolutePath(entry->getName(), mDirectory));
+        }
+        mFiles.emplace(entry, result);
+        return result;
+    }
+
+    std::uint32_t addSymbol(std::string usr, std::string name,
+                            std::string qualifiedName, llvm::StringRef kind)
+    {
+        const auto found = mSymbols.find(usr);
+        if (found != mSymbols.end()) return found->second;
+        const auto result = static_cast<std::uint32_t>(mShard.symbols.size());
+        mSymbols.emplace(usr, result);
+        mShard.symbols.push_back({std::move(usr), std::move(name),
+                                  std::move(qualifiedName), kind.str()});
+        return result;
+    }
+
+    void addOccurrence(std::uint32_t symbol, std::uint32_t fileIndex,
+                       clang::FileID file, unsigned offset,
+                       std::uint32_t roles)
+    {
+        Clara::SymbolIndex::Shard::Occurrence occurrence;
+        occurrence.symbol = symbol;
+        occurrence.file = fileIndex;
+        occurrence.line = mSourceManager->getLineNumber(file, offset);
+        occurrence.column = mSourceManager->getColumnNumber(file, offset);
+        occurrence.roles = roles;
+        mShard.occurrences.push_back(occurrence);
+    }
+
+    Clara::SymbolIndex::Shard &mShard;
+    const std::string mDirectory;
+    const clang::SourceManager *mSourceManager = nullptr;
+    std::unordered_map<const clang::FileEntry *, std::uint32_t> mFiles;
+    std::unordered_map<std::string, std::uint32_t> mSymbols;
+};
+
+class IndexConsumer : public clang::index::IndexDataConsumer
+{
+  public:
+    explicit IndexConsumer(ShardBuilder &builder) : mBuilder(builder) {}
+
+    void initialize(clang::ASTContext &context) override
+    {
+        mBuilder.setSourceManager(context.getSourceManager());
+    }
+
+    bool handleDeclOccurence(const clang::Decl *decl,
+                             clang::index::SymbolRoleSet roles,
+                             llvm::ArrayRef<clang::index::SymbolRelation>,
+                             clang::FileID file, unsigned offset,
+                             ASTNodeInfo) override
+    {
+        mBuilder.addDecl(decl, roles, file, offset);
+        return true;
+    }
+
+  private:
+    ShardBuilder &mBuilder;
+};
+
+// Clang's indexer leaves out macros, so they are picked up from the
+// preprocessor.
+class MacroCallbacks : public clang::PPCallbacks
+{
+  public:
+    explicit MacroCallbacks(ShardBuilder &builder) : mBuilder(builder) {}
+
+    void MacroDefined(const clang::Token &name,
+                      const clang::MacroDirective *directive) override
+    {
+        mBuilder.addMacro(name, directive->getMacroInfo(),
+                          Clara::SymbolIndex::Shard::Definition);
+    }
+
+    void MacroExpands(const clang::Token &name,
+                      const clang::MacroDefinition &definition,
+                      clang::SourceRange, const clang::MacroArgs *) override
+    {
+        mBuilder.addMacro(name, definition.getMacroInfo(),
+                          Clara::SymbolIndex::Shard::Reference);
+    }
+
+  private:
+    ShardBuilder &mBuilder;
+};
+
+// Wrapped by the indexing action, only to add the MacroCallbacks.
+class MacroAction : public clang::ASTFrontendAction
+{
+  public:
+    explicit MacroAction(ShardBuilder &builder) : mBuilder(builder) {}
+
+    std::unique_ptr<clang::ASTConsumer>
+    CreateASTConsumer(clang::CompilerInstance &, llvm::StringRef) override
+    {
+        return std::make_unique<clang::ASTConsumer>();
+    }
+
+    bool BeginSourceFileAction(clang::CompilerInstance &compiler,
+                               llvm::StringRef) override
+    {
+        mBuilder.setSourceManager(compiler.getSourceManager());
+        compiler.getPreprocessor().addPPCallbacks(
+            std::make_unique<MacroCallbacks>(mBuilder));
+        return true;
+    }
+
+  private:
+    ShardBuilder &mBuilder;
+};
+
+// Hands out offsets into the strings of the index, once per string.
+class StringTable
+{
+  public:
+    std::uint32_t add(const std::string &str)
+    {
+        const auto found = mOffsets.find(str);
+        if (found != mOffsets.end()) return found->second;
+        const auto result = static_cast<std::uint32_t>(mData.size());
+        mData.append(str);
+        mData.push_back('\0');
+        mOffsets.emplace(str, result);
+        return result;
+    }
+
+    const std::string &getData() const { return mData; }
+
+  private:
+    std::string mData;
+    std::unordered_map<std::string, std::uint32_t> mOffsets;
+};
+
+} // anonymous namespace
+
+namespace Clara
+{
+
+SymbolIndex::SymbolIndex(std::string directory,
+                         CompletionBackend::Options options)
+    : mDirectory(std::move(directory)), mOptions(std::move(options))
+{
+    llvm::sys::fs::create_directories(mDirectory);
+    // The index of an earlier session serves until the first merge.
+    llvm::SmallString<256> path(mDirectory);
+    llvm::sys::path::append(path, "index.bin");
+    auto buffer = llvm::MemoryBuffer::getFile(path, -1, false);
+    if (buffer && isValidIndex(**buffer)) mIndex = std::move(*buffer);
+}
+
+void SymbolIndex::build(std::vector<Unit> units)
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mUnits.clear();
+        for (const auto &unit : units) mUnits.emplace(unit.filename, unit);
+    }
+    index(units);
+}
+
+void SymbolIndex::update(const std::string &filename)
+{
+    std::vector<Unit> units;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        std::set<std::string> filenames;
+        if (mUnits.count(filename) != 0) filenames.insert(filename);
+        const auto found = mDependents.find(filename);
+        if (found != mDependents.end())
+        {
+            filenames.insert(found->second.begin(), found->second.end());
+        }
+        for (const auto &unit : filenames)
+        {
+            const auto findResult = mUnits.find(unit);
+            if (findResult != mUnits.end()) units.push_back(findResult->second);
+        }
+    }
+    if (!units.empty()) index(units);
+}
+
+void SymbolIndex::stop() { mIsStopped = true; }
+
+void SymbolIndex::index(const std::vector<Unit> &units)
+{
+    const auto self = shared_from_this();
+    if (units.empty())
+    {
+        // Merging drops the shards of units that were removed.
+        WorkerPool::get().post(this, WorkerPool::Priority::Background,
+                               [self]() { self->merge(); });
+        return;
+    }
+    mPending += units.size();
+    for (const auto &unit : units)
+    {
+        // Always the same strand for a unit, so that it is never indexed
+        // twice at the same time.
+        const auto *strand =
+            &mStrands[std::hash<std::string>()(unit.filename) % strandCount];
+        WorkerPool::get().post(strand, WorkerPool::Priority::Background,
+                               [self, unit]() { self->indexJob(unit); });
+    }
+}
+
+void SymbolIndex::indexJob(const Unit &unit)
+{
+    if (!mIsStopped)
+    {
+        const auto path = getShardPath(unit.filename);
+        const auto command = hashCommand(unit);
+        if (!isUpToDate(path, command))
+        {
+            Trace::Scope scope(0, "index");
+            Trace::message(0, "indexing", unit.filename);
+            Shard shard;
+            shard.command = command;
+            if (indexUnit(unit, mOptions, shard)) writeShard(path, shard);
+        }
+    }
+    if (--mPending == 0 && !mIsStopped)
+    {
+        const auto self = shared_from_this();
+        WorkerPool::get().post(this, WorkerPool::Priority::Background,
+                               [self]() { self->merge(); });
+    }
+}
+
+bool SymbolIndex::indexUnit(const Unit &unit,
+                            const CompletionBackend::Options &options,
+                            Shard &shard)
+{
+    const auto commandLine = CompletionEngine::getCommandLine(unit.command);
+    clang::IntrusiveRefCntPtr<clang::DiagnosticsEngine> diags(
+        new clang::DiagnosticsEngine(
+            new clang::DiagnosticIDs(), new clang::DiagnosticOptions(),
+            new clang::IgnoringDiagConsumer(), /*ShouldOwnClient*/ true));
+    std::shared_ptr<clang::CompilerInvocation> invocation =
+        CompletionEngine::createInvocation(commandLine, unit.directory,
+                                           options, diags);
+    if (!invocation) return false;
+    auto &frontendOpts = invocation->getFrontendOpts();
+    // The references in function bodies are what an index is for.
+    frontendOpts.SkipFunctionBodies = 0;
+    // Otherwise every unit leaks its AST.
+    frontendOpts.DisableFree = 0;
+
+    clang::CompilerInstance compiler(
+        std::make_shared<clang::PCHContainerOperations>());
+    compiler.setInvocation(std::move(invocation));
+    compiler.createDiagnostics(new clang::IgnoringDiagConsumer(),
+                               /*ShouldOwnClient*/ true);
+    auto collector = std::make_shared<UserDependencyCollector>();
+    compiler.addDependencyCollector(collector);
+    ShardBuilder builder(shard, unit.directory);
+    clang::index::IndexingOptions indexingOptions;
+    indexingOptions.SystemSymbolFilter =
+        clang::index::IndexingOptions::SystemSymbolFilterKind::None;
+    indexingOptions.IndexFunctionLocals = false;
+    auto action = clang::index::createIndexingAction(
+        std::make_shared<IndexConsumer>(builder), indexingOptions,
+        std::make_unique<MacroAction>(builder));
+    // A unit with errors is still indexed as far as clang got.
+    if (!compiler.ExecuteAction(*action)) return false;
+    builder.finish();
+
+    std::set<std::string> paths;
+    paths.insert(getAbsolutePath(unit.filename, unit.directory));
+    for (const auto &path : collector->getDependencies())
+    {
+        paths.insert(getAbsolutePath(path, unit.directory));
+    }
+    for (const auto &path : paths)
+    {
+        llvm::sys::fs::file_status status;
+        if (llvm::sys::fs::status(path, status)) continue;
+        PreambleCache::Dependency dependency;
+        dependency.path = path;
+        dependency.modificationTime = getModificationTime(status);
+        dependency.size = status.getSize();
+        shard.dependencies.push_back(std::move(dependency));
+    }
+    return true;
+}
+
+std::string SymbolIndex::hashCommand(const Unit &unit)
+{
+    std::vector<llvm::StringRef> strings;
+    // Clang indexes differently from one version to the next.
+    const auto version = clang::getClangFullRepositoryVersion();
+    strings.push_back(shardHeader);
+    strings.push_back(version);
+    strings.push_back(unit.directory);
+    strings.push_back(unit.filename);
+    for (const auto &argument : unit.command) strings.push_back(argument);
+    return hash(strings);
+}
+
+std::string SymbolIndex::getShardPath(const std::string &filename) const
+{
+    llvm::SmallString<256> path(mDirectory);
+    llvm::sys::path::append(path, hash({filename}) + ".shard");
+    return path.str().str();
+}
+
+// A shard is a text file with one record per line, dependencies first:
+//
+// clara-shard 2
+// command <hash>
+// dependency <mtime> <size> <path>
+// file <path>
+// symbol <usr>\t<name>\t<qualified name>\t<kind>
+// occurrence <symbol> <file> <line> <column> <roles>
+// end
+//
+// Symbols and occurrences refer to earlier records by their index.
+
+bool SymbolIndex::writeShard(const std::string &path, const Shard &shard)
+{
+    // Written next to it and then renamed, so that a crash never leaves half
+    // a shard behind.
+    int fd;
+    llvm::SmallString<256> temporary;
+    if (llvm::sys::fs::createUniqueFile(path + "-%%%%%%%%.tmp", fd,
+                                        temporary))
+    {
+        return false;
+    }
+    bool isWritten;
+    {
+        llvm::raw_fd_ostream file(fd, /*shouldClose*/ true);
+        file << shardHeader << '\n' << "command " << shard.command << '\n';
+        for (const auto &dependency : shard.dependencies)
+        {
+            file << "dependency " << dependency.modificationTime << ' '
+                 << dependency.size << ' ' << dependency.path << '\n';
+        }
+        for (const auto &filename : shard.files)
+        {
+            file << "file " << filename << '\n';
+        }
+        for (const auto &symbol : shard.symbols)
+        {
+            file << "symbol " << symbol.usr << '\t' << symbol.name << '\t'
+                 << symbol.qualifiedName << '\t' << symbol.kind << '\n';
+        }
+        for (const auto &occurrence : shard.occurrences)
+        {
+            file << "occurrence " << occurrence.symbol << ' '
+                 << occurrence.file << ' ' << occurrence.line << ' '
+                 << occurrence.column << ' ' << occurrence.roles << '\n';
+        }
+        file << shardTrailer << '\n';
+        file.close();
+        isWritten = !file.has_error();
+        file.clear_error();
+    }
+    if (!isWritten || llvm::sys::fs::rename(temporary, path))
+    {
+        llvm::sys::fs::remove(temporary);
+        return false;
+    }
+    return true;
+}
+
+bool SymbolIndex::readShard(const std::string &path, Shard &shard)
+{
+    auto buffer = llvm::MemoryBuffer::getFile(path);
+    if (!buffer) return false;
+    llvm::StringRef rest = (*buffer)->getBuffer();
+    llvm::StringRef line;
+    std::tie(line, rest) = rest.split('\n');
+    if (line != shardHeader) return false;
+    while (!rest.empty())
+    {
+        std::tie(line, rest) = rest.split('\n');
+        if (line == shardTrailer) return rest.empty();
+        llvm::StringRef kind;
+        std::tie(kind, line) = line.split(' ');
+        if (kind == "command")
+        {
+            shard.command = line.str();
+        }
+        else if (kind == "dependency")
+        {
+            llvm::StringRef time, size;
+            std::tie(time, line) = line.split(' ');
+            std::tie(size, line) = line.split(' ');
+            PreambleCache::Dependency dependency;
+            if (time.getAsInteger(10, dependency.modificationTime) ||
+                size.getAsInteger(10, dependency.size))
+            {
+                return false;
+            }
+            dependency.path = line.str();
+            shard.dependencies.push_back(std::move(dependency));
+        }
+        else if (kind == "file")
+        {
+            shard.files.push_back(line.str());
+        }
+        else if (kind == "symbol")
+        {
+            llvm::SmallVector<llvm::StringRef, 4> fields;
+            line.split(fields, '\t');
+            if (fields.size() != 4) return false;
+            shard.symbols.push_back({fields[0].str(), fields[1].str(),
+                                     fields[2].str(), fields[3].str()});
+        }
+        else if (kind == "occurrence")
+        {
+            llvm::SmallVector<llvm::StringRef, 5> fields;
+            line.split(fields, ' ');
+            Shard::Occurrence occurrence;
+            if (fields.size() != 5 ||
+                fields[0].getAsInteger(10, occurrence.symbol) ||
+                fields[1].getAsInteger(10, occurrence.file) ||
+                fields[2].getAsInteger(10, occurrence.line) ||
+                fields[3].getAsInteger(10, occurrence.column) ||
+                fields[4].getAsInteger(10, occurrence.roles) ||
+                occurrence.symbol >= shard.symbols.size() ||
+                occurrence.file >= shard.files.size())
+            {
+                return false;
+            }
+            shard.occurrences.push_back(occurrence);
+        }
+    }
+    // Cut off.
+    return false;
+}
+
+bool SymbolIndex::isUpToDate(const std::string &path,
+                             const std::string &command)
+{
+    auto buffer = llvm::MemoryBuffer::getFile(path);
+    if (!buffer) return false;
+    llvm::StringRef rest = (*buffer)->getBuffer();
+    // A shard that was cut off is indexed again.
+    if (!rest.endswith("\n" + std::string(shardTrailer) + "\n")) return false;
+    llvm::StringRef line;
+    std::tie(line, rest) = rest.split('\n');
+    if (line != shardHeader) return false;
+    std::tie(line, rest) = rest.split('\n');
+    if (line != "command " + command) return false;
+    // Only the dependencies are read, which come first.
+    while (!rest.empty())
+    {
+        std::tie(line, rest) = rest.split('\n');
+        llvm::StringRef kind, time, size;
+        std::tie(kind, line) = line.split(' ');
+        if (kind != "dependency") break;
+        std::tie(time, line) = line.split(' ');
+        std::tie(size, line) = line.split(' ');
+        long long modificationTime;
+        unsigned long long fileSize;
+        llvm::sys::fs::file_status status;
+        if (time.getAsInteger(10, modificationTime) ||
+            size.getAsInteger(10, fileSize) ||
+            llvm::sys::fs::status(line, status) ||
+            getModificationTime(status) != modificationTime ||
+            status.getSize() != fileSize)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void SymbolIndex::merge()
+{
+    if (mIsStopped) return;
+    Trace::Scope scope(0, "merge index");
+    std::vector<std::string> units;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        for (const auto &unit : mUnits) units.push_back(unit.first);
+    }
+    // Headers are indexed with every unit that includes them, so the same
+    // symbols and occurrences come from many shards.
+    std::vector<std::string> files;
+    std::unordered_map<std::string, std::uint32_t> fileIds;
+    std::vector<Shard::Symbol> symbols;
+    std::unordered_map<std::string, std::uint32_t> symbolIds;
+    std::vector<Shard::Occurrence> occurrences;
+    std::unordered_map<std::string, std::vector<std::string>> dependents;
+    std::set<std::string> shards;
+    for (const auto &unit : units)
+    {
+        if (mIsStopped) return;
+        const auto path = getShardPath(unit);
+        shards.insert(llvm::sys::path::filename(path).str());
+        Shard shard;
+        if (!readShard(path, shard))
+        {
+            // So that isUpToDate doesn't take it for up to date, and the next
+            // run indexes the unit again.
+            llvm::sys::fs::remove(path);
+            continue;
+        }
+        for (const auto &dependency : shard.dependencies)
+        {
+            dependents[dependency.path].push_back(unit);
+        }
+        std::vector<std::uint32_t> fileMap;
+        for (auto &filename : shard.files)
+        {
+            const auto id = static_cast<std::uint32_t>(files.size());
+            const auto inserted = fileIds.emplace(filename, id);
+            if (inserted.second) files.push_back(std::move(filename));
+            fileMap.push_back(inserted.first->second);
+        }
+        std::vector<std::uint32_t> symbolMap;
+        for (auto &symbol : shard.symbols)
+        {
+            const auto id = static_cast<std::uint32_t>(symbols.size());
+            const auto inserted = symbolIds.emplace(symbol.usr, id);
+            if (inserted.second) symbols.push_back(std::move(symbol));
+            symbolMap.push_back(inserted.first->second);
+        }
+        for (auto occurrence : shard.occurrences)
+        {
+            occurrence.symbol = symbolMap[occurrence.symbol];
+            occurrence.file = fileMap[occurrence.file];
+            occurrences.push_back(occurrence);
+        }
+    }
+    symbolIds.clear();
+
+    // Definitions first, then declarations, then references, so that the
+    // first occurrence of a symbol is where to go to.
+    const auto rank = [](std::uint32_t roles) {
+        if (roles & Shard::Definition) return 0;
+        if (roles & Shard::Declaration) return 1;
+        return 2;
+    };
+    removeDuplicates(occurrences);
+    std::stable_sort(
+        occurrences.begin(), occurrences.end(),
+        [&rank](const Shard::Occurrence &lhs, const Shard::Occurrence &rhs) {
+            if (lhs.symbol != rhs.symbol) return lhs.symbol < rhs.symbol;
+            return rank(lhs.roles) < rank(rhs.roles);
+        });
+
+    std::vector<std::uint32_t> order(symbols.size());
+    for (std::uint32_t i = 0; i < order.size(); ++i) order[i] = i;
+    std::sort(order.begin(), order.end(),
+              [&symbols](std::uint32_t lhs, std::uint32_t rhs) {
+                  const auto compare =
+                      compareLower(symbols[lhs].name, symbols[rhs].name);
+                  if (compare != 0) return compare < 0;
+                  return symbols[lhs].qualifiedName <
+                         symbols[rhs].qualifiedName;
+              });
+    std::vector<std::size_t> firstOccurrence(symbols.size(),
+                                             occurrences.size());
+    for (std::size_t i = occurrences.size(); i-- > 0;)
+    {
+        firstOccurrence[occurrences[i].symbol] = i;
+    }
+
+    StringTable strings;
+    std::vector<std::uint32_t> fileRecords;
+    for (const auto &filename : files)
+    {
+        fileRecords.push_back(strings.add(filename));
+    }
+    std::vector<SymbolRecord> symbolRecords;
+    std::vector<OccurrenceRecord> occurrenceRecords;
+    for (const auto id : order)
+    {
+        const auto &symbol = symbols[id];
+        std::uint32_t count = 0;
+        for (auto i = firstOccurrence[id];
+             i < occurrences.size() && occurrences[i].symbol == id; ++i)
+        {
+            const auto &occurrence = occurrences[i];
+            occurrenceRecords.push_back({occurrence.file, occurrence.line,
+                                         occurrence.column, occurrence.roles});
+            ++count;
+        }
+        if (count == 0) continue;
+        SymbolRecord record;
+        record.name = strings.add(symbol.name);
+        record.qualifiedName = strings.add(symbol.qualifiedName);
+        record.kind = strings.add(symbol.kind);
+        record.firstOccurrence =
+            static_cast<std::uint32_t>(occurrenceRecords.size() - count);
+        record.occurrenceCount = count;
+        symbolRecords.push_back(record);
+    }
+
+    IndexHeader header;
+    std::memcpy(header.magic, indexMagic, sizeof(indexMagic));
+    header.fileCount = static_cast<std::uint32_t>(fileRecords.size());
+    header.symbolCount = static_cast<std::uint32_t>(symbolRecords.size());
+    header.occurrenceCount =
+        static_cast<std::uint32_t>(occurrenceRecords.size());
+    header.stringSize = static_cast<std::uint32_t>(strings.getData().size());
+    llvm::SmallString<256> path(mDirectory);
+    llvm::sys::path::append(path, "index.bin");
+    const auto temporary = path.str().str() + ".tmp";
+    {
+        std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+        const auto write = [&file](const void *data, std::size_t size) {
+            file.write(static_cast<const char *>(data), size);
+        };
+        write(&header, sizeof(header));
+        write(fileRecords.data(), fileRecords.size() * sizeof(std::uint32_t));
+        write(symbolRecords.data(),
+              symbolRecords.size() * sizeof(SymbolRecord));
+        write(occurrenceRecords.data(),
+              occurrenceRecords.size() * sizeof(OccurrenceRecord));
+        write(strings.getData().data(), strings.getData().size());
+        // Flushing the last of it may fail too.
+        file.close();
+        if (!file)
+        {
+            llvm::sys::fs::remove(temporary);
+            return;
+        }
+    }
+    // A mapped index stays valid when it is replaced, as the old file lives
+    // on until it is unmapped.
+    if (llvm::sys::fs::rename(temporary, path)) return;
+    auto buffer = llvm::MemoryBuffer::getFile(path, -1, false);
+    if (!buffer || !isValidIndex(**buffer)) return;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mIndex = std::move(*buffer);
+        mDependents = std::move(dependents);
+    }
+    Trace::message(0, "indexed symbols", std::to_string(symbolRecords.size()));
+
+    // The shards of units that left the database.
+    std::error_code error;
+    for (llvm::sys::fs::directory_iterator i(mDirectory, error), end;
+         !error && i != end; i.increment(error))
+    {
+        const auto name = llvm::sys::path::filename(i->path());
+        if (name.endswith(".shard") && shards.count(name.str()) == 0)
+        {
+            llvm::sys::fs::remove(i->path());
+        }
+    }
+}
+
+std::vector<SymbolIndex::Symbol>
+SymbolIndex::find(llvm::StringRef query, std::size_t maxResults) const
+{
+    std::shared_ptr<llvm::MemoryBuffer> index;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        index = mIndex;
+    }
+    std::vector<Symbol> result;
+    if (!index || query.empty()) return result;
+    // The offsets were checked when the index was loaded.
+    IndexView view;
+    if (!getIndexView(*index, view)) return result;
+    const auto &header = view.header;
+    const auto *files = view.files;
+    const auto *symbols = view.symbols;
+    const auto *occurrences = view.occurrences;
+    const auto *strings = view.strings;
+
+    const auto *first = std::lower_bound(
+        symbols, symbols + header.symbolCount, query,
+        [strings](const SymbolRecord &symbol, llvm::StringRef query) {
+            return compareLower(strings + symbol.name, query) < 0;
+        });
+    for (const auto *symbol = first; symbol != symbols + header.symbolCount &&
+                                     result.size() < maxResults;
+         ++symbol)
+    {
+        if (comparePrefix(strings + symbol->name, query) != 0) break;
+        const auto &occurrence = occurrences[symbol->firstOccurrence];
+        Symbol found;
+        found.name = strings + symbol->name;
+        found.qualifiedName = strings + symbol->qualifiedName;
+        found.kind = strings + symbol->kind;
+        found.filename = strings + files[occurrence.file];
+        found.line = occurrence.line;
+        found.column = occurrence.column;
+        result.push_back(std::move(found));
+    }
+    return result;
+}
+
+} // Clara
@@ -0,0 +1,276 @@
+#include "TextBuffer.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+
+namespace Clara
+{
+
+std::unique_ptr<llvm::MemoryBuffer>
+TextBuffer::Snapshot::getMemoryBuffer(llvm::StringRef name) const
+{
+    // std::string guarantees the null terminator that clang relies on.
+    return llvm::MemoryBuffer::getMemBuffer(llvm::StringRef(*text), name,
+                                            /*RequiresNullTerminator*/ true);
+}
+
+std::string TextBuffer::Snapshot::getUnmaskedText() const
+{
+    auto result = *text;
+    if (maskedPrefix) result.replace(0, maskedPrefix->size(), *maskedPrefix);
+    return result;
+}
+
+TextBuffer::TextBuffer() : mText(std::make_shared<std::string>()) {}
+
+std::string &TextBuffer::makeUnique()
+{
+    // Only the thread that owns this buffer hands out snapshots, so a use
+    // count of one means that no worker can be reading the text.
+    if (mText.use_count() > 1) mText = std::make_shared<std::string>(*mText);
+    return *mText;
+}
+
+std::size_t TextBuffer::findFirstDifference(const std::string &text) const
+{
+    const auto &buffer = *mText;
+    const auto size = std::min(buffer.size(), text.size());
+    std::size_t offset = 0;
+    if (mMaskedPrefix)
+    {
+        const auto &prefix = *mMaskedPrefix;
+        const auto prefixSize = std::min(size, prefix.size());
+        offset = std::mismatch(prefix.begin(), prefix.begin() + prefixSize,
+                               text.begin())
+                     .first -
+                 prefix.begin();
+        if (offset < prefixSize) return offset;
+    }
+    offset = std::mismatch(buffer.begin() + offset, buffer.begin() + size,
+                           text.begin() + offset)
+                 .first -
+             buffer.begin();
+    if (offset == size && buffer.size() == text.size())
+    {
+        return std::string::npos;
+    }
+    return offset;
+}
+
+void TextBuffer::assign(std::string text)
+{
+    mFirstChangedOffset =
+        std::min(mFirstChangedOffset, findFirstDifference(text));
+    mText = std::make_shared<std::string>(std::move(text));
+    if (mMaskedPrefix)
+    {
+        const auto prefix = std::move(mMaskedPrefix);
+        mask(*prefix);
+    }
+}
+
+void TextBuffer::replace(std::size_t offset, std::size_t length,
+                         llvm::StringRef text)
+{
+    if (mMaskedPrefix && offset < mMaskedPrefix->size()) unmask();
+    auto &buffer = makeUnique();
+    offset = std::min(offset, buffer.size());
+    length = std::min(length, buffer.size() - offset);
+    buffer.replace(offset, length, text.data(), text.size());
+    mFirstChangedOffset = std::min(mFirstChangedOffset, offset);
+}
+
+char TextBuffer::getCharacter(std::size_t offset) const
+{
+    if (mMaskedPrefix && offset < mMaskedPrefix->size())
+    {
+        return (*mMaskedPrefix)[offset];
+    }
+    return (*mText)[offset];
+}
+
+bool TextBuffer::isIdentifierCharacter(char c)
+{
+    const auto byte = static_cast<unsigned char>(c);
+    return byte == '_' || byte >= 0x80 || std::isalnum(byte);
+}
+
+unsigned TextBuffer::countCharacters(llvm::StringRef text)
+{
+    return static_cast<unsigned>(
+        std::count_if(text.begin(), text.end(), [](char c) {
+            return (static_cast<unsigned char>(c) & 0xC0) != 0x80;
+        }));
+}
+
+std::size_t TextBuffer::getStartOfIdentifier(std::size_t offset) const
+{
+    offset = std::min(offset, mText->size());
+    while (offset > 0 && isIdentifierCharacter(getCharacter(offset - 1)))
+    {
+        --offset;
+    }
+    return offset;
+}
+
+std::size_t TextBuffer::getStartOfCall(std::size_t offset) const
+{
+    // Calls rarely span more than this, and the caret may be anywhere.
+    const std::size_t maxDistance = 4096;
+    offset = std::min(offset, mText->size());
+    const auto end = offset > maxDistance ? offset - maxDistance : 0;
+    unsigned depth = 0;
+    while (offset > end)
+    {
+        switch (getCharacter(--offset))
+        {
+        case ')':
+        case ']':
+        case '}':
+            ++depth;
+            break;
+        case '(':
+            if (depth == 0) return offset;
+            --depth;
+            break;
+        case '[':
+        case '{':
+            if (depth == 0) return std::string::npos;
+            --depth;
+            break;
+        case ';':
+            if (depth == 0) return std::string::npos;
+            break;
+        default:
+            break;
+        }
+    }
+    return std::string::npos;
+}
+
+bool TextBuffer::getArgumentIndex(std::size_t callStart, std::size_t offset,
+                                  unsigned &index) const
+{
+    offset = std::min(offset, mText->size());
+    index = 0;
+    unsigned depth = 0;
+    for (auto i = callStart + 1; i < offset; ++i)
+    {
+        switch (getCharacter(i))
+        {
+        case '(':
+        case '[':
+        case '{':
+            ++depth;
+            break;
+        case ')':
+        case ']':
+        case '}':
+            if (depth == 0) return false;
+            --depth;
+            break;
+        case ',':
+            if (depth == 0) ++index;
+            break;
+        case ';':
+            if (depth == 0) return false;
+            break;
+        default:
+            break;
+        }
+    }
+    return true;
+}
+
+std::string TextBuffer::getText(std::size_t offset, std::size_t length) const
+{
+    offset = std::min(offset, mText->size());
+    length = std::min(length, mText->size() - offset);
+    std::string result;
+    result.reserve(length);
+    for (auto i = offset; i < offset + length; ++i)
+    {
+        result.push_back(getCharacter(i));
+    }
+    return result;
+}
+
+std::size_t TextBuffer::getStartOfLine(unsigned row) const
+{
+    const auto &buffer = *mText;
+    const char *begin = buffer.data();
+    const char *end = begin + buffer.size();
+    const char *pos = begin;
+    for (; row > 0; --row)
+    {
+        const auto *newline =
+            static_cast<const char *>(std::memchr(pos, '\n', end - pos));
+        if (newline == nullptr) return buffer.size();
+        pos = newline + 1;
+    }
+    return pos - begin;
+}
+
+std::size_t TextBuffer::getOffset(unsigned row, unsigned column) const
+{
+    return std::min(getStartOfLine(row) + column, mText->size());
+}
+
+std::size_t TextBuffer::getOffsetOfCharacter(unsigned row,
+                                             unsigned column) const
+{
+    const auto &buffer = *mText;
+    auto offset = getStartOfLine(row);
+    while (column > 0 && offset < buffer.size() && buffer[offset] != '\n')
+    {
+        // Skip the continuation bytes of a multi-byte UTF-8 sequence.
+        ++offset;
+        while (offset < buffer.size() &&
+               (static_cast<unsigned char>(buffer[offset]) & 0xC0) == 0x80)
+        {
+            ++offset;
+        }
+        --column;
+    }
+    return offset;
+}
+
+bool TextBuffer::mask(const std::string &prefix)
+{
+    if (isMaskedWith(prefix)) return true;
+    unmask();
+    if (prefix.empty() || mText->compare(0, prefix.size(), prefix) != 0)
+    {
+        return false;
+    }
+    auto &buffer = makeUnique();
+    for (std::size_t i = 0; i < prefix.size(); ++i)
+    {
+        if (buffer[i] != '\n' && buffer[i] != '\r') buffer[i] = ' ';
+    }
+    mMaskedPrefix = std::make_shared<const std::string>(prefix);
+    return true;
+}
+
+void TextBuffer::unmask()
+{
+    if (!mMaskedPrefix) return;
+    auto &buffer = makeUnique();
+    buffer.replace(0, mMaskedPrefix->size(), *mMaskedPrefix);
+    mMaskedPrefix.reset();
+}
+
+bool TextBuffer::isMaskedWith(const std::string &prefix) const
+{
+    return mMaskedPrefix && *mMaskedPrefix == prefix;
+}
+
+TextBuffer::Snapshot TextBuffer::getSnapshot() const
+{
+    Snapshot snapshot;
+    snapshot.text = mText;
+    snapshot.maskedPrefix = mMaskedPrefix;
+    return snapshot;
+}
+
+} // Clara
@@ -0,0 +1,266 @@
+#include "Trace.hpp"
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <deque>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Format.h>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+namespace Clara
+{
+
+std::atomic_bool Trace::mIsEnabled{false};
+
+namespace
+{
+
+struct Event
+{
+    std::uint64_t start;
+    std::uint64_t duration;
+    int view;
+    unsigned thread;
+    // nullptr for a message.
+    const char *phase;
+    std::uint32_t length;
+    char message[100];
+};
+
+// Written by one thread, and read by the drain.
+struct Ring
+{
+    static const std::uint32_t capacity = 512;
+
+    std::array<Event, capacity> events;
+    std::atomic<std::uint32_t> head{0};
+    std::atomic<std::uint32_t> tail{0};
+    // Rings of threads that have exited are handed to new threads.
+    std::atomic_bool isOwned{true};
+    unsigned index = 0;
+};
+
+struct Registry
+{
+    std::mutex mutex;
+    std::vector<std::unique_ptr<Ring>> rings;
+    // The most recent events, for the export.
+    std::deque<Event> history;
+    std::atomic<std::uint64_t> dropped{0};
+};
+
+const std::size_t historyLimit = 100000;
+
+const auto epoch = std::chrono::steady_clock::now();
+
+Registry &getRegistry()
+{
+    // Intentionally leaked, because threads may still record events while
+    // the module is unloaded.
+    static auto *registry = new Registry();
+    return *registry;
+}
+
+struct RingOwner
+{
+    Ring *ring = nullptr;
+
+    ~RingOwner()
+    {
+        if (ring) ring->isOwned.store(false, std::memory_order_release);
+    }
+};
+
+Ring &getRing()
+{
+    thread_local RingOwner owner;
+    if (owner.ring) return *owner.ring;
+    auto &registry = getRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    for (const auto &ring : registry.rings)
+    {
+        if (!ring->isOwned.load(std::memory_order_acquire))
+        {
+            ring->isOwned.store(true, std::memory_order_relaxed);
+            owner.ring = ring.get();
+            return *owner.ring;
+        }
+    }
+    registry.rings.emplace_back(new Ring());
+    owner.ring = registry.rings.back().get();
+    owner.ring->index = static_cast<unsigned>(registry.rings.size() - 1);
+    return *owner.ring;
+}
+
+double toMilliseconds(std::uint64_t nanoseconds)
+{
+    return static_cast<double>(nanoseconds) / 1e6;
+}
+
+void writeJSONString(llvm::raw_ostream &stream, llvm::StringRef text)
+{
+    stream << '"';
+    for (const char c : text)
+    {
+        if (c == '"' || c == '\\')
+        {
+            stream << '\\' << c;
+        }
+        else if (static_cast<unsigned char>(c) < 0x20)
+        {
+            stream << llvm::format("\\u%04x", static_cast<unsigned>(c));
+        }
+        else
+        {
+            stream << c;
+        }
+    }
+    stream << '"';
+}
+
+} // anonymous namespace
+
+void Trace::setEnabled(bool isEnabled)
+{
+    mIsEnabled.store(isEnabled, std::memory_order_relaxed);
+}
+
+std::uint64_t Trace::now()
+{
+    return static_cast<std::uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - epoch)
+            .count());
+}
+
+void Trace::record(int view, const char *phase, std::uint64_t start,
+                   std::uint64_t duration, llvm::StringRef message)
+{
+    auto &ring = getRing();
+    const auto head = ring.head.load(std::memory_order_relaxed);
+    if (head - ring.tail.load(std::memory_order_acquire) == Ring::capacity)
+    {
+        // Nobody drains fast enough. Losing events beats blocking.
+        ++getRegistry().dropped;
+        return;
+    }
+    auto &event = ring.events[head % Ring::capacity];
+    event.start = start;
+    event.duration = duration;
+    event.view = view;
+    event.phase = phase;
+    auto length = std::min(message.size(), sizeof(event.message));
+    // Don't cut a UTF-8 sequence in half.
+    while (length < message.size() && length > 0 &&
+           (static_cast<unsigned char>(message[length]) & 0xC0) == 0x80)
+    {
+        --length;
+    }
+    std::memcpy(event.message, message.data(), length);
+    event.length = static_cast<std::uint32_t>(length);
+    ring.head.store(head + 1, std::memory_order_release);
+}
+
+std::vector<std::string> Trace::drain()
+{
+    auto &registry = getRegistry();
+    std::vector<Event> events;
+    std::uint64_t dropped;
+    {
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        for (const auto &ring : registry.rings)
+        {
+            auto tail = ring->tail.load(std::memory_order_relaxed);
+            const auto head = ring->head.load(std::memory_order_acquire);
+            for (; tail != head; ++tail)
+            {
+                events.push_back(ring->events[tail % Ring::capacity]);
+                events.back().thread = ring->index;
+            }
+            ring->tail.store(tail, std::memory_order_release);
+        }
+        std::stable_sort(events.begin(), events.end(),
+                         [](const Event &lhs, const Event &rhs) {
+                             return lhs.start < rhs.start;
+                         });
+        registry.history.insert(registry.history.end(), events.begin(),
+                                events.end());
+        while (registry.history.size() > historyLimit)
+        {
+            registry.history.pop_front();
+        }
+        dropped = registry.dropped.exchange(0);
+    }
+    std::vector<std::string> lines;
+    if (!isEnabled()) return lines;
+    for (const auto &event : events)
+    {
+        std::string line;
+        llvm::raw_string_ostream stream(line);
+        if (event.view != 0) stream << "[view " << event.view << "] ";
+        if (event.phase)
+        {
+            stream << event.phase << " took "
+                   << llvm::format("%.1f", toMilliseconds(event.duration))
+                   << " ms";
+        }
+        else
+        {
+            stream.write(event.message, event.length);
+        }
+        lines.push_back(std::move(stream.str()));
+    }
+    if (dropped != 0)
+    {
+        lines.push_back(std::to_string(dropped) +
+                        " trace events were dropped");
+    }
+    return lines;
+}
+
+void Trace::exportChromeTrace(const std::string &path)
+{
+    drain();
+    std::error_code error;
+    llvm::raw_fd_ostream stream(path, error, llvm::sys::fs::F_Text);
+    if (error)
+    {
+        throw std::runtime_error("could not write " + path + ": " +
+                                 error.message());
+    }
+    auto &registry = getRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    stream << "{\"traceEvents\":[";
+    bool isFirst = true;
+    for (const auto &event : registry.history)
+    {
+        if (!isFirst) stream << ",";
+        isFirst = false;
+        stream << "\n{\"name\":";
+        writeJSONString(stream, event.phase
+                                    ? llvm::StringRef(event.phase)
+                                    : llvm::StringRef(event.message,
+                                                      event.length));
+        // Timestamps are in microseconds.
+        stream << ",\"cat\":\"clara\",\"pid\":1,\"tid\":" << event.thread
+               << ",\"ts\":"
+               << llvm::format("%.3f", toMilliseconds(event.start) * 1000);
+        if (event.phase)
+        {
+            stream << ",\"ph\":\"X\",\"dur\":"
+                   << llvm::format("%.3f",
+                                   toMilliseconds(event.duration) * 1000);
+        }
+        else
+        {
+            stream << ",\"ph\":\"i\",\"s\":\"t\"";
+        }
+        stream << ",\"args\":{\"view\":" << event.view << "}}";
+    }
+    stream << "\n],\"displayTimeUnit\":\"ms\"}\n";
+}
+
+} // Clara
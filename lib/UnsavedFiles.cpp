@@ -0,0 +1,144 @@
+#include "UnsavedFiles.hpp"
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Support/Path.h>
+#include <utility>
+
+namespace
+{
+
+// A MemoryBuffer that points into a shared text instead of owning a copy.
+class SharedBuffer : public llvm::MemoryBuffer
+{
+  public:
+    SharedBuffer(std::shared_ptr<const std::string> text, std::string name)
+        : mText(std::move(text)), mName(std::move(name))
+    {
+        // std::string guarantees the null terminator that clang relies on.
+        init(mText->data(), mText->data() + mText->size(),
+             /*RequiresNullTerminator*/ true);
+    }
+
+    llvm::StringRef getBufferIdentifier() const override { return mName; }
+    BufferKind getBufferKind() const override { return MemoryBuffer_Malloc; }
+
+  private:
+    std::shared_ptr<const std::string> mText;
+    std::string mName;
+};
+
+} // anonymous namespace
+
+namespace Clara
+{
+
+std::unique_ptr<llvm::MemoryBuffer> UnsavedFiles::File::getMemoryBuffer() const
+{
+    return std::unique_ptr<llvm::MemoryBuffer>(
+        new SharedBuffer(text, filename));
+}
+
+UnsavedFiles &UnsavedFiles::get()
+{
+    // Intentionally leaked, for the same reason as the WorkerPool.
+    static auto *files = new UnsavedFiles();
+    return *files;
+}
+
+std::string UnsavedFiles::normalize(llvm::StringRef filename)
+{
+    llvm::SmallString<256> path(filename);
+    llvm::sys::path::remove_dots(path, /*remove_dot_dot=*/true);
+    llvm::sys::path::native(path);
+    return path.str().str();
+}
+
+std::uint64_t UnsavedFiles::set(const std::string &filename,
+                                TextBuffer::Snapshot snapshot)
+{
+    File file;
+    file.filename = normalize(filename);
+    if (snapshot.maskedPrefix)
+    {
+        file.text = std::make_shared<const std::string>(
+            snapshot.getUnmaskedText());
+    }
+    else
+    {
+        file.text = std::move(snapshot.text);
+    }
+    std::lock_guard<std::mutex> lock(mMutex);
+    file.version = ++mLastVersion;
+    auto &entry = mFiles[file.filename];
+    entry = std::move(file);
+    notify(entry);
+    return entry.version;
+}
+
+void UnsavedFiles::remove(const std::string &filename, std::uint64_t version)
+{
+    File file;
+    file.filename = normalize(filename);
+    std::lock_guard<std::mutex> lock(mMutex);
+    const auto found = mFiles.find(file.filename);
+    if (found == mFiles.end()) return;
+    // Another view of the same file published a newer version.
+    if (version != 0 && found->second.version != version) return;
+    mFiles.erase(found);
+    notify(file);
+}
+
+std::uint64_t UnsavedFiles::getVersion(llvm::StringRef filename) const
+{
+    const auto key = normalize(filename);
+    std::lock_guard<std::mutex> lock(mMutex);
+    const auto found = mFiles.find(key);
+    return found == mFiles.end() ? 0 : found->second.version;
+}
+
+std::vector<UnsavedFiles::File>
+UnsavedFiles::getFiles(llvm::StringRef except) const
+{
+    const auto key = except.empty() ? std::string() : normalize(except);
+    std::vector<File> files;
+    std::lock_guard<std::mutex> lock(mMutex);
+    for (const auto &entry : mFiles)
+    {
+        if (entry.first != key) files.push_back(entry.second);
+    }
+    return files;
+}
+
+std::unique_ptr<llvm::MemoryBuffer>
+UnsavedFiles::read(const std::string &filename) const
+{
+    {
+        const auto key = normalize(filename);
+        std::lock_guard<std::mutex> lock(mMutex);
+        const auto found = mFiles.find(key);
+        if (found != mFiles.end()) return found->second.getMemoryBuffer();
+    }
+    auto buffer = llvm::MemoryBuffer::getFile(filename);
+    if (!buffer) return nullptr;
+    return std::move(*buffer);
+}
+
+void UnsavedFiles::subscribe(const void *owner, Listener listener)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    for (const auto &entry : mFiles) listener(entry.second);
+    mListeners[owner] = std::move(listener);
+}
+
+void UnsavedFiles::unsubscribe(const void *owner)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mListeners.erase(owner);
+}
+
+void UnsavedFiles::notify(const File &file)
+{
+    // Expects mMutex to be locked.
+    for (const auto &entry : mListeners) entry.second(file);
+}
+
+} // Clara
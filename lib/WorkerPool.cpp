@@ -0,0 +1,168 @@
+#include "WorkerPool.hpp"
+#include "Trace.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <exception>
+#include <new>
+#include <thread>
+
+namespace Clara
+{
+
+WorkerPool &WorkerPool::get()
+{
+    // Intentionally leaked. Detached workers may still be running while the
+    // plugin host shuts down, and they must not touch a destroyed pool.
+    static auto *pool = new WorkerPool();
+    return *pool;
+}
+
+void WorkerPool::setWorkerCount(unsigned count)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mMaxWorkers = count;
+    // Superfluous workers exit the next time they look for a job.
+    mJobAvailable.notify_all();
+}
+
+void WorkerPool::setExitOnOutOfMemory(bool isEnabled)
+{
+    mExitOnOutOfMemory = isEnabled;
+}
+
+unsigned WorkerPool::getMaxWorkers() const
+{
+    if (mMaxWorkers != 0) return mMaxWorkers;
+    const auto hardwareThreads = std::thread::hardware_concurrency();
+    return hardwareThreads > 2 ? hardwareThreads - 1 : 1;
+}
+
+void WorkerPool::post(const void *owner, Priority priority, Job job)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto &strand = mStrands[owner];
+    strand.jobs.push_back(QueuedJob{priority, mSequence++, std::move(job)});
+    if (mIdleWorkers == 0 && mWorkerCount < getMaxWorkers())
+    {
+        ++mWorkerCount;
+        std::thread(&WorkerPool::work, this).detach();
+    }
+    else
+    {
+        mJobAvailable.notify_all();
+    }
+}
+
+void WorkerPool::setOwnerPriority(const void *owner, Priority priority)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    // A strand is only created by posting, so that an owner that is gone
+    // doesn't get one back.
+    const auto strand = mStrands.find(owner);
+    if (strand == mStrands.end()) return;
+    strand->second.priority = priority;
+    mJobAvailable.notify_all();
+}
+
+void WorkerPool::cancel(const void *owner)
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    auto strand = mStrands.find(owner);
+    if (strand == mStrands.end()) return;
+    strand->second.jobs.clear();
+    mJobFinished.wait(lock, [this, owner]() {
+        const auto findResult = mStrands.find(owner);
+        return findResult == mStrands.end() || !findResult->second.isRunning;
+    });
+    mStrands.erase(owner);
+}
+
+std::map<const void *, WorkerPool::Strand>::iterator WorkerPool::findNextJob()
+{
+    const auto maxWorkers = getMaxWorkers();
+    auto best = mStrands.end();
+    Priority bestPriority = Priority::Background;
+    std::uint64_t bestSequence = 0;
+    for (auto iter = mStrands.begin(); iter != mStrands.end(); ++iter)
+    {
+        const auto &strand = iter->second;
+        if (strand.isRunning || strand.jobs.empty()) continue;
+        const auto &job = strand.jobs.front();
+        const auto priority = std::max(job.priority, strand.priority);
+        // Always keep one worker free for the active view, so that its jobs
+        // never have to wait for a parse of a view in the background.
+        if (priority == Priority::Background && maxWorkers > 1 &&
+            mBusyBackgroundWorkers + 1 >= maxWorkers)
+        {
+            continue;
+        }
+        if (best == mStrands.end() || priority > bestPriority ||
+            (priority == bestPriority && job.sequence < bestSequence))
+        {
+            best = iter;
+            bestPriority = priority;
+            bestSequence = job.sequence;
+        }
+    }
+    return best;
+}
+
+void WorkerPool::work()
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    while (true)
+    {
+        if (mWorkerCount > getMaxWorkers())
+        {
+            --mWorkerCount;
+            return;
+        }
+        auto strand = findNextJob();
+        if (strand == mStrands.end())
+        {
+            ++mIdleWorkers;
+            mJobAvailable.wait(lock);
+            --mIdleWorkers;
+            continue;
+        }
+        const auto owner = strand->first;
+        auto job = std::move(strand->second.jobs.front());
+        strand->second.jobs.pop_front();
+        strand->second.isRunning = true;
+        const bool isBackground =
+            std::max(job.priority, strand->second.priority) ==
+            Priority::Background;
+        if (isBackground) ++mBusyBackgroundWorkers;
+        lock.unlock();
+        try
+        {
+            job.job();
+        }
+        catch (const std::bad_alloc &)
+        {
+            // A clara-server worker runs under a memory limit, and ending it
+            // lets the supervisor start a fresh one. In the plugin host, the
+            // job is dropped like any other that fails.
+            Trace::message(0, "a job ran out of memory");
+            if (mExitOnOutOfMemory) std::_Exit(EXIT_FAILURE);
+        }
+        catch (const std::exception &exception)
+        {
+            // A failing job must not take the worker down with it.
+            Trace::message(0, "a job failed:", exception.what());
+        }
+        catch (...)
+        {
+            Trace::message(0, "a job failed");
+        }
+        job.job = nullptr;
+        lock.lock();
+        if (isBackground) --mBusyBackgroundWorkers;
+        mStrands[owner].isRunning = false;
+        mJobFinished.notify_all();
+        // The owner may have more jobs queued that can run now.
+        mJobAvailable.notify_all();
+    }
+}
+
+} // Clara
@@ -1,8 +1,16 @@
 from Clara.commands.diagnose import ClaraDiagnoseCommand
+from Clara.commands.export_trace import ClaraExportTraceCommand
+from Clara.commands.go_to_definition import ClaraGoToDefinitionCommand
+from Clara.commands.go_to_symbol import ClaraGoToSymbolCommand
 from Clara.commands.insert_diagnosis import ClaraInsertDiagnosisCommand
+from Clara.commands.show_performance_stats import ClaraShowPerformanceStatsCommand
 from Clara.commands.write_system_headers import ClaraWriteSystemHeadersCommand
 
 __all__ = [
     'ClaraDiagnoseCommand', 
+    'ClaraExportTraceCommand',
+    'ClaraGoToDefinitionCommand',
+    'ClaraGoToSymbolCommand',
     'ClaraInsertDiagnosisCommand',
+    'ClaraShowPerformanceStatsCommand',
     'ClaraWriteSystemHeadersCommand' ]
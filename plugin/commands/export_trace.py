@@ -0,0 +1,16 @@
+import sublime, sublime_plugin, os
+import Clara.Clara
+
+class ClaraExportTraceCommand(sublime_plugin.ApplicationCommand):
+	"""Writes the recent trace events in the Chrome trace format."""
+
+	def run(self):
+		directory = os.path.join(sublime.cache_path(), "Clara")
+		os.makedirs(directory, exist_ok=True)
+		path = os.path.join(directory, "trace.json")
+		Clara.Clara.Trace.export_chrome_trace(path)
+		sublime.message_dialog("The trace was written to {}. Load it in "
+		                       "chrome://tracing to view it.".format(path))
+
+	def is_enabled(self):
+		return Clara.Clara.Trace.is_enabled()
@@ -0,0 +1,17 @@
+import sublime, sublime_plugin
+from Clara.eventlisteners.code_completer import CodeCompleter
+
+class ClaraGoToDefinitionCommand(sublime_plugin.TextCommand):
+	"""Goes to the definition of the symbol at the caret, as the file was last
+	parsed. Goes to the declaration when the definition is in another unit."""
+
+	def run(self, edit):
+		if len(self.view.sel()) == 0:
+			return
+		for listener in sublime_plugin.view_event_listeners.get(self.view.id(), []):
+			if isinstance(listener, CodeCompleter):
+				listener.go_to_definition(self.view.sel()[0].b)
+				return
+
+	def is_enabled(self):
+		return bool(self.view.settings().get("_clara_code_completer", False))
@@ -0,0 +1,41 @@
+import sublime, sublime_plugin
+import Clara.Clara
+
+class ClaraGoToSymbolCommand(sublime_plugin.WindowCommand):
+	"""Goes to a symbol of the project, from the symbol index."""
+
+	MAX_RESULTS = 200
+
+	def run(self):
+		view = self.window.active_view()
+		initial = ""
+		if view:
+			region = view.sel()[0] if len(view.sel()) > 0 else None
+			if region is not None:
+				initial = view.substr(view.word(region) if region.empty() else region)
+		self.window.show_input_panel("Symbol:", initial.strip(), self.on_done, None, None)
+
+	def on_done(self, query):
+		query = query.strip()
+		if not query:
+			return
+		self.symbols = Clara.Clara.CompilationDatabaseWatcher.find_symbols(
+			self.window, query, self.MAX_RESULTS)
+		if not self.symbols:
+			sublime.status_message("No symbols start with {}".format(query))
+			return
+		items = []
+		for name, qualified, kind, filename, line, column in self.symbols:
+			items.append([qualified, "{} — {}:{}".format(kind, filename, line)])
+		self.window.show_quick_panel(items, self.on_select)
+
+	def on_select(self, index):
+		if index == -1:
+			return
+		_, _, _, filename, line, column = self.symbols[index]
+		self.window.open_file("{}:{}:{}".format(filename, line, column),
+		                      sublime.ENCODED_POSITION)
+
+	def is_enabled(self):
+		settings = sublime.load_settings("Clara.sublime-settings")
+		return bool(settings.get("symbol_index", False))
@@ -0,0 +1,33 @@
+import sublime, sublime_plugin
+import Clara.Clara
+
+PHASES = ("queue", "reparse", "complete", "rank", "strings", "gil", "popup",
+          "total", "filter", "load", "preamble", "signatures")
+
+def format_phases(phases):
+	lines = ["{:<10}{:>8}{:>10}{:>10}{:>10}{:>10}{:>10}".format(
+		"phase", "count", "mean", "p50", "p90", "p99", "max")]
+	for phase in PHASES:
+		if phase not in phases:
+			continue
+		stats = phases[phase]
+		lines.append("{:<10}{:>8}{:>10.1f}{:>10.1f}{:>10.1f}{:>10.1f}{:>10.1f}".format(
+			phase, stats["count"], stats["mean"], stats["p50"], stats["p90"],
+			stats["p99"], stats["max"]))
+	return "\n".join(lines)
+
+class ClaraShowPerformanceStatsCommand(sublime_plugin.ApplicationCommand):
+	"""Shows the completion latencies, in milliseconds."""
+
+	def run(self):
+		stats = Clara.Clara.stats()
+		text = "All views\n\n" + format_phases(stats["global"]) + "\n"
+		for view_id, phases in sorted(stats["views"].items()):
+			name = phases.pop("name") or "untitled"
+			text += "\nView {} ({})\n\n".format(view_id, name)
+			text += format_phases(phases) + "\n"
+		view = sublime.active_window().new_file()
+		view.set_scratch(True)
+		view.set_name("Clara Performance Stats")
+		view.run_command("append", {"characters": text})
+		view.set_read_only(True)
@@ -1,5 +1,12 @@
 from Clara.eventlisteners.code_completer import CodeCompleter
 from Clara.eventlisteners.compilation_database_watcher import CompilationDatabaseWatcher
+from Clara.eventlisteners.trace_settings import TraceSettingsListener
 import Clara.Clara
 
-__all__ = ['CodeCompleter', 'CompilationDatabaseWatcher']
+__all__ = ['CodeCompleter', 'CompilationDatabaseWatcher', 'TraceSettingsListener']
+
+try:
+    from Clara.eventlisteners.code_completer import TextChangeForwarder
+    __all__.append('TextChangeForwarder')
+except ImportError:
+    pass
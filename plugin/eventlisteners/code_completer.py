@@ -1,6 +1,10 @@
+import sublime
 import sublime_plugin
 
 import Clara.Clara
+from . import diagnostics
+from . import signatures
+
 class CodeCompleter(sublime_plugin.ViewEventListener, Clara.Clara.CodeCompleter):
 
     @classmethod
@@ -12,5 +16,57 @@ class CodeCompleter(sublime_plugin.ViewEventListener, Clara.Clara.CodeCompleter)
         Clara.Clara.CodeCompleter.__init__(self, view)
 
     def on_query_completions(self, prefix, locations):
-        return Clara.Clara.CodeCompleter.on_query_completions(self, prefix, locations)
+        # Sublime only accepts a list, or a tuple of a sequence and flags. The
+        # native CompletionList is a sequence that creates its strings on
+        # demand, so it is passed in a tuple.
+        completions = Clara.Clara.CodeCompleter.on_query_completions(self, prefix, locations)
+        return (completions, 0)
+
+    def on_modified(self):
+        # Newer versions call it from on_text_changed, see below.
+        if int(sublime.version()) < 4050:
+            Clara.Clara.CodeCompleter.on_modified(self)
+
+    def on_selection_modified(self):
+        Clara.Clara.CodeCompleter.on_selection_modified(self)
+
+    def on_activated(self):
+        Clara.Clara.CodeCompleter.on_activated(self)
+
+    def on_deactivated(self):
+        Clara.Clara.CodeCompleter.on_deactivated(self)
+
+    def on_hover(self, point, hover_zone):
+        if hover_zone != sublime.HOVER_TEXT:
+            return
+        # The popup is shown once the symbol at the point is looked up, with
+        # the diagnostics in it.
+        if not Clara.Clara.CodeCompleter.on_hover(self, point):
+            diagnostics.show_popup(self.view, point)
+
+    def on_close(self):
+        diagnostics.forget(self.view)
+        signatures.forget(self.view)
+
+# Text change events are available since build 4050. Older versions copy the
+# whole view to the native text buffer when completions are requested.
+if int(sublime.version()) >= 4050:
+
+    class TextChangeForwarder(sublime_plugin.TextChangeListener):
+        """Forwards the edits of a buffer to the code completers of its views,
+        which keep a native copy of the text."""
+
+        @classmethod
+        def is_applicable(cls, buffer):
+            # Applicability is only decided when the buffer is opened, which
+            # is before its compilation database has loaded. Buffers without
+            # a code completer are skipped in on_text_changed.
+            return True
+
+        def on_text_changed(self, changes):
+            for view in self.buffer.views():
+                listeners = sublime_plugin.view_event_listeners.get(view.id(), [])
+                for listener in listeners:
+                    if isinstance(listener, CodeCompleter):
+                        listener.on_text_changed(changes)
 
@@ -6,6 +6,7 @@ class CompilationDatabaseWatcher(sublime_plugin.EventListener,
                                  Clara.Clara.CompilationDatabaseWatcher):
 
     def on_post_save(self, view):
+        Clara.Clara.CompilationDatabaseWatcher.on_post_save(self, view)
         listeners = sublime_plugin.view_event_listeners.get(view.id(), [])
         for listener in listeners:
             if isinstance(listener, CodeCompleter):
@@ -0,0 +1,63 @@
+import html
+
+import sublime
+
+from . import diagnostics
+
+
+def show_popup(view, point, declaration):
+    """Called by the native code when the symbol under the mouse has been
+    looked up. The declaration is a dict, or None when there is no symbol
+    there. Shows it together with the diagnostics of the row."""
+    parts = diagnostics.popup_messages(view, point)
+    if declaration:
+        parts.append(_render(declaration))
+    if not parts:
+        return
+    view.show_popup("<hr>".join(parts), sublime.HIDE_ON_MOUSE_MOVE_AWAY,
+                    point, 800, 800,
+                    lambda href: _open(view.window(), declaration, href))
+
+
+def go_to_definition(view, point, declaration):
+    """Called by the native code when the symbol at the caret has been looked
+    up. Goes to its definition, or to its declaration when there is no
+    definition in the unit or the caret is on the definition already."""
+    if not declaration:
+        sublime.status_message("Clara: no symbol at the caret")
+        return
+    target = "definition"
+    if not declaration["definition_filename"] or (
+            declaration["definition_filename"] == view.file_name() and
+            declaration["definition_row"] - 1 == view.rowcol(point)[0]):
+        target = "declaration"
+    _open(view.window(), declaration, target)
+
+
+def _render(declaration):
+    lines = ["<b>{}</b> <i>{}</i>".format(html.escape(declaration["name"]),
+                                          html.escape(declaration["kind"]))]
+    if declaration["type"]:
+        lines.append("<code>{}</code>".format(
+            html.escape(declaration["type"])))
+    if declaration["documentation"]:
+        lines.append(html.escape(declaration["documentation"]).replace(
+            "\n", "<br>"))
+    links = ['<a href="declaration">Declaration</a>']
+    if declaration["definition_filename"]:
+        links.append('<a href="definition">Definition</a>')
+    lines.append(" ".join(links))
+    return "<br>".join(lines)
+
+
+def _open(window, declaration, target):
+    if not window or not declaration:
+        return
+    if target == "definition":
+        location = (declaration["definition_filename"],
+                    declaration["definition_row"],
+                    declaration["definition_column"])
+    else:
+        location = (declaration["filename"], declaration["row"],
+                    declaration["column"])
+    window.open_file("{}:{}:{}".format(*location), sublime.ENCODED_POSITION)
@@ -0,0 +1,95 @@
+import html
+
+import sublime
+
+# The most recent diagnostics of each view, for the hover popups.
+_diagnostics = {}
+_phantom_sets = {}
+
+_REGION_FLAGS = (sublime.DRAW_NO_FILL | sublime.DRAW_NO_OUTLINE |
+                 sublime.DRAW_SQUIGGLY_UNDERLINE)
+
+# The number of inline messages when "inline_diagnostics" is true.
+_INLINE_DIAGNOSTICS_LIMIT = 100
+
+
+def show_diagnostics(view, diagnostics):
+    """Called by the native code once per parse, with a DiagnosticList of the
+    main file. Every diagnostic is underlined, but only the first ones get
+    their message shown inline, as set by "inline_diagnostics"."""
+    _diagnostics[view.id()] = diagnostics
+    errors = []
+    warnings = []
+    for index in range(len(diagnostics)):
+        row, column, end_row, end_column = diagnostics.range(index)
+        region = sublime.Region(view.text_point(row, column),
+                                view.text_point(end_row, end_column))
+        if diagnostics.is_error(index):
+            errors.append(region)
+        else:
+            warnings.append(region)
+    view.add_regions("clara_errors", errors, "invalid", "", _REGION_FLAGS)
+    view.add_regions("clara_warnings", warnings, "markup.changed", "",
+                     _REGION_FLAGS)
+    _update_status(view, diagnostics)
+    _update_phantoms(view, diagnostics)
+
+
+def show_popup(view, point):
+    """Shows the messages of the diagnostics on the row of the point."""
+    messages = popup_messages(view, point)
+    if messages:
+        view.show_popup("<br>".join(messages),
+                        sublime.HIDE_ON_MOUSE_MOVE_AWAY, point, 800)
+
+
+def popup_messages(view, point):
+    """Returns the escaped messages of the diagnostics on the row of the
+    point."""
+    diagnostics = _diagnostics.get(view.id())
+    if not diagnostics:
+        return []
+    row = view.rowcol(point)[0]
+    return [html.escape(diagnostics.message(index))
+            for index in diagnostics.in_rows(row, row)]
+
+
+def forget(view):
+    _diagnostics.pop(view.id(), None)
+    _phantom_sets.pop(view.id(), None)
+
+
+def _update_status(view, diagnostics):
+    errors, warnings, included_errors, included_warnings = diagnostics.counts()
+    status = "{} errors, {} warnings".format(errors, warnings)
+    if included_errors or included_warnings:
+        status += " ({} errors, {} warnings in included files)".format(
+            included_errors, included_warnings)
+    view.set_status("clara_diagnostics", status)
+
+
+def _update_phantoms(view, diagnostics):
+    phantom_set = _phantom_sets.get(view.id())
+    if phantom_set is None:
+        phantom_set = sublime.PhantomSet(view, "clara_diagnostics")
+        _phantom_sets[view.id()] = phantom_set
+    settings = sublime.load_settings("Clara.sublime-settings")
+    # Sublime Text has no event for scrolling, so that the phantoms are made
+    # for the whole file. Their number is limited, as each one costs a bit
+    # of layout on every edit.
+    limit = settings.get("inline_diagnostics", True)
+    if limit is True:
+        limit = _INLINE_DIAGNOSTICS_LIMIT
+    elif not isinstance(limit, int):
+        limit = 0
+    phantoms = []
+    for index in range(min(len(diagnostics), limit)):
+        row, column, _, _ = diagnostics.range(index)
+        color = "redish" if diagnostics.is_error(index) else "yellowish"
+        content = ('<body id="clara-diagnostic" style="color: var(--{});">'
+                   '{}</body>').format(color,
+                                       html.escape(diagnostics.message(index)))
+        region = sublime.Region(view.text_point(row, column))
+        phantoms.append(sublime.Phantom(region, content,
+                                        sublime.LAYOUT_BELOW))
+    phantom_set.update(phantoms)
@@ -0,0 +1,47 @@
+import html
+
+import sublime
+
+# The views that show parameter hints.
+_shown = set()
+
+# Lets the hints stay up next to the completions, where that is supported.
+_POPUP_FLAGS = getattr(sublime, "COOPERATE_WITH_AUTO_COMPLETE", 0)
+
+
+def show(view, point, signatures, active):
+    """Called by the native code with the overloads of the call that opens at
+    the point. Every overload is a tuple of a label, the character ranges of
+    its parameters in the label, and its documentation. The parameter of the
+    active argument is highlighted."""
+    lines = []
+    for label, parameters, documentation in signatures:
+        if active < len(parameters):
+            begin, end = parameters[active]
+            text = "{}<b><u>{}</u></b>{}".format(html.escape(label[:begin]),
+                                                 html.escape(label[begin:end]),
+                                                 html.escape(label[end:]))
+        else:
+            text = html.escape(label)
+        line = "<code>{}</code>".format(text)
+        if documentation:
+            line += "<br><i>{}</i>".format(html.escape(documentation))
+        lines.append(line)
+    content = "<br>".join(lines)
+    if view.id() in _shown and view.is_popup_visible():
+        view.update_popup(content)
+    else:
+        view.show_popup(content, _POPUP_FLAGS, point, 800)
+        _shown.add(view.id())
+
+
+def hide(view):
+    if view.id() not in _shown:
+        return
+    _shown.discard(view.id())
+    if view.is_popup_visible():
+        view.hide_popup()
+
+
+def forget(view):
+    _shown.discard(view.id())
@@ -0,0 +1,40 @@
+import sublime
+import sublime_plugin
+
+import Clara.Clara
+
+# How often the native trace buffers are printed to the console while
+# "clara_debug" is on, in milliseconds.
+DRAIN_INTERVAL = 250
+
+_is_draining = False
+
+
+def _drain():
+    global _is_draining
+    Clara.Clara.Trace.drain()
+    if Clara.Clara.Trace.is_enabled():
+        sublime.set_timeout_async(_drain, DRAIN_INTERVAL)
+    else:
+        _is_draining = False
+
+
+def update_trace_enabled(view=None):
+    """Caches the "clara_debug" setting natively, so that native code never
+    has to ask Python whether it should log. A view or project setting takes
+    precedence over the package setting."""
+    global _is_draining
+    settings = sublime.load_settings("Clara.sublime-settings")
+    enabled = settings.get("clara_debug", False)
+    if view is not None:
+        enabled = view.settings().get("clara_debug", enabled)
+    Clara.Clara.Trace.set_enabled(bool(enabled))
+    if enabled and not _is_draining:
+        _is_draining = True
+        sublime.set_timeout_async(_drain, DRAIN_INTERVAL)
+
+
+class TraceSettingsListener(sublime_plugin.EventListener):
+
+    def on_activated(self, view):
+        update_trace_enabled(view)